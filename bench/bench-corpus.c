@@ -0,0 +1,406 @@
+/* bench-corpus.c -- generate a tree of source files for benchmarks
+   Copyright (C) 2012 Free Software Foundation, Inc.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Write FILES source files of about BYTES bytes each under DIRECTORY,
+   a hundred to a subdirectory, in the languages of MIX, drawing their
+   identifiers from a vocabulary of WORDS made of syllables, the first
+   of them far more often than the last.  The same options and SEED
+   give the same tree on every host.  Then print, one per line, a
+   description of the tree and some patterns that occur in it, for
+   bench-ids.sh to query.  */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "error.h"
+#include "progname.h"
+#include "quote.h"
+#include "xalloc.h"
+
+#include "xnls.h"
+
+void usage (void) __attribute__((__noreturn__));
+
+/* A language that bench-corpus writes, and the share of the files that
+   are in it.  */
+
+struct corpus_lang
+{
+  char const *cl_name;
+  char const *cl_suffix;
+  void (*cl_line) (FILE *out);
+  unsigned long cl_weight;
+};
+
+static void c_line (FILE *out);
+static void asm_line (FILE *out);
+static void perl_line (FILE *out);
+static void lisp_line (FILE *out);
+static void text_line (FILE *out);
+
+static struct corpus_lang corpus_langs[] =
+{
+  { "c", "c", c_line, 70 },
+  { "asm", "s", asm_line, 10 },
+  { "perl", "pl", perl_line, 10 },
+  { "lisp", "el", lisp_line, 5 },
+  { "text", "txt", text_line, 5 },
+};
+#define CORPUS_LANGS (sizeof corpus_langs / sizeof corpus_langs[0])
+
+static char const syllables[][3] =
+{
+  "ba", "ce", "di", "fo", "gu", "ha", "je", "ki",
+  "lo", "mu", "na", "pe", "qi", "ro", "su", "ta",
+  "ve", "wi", "xo", "yu", "za", "bo", "cu", "da",
+  "fe", "gi", "ho", "ju", "ka", "le", "mi", "no",
+};
+
+static void parse_mix (char const *arg);
+static void make_vocabulary (void);
+static void make_directory (char const *name);
+static uint64_t next_random (void);
+static char const *random_word (void);
+static unsigned long random_number (void);
+static void put_words (FILE *out, int count);
+
+static uint64_t random_state;
+static char **vocabulary;
+static unsigned long vocabulary_size = 10000;
+
+void
+usage (void)
+{
+  fprintf (stderr, _("\
+Usage: %s [-f FILES] [-s BYTES] [-v WORDS] [-l LANG=WEIGHT,...] [-r SEED]\n\
+       DIRECTORY\n"), program_name);
+  exit (EXIT_FAILURE);
+}
+
+int
+main (int argc, char **argv)
+{
+  unsigned long files = 1000;
+  unsigned long file_size = 8192;
+  unsigned long seed = 1;
+  unsigned long weights = 0;
+  uintmax_t total_bytes = 0;
+  char const *directory;
+  char *file_name;
+  char *middle_file = 0;
+  unsigned long i;
+  size_t l;
+  int optc;
+
+  set_program_name (argv[0]);
+  while ((optc = getopt (argc, argv, "f:s:v:l:r:")) != -1)
+    switch (optc)
+      {
+      case 'f':
+	files = strtoul (optarg, 0, 10);
+	break;
+      case 's':
+	file_size = strtoul (optarg, 0, 10);
+	break;
+      case 'v':
+	vocabulary_size = strtoul (optarg, 0, 10);
+	break;
+      case 'l':
+	parse_mix (optarg);
+	break;
+      case 'r':
+	seed = strtoul (optarg, 0, 10);
+	break;
+      default:
+	usage ();
+      }
+  if (optind != argc - 1 || files == 0 || vocabulary_size < 4)
+    usage ();
+  directory = argv[optind];
+  for (l = 0; l < CORPUS_LANGS; l++)
+    weights += corpus_langs[l].cl_weight;
+  if (weights == 0)
+    error (EXIT_FAILURE, 0, _("the languages all have a weight of 0"));
+
+  random_state = seed;
+  make_vocabulary ();
+  make_directory (directory);
+  file_name = xmalloc (strlen (directory) + 64);
+
+  for (i = 0; i < files; i++)
+    {
+      unsigned long pick = next_random () % weights;
+      unsigned long size = file_size / 2 + next_random () % (file_size + 1);
+      struct corpus_lang *lang = corpus_langs;
+      FILE *out;
+
+      while (pick >= lang->cl_weight)
+	pick -= lang++->cl_weight;
+      if (i % 100 == 0)
+	{
+	  sprintf (file_name, "%s/d%03lu", directory, i / 100);
+	  make_directory (file_name);
+	}
+      sprintf (file_name, "%s/d%03lu/f%05lu.%s", directory, i / 100, i,
+	       lang->cl_suffix);
+      if (i == files / 2)
+	middle_file = xstrdup (file_name + strlen (directory) + 1);
+      out = fopen (file_name, "w");
+      if (out == 0)
+	error (EXIT_FAILURE, errno, _("cannot create %s"), quote (file_name));
+      while ((unsigned long) ftell (out) < size)
+	lang->cl_line (out);
+      total_bytes += ftell (out);
+      if (fclose (out) != 0)
+	error (EXIT_FAILURE, errno, _("error writing %s"), quote (file_name));
+    }
+
+  /* The patterns are built from the most common words, so that they
+     match in any tree but the smallest.  */
+  printf ("files %lu\n", files);
+  printf ("bytes %ju\n", total_bytes);
+  printf ("literal %s\n", vocabulary[vocabulary_size / 10]);
+  printf ("prefix ^%.4s\n", vocabulary[0]);
+  printf ("regexp ^%.2s.*%s$\n", vocabulary[1],
+	  vocabulary[1] + strlen (vocabulary[1]) - 2);
+  printf ("substring %.4s\n", vocabulary[2] + 2);
+  printf ("number %lu\n", 3 * 37UL + 1);
+  printf ("file %s\n", middle_file);
+  free (middle_file);
+  free (file_name);
+  return EXIT_SUCCESS;
+}
+
+/* Parse ARG, a list of LANG=WEIGHT separated by commas, into the
+   weights of corpus_langs.  Languages not in the list have none.  */
+
+static void
+parse_mix (char const *arg)
+{
+  char *mix = xstrdup (arg);
+  char *item;
+  size_t l;
+
+  for (l = 0; l < CORPUS_LANGS; l++)
+    corpus_langs[l].cl_weight = 0;
+  for (item = strtok (mix, ","); item; item = strtok (0, ","))
+    {
+      char *equals = strchr (item, '=');
+
+      if (equals == 0)
+	error (EXIT_FAILURE, 0, _("invalid language mix: %s"), quote (arg));
+      *equals = '\0';
+      for (l = 0; l < CORPUS_LANGS; l++)
+	if (strcmp (corpus_langs[l].cl_name, item) == 0)
+	  break;
+      if (l == CORPUS_LANGS)
+	error (EXIT_FAILURE, 0, _("unknown language: %s"), quote (item));
+      corpus_langs[l].cl_weight = strtoul (equals + 1, 0, 10);
+    }
+  free (mix);
+}
+
+/* Make the words of the vocabulary: two to five syllables each,
+   sometimes joined by an underscore or ended by a digit.  */
+
+static void
+make_vocabulary (void)
+{
+  unsigned long i;
+
+  vocabulary = xnmalloc (vocabulary_size, sizeof *vocabulary);
+  for (i = 0; i < vocabulary_size; i++)
+    {
+      uint64_t r = next_random ();
+      int count = 2 + r % 4;
+      int underscore = (r >> 2) % 4 == 0;
+      int digit = (r >> 4) % 8 == 0;
+      char word[32];
+      char *w = word;
+      int s;
+
+      r >>= 8;
+      for (s = 0; s < count; s++, r >>= 5)
+	{
+	  if (underscore && s == count - 1)
+	    *w++ = '_';
+	  memcpy (w, syllables[r & 31], 2);
+	  w += 2;
+	}
+      if (digit)
+	*w++ = '0' + r % 10;
+      *w = '\0';
+      vocabulary[i] = xstrdup (word);
+    }
+}
+
+static void
+make_directory (char const *name)
+{
+  if (mkdir (name, 0777) != 0 && errno != EEXIST)
+    error (EXIT_FAILURE, errno, _("cannot create %s"), quote (name));
+}
+
+/* Return the next number of a splitmix64 sequence, which is the same
+   on every host.  */
+
+static uint64_t
+next_random (void)
+{
+  uint64_t z = (random_state += 0x9e3779b97f4a7c15ULL);
+
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+/* Return a word of the vocabulary, the first ones far more often than
+   the last.  */
+
+static char const *
+random_word (void)
+{
+  unsigned long bound = next_random () % vocabulary_size + 1;
+  return vocabulary[next_random () % bound];
+}
+
+/* Return a number, chosen as the words are, from a few hundred.  */
+
+static unsigned long
+random_number (void)
+{
+  unsigned long bound = next_random () % 256 + 1;
+  return (next_random () % bound) * 37 + 1;
+}
+
+static void
+put_words (FILE *out, int count)
+{
+  while (count--)
+    fprintf (out, count ? "%s " : "%s", random_word ());
+}
+
+static void
+c_line (FILE *out)
+{
+  switch (next_random () % 6)
+    {
+    case 0:
+      fprintf (out, "#define %s %lu\n", random_word (), random_number ());
+      break;
+    case 1:
+      fprintf (out, "static int %s (int %s, char *%s);\n",
+	       random_word (), random_word (), random_word ());
+      break;
+    case 2:
+      fprintf (out, "  %s = %s (%s, 0x%lx);\n",
+	       random_word (), random_word (), random_word (),
+	       random_number ());
+      break;
+    case 3:
+      fprintf (out, "  if (%s->%s > %lu)\n    return \"%s\";\n",
+	       random_word (), random_word (), random_number (),
+	       random_word ());
+      break;
+    case 4:
+      fputs ("/* ", out);
+      put_words (out, 1 + next_random () % 8);
+      fputs (" */\n", out);
+      break;
+    default:
+      fprintf (out, "struct %s\n{\n  long %s;\n  struct %s *%s;\n};\n",
+	       random_word (), random_word (), random_word (),
+	       random_word ());
+      break;
+    }
+}
+
+static void
+asm_line (FILE *out)
+{
+  switch (next_random () % 3)
+    {
+    case 0:
+      fprintf (out, "%s:\n", random_word ());
+      break;
+    case 1:
+      fprintf (out, "\tmov %s, %lu\t; ", random_word (), random_number ());
+      put_words (out, 1 + next_random () % 4);
+      putc ('\n', out);
+      break;
+    default:
+      fprintf (out, "\tcall %s\n", random_word ());
+      break;
+    }
+}
+
+static void
+perl_line (FILE *out)
+{
+  switch (next_random () % 3)
+    {
+    case 0:
+      fprintf (out, "sub %s {\n  my ($%s, $%s) = @_;\n}\n",
+	       random_word (), random_word (), random_word ());
+      break;
+    case 1:
+      fprintf (out, "$%s{%s} = &%s (%lu);\n",
+	       random_word (), random_word (), random_word (),
+	       random_number ());
+      break;
+    default:
+      fputs ("# ", out);
+      put_words (out, 1 + next_random () % 8);
+      putc ('\n', out);
+      break;
+    }
+}
+
+static void
+lisp_line (FILE *out)
+{
+  switch (next_random () % 3)
+    {
+    case 0:
+      fprintf (out, "(defun %s (%s %s)\n  (%s %s %lu))\n",
+	       random_word (), random_word (), random_word (),
+	       random_word (), random_word (), random_number ());
+      break;
+    case 1:
+      fprintf (out, "(setq %s '%s)\n", random_word (), random_word ());
+      break;
+    default:
+      fputs (";; ", out);
+      put_words (out, 1 + next_random () % 8);
+      putc ('\n', out);
+      break;
+    }
+}
+
+static void
+text_line (FILE *out)
+{
+  put_words (out, 4 + next_random () % 8);
+  fputs (".\n", out);
+}
@@ -0,0 +1,83 @@
+#!/bin/sh
+# Build an ID file of a synthetic tree, time queries of it, and print
+# the results as JSON.
+
+# Copyright (C) 2012 Free Software Foundation, Inc.
+
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+# bench-corpus writes the tree, in bench-tree, and names patterns that
+# occur in it.  mkid, lid and fid are taken from $PATH, bench-corpus
+# and bench-time from the current directory.  The options of
+# bench-corpus are passed on to it; -n gives the number of runs of each
+# query, -m the language map of mkid.
+
+set -e
+
+files=1000 size=8192 words=10000 mix=c=70,asm=10,perl=10,lisp=5,text=5
+seed=1 rounds=20 map=
+while getopts f:s:v:l:r:n:m: opt; do
+  case $opt in
+    f) files=$OPTARG ;;
+    s) size=$OPTARG ;;
+    v) words=$OPTARG ;;
+    l) mix=$OPTARG ;;
+    r) seed=$OPTARG ;;
+    n) rounds=$OPTARG ;;
+    m) map=$OPTARG ;;
+    *) echo "Usage: $0 [-f FILES] [-s BYTES] [-v WORDS] [-l MIX]" \
+	 "[-r SEED] [-n ROUNDS] [-m MAP]" >&2
+       exit 1 ;;
+  esac
+done
+
+bin=`pwd`
+rm -rf bench-tree bench-ID bench-corpus.out bench-mkid.json
+"$bin/bench-corpus" -f "$files" -s "$size" -v "$words" -l "$mix" \
+  -r "$seed" bench-tree > bench-corpus.out
+while read key value; do
+  eval "q_$key=\$value"
+done < bench-corpus.out
+
+cd bench-tree
+# The first run reads the files into the cache; the second is timed.
+mkid ${map:+-m "$map"} -o ../bench-ID .
+mkid ${map:+-m "$map"} --stats=json -o ../bench-ID . > ../bench-mkid.json
+
+time_query ()
+{
+  name=$1
+  shift
+  result=`"$bin/bench-time" -n "$rounds" "$name" "$@"`
+  test -z "$sep" || printf ',\n'
+  printf '    %s' "$result"
+  sep=,
+}
+
+printf '{\n'
+printf '  "corpus": {"files": %s, "bytes": %s, "vocabulary": %s,' \
+  "$q_files" "$q_bytes" "$words"
+printf ' "languages": "%s", "seed": %s},\n' "$mix" "$seed"
+printf '  "mkid": '
+sed '1!s/^/  /' ../bench-mkid.json | sed '$s/$/,/'
+printf '  "queries": [\n'
+sep=
+time_query literal lid -f ../bench-ID "$q_literal"
+time_query prefix lid -f ../bench-ID "$q_prefix"
+time_query regexp lid -f ../bench-ID -r "$q_regexp"
+time_query substring lid -f ../bench-ID -s "$q_substring"
+time_query number lid -f ../bench-ID "$q_number"
+time_query ambiguous lid -f ../bench-ID -a 6
+time_query fid fid -f ../bench-ID "$q_file"
+printf '\n  ]\n}\n'
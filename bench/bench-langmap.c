@@ -0,0 +1,197 @@
+/* bench-langmap.c -- time the mapping of file names onto languages
+   Copyright (C) 2012 Free Software Foundation, Inc.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Read file names, one per line, from standard input, and map each of
+   them onto its language ROUNDS times: first by trying every pattern
+   of the language map in turn with fnmatch, as the walker used to,
+   then with the compiled map that the walker uses now.  Report the
+   time each takes, and fail if they disagree about any name.  */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <fnmatch.h>
+#include <sys/time.h>
+
+#include "error.h"
+#include "progname.h"
+#include "xalloc.h"
+
+#include "xnls.h"
+#include "scanners.h"
+#include "iduglobal.h"
+
+void usage (void) __attribute__((__noreturn__));
+
+static struct lang_args *linear_lang_args (char const *base_name,
+					   char const *file_name);
+static struct lang_args *compiled_lang_args (char const *base_name,
+					     char const *file_name);
+static double wall_seconds (void);
+
+void
+usage (void)
+{
+  fprintf (stderr, _("Usage: %s [-m MAPFILE] [-n ROUNDS] < FILE-NAMES\n"),
+	   program_name);
+  exit (EXIT_FAILURE);
+}
+
+int
+main (int argc, char **argv)
+{
+  char *lang_map_file_name = 0;
+  unsigned long rounds = 10;
+  char **names = 0;
+  char **bases;
+  size_t names_count = 0;
+  size_t names_alloc = 0;
+  char *line = 0;
+  size_t line_alloc = 0;
+  ssize_t length;
+  struct lang_args *args;
+  unsigned long patterns = 0;
+  unsigned long globs = 0;
+  unsigned long round;
+  size_t i;
+  double start;
+  double linear_seconds;
+  double compiled_seconds;
+  int optc;
+
+  set_program_name (argv[0]);
+  while ((optc = getopt (argc, argv, "m:n:")) != -1)
+    switch (optc)
+      {
+      case 'm':
+	lang_map_file_name = optarg;
+	break;
+      case 'n':
+	rounds = strtoul (optarg, 0, 10);
+	break;
+      default:
+	usage ();
+      }
+  if (optind != argc)
+    usage ();
+
+  parse_language_map (lang_map_file_name);
+  for (args = lang_args_list; args; args = args->la_next)
+    patterns++;
+  for (args = lang_args_globs; args; args = args->la_next_glob)
+    globs++;
+
+  while ((length = getline (&line, &line_alloc, stdin)) > 0)
+    {
+      if (line[length - 1] == '\n')
+	line[--length] = '\0';
+      if (length == 0)
+	continue;
+      if (names_count == names_alloc)
+	names = x2nrealloc (names, &names_alloc, sizeof *names);
+      names[names_count++] = xstrdup (line);
+    }
+  free (line);
+  if (names_count == 0)
+    error (EXIT_FAILURE, 0, _("no file names on standard input"));
+
+  bases = xnmalloc (names_count, sizeof *bases);
+  for (i = 0; i < names_count; i++)
+    {
+      char *slash = strrchr (names[i], SLASH_CHAR);
+      bases[i] = slash ? slash + 1 : names[i];
+      if (linear_lang_args (bases[i], names[i])
+	  != compiled_lang_args (bases[i], names[i]))
+	error (EXIT_FAILURE, 0, _("the compiled map disagrees about `%s'"),
+	       names[i]);
+    }
+
+  start = wall_seconds ();
+  for (round = 0; round < rounds; round++)
+    for (i = 0; i < names_count; i++)
+      linear_lang_args (bases[i], names[i]);
+  linear_seconds = wall_seconds () - start;
+
+  start = wall_seconds ();
+  for (round = 0; round < rounds; round++)
+    for (i = 0; i < names_count; i++)
+      compiled_lang_args (bases[i], names[i]);
+  compiled_seconds = wall_seconds () - start;
+
+  printf ("names=%lu rounds=%lu patterns=%lu globs=%lu\n",
+	  (unsigned long) names_count, rounds, patterns, globs);
+  printf ("linear %.3f s, %.0f ns/name\n", linear_seconds,
+	  linear_seconds * 1e9 / ((double) names_count * rounds));
+  printf ("compiled %.3f s, %.0f ns/name\n", compiled_seconds,
+	  compiled_seconds * 1e9 / ((double) names_count * rounds));
+  return EXIT_SUCCESS;
+}
+
+/* Match each pattern of the map in turn, as get_lang_args did before
+   the map was compiled.  */
+
+static struct lang_args *
+linear_lang_args (char const *base_name, char const *file_name)
+{
+  struct lang_args *args;
+
+  for (args = lang_args_list; args; args = args->la_next)
+    {
+      if (strchr (args->la_pattern, SLASH_CHAR))
+	{
+	  if (fnmatch (args->la_pattern, file_name, MAYBE_FNM_CASEFOLD | FNM_FILE_NAME) == 0)
+	    return args;
+	}
+      else if (fnmatch (args->la_pattern, base_name, MAYBE_FNM_CASEFOLD) == 0)
+	return args;
+    }
+  return lang_args_default;
+}
+
+/* Match as get_lang_args does.  */
+
+static struct lang_args *
+compiled_lang_args (char const *base_name, char const *file_name)
+{
+  struct lang_args *best = find_literal_lang_args (base_name);
+  struct lang_args *args;
+
+  for (args = lang_args_globs;
+       args && (best == 0 || args->la_index < best->la_index);
+       args = args->la_next_glob)
+    {
+      if (strchr (args->la_pattern, SLASH_CHAR))
+	{
+	  if (fnmatch (args->la_pattern, file_name, MAYBE_FNM_CASEFOLD | FNM_FILE_NAME) == 0)
+	    return args;
+	}
+      else if (fnmatch (args->la_pattern, base_name, MAYBE_FNM_CASEFOLD) == 0)
+	return args;
+    }
+  return best ? best : lang_args_default;
+}
+
+static double
+wall_seconds (void)
+{
+  struct timeval tv;
+
+  gettimeofday (&tv, 0);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
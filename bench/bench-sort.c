@@ -0,0 +1,159 @@
+/* bench-sort.c -- time the sorting of tokens
+   Copyright (C) 2012 Free Software Foundation, Inc.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Read tokens, one per line, from standard input, as xtokid prints
+   them, and keep one of each in a hash table, as mkid does.  Then sort
+   the tokens in the order of the table ROUNDS times: first with qsort,
+   as mkid used to, then with sort_by_name, as mkid does now.  Report
+   the time each takes, and fail if they disagree.  */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <sys/time.h>
+
+#include "error.h"
+#include "progname.h"
+#include "xalloc.h"
+
+#include "xnls.h"
+#include "idu-hash.h"
+#include "strsort.h"
+
+void usage (void) __attribute__((__noreturn__));
+
+static unsigned long name_hash (void const *key);
+static int name_hash_cmp (void const *x, void const *y);
+static int name_qsort_cmp (void const *x, void const *y);
+static double wall_seconds (void);
+
+void
+usage (void)
+{
+  fprintf (stderr, _("Usage: %s [-n ROUNDS] < TOKENS\n"), program_name);
+  exit (EXIT_FAILURE);
+}
+
+int
+main (int argc, char **argv)
+{
+  unsigned long rounds = 10;
+  struct hash_table names;
+  char **unsorted;
+  char **by_qsort;
+  char **by_name;
+  unsigned long count;
+  char *line = 0;
+  size_t line_alloc = 0;
+  ssize_t length;
+  unsigned long round;
+  unsigned long i;
+  double qsort_seconds = 0;
+  double name_seconds = 0;
+  double start;
+  int optc;
+
+  set_program_name (argv[0]);
+  while ((optc = getopt (argc, argv, "n:")) != -1)
+    switch (optc)
+      {
+      case 'n':
+	rounds = strtoul (optarg, 0, 10);
+	break;
+      default:
+	usage ();
+      }
+  if (optind != argc)
+    usage ();
+
+  hash_init_tagged (&names, 1 << 16, name_hash, name_hash_cmp);
+  while ((length = getline (&line, &line_alloc, stdin)) > 0)
+    {
+      void **slot;
+
+      if (line[length - 1] == '\n')
+	line[--length] = '\0';
+      if (length == 0)
+	continue;
+      slot = hash_find_slot (&names, line);
+      if (HASH_VACANT (*slot))
+	hash_insert_at (&names, xstrdup (line), slot);
+    }
+  free (line);
+  count = names.ht_fill;
+  if (count == 0)
+    error (EXIT_FAILURE, 0, _("no tokens on standard input"));
+
+  unsorted = (char **) hash_dump (&names, 0, 0);
+  by_qsort = xnmalloc (count, sizeof *by_qsort);
+  by_name = xnmalloc (count, sizeof *by_name);
+
+  for (round = 0; round < rounds; round++)
+    {
+      memcpy (by_qsort, unsorted, count * sizeof *by_qsort);
+      start = wall_seconds ();
+      qsort (by_qsort, count, sizeof *by_qsort, name_qsort_cmp);
+      qsort_seconds += wall_seconds () - start;
+
+      memcpy (by_name, unsorted, count * sizeof *by_name);
+      start = wall_seconds ();
+      sort_by_name ((void **) by_name, count, 0);
+      name_seconds += wall_seconds () - start;
+    }
+  for (i = 0; i < count; i++)
+    if (by_qsort[i] != by_name[i])
+      error (EXIT_FAILURE, 0, _("the sorts disagree about `%s'"),
+	     by_qsort[i]);
+
+  printf ("tokens=%lu rounds=%lu\n", count, rounds);
+  printf ("qsort %.3f s, %.0f ns/token\n", qsort_seconds,
+	  qsort_seconds * 1e9 / ((double) count * rounds));
+  printf ("sort_by_name %.3f s, %.0f ns/token\n", name_seconds,
+	  name_seconds * 1e9 / ((double) count * rounds));
+  return EXIT_SUCCESS;
+}
+
+static unsigned long _GL_ATTRIBUTE_PURE
+name_hash (void const *key)
+{
+  return_STRING_HASH ((char const *) key);
+}
+
+static int _GL_ATTRIBUTE_PURE
+name_hash_cmp (void const *x, void const *y)
+{
+  return_STRING_COMPARE ((char const *) x, (char const *) y);
+}
+
+/* Compare as mkid's token_qsort_cmp did.  */
+
+static int _GL_ATTRIBUTE_PURE
+name_qsort_cmp (void const *x, void const *y)
+{
+  return_STRING_COMPARE (*(char const *const *) x, *(char const *const *) y);
+}
+
+static double
+wall_seconds (void)
+{
+  struct timeval tv;
+
+  gettimeofday (&tv, 0);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
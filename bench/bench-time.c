@@ -0,0 +1,151 @@
+/* bench-time.c -- time the runs of a command
+   Copyright (C) 2012 Free Software Foundation, Inc.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Run COMMAND with its ARGs ROUNDS times, with its output thrown
+   away, and print as a JSON object the NAME of the query it makes, the
+   size of its output, and the least, median and mean wall-clock time
+   of its runs, in seconds.  Fail if any run fails.  */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "error.h"
+#include "progname.h"
+#include "quote.h"
+#include "xalloc.h"
+
+#include "xnls.h"
+
+void usage (void) __attribute__((__noreturn__));
+
+static double run_command (char **argv, off_t *output_size);
+static int double_qsort_cmp (void const *x, void const *y);
+static double wall_seconds (void);
+
+void
+usage (void)
+{
+  fprintf (stderr, _("Usage: %s [-n ROUNDS] NAME COMMAND [ARG]...\n"),
+	   program_name);
+  exit (EXIT_FAILURE);
+}
+
+int
+main (int argc, char **argv)
+{
+  unsigned long rounds = 20;
+  double *seconds;
+  double total = 0;
+  off_t output_size = 0;
+  char const *name;
+  unsigned long i;
+  int optc;
+
+  set_program_name (argv[0]);
+  while ((optc = getopt (argc, argv, "+n:")) != -1)
+    switch (optc)
+      {
+      case 'n':
+	rounds = strtoul (optarg, 0, 10);
+	break;
+      default:
+	usage ();
+      }
+  if (argc - optind < 2 || rounds == 0)
+    usage ();
+  name = argv[optind];
+
+  seconds = xnmalloc (rounds, sizeof *seconds);
+  for (i = 0; i < rounds; i++)
+    {
+      seconds[i] = run_command (&argv[optind + 1], &output_size);
+      total += seconds[i];
+    }
+  qsort (seconds, rounds, sizeof *seconds, double_qsort_cmp);
+
+  printf ("{\"name\": \"%s\", \"rounds\": %lu, \"output_bytes\": %jd, "
+	  "\"min\": %.6f, \"median\": %.6f, \"mean\": %.6f}\n",
+	  name, rounds, (intmax_t) output_size, seconds[0],
+	  seconds[rounds / 2], total / rounds);
+  free (seconds);
+  return EXIT_SUCCESS;
+}
+
+/* Run the command ARGV with its output to a temporary file, and return
+   the seconds it takes.  Set *OUTPUT_SIZE to the size of its output.  */
+
+static double
+run_command (char **argv, off_t *output_size)
+{
+  char file_name[] = "/tmp/bench-timeXXXXXX";
+  double start;
+  double stop;
+  int status;
+  pid_t pid;
+  int fd = mkstemp (file_name);
+
+  if (fd < 0)
+    error (EXIT_FAILURE, errno, _("cannot create a temporary file"));
+  unlink (file_name);
+
+  start = wall_seconds ();
+  pid = fork ();
+  if (pid < 0)
+    error (EXIT_FAILURE, errno, _("can't fork"));
+  if (pid == 0)
+    {
+      dup2 (fd, STDOUT_FILENO);
+      close (fd);
+      execvp (argv[0], argv);
+      error (127, errno, _("can't exec %s"), quote (argv[0]));
+    }
+  if (waitpid (pid, &status, 0) < 0)
+    error (EXIT_FAILURE, errno, _("can't wait for %s"), quote (argv[0]));
+  stop = wall_seconds ();
+  if (!WIFEXITED (status) || WEXITSTATUS (status) != 0)
+    error (EXIT_FAILURE, 0, _("%s failed"), quote (argv[0]));
+
+  *output_size = lseek (fd, 0, SEEK_END);
+  close (fd);
+  return stop - start;
+}
+
+static int
+double_qsort_cmp (void const *x, void const *y)
+{
+  double a = *(double const *) x;
+  double b = *(double const *) y;
+  return (a > b) - (a < b);
+}
+
+static double
+wall_seconds (void)
+{
+  struct timeval tv;
+
+  gettimeofday (&tv, 0);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
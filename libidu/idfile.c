@@ -22,6 +22,8 @@
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <assert.h>
 #include <obstack.h>
 #include <error.h>
 #include <sys/stat.h>
@@ -30,7 +32,13 @@
 #include "xalloc.h"
 #include "xnls.h"
 
-static int io_size (FILE *, void *, unsigned int size, int);
+static int io_size (void *, void *, unsigned int size, int);
+static int io_idhead_4 (void *stream, io_func_t iof, struct idhead *idhp);
+static int io_idhead_5 (void *stream, io_func_t iof, struct idhead *idhp);
+static int io_section (void *stream, io_func_t iof, struct id_section *section);
+static int io_offset (void *stream, io_func_t iof, off_t *offset,
+		      unsigned int size);
+static int io_count (void *stream, io_func_t iof, unsigned long *count);
 
 /****************************************************************************/
 
@@ -94,13 +102,13 @@ locate_id_file_name (char const *arg)
 /****************************************************************************/
 
 int
-sizeof_idhead (void)
+sizeof_idhead (struct idhead *idhp)
 {
-  return io_idhead (0, io_size, 0);
+  return io_idhead (0, io_size, idhp);
 }
 
 static int
-io_size (FILE *ignore_FILE, void *ignore_addr, unsigned int size, int io_type)
+io_size (void *ignore_stream, void *ignore_addr, unsigned int size, int io_type)
 {
   if (io_type == IO_TYPE_STR)
     error (0, 0, _("can't determine the io_size of a string!"));
@@ -110,28 +118,202 @@ io_size (FILE *ignore_FILE, void *ignore_addr, unsigned int size, int io_type)
 /* The sizes of the fields must be hard-coded.  They aren't
    necessarily the sizes of the struct members, because some
    architectures don't have any way to declare 4-byte integers
-   (e.g., Cray) */
+   (e.g., Cray).  STREAM must be at the start of the ID file.  */
 
 int
-io_idhead (FILE *fp, io_func_t iof, struct idhead *idhp)
+io_idhead (void *stream, io_func_t iof, struct idhead *idhp)
 {
   unsigned int size = 0;
   unsigned char pad = 0;
-  if (fp)
-    fseek (fp, 0L, 0);
-  size += iof (fp, idhp->idh_magic, 2, IO_TYPE_FIX);
-  size += iof (fp, &pad, 1, IO_TYPE_FIX);
-  size += iof (fp, &idhp->idh_version, 1, IO_TYPE_FIX);
-  size += iof (fp, &idhp->idh_flags, 2, IO_TYPE_INT);
-  size += iof (fp, &idhp->idh_file_links, 4, IO_TYPE_INT);
-  size += iof (fp, &idhp->idh_files, 4, IO_TYPE_INT);
-  size += iof (fp, &idhp->idh_tokens, 4, IO_TYPE_INT);
-  size += iof (fp, &idhp->idh_buf_size, 4, IO_TYPE_INT);
-  size += iof (fp, &idhp->idh_vec_size, 4, IO_TYPE_INT);
-  size += iof (fp, &idhp->idh_tokens_offset, 4, IO_TYPE_INT);
-  size += iof (fp, &idhp->idh_flinks_offset, 4, IO_TYPE_INT);
-  size += iof (fp, &idhp->idh_end_offset, 4, IO_TYPE_INT);
-  size += iof (fp, &idhp->idh_max_link, 2, IO_TYPE_INT);
-  size += iof (fp, &idhp->idh_max_path, 2, IO_TYPE_INT);
+  size += iof (stream, idhp->idh_magic, 2, IO_TYPE_FIX);
+  size += iof (stream, &pad, 1, IO_TYPE_FIX);
+  size += iof (stream, &idhp->idh_version, 1, IO_TYPE_FIX);
+  size += iof (stream, &idhp->idh_flags, 2, IO_TYPE_INT);
+  if (idhp->idh_version == IDH_VERSION_4)
+    size += io_idhead_4 (stream, iof, idhp);
+  else if (idhp->idh_version == IDH_VERSION_5)
+    size += io_idhead_5 (stream, iof, idhp);
   return size;
 }
+
+static int
+io_idhead_4 (void *stream, io_func_t iof, struct idhead *idhp)
+{
+  unsigned int size = 0;
+  size += iof (stream, &idhp->idh_file_links, 4, IO_TYPE_INT);
+  size += iof (stream, &idhp->idh_files, 4, IO_TYPE_INT);
+  size += iof (stream, &idhp->idh_tokens, 4, IO_TYPE_INT);
+  size += iof (stream, &idhp->idh_buf_size, 4, IO_TYPE_INT);
+  size += iof (stream, &idhp->idh_vec_size, 4, IO_TYPE_INT);
+  size += io_offset (stream, iof, &idhp->idh_tokens_offset, 4);
+  size += io_offset (stream, iof, &idhp->idh_flinks_offset, 4);
+  size += io_offset (stream, iof, &idhp->idh_end_offset, 4);
+  size += iof (stream, &idhp->idh_max_link, 2, IO_TYPE_INT);
+  size += iof (stream, &idhp->idh_max_path, 2, IO_TYPE_INT);
+  /* Readers that predate the token index stop here, and find the
+     other sections through the offsets above.  */
+  if (idhp->idh_flags & IDH_TOKEN_INDEX)
+    size += io_offset (stream, iof, &idhp->idh_index_offset, 4);
+  return size;
+}
+
+/* A version 5 header has 64-bit counts, followed by a directory of
+   (section id, offset, length) entries.  The sections that have
+   dedicated fields in struct idhead come first, then any others.  */
+
+static int
+io_idhead_5 (void *stream, io_func_t iof, struct idhead *idhp)
+{
+  unsigned int size = 0;
+  unsigned short count;
+  struct id_section sections[4];
+  struct id_section *section;
+  unsigned int i;
+
+  size += iof (stream, &idhp->idh_max_link, 2, IO_TYPE_INT);
+  size += iof (stream, &idhp->idh_max_path, 2, IO_TYPE_INT);
+
+  /* On output, derive the directory entries of the dedicated sections
+     from the corresponding header fields.  */
+  memset (sections, 0, sizeof sections);
+  count = 0;
+  section = &sections[count++];
+  section->ids_id = IDS_FILE_LINKS;
+  section->ids_offset = idhp->idh_flinks_offset;
+  section->ids_length = ((idhp->idh_flags & IDH_TOKEN_INDEX
+			  ? idhp->idh_index_offset : idhp->idh_tokens_offset)
+			 - 2 - idhp->idh_flinks_offset);
+  if (idhp->idh_flags & IDH_TOKEN_INDEX)
+    {
+      section = &sections[count++];
+      section->ids_id = IDS_TOKEN_INDEX;
+      section->ids_offset = idhp->idh_index_offset;
+      section->ids_length = (idhp->idh_tokens
+			     * IDH_TOKEN_INDEX_BYTES (IDH_VERSION_5));
+    }
+  section = &sections[count++];
+  section->ids_id = IDS_TOKENS;
+  section->ids_offset = idhp->idh_tokens_offset;
+  section->ids_length = idhp->idh_end_offset + 2 - idhp->idh_tokens_offset;
+  count += idhp->idh_section_count;
+
+  size += iof (stream, &count, 2, IO_TYPE_INT);
+  size += io_count (stream, iof, &idhp->idh_file_links);
+  size += io_count (stream, iof, &idhp->idh_files);
+  size += io_count (stream, iof, &idhp->idh_tokens);
+  size += io_count (stream, iof, &idhp->idh_buf_size);
+  size += io_count (stream, iof, &idhp->idh_vec_size);
+
+  if (iof == io_read)
+    {
+      idhp->idh_flags &= ~IDH_TOKEN_INDEX;
+      idhp->idh_section_count = 0;
+      for (i = 0; i < count; i++)
+	{
+	  struct id_section entry;
+	  size += io_section (stream, iof, &entry);
+	  switch (entry.ids_id)
+	    {
+	    case IDS_FILE_LINKS:
+	      idhp->idh_flinks_offset = entry.ids_offset;
+	      break;
+	    case IDS_TOKEN_INDEX:
+	      idhp->idh_index_offset = entry.ids_offset;
+	      idhp->idh_flags |= IDH_TOKEN_INDEX;
+	      break;
+	    case IDS_TOKENS:
+	      idhp->idh_tokens_offset = entry.ids_offset;
+	      idhp->idh_end_offset = entry.ids_offset + entry.ids_length - 2;
+	      break;
+	    default:
+	      if (idhp->idh_section_count == IDH_MAX_SECTIONS)
+		error (EXIT_FAILURE, 0, _("`%s' has too many sections"),
+		       idhp->idh_file_name);
+	      idhp->idh_sections[idhp->idh_section_count++] = entry;
+	      break;
+	    }
+	}
+    }
+  else
+    {
+      for (section = sections; section->ids_id; section++)
+	size += io_section (stream, iof, section);
+      for (i = 0; i < idhp->idh_section_count; i++)
+	size += io_section (stream, iof, &idhp->idh_sections[i]);
+    }
+  return size;
+}
+
+static int
+io_section (void *stream, io_func_t iof, struct id_section *section)
+{
+  unsigned int size = 0;
+  size += iof (stream, &section->ids_id, 4, IO_TYPE_INT);
+  size += io_offset (stream, iof, &section->ids_offset, 8);
+  size += io_offset (stream, iof, &section->ids_length, 8);
+  return size;
+}
+
+/* Read or write an offset, which may be wider or narrower than off_t
+   on disk.  */
+
+static int
+io_offset (void *stream, io_func_t iof, off_t *offset, unsigned int size)
+{
+  int result;
+  if (size == 8)
+    {
+      uint64_t value = *offset;
+      result = iof (stream, &value, size, IO_TYPE_INT);
+      *offset = value;
+    }
+  else
+    {
+      unsigned long value = *offset;
+      result = iof (stream, &value, size, IO_TYPE_INT);
+      *offset = value;
+    }
+  return result;
+}
+
+static int
+io_count (void *stream, io_func_t iof, unsigned long *count)
+{
+  uint64_t value = *count;
+  int result = iof (stream, &value, 8, IO_TYPE_INT);
+  *count = value;
+  return result;
+}
+
+
+/****************************************************************************/
+
+/* Return the directory entry for section ID, or 0 if there is none.  */
+
+struct id_section *
+find_id_section (struct idhead *idhp, unsigned long id)
+{
+  unsigned int i;
+  for (i = 0; i < idhp->idh_section_count; i++)
+    if (idhp->idh_sections[i].ids_id == id)
+      return &idhp->idh_sections[i];
+  return 0;
+}
+
+/* Add an entry for section ID to the directory of a version 5 ID
+   file that is about to be written.  The caller fills in the offset
+   and length before the header is written.  */
+
+struct id_section *
+add_id_section (struct idhead *idhp, unsigned long id)
+{
+  struct id_section *section = find_id_section (idhp, id);
+  if (section)
+    return section;
+  assert (idhp->idh_section_count < IDH_MAX_SECTIONS);
+  section = &idhp->idh_sections[idhp->idh_section_count++];
+  section->ids_id = id;
+  section->ids_offset = 0;
+  section->ids_length = 0;
+  return section;
+}
@@ -23,6 +23,7 @@
 #include <config.h>
 #include <sys/types.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <string.h>
 #include "obstack.h"
 #include "idu-hash.h"
@@ -32,6 +33,78 @@
 
 /****************************************************************************/
 
+/* Version 5 ID files begin with a directory of sections.  Besides
+   the file names, tokens and token index, which are also present in
+   version 4 and have dedicated fields in struct idhead, the directory
+   may name other sections, which are kept in idh_sections.  */
+
+struct id_section
+{
+  unsigned long ids_id;
+#define IDS_FILE_LINKS	1	/* constituent file & directory names */
+#define IDS_TOKEN_INDEX	2	/* offsets of token entries */
+#define IDS_TOKENS	3	/* constituent tokens */
+#define IDS_MEMBER_STATS 4	/* status of member files, for mkid --incremental */
+#define IDS_TRIGRAMS	5	/* tokens containing each trigram */
+#define IDS_POSITIONS	6	/* lines of each token, for mkid --positions */
+#define IDS_SHARD	7	/* file numbers in the whole tree, for mkid --shard */
+#define IDS_TOKEN_TALLIES 8	/* occurrences of each token in each file,
+				   for mkid --incremental */
+  off_t ids_offset;
+  off_t ids_length;
+};
+
+#define IDH_MAX_SECTIONS 16
+
+/* An id_output gathers what mkid writes to an ID file in a buffer, and
+   hands it to its sink in large blocks, so that building a token entry
+   costs a store per byte rather than a stdio call.  A block that is
+   larger than the buffer goes to the sink beside what is buffered,
+   without being copied.  The sink receives COUNT blocks to be written
+   in order at OFFSET in the file; it returns 0, or -1 with errno set.
+   The default sink writes them to ido_fd with writev; a compressing or
+   checksumming one may take its place.  */
+
+struct id_block
+{
+  void const *idb_base;
+  size_t idb_size;
+};
+
+struct id_output;
+typedef int (*id_sink_func_t) (struct id_output *ido,
+			       struct id_block const *blocks, int count,
+			       off_t offset);
+
+struct id_output
+{
+  int ido_fd;
+  id_sink_func_t ido_sink;
+  void *ido_sink_data;
+  unsigned char *ido_buf;
+  size_t ido_fill;		/* bytes in ido_buf */
+  size_t ido_alloc;		/* size of ido_buf */
+  off_t ido_offset;		/* file offset of ido_buf[0] */
+  off_t ido_fd_offset;		/* file offset of ido_fd, for the default sink */
+  int ido_errno;		/* first error from the sink, or 0 */
+};
+
+#define ID_OUTPUT_BUFFER_SIZE (256 * 1024)
+
+#define id_output_putc(ido, c) \
+  ((ido)->ido_fill < (ido)->ido_alloc \
+   ? (void) ((ido)->ido_buf[(ido)->ido_fill++] = (unsigned char) (c)) \
+   : id_output_putc_1 ((ido), (c)))
+#define id_output_tell(ido) ((ido)->ido_offset + (off_t) (ido)->ido_fill)
+
+extern void open_id_output (struct id_output *ido, int fd);
+extern int close_id_output (struct id_output *ido);
+extern void id_output_write (struct id_output *ido, void const *addr,
+			     size_t size);
+extern void id_output_putc_1 (struct id_output *ido, int c);
+extern void id_output_flush (struct id_output *ido);
+extern void id_output_seek (struct id_output *ido, off_t offset);
+
 /* The ID file header is the nexus of all ID file information.  This
    is an in-core structure, only some of which is read/written to disk.  */
 
@@ -41,7 +114,9 @@ struct idhead
 #define	IDH_MAGIC_0 ('I'|0x80)
 #define	IDH_MAGIC_1 ('D'|0x80)
   unsigned char idh_version;
-#define	IDH_VERSION	4
+#define	IDH_VERSION_4	4	/* 32-bit offsets and counts */
+#define	IDH_VERSION_5	5	/* 64-bit offsets and counts, section directory */
+#define	IDH_VERSION	IDH_VERSION_5	/* the newest version */
   unsigned short idh_flags;
 #define IDH_COUNTS	(1<<0)	/* include occurrence counts for each token */
 #define IDH_FOLLOW_SL	(1<<1)	/* follow symlinks to directories */
@@ -50,6 +125,8 @@ struct idhead
 #define IDH_DECL_DEFN_USE (1<<4) /* include decl/defn/use info */
 #define IDH_L_R_VALUE	(1<<5)	/* include lvalue/rvalue info */
 #define IDH_CALL_ER_EE	(1<<6)	/* include caller/callee relationship info */
+#define IDH_TOKEN_INDEX	(1<<7)	/* table of token offsets precedes tokens */
+#define IDH_POSITIONS	(1<<8)	/* include the lines on which tokens occur */
   unsigned long idh_file_links;	/* total # of file links */
   unsigned long idh_files;	/* total # of constituent source files */
   unsigned long idh_tokens;	/* total # of constituent tokens */
@@ -57,11 +134,16 @@ struct idhead
   unsigned long idh_buf_size;	/* # of bytes in longest entry */
   unsigned long idh_vec_size;	/* # of hits in longest entry */
   /* idh_*_offset: ID file offsets for start of various sections */
-  long idh_tokens_offset;	/* constituent tokens section */
-  long idh_flinks_offset;	/* constituent file & directory names section */
-  long idh_end_offset;		/* end of tokens section */
+  off_t idh_tokens_offset;	/* constituent tokens section */
+  off_t idh_flinks_offset;	/* constituent file & directory names section */
+  off_t idh_end_offset;		/* end of tokens section */
+  off_t idh_index_offset;	/* token offsets table (IDH_TOKEN_INDEX) */
+#define IDH_TOKEN_INDEX_BYTES(version) ((version) < IDH_VERSION_5 ? 4 : 8)
   unsigned short idh_max_link;	/* longest file name component */
   unsigned short idh_max_path;	/* largest # of file name components */
+  /* sections other than those above (version 5 and later) */
+  unsigned int idh_section_count;
+  struct id_section idh_sections[IDH_MAX_SECTIONS];
 
   /* The following are run-time variables and are not stored on disk */
   char const *idh_file_name;
@@ -74,8 +156,20 @@ struct idhead
   struct obstack idh_dev_ino_obstack;
 #endif
   FILE *idh_FILE;
+  struct id_output idh_output;	/* where mkid writes the ID file */
+  unsigned char const *idh_map;	/* contents of ID file, once mapped */
+  size_t idh_map_size;
+  int idh_mapped;		/* nonzero if idh_map came from mmap */
 };
 
+/* Addresses of the first token entry and of the end of the token
+   entries in a mapped ID file.  */
+
+#define ID_TOKENS_BEGIN(idhp) \
+  ((char const *) (idhp)->idh_map + (idhp)->idh_tokens_offset)
+#define ID_TOKENS_END(idhp) \
+  ((char const *) (idhp)->idh_map + (idhp)->idh_end_offset)
+
 /* idhead input/output definitions */
 
 #define IO_TYPE_INT	0	/* integer */
@@ -95,7 +189,7 @@ struct file_link
 #define fl_parent fl_u.u_parent
     unsigned long u_index;
 #define fl_index fl_u.u_index
-#define FL_PARENT_INDEX_BYTES 3
+#define FL_PARENT_INDEX_BYTES(version) ((version) < IDH_VERSION_5 ? 3 : 4)
 #define IS_ROOT_FILE_LINK(flink) ((flink)->fl_parent == (flink))
   } fl_u;
   unsigned char fl_flags;
@@ -120,6 +214,7 @@ struct member_file
   struct file_link *mf_link;
   struct lang_args const *mf_lang_args;
   long mf_index;	/* order in ID file */
+  off_t mf_size;	/* as the walk found it, or -1 */
 };
 
 #if HAVE_LINK
@@ -168,20 +263,30 @@ enum separator_style
 #define DEFAULT_SEPARATOR_STYLE ss_braces
 #endif
 
-typedef int (*io_func_t) (FILE *, void *, unsigned int, int);
+/* The first argument is the FILE to read, or the struct id_output to
+   write.  */
+typedef int (*io_func_t) (void *, void *, unsigned int, int);
 
 extern struct file_link **read_id_file (char const *id_file_name, struct idhead *idhp);
 extern struct file_link **maybe_read_id_file (char const *id_file_name, struct idhead *idhp);
+extern void map_id_file (struct idhead *idhp);
+extern void unmap_id_file (struct idhead *idhp);
 extern int read_idhead (struct idhead *idhp);
 extern int write_idhead (struct idhead *idhp);
-extern int sizeof_idhead (void);
+extern int sizeof_idhead (struct idhead *idhp);
 extern struct file_link *init_walker (struct idhead *idhp);
 extern void init_idh_obstacks (struct idhead *idhp);
 extern void init_idh_tables (struct idhead *idhp);
+extern void free_idh_obstacks (struct idhead *idhp);
+extern void free_idh_tables (struct idhead *idhp);
 
-extern int io_write (FILE *output_FILE, void *addr, unsigned int size, int io_type);
-extern int io_read (FILE *input_FILE, void *addr, unsigned int size, int io_type);
-extern int io_idhead (FILE *fp, io_func_t iof, struct idhead *idhp);
+extern int io_write (void *output, void *addr, unsigned int size, int io_type);
+extern int io_read (void *input, void *addr, unsigned int size, int io_type);
+extern int io_idhead (void *stream, io_func_t iof, struct idhead *idhp);
+extern struct id_section *find_id_section (struct idhead *idhp,
+					   unsigned long id) _GL_ATTRIBUTE_PURE;
+extern struct id_section *add_id_section (struct idhead *idhp,
+					  unsigned long id);
 
 extern struct file_link *get_current_dir_link (void);
 extern struct file_link **deserialize_file_links (struct idhead *idhp);
@@ -207,9 +312,136 @@ extern char const *locate_id_file_name (char const *arg);
 extern int tree8_count_levels (unsigned int cardinality) _GL_ATTRIBUTE_CONST;
 extern int gets_past_00 (char *tok, FILE *input_FILE);
 extern int skip_past_00 (FILE *input_FILE);
+extern char const *skip_token (char const *tok) _GL_ATTRIBUTE_PURE;
+extern char const *token_at (struct idhead const *idhp, unsigned long ordinal)
+  _GL_ATTRIBUTE_PURE;
+extern int token_ordinal (struct idhead const *idhp, char const *tok,
+			  unsigned long *ordinal);
 
 extern int links_depth (struct file_link const *flink) _GL_ATTRIBUTE_PURE;
 
+
+/******************************************************************************/
+/* Trigram postings (IDS_TRIGRAMS).  For every three consecutive bytes
+   of a token name, with ASCII letters folded to lower case, the ID
+   file may list the ordinals of the tokens whose names contain them.  */
+
+#define TRIGRAM_FOLD(c) ((c) >= 'A' && (c) <= 'Z' ? (c) - 'A' + 'a' : (c))
+#define TRIGRAM_KEY(s) \
+  (((unsigned long) TRIGRAM_FOLD ((unsigned char) (s)[0]) << 020) \
+   | ((unsigned long) TRIGRAM_FOLD ((unsigned char) (s)[1]) << 010) \
+   | (unsigned long) TRIGRAM_FOLD ((unsigned char) (s)[2]))
+#define TRIGRAM_ENTRY_BYTES 12	/* trigram and offset of its postings */
+#define TRIGRAM_POSTING_MAX 10	/* bytes of one encoded ordinal */
+
+struct trigram_postings
+{
+  unsigned char const *tp_next;
+  unsigned char const *tp_end;
+  unsigned long tp_ordinal;	/* the ordinal last returned */
+};
+
+extern void init_trigrams (void);
+extern void add_token_trigrams (char const *name, unsigned long ordinal);
+extern void write_trigrams (struct idhead *idhp);
+extern int find_trigram_postings (struct idhead *idhp, unsigned long key,
+				  struct trigram_postings *tp);
+extern int next_trigram_ordinal (struct trigram_postings *tp,
+				 unsigned long *ordinal);
+
+/******************************************************************************/
+/* A tree8 has a byte for each node of a tree in which every node has
+   eight kids, stored depth first; bit I of a node's byte is set if
+   some file under its Ith kid has the token.  Only the kids whose bits
+   are set are stored, and the bits of a leaf stand for single files.
+   next_tree8_leaf walks the tree without recursion, and returns each
+   leaf byte in turn with the number of the file of its bit 0.  */
+
+#define TREE8_MAX_LEVELS 22	/* enough for 64-bit file numbers */
+
+struct tree8_walk
+{
+  unsigned char const *tw_next;
+  int tw_top;			/* level of the root's imaginary parent */
+  int tw_level;			/* level of the node being visited */
+  unsigned char tw_kids[TREE8_MAX_LEVELS + 2];	/* kids left to visit */
+  unsigned long tw_base[TREE8_MAX_LEVELS + 2];	/* first file of node */
+};
+
+extern void init_tree8_walk (struct tree8_walk *tw, unsigned char const *hits,
+			     int levels);
+extern int next_tree8_leaf (struct tree8_walk *tw, unsigned long *base);
+extern unsigned long tree8_file_numbers (unsigned char const *hits, int levels,
+					 unsigned long *files);
+
+/******************************************************************************/
+/* Hits postings.  Rather than as a tree8, mkid may store the numbers of
+   the files in which a token occurs as one of three containers,
+   whichever is smallest, and marks it in the token's flags:
+
+   TOK_VECTOR	the file numbers, each as the difference from the one
+		before (the first from -1)
+   TOK_RUNS	for each run of consecutive files, the difference between
+		its first file and the file after the previous run (the
+		first from 0), plus one, followed by its length
+   TOK_BITMAP	the first file number plus one, followed by a byte for
+		each seven files from there on, with bit I set for the
+		Ith of them and bit 7 always set
+
+   Numbers are written seven bits at a time, least significant first,
+   with bit 7 set in all but the last byte.  None of the containers has
+   a NUL byte, so the `\0\0' that ends a token entry ends them too.  */
+
+#define HITS_POSTING_MAX 10	/* bytes of one encoded number */
+
+struct hits_postings
+{
+  unsigned char const *hp_next;
+  int hp_kind;			/* TOK_VECTOR, TOK_RUNS or TOK_BITMAP */
+  unsigned long hp_file;	/* past the file last returned, or the
+				   first file of the current bitmap byte */
+  unsigned long hp_left;	/* files left in the current run */
+  unsigned int hp_bits;		/* bits left in the current bitmap byte */
+};
+
+extern int init_hits_postings (struct hits_postings *hp, char const *tok);
+extern int next_hit_file (struct hits_postings *hp, unsigned long *file);
+
+/******************************************************************************/
+/* Token positions (IDS_POSITIONS).  mkid --positions records the lines
+   on which each token occurs.  The section begins with the number of
+   tokens, followed by the offset, relative to the start of the
+   section, of the positions of each token in turn.  The positions of
+   a token end where those of the next begin.  For each file in which
+   the token occurs they hold the difference between its number and
+   that of the file before (the first from -1), then, for each line on
+   which the token occurs, the difference between its number and that
+   of the line before (the first from 0), the difference between the
+   offset of its first byte in the file and that of the line before
+   (the first from 0), and the number of occurrences on the line, and
+   then a zero.  Numbers are written seven bits at a time, least
+   significant first, with bit 7 set in all but the last byte.  */
+
+#define POSITION_NUMBER_MAX 10	/* bytes of one encoded number */
+
+struct position_postings
+{
+  unsigned char const *pp_next;
+  unsigned char const *pp_end;
+  unsigned long pp_file;	/* the file last returned */
+  int pp_in_file;		/* its lines aren't all read */
+  unsigned long pp_line;	/* the line last returned */
+  uint64_t pp_offset;		/* offset of the line last returned */
+};
+
+extern int find_position_postings (struct idhead *idhp, unsigned long ordinal,
+				   struct position_postings *pp);
+extern int next_position_file (struct position_postings *pp,
+			       unsigned long *file);
+extern int next_position_line (struct position_postings *pp,
+			       unsigned long *line, uint64_t *offset,
+			       unsigned long *occurrences);
+
 #if HAVE_LINK
 
 extern struct member_file *find_member_file (struct file_link const *flink);
@@ -220,6 +452,9 @@ extern struct idhead idh;
 
 extern int walker_verbose_flag;
 
+/* The number of threads that read directories ahead of walk_flink.  */
+extern int walker_jobs;
+
 extern off_t largest_member_file;
 #define MAX_LARGEST_MEMBER_FILE (2*1024*1024-1)
 
@@ -19,8 +19,14 @@
 #include <config.h>
 #include <stdio.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <errno.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#if HAVE_MMAP && HAVE_SYS_MMAN_H
+# include <sys/mman.h>
+#endif
 #include <obstack.h>
 #include <xalloc.h>
 #include <error.h>
@@ -32,6 +38,8 @@
 #include "xnls.h"
 
 static int fgets0 (char *buf0, int size, FILE *in_FILE);
+static uint64_t get_le (unsigned char const *buf, int width);
+static uint64_t get_position_number (struct position_postings *pp);
 
 
 /****************************************************************************/
@@ -66,11 +74,14 @@ maybe_read_id_file (char const *id_file_name, struct idhead *idhp)
   read_idhead (idhp);
   if (idhp->idh_magic[0] != IDH_MAGIC_0 || idhp->idh_magic[1] != IDH_MAGIC_1)
     error (EXIT_FAILURE, 0, _("`%s' is not an ID file! (bad magic #)"), id_file_name);
-  if (idhp->idh_version != IDH_VERSION)
-    error (EXIT_FAILURE, 0, _("`%s' is version %d, but I only grok version %d"),
-	   id_file_name, idhp->idh_version, IDH_VERSION);
-
-  fseek (idhp->idh_FILE, idhp->idh_flinks_offset, 0);
+  if (idhp->idh_version < IDH_VERSION_4 || idhp->idh_version > IDH_VERSION)
+    error (EXIT_FAILURE, 0,
+	   _("`%s' is version %d, but I only grok versions %d through %d"),
+	   id_file_name, idhp->idh_version, IDH_VERSION_4, IDH_VERSION);
+
+  if (!(idhp->idh_flags & IDH_TOKEN_INDEX))
+    idhp->idh_index_offset = 0;
+  fseeko (idhp->idh_FILE, idhp->idh_flinks_offset, SEEK_SET);
   return deserialize_file_links (idhp);
 }
 
@@ -113,7 +124,8 @@ deserialize_file_links (struct idhead *idhp)
       flink = (struct file_link *) obstack_finish (&idhp->idh_file_link_obstack);
       *flinks = flink;
       io_read (idhp->idh_FILE, &flink->fl_flags, sizeof (flink->fl_flags), IO_TYPE_INT);
-      io_read (idhp->idh_FILE, &parent_index, FL_PARENT_INDEX_BYTES, IO_TYPE_INT);
+      io_read (idhp->idh_FILE, &parent_index,
+	       FL_PARENT_INDEX_BYTES (idhp->idh_version), IO_TYPE_INT);
       flink->fl_parent = flinks_0[parent_index];
       slot = (struct file_link **) hash_find_slot (&idhp->idh_file_link_table, flink);
       if (HASH_VACANT (*slot))
@@ -136,9 +148,80 @@ deserialize_file_links (struct idhead *idhp)
 
 /****************************************************************************/
 
+/* Bring the whole of the open ID file into memory, so that token
+   entries can be examined in place rather than copied out of a
+   stdio buffer.  Prefer mmap, but fall back to reading the file into
+   a malloc'd buffer.  Afterwards, idh_map addresses byte 0 of the
+   file.  */
+
+void
+map_id_file (struct idhead *idhp)
+{
+  int fd = fileno (idhp->idh_FILE);
+  struct stat st;
+  size_t size;
+  unsigned char *buf;
+  size_t got;
+
+  if (fstat (fd, &st) < 0)
+    error (EXIT_FAILURE, errno, _("can't stat `%s'"), idhp->idh_file_name);
+  size = st.st_size;
+  if (st.st_size < idhp->idh_end_offset + 2
+      || ((idhp->idh_flags & IDH_TOKEN_INDEX)
+	  && (st.st_size < (idhp->idh_index_offset
+			    + (idhp->idh_tokens
+			       * IDH_TOKEN_INDEX_BYTES (idhp->idh_version))))))
+    error (EXIT_FAILURE, 0, _("`%s' is truncated"), idhp->idh_file_name);
+
+#if HAVE_MMAP && HAVE_SYS_MMAN_H
+  buf = mmap (0, size, PROT_READ, MAP_SHARED, fd, 0);
+  if (buf != MAP_FAILED)
+    {
+      idhp->idh_map = buf;
+      idhp->idh_map_size = size;
+      idhp->idh_mapped = 1;
+      return;
+    }
+#endif
+
+  buf = xmalloc (size);
+  if (lseek (fd, 0, SEEK_SET) < 0)
+    error (EXIT_FAILURE, errno, _("can't seek in `%s'"), idhp->idh_file_name);
+  for (got = 0; got < size; )
+    {
+      ssize_t n = read (fd, buf + got, size - got);
+      if (n <= 0)
+	error (EXIT_FAILURE, n < 0 ? errno : 0,
+	       _("can't read `%s'"), idhp->idh_file_name);
+      got += n;
+    }
+  idhp->idh_map = buf;
+  idhp->idh_map_size = size;
+  idhp->idh_mapped = 0;
+}
+
+void
+unmap_id_file (struct idhead *idhp)
+{
+  if (idhp->idh_map == 0)
+    return;
+#if HAVE_MMAP && HAVE_SYS_MMAN_H
+  if (idhp->idh_mapped)
+    munmap ((void *) idhp->idh_map, idhp->idh_map_size);
+  else
+#endif
+    free ((void *) idhp->idh_map);
+  idhp->idh_map = 0;
+  idhp->idh_map_size = 0;
+}
+
+
+/****************************************************************************/
+
 int
 read_idhead (struct idhead *idhp)
 {
+  fseek (idhp->idh_FILE, 0L, 0);
   return io_idhead (idhp->idh_FILE, io_read, idhp);
 }
 
@@ -162,12 +245,23 @@ fgets0 (char *buf0, int size, FILE * in_FILE)
 }
 
 int
-io_read (FILE *input_FILE, void *addr, unsigned int size, int io_type)
+io_read (void *input, void *addr, unsigned int size, int io_type)
 {
+  FILE *input_FILE = input;
+
   if (io_type == IO_TYPE_INT || size == 1)
     {
       switch (size)
 	{
+	case 8:
+	  {
+	    uint64_t value = 0;
+	    int shift;
+	    for (shift = 0; shift < 64; shift += 010)
+	      value |= (uint64_t) getc (input_FILE) << shift;
+	    *(uint64_t *)addr = value;
+	  }
+	  break;
 	case 4:
 	  *(unsigned long *)addr = getc (input_FILE);
 	  *(unsigned long *)addr += getc (input_FILE) << 010;
@@ -245,6 +339,97 @@ tree8_count_levels (unsigned int cardinality)
   return levels;
 }
 
+/* The number of bits set in each byte value, and their positions.  */
+static unsigned char tree8_bit_counts[256];
+static unsigned char tree8_bit_positions[256][8];
+
+static void
+init_tree8_tables (void)
+{
+  int byte;
+  int bit;
+
+  for (byte = 1; byte < 256; byte++)
+    for (bit = 0; bit < 8; bit++)
+      if (byte & (1 << bit))
+	tree8_bit_positions[byte][tree8_bit_counts[byte]++] = bit;
+}
+
+/* Set *TW to walk the tree8 at HITS, which has LEVELS levels.  */
+
+void
+init_tree8_walk (struct tree8_walk *tw, unsigned char const *hits, int levels)
+{
+  if (tree8_bit_counts[0xff] == 0)
+    init_tree8_tables ();
+  if (levels > TREE8_MAX_LEVELS)
+    error (EXIT_FAILURE, 0, _("tree8 of %d levels is too deep"), levels);
+  tw->tw_next = hits;
+  tw->tw_top = tw->tw_level = levels + 1;
+  tw->tw_kids[tw->tw_level] = 1;
+  tw->tw_base[tw->tw_level] = 0;
+}
+
+/* Return the next leaf byte of the tree8 walk *TW, and store in *BASE
+   the number of the file of its bit 0.  Return zero after the last.  */
+
+int
+next_tree8_leaf (struct tree8_walk *tw, unsigned long *base)
+{
+  int level = tw->tw_level;
+
+  for (;;)
+    {
+      unsigned int kids = tw->tw_kids[level];
+      unsigned long kid_base;
+
+      if (kids == 0)
+	{
+	  if (level == tw->tw_top)
+	    return 0;
+	  level++;
+	  continue;
+	}
+      tw->tw_kids[level] = kids & (kids - 1);
+      kid_base = (tw->tw_base[level]
+		  + ((unsigned long) tree8_bit_positions[kids][0]
+		     << (3 * (level - 1))));
+      if (level == 2)
+	{
+	  tw->tw_level = level;
+	  *base = kid_base;
+	  return *tw->tw_next++;
+	}
+      level--;
+      tw->tw_base[level] = kid_base;
+      tw->tw_kids[level] = *tw->tw_next++;
+    }
+}
+
+/* Store in FILES the numbers of the files in the tree8 at HITS, which
+   has LEVELS levels, in ascending order.  Return how many there are.  */
+
+unsigned long
+tree8_file_numbers (unsigned char const *hits, int levels,
+		    unsigned long *files)
+{
+  struct tree8_walk tw;
+  unsigned long *fp = files;
+  unsigned long base;
+  int leaf;
+
+  init_tree8_walk (&tw, hits, levels);
+  while ((leaf = next_tree8_leaf (&tw, &base)))
+    {
+      unsigned char const *position = tree8_bit_positions[leaf];
+      int count = tree8_bit_counts[leaf];
+
+      while (count--)
+	*fp++ = base + *position++;
+    }
+  return fp - files;
+}
+
 int
 gets_past_00 (char *tok, FILE *input_FILE)
 {
@@ -281,3 +466,347 @@ skip_past_00 (FILE *input_FILE)
   while (getc (input_FILE) > 0);
   return skipped;
 }
+
+/* This is the in-memory analogue of skip_past_00: starting anywhere
+   within a token entry, return the address just past the `\0\0'
+   that terminates it, which is the start of the next entry.  */
+
+char const *
+skip_token (char const *tok)
+{
+  do
+    {
+      while (*tok++)
+	;
+    }
+  while (*tok++);
+  return tok;
+}
+
+/* Return the address of the entry for the token whose position in
+   the sorted token section is ORDINAL.  The ID file must be mapped,
+   and must have a token index.  */
+
+char const *
+token_at (struct idhead const *idhp, unsigned long ordinal)
+{
+  int width = IDH_TOKEN_INDEX_BYTES (idhp->idh_version);
+  unsigned char const *entry = (idhp->idh_map + idhp->idh_index_offset
+				+ ordinal * width);
+  uint64_t offset = 0;
+
+  while (width--)
+    offset = (offset << 010) | entry[width];
+  return (char const *) idhp->idh_map + offset;
+}
+
+/* Store in *ORDINAL the ordinal of the token entry TOK of the mapped
+   ID file IDHP, found by bisecting its token index.  Return zero if
+   the ID file has no index, or TOK doesn't begin an entry.  */
+
+int
+token_ordinal (struct idhead const *idhp, char const *tok,
+	       unsigned long *ordinal)
+{
+  uintptr_t map = (uintptr_t) idhp->idh_map;
+  uintptr_t address = (uintptr_t) tok;
+  unsigned long low = 0;
+  unsigned long high = idhp->idh_tokens;
+
+  if (!(idhp->idh_flags & IDH_TOKEN_INDEX) || idhp->idh_map == 0
+      || address < map + idhp->idh_tokens_offset
+      || address >= map + idhp->idh_end_offset)
+    return 0;
+  while (low < high)
+    {
+      unsigned long middle = low + (high - low) / 2;
+      uintptr_t middle_address = (uintptr_t) token_at (idhp, middle);
+      if (middle_address < address)
+	low = middle + 1;
+      else if (middle_address > address)
+	high = middle;
+      else
+	{
+	  *ordinal = middle;
+	  return 1;
+	}
+    }
+  return 0;
+}
+
+static uint64_t _GL_ATTRIBUTE_PURE
+get_le (unsigned char const *buf, int width)
+{
+  uint64_t value = 0;
+
+  while (width--)
+    value = (value << 010) | buf[width];
+  return value;
+}
+
+/* Set *TP to walk the ordinals of the tokens whose names contain the
+   trigram KEY, as recorded in the trigram postings of the mapped ID
+   file IDHP.  Return zero if the ID file has no trigram postings,
+   and -1 if no token contains KEY.  */
+
+int
+find_trigram_postings (struct idhead *idhp, unsigned long key,
+		       struct trigram_postings *tp)
+{
+  struct id_section *section = find_id_section (idhp, IDS_TRIGRAMS);
+  unsigned char const *base;
+  unsigned long low;
+  unsigned long high;
+  unsigned long count;
+
+  if (section == 0)
+    return 0;
+  if (section->ids_offset + section->ids_length > idhp->idh_map_size
+      || section->ids_length < 4)
+    error (EXIT_FAILURE, 0, _("`%s' is truncated"), idhp->idh_file_name);
+  base = idhp->idh_map + section->ids_offset;
+  count = get_le (base, 4);
+  if (4 + (uint64_t) count * TRIGRAM_ENTRY_BYTES > section->ids_length)
+    error (EXIT_FAILURE, 0, _("`%s' is corrupt"), idhp->idh_file_name);
+
+  low = 0;
+  high = count;
+  while (low < high)
+    {
+      unsigned long middle = low + (high - low) / 2;
+      unsigned long middle_key
+	= get_le (base + 4 + middle * TRIGRAM_ENTRY_BYTES, 4);
+      if (middle_key < key)
+	low = middle + 1;
+      else if (middle_key > key)
+	high = middle;
+      else
+	{
+	  unsigned char const *entry = base + 4 + middle * TRIGRAM_ENTRY_BYTES;
+	  uint64_t begin = get_le (entry + 4, 8);
+	  uint64_t end = (middle + 1 < count
+			  ? get_le (entry + TRIGRAM_ENTRY_BYTES + 4, 8)
+			  : (uint64_t) section->ids_length);
+	  if (begin > end || end > section->ids_length)
+	    error (EXIT_FAILURE, 0, _("`%s' is corrupt"), idhp->idh_file_name);
+	  tp->tp_next = base + begin;
+	  tp->tp_end = base + end;
+	  tp->tp_ordinal = -1;
+	  return 1;
+	}
+    }
+  tp->tp_next = tp->tp_end = 0;
+  return -1;
+}
+
+/* Store in *ORDINAL the next ordinal from the postings *TP.  Return
+   zero when there are no more.  */
+
+int
+next_trigram_ordinal (struct trigram_postings *tp, unsigned long *ordinal)
+{
+  unsigned long delta = 0;
+  int shift = 0;
+
+  if (tp->tp_next >= tp->tp_end)
+    return 0;
+  while (tp->tp_next < tp->tp_end && (*tp->tp_next & 0x80))
+    {
+      delta |= (unsigned long) (*tp->tp_next++ & 0x7f) << shift;
+      shift += 7;
+    }
+  if (tp->tp_next < tp->tp_end)
+    delta |= (unsigned long) *tp->tp_next++ << shift;
+  tp->tp_ordinal += delta + 1;
+  *ordinal = tp->tp_ordinal;
+  return 1;
+}
+
+/* Set *PP to walk the lines of the token whose ordinal is ORDINAL, as
+   recorded in the positions section of the mapped ID file IDHP.
+   Return zero if the ID file has no positions.  */
+
+int
+find_position_postings (struct idhead *idhp, unsigned long ordinal,
+			struct position_postings *pp)
+{
+  struct id_section *section = find_id_section (idhp, IDS_POSITIONS);
+  unsigned char const *base;
+  uint64_t count;
+  uint64_t begin;
+  uint64_t end;
+
+  if (section == 0)
+    return 0;
+  if (section->ids_offset + section->ids_length > idhp->idh_map_size
+      || section->ids_length < 8)
+    error (EXIT_FAILURE, 0, _("`%s' is truncated"), idhp->idh_file_name);
+  base = idhp->idh_map + section->ids_offset;
+  count = get_le (base, 8);
+  if (ordinal >= count || 8 + count * 8 > (uint64_t) section->ids_length)
+    error (EXIT_FAILURE, 0, _("`%s' is corrupt"), idhp->idh_file_name);
+  begin = get_le (base + 8 + ordinal * 8, 8);
+  end = (ordinal + 1 < count
+	 ? get_le (base + 8 + (ordinal + 1) * 8, 8)
+	 : (uint64_t) section->ids_length);
+  if (begin > end || end > (uint64_t) section->ids_length)
+    error (EXIT_FAILURE, 0, _("`%s' is corrupt"), idhp->idh_file_name);
+  pp->pp_next = base + begin;
+  pp->pp_end = base + end;
+  pp->pp_file = -1;
+  pp->pp_in_file = 0;
+  pp->pp_line = 0;
+  pp->pp_offset = 0;
+  return 1;
+}
+
+/* Store in *FILE the number of the next file of the positions *PP,
+   skipping any lines of the previous file not yet read.  Return zero
+   when there are no more.  */
+
+int
+next_position_file (struct position_postings *pp, unsigned long *file)
+{
+  unsigned long line;
+  uint64_t offset;
+  unsigned long occurrences;
+
+  while (next_position_line (pp, &line, &offset, &occurrences))
+    ;
+  if (pp->pp_next >= pp->pp_end)
+    return 0;
+  pp->pp_file += get_position_number (pp);
+  pp->pp_in_file = 1;
+  pp->pp_line = 0;
+  pp->pp_offset = 0;
+  *file = pp->pp_file;
+  return 1;
+}
+
+/* Store in *LINE the number of the next line of the current file of
+   the positions *PP, in *OFFSET the offset of its first byte, and in
+   *OCCURRENCES the number of times the token occurs on it.  Return
+   zero when there are no more.  */
+
+int
+next_position_line (struct position_postings *pp, unsigned long *line,
+		    uint64_t *offset, unsigned long *occurrences)
+{
+  uint64_t delta;
+
+  if (!pp->pp_in_file)
+    return 0;
+  delta = get_position_number (pp);
+  if (delta == 0)
+    {
+      pp->pp_in_file = 0;
+      return 0;
+    }
+  pp->pp_line += delta;
+  pp->pp_offset += get_position_number (pp);
+  *line = pp->pp_line;
+  *offset = pp->pp_offset;
+  *occurrences = get_position_number (pp);
+  return 1;
+}
+
+static uint64_t
+get_position_number (struct position_postings *pp)
+{
+  uint64_t value = 0;
+  int shift = 0;
+
+  while (pp->pp_next < pp->pp_end && (*pp->pp_next & 0x80))
+    {
+      value |= (uint64_t) (*pp->pp_next++ & 0x7f) << shift;
+      shift += 7;
+    }
+  if (pp->pp_next < pp->pp_end)
+    value |= (uint64_t) *pp->pp_next++ << shift;
+  return value;
+}
+
+/* Read a number of a hits postings container, and advance *P past it.  */
+
+static unsigned long
+get_hits_number (unsigned char const **p)
+{
+  unsigned long value = 0;
+  int shift = 0;
+
+  while (**p & 0x80)
+    {
+      value |= (unsigned long) (*(*p)++ & 0x7f) << shift;
+      shift += 7;
+    }
+  if (**p)
+    value |= (unsigned long) *(*p)++ << shift;
+  return value;
+}
+
+/* Set *HP to walk the file numbers of the token entry TOK, if its hits
+   are a postings container.  Return zero if they are a tree8.  */
+
+int
+init_hits_postings (struct hits_postings *hp, char const *tok)
+{
+  int kind = TOK_POSTINGS (token_flags (tok));
+
+  if (kind == 0)
+    return 0;
+  hp->hp_next = token_hits_addr (tok);
+  hp->hp_kind = kind;
+  hp->hp_file = 0;
+  hp->hp_left = 0;
+  hp->hp_bits = 0;
+  if (kind == TOK_BITMAP && *hp->hp_next)
+    hp->hp_file = get_hits_number (&hp->hp_next) - 1 - 7;
+  return 1;
+}
+
+/* Store in *FILE the next file number from the postings *HP.  Return
+   zero when there are no more.  */
+
+int
+next_hit_file (struct hits_postings *hp, unsigned long *file)
+{
+  int bit;
+
+  switch (hp->hp_kind)
+    {
+    case TOK_VECTOR:
+      if (*hp->hp_next == 0)
+	return 0;
+      hp->hp_file += get_hits_number (&hp->hp_next);
+      *file = hp->hp_file - 1;
+      return 1;
+
+    case TOK_RUNS:
+      if (hp->hp_left == 0)
+	{
+	  if (*hp->hp_next == 0)
+	    return 0;
+	  hp->hp_file += get_hits_number (&hp->hp_next) - 1;
+	  hp->hp_left = get_hits_number (&hp->hp_next);
+	  if (hp->hp_left == 0)
+	    return 0;
+	}
+      hp->hp_left--;
+      *file = hp->hp_file++;
+      return 1;
+
+    default:
+      while (hp->hp_bits == 0)
+	{
+	  if (*hp->hp_next == 0)
+	    return 0;
+	  hp->hp_bits = *hp->hp_next++ & 0x7f;
+	  hp->hp_file += 7;
+	}
+      for (bit = 0; !(hp->hp_bits & (1 << bit)); bit++)
+	;
+      hp->hp_bits &= hp->hp_bits - 1;
+      *file = hp->hp_file + bit;
+      return 1;
+    }
+}
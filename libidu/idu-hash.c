@@ -19,6 +19,8 @@
 #include <config.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <limits.h>
 #include <xalloc.h>
 #include <error.h>
 
@@ -26,6 +28,10 @@
 #include "xnls.h"
 
 static void hash_rehash (struct hash_table* ht);
+static void **hash_find_tagged_slot (struct hash_table *ht, void const *key,
+				     unsigned long hash);
+static void **hash_find_empty_tagged_slot (struct hash_table const *ht,
+					   unsigned long hash);
 static unsigned long round_up_2 (unsigned long rough);
 
 /* Implement double hashing with open addressing.  The table size is
@@ -33,7 +39,79 @@ static unsigned long round_up_2 (unsigned long rough);
    is forced to return an odd-value, in order to be relatively prime
    to the table size.  This guarantees that the increment can
    potentially hit every slot in the table during collision
-   resolution.  */
+   resolution.  If there is no secondary hash function, the increment
+   is taken from the upper half of the primary hash, whose lower bits
+   choose the first slot, so that each key is hashed only once.  */
+
+#define HASH_STEP_SHIFT (sizeof (unsigned long) * CHAR_BIT / 2)
+
+/* A tagged table, set up by hash_init_tagged, is probed a group of
+   HASH_GROUP_SIZE slots at a time, as in Google's Swiss tables.  Next
+   to the slots it keeps a byte per slot, ht_tags, holding either
+   HASH_TAG_EMPTY, HASH_TAG_DELETED, or the top 7 bits of the hash of
+   the item in the slot, and the item's full hash, in ht_hashes.  A
+   lookup compares its own tag against a whole group of tags at once,
+   with SSE2 where available, and calls the comparison function only
+   for items whose tag is equal to its own, about one in 128 of the
+   others; the items themselves, usually far away in memory, are not
+   touched otherwise.  The low bits of the hash choose the first group,
+   and later groups follow in triangular steps, which visit every group
+   of a power-of-two table.  Since probing stays short up to a loading
+   factor of 7/8, a tagged table needs fewer slots.  Rehashing uses the
+   stored hashes rather than hashing the items again.  */
+
+#define HASH_GROUP_SIZE 16
+#define HASH_TAG_EMPTY 0x80
+#define HASH_TAG_DELETED 0xfe
+#define HASH_TAG_SHIFT (sizeof (unsigned long) * CHAR_BIT - 7)
+#define HASH_TAG(hash) ((unsigned char) ((hash) >> HASH_TAG_SHIFT))
+
+#if defined __SSE2__ && defined __GNUC__
+# include <emmintrin.h>
+#endif
+
+#ifdef __GNUC__
+# define HASH_PREFETCH(address) __builtin_prefetch (address)
+#else
+# define HASH_PREFETCH(address) ((void) 0)
+#endif
+
+/* Return a mask of the slots in the group starting at TAGS whose tag
+   is TAG.  */
+
+static inline unsigned int
+hash_match_group (unsigned char const *tags, unsigned char tag)
+{
+#if defined __SSE2__ && defined __GNUC__
+  __m128i group = _mm_loadu_si128 ((__m128i const *) tags);
+  return _mm_movemask_epi8 (_mm_cmpeq_epi8 (group, _mm_set1_epi8 ((char) tag)));
+#else
+  unsigned int mask = 0;
+  int i;
+  for (i = 0; i < HASH_GROUP_SIZE; i++)
+    if (tags[i] == tag)
+      mask |= 1U << i;
+  return mask;
+#endif
+}
+
+/* Return the index of the lowest bit set in the nonzero MASK.  */
+
+static inline int
+hash_lowest_bit (unsigned int mask)
+{
+#ifdef __GNUC__
+  return __builtin_ctz (mask);
+#else
+  int i = 0;
+  while (!(mask & 1))
+    {
+      mask >>= 1;
+      i++;
+    }
+  return i;
+#endif
+}
 
 void *hash_deleted_item = &hash_deleted_item;
 
@@ -58,6 +136,27 @@ hash_init (struct hash_table* ht, unsigned long size,
   ht->ht_hash_1 = hash_1;
   ht->ht_hash_2 = hash_2;
   ht->ht_compare = hash_cmp;
+  ht->ht_tags = 0;
+  ht->ht_hashes = 0;
+  ht->ht_last_slot = 0;
+  ht->ht_last_hash = 0;
+}
+
+/* Like hash_init, but set up a tagged table, probed a group at a time.
+   Its hash function must mix well into the upper bits, as hash_bytes
+   and hash_integer do.  */
+
+void
+hash_init_tagged (struct hash_table* ht, unsigned long size,
+		  hash_func_t hash, hash_cmp_func_t hash_cmp)
+{
+  if (size < HASH_GROUP_SIZE)
+    size = HASH_GROUP_SIZE;
+  hash_init (ht, size, hash, 0, hash_cmp);
+  ht->ht_capacity = ht->ht_size - ht->ht_size / 8; /* 87.5% loading factor */
+  ht->ht_tags = xmalloc (ht->ht_size);
+  memset (ht->ht_tags, HASH_TAG_EMPTY, ht->ht_size);
+  ht->ht_hashes = xnmalloc (ht->ht_size, sizeof *ht->ht_hashes);
 }
 
 /* Load an array of items into `ht'.  */
@@ -83,14 +182,17 @@ hash_find_slot (struct hash_table* ht, void const *key)
 {
   void **slot;
   void **deleted_slot = 0;
-  unsigned int hash_2 = 0;
-  unsigned int hash_1 = (*ht->ht_hash_1) (key);
+  unsigned long hash = (*ht->ht_hash_1) (key);
+  unsigned long index = hash;
+  unsigned long step = 0;
 
+  if (ht->ht_tags)
+    return hash_find_tagged_slot (ht, key, hash);
   ht->ht_lookups++;
   for (;;)
     {
-      hash_1 %= ht->ht_size;
-      slot = &ht->ht_vec[hash_1];
+      index &= ht->ht_size - 1;
+      slot = &ht->ht_vec[index];
 
       if (*slot == 0)
 	return (deleted_slot ? deleted_slot : slot);
@@ -107,9 +209,89 @@ hash_find_slot (struct hash_table* ht, void const *key)
 	    return slot;
 	  ht->ht_collisions++;
 	}
-      if (!hash_2)
-	  hash_2 = (*ht->ht_hash_2) (key) | 1;
-      hash_1 += hash_2;
+      if (!step)
+	step = (ht->ht_hash_2
+		? (*ht->ht_hash_2) (key)
+		: hash >> HASH_STEP_SHIFT) | 1;
+      index += step;
+    }
+}
+
+/* Return the slot of a tagged table that holds `key', whose hash is
+   `hash', or else the slot to insert it at.  Remember the slot and the
+   hash, for hash_insert_at.  */
+
+static void **
+hash_find_tagged_slot (struct hash_table *ht, void const *key,
+		       unsigned long hash)
+{
+  unsigned long group_mask = ht->ht_size / HASH_GROUP_SIZE - 1;
+  unsigned long group = hash & group_mask;
+  unsigned long probes = 0;
+  unsigned char tag = HASH_TAG (hash);
+  void **deleted_slot = 0;
+  void **slot;
+
+  ht->ht_lookups++;
+  for (;;)
+    {
+      unsigned long base = group * HASH_GROUP_SIZE;
+      unsigned char const *tags = &ht->ht_tags[base];
+      unsigned int match;
+      unsigned int empty;
+
+      HASH_PREFETCH (&ht->ht_vec[base]);
+      match = hash_match_group (tags, tag);
+
+      while (match)
+	{
+	  unsigned long i = base + hash_lowest_bit (match);
+	  match &= match - 1;
+	  slot = &ht->ht_vec[i];
+	  if (key == *slot || (*ht->ht_compare) (key, *slot) == 0)
+	    goto found;
+	  ht->ht_collisions++;
+	}
+      if (deleted_slot == 0 && ht->ht_fill + ht->ht_empty_slots < ht->ht_size)
+	{
+	  unsigned int deleted = hash_match_group (tags, HASH_TAG_DELETED);
+	  if (deleted)
+	    deleted_slot = &ht->ht_vec[base + hash_lowest_bit (deleted)];
+	}
+      empty = hash_match_group (tags, HASH_TAG_EMPTY);
+      if (empty)
+	{
+	  slot = (deleted_slot ? deleted_slot
+		  : &ht->ht_vec[base + hash_lowest_bit (empty)]);
+	  goto found;
+	}
+      group = (group + ++probes) & group_mask;
+    }
+ found:
+  ht->ht_last_slot = slot;
+  ht->ht_last_hash = hash;
+  return slot;
+}
+
+/* Return the first empty slot of a tagged table for an item whose hash
+   is `hash'.  Only hash_rehash needs this: there are no deleted slots
+   and no equal items yet.  */
+
+static void **
+hash_find_empty_tagged_slot (struct hash_table const *ht, unsigned long hash)
+{
+  unsigned long group_mask = ht->ht_size / HASH_GROUP_SIZE - 1;
+  unsigned long group = hash & group_mask;
+  unsigned long probes = 0;
+
+  for (;;)
+    {
+      unsigned long base = group * HASH_GROUP_SIZE;
+      unsigned int empty = hash_match_group (&ht->ht_tags[base],
+					     HASH_TAG_EMPTY);
+      if (empty)
+	return &ht->ht_vec[base + hash_lowest_bit (empty)];
+      group = (group + ++probes) & group_mask;
     }
 }
 
@@ -141,6 +323,14 @@ hash_insert_at (struct hash_table* ht, void *item, void const *slot)
       old_item = item;
     }
   *(void const **) slot = item;
+  if (ht->ht_tags)
+    {
+      unsigned long i = (void **) slot - ht->ht_vec;
+      unsigned long hash = (slot == ht->ht_last_slot
+			    ? ht->ht_last_hash : (*ht->ht_hash_1) (item));
+      ht->ht_tags[i] = HASH_TAG (hash);
+      ht->ht_hashes[i] = hash;
+    }
   if (ht->ht_empty_slots < ht->ht_size - ht->ht_capacity)
     {
       hash_rehash (ht);
@@ -164,6 +354,8 @@ hash_delete_at (struct hash_table* ht, void const *slot)
   if (!HASH_VACANT (item))
     {
       *(void const **) slot = hash_deleted_item;
+      if (ht->ht_tags)
+	ht->ht_tags[(void **) slot - ht->ht_vec] = HASH_TAG_DELETED;
       ht->ht_fill--;
       return item;
     }
@@ -183,6 +375,8 @@ hash_free_items (struct hash_table* ht)
 	free (item);
       *vec = 0;
     }
+  if (ht->ht_tags)
+    memset (ht->ht_tags, HASH_TAG_EMPTY, ht->ht_size);
   ht->ht_fill = 0;
   ht->ht_empty_slots = ht->ht_size;
 }
@@ -194,6 +388,8 @@ hash_delete_items (struct hash_table* ht)
   void **end = &vec[ht->ht_size];
   for (; vec < end; vec++)
     *vec = 0;
+  if (ht->ht_tags)
+    memset (ht->ht_tags, HASH_TAG_EMPTY, ht->ht_size);
   ht->ht_fill = 0;
   ht->ht_collisions = 0;
   ht->ht_lookups = 0;
@@ -211,9 +407,23 @@ hash_free (struct hash_table* ht, int free_items)
       ht->ht_fill = 0;
       ht->ht_empty_slots = ht->ht_size;
     }
+  hash_free_slots (ht);
+}
+
+/* Free the slots of `ht', but leave its counts, which callers may
+   still want to report.  */
+
+void
+hash_free_slots (struct hash_table* ht)
+{
   free (ht->ht_vec);
   ht->ht_vec = 0;
   ht->ht_capacity = 0;
+  free (ht->ht_tags);
+  ht->ht_tags = 0;
+  free (ht->ht_hashes);
+  ht->ht_hashes = 0;
+  ht->ht_last_slot = 0;
 }
 
 void
@@ -241,17 +451,44 @@ hash_rehash (struct hash_table* ht)
   if (ht->ht_fill >= ht->ht_capacity)
     {
       ht->ht_size *= 2;
-      ht->ht_capacity = ht->ht_size - (ht->ht_size >> 4);
+      ht->ht_capacity = ht->ht_size - (ht->ht_size >> (ht->ht_tags ? 3 : 4));
     }
   ht->ht_rehashes++;
   ht->ht_vec = xcalloc (ht->ht_size, sizeof(struct token *));
 
-  for (ovp = old_vec; ovp < &old_vec[old_ht_size]; ovp++)
+  if (ht->ht_tags)
+    {
+      unsigned char *old_tags = ht->ht_tags;
+      unsigned long *old_hashes = ht->ht_hashes;
+      unsigned long i;
+
+      ht->ht_tags = xmalloc (ht->ht_size);
+      memset (ht->ht_tags, HASH_TAG_EMPTY, ht->ht_size);
+      ht->ht_hashes = xnmalloc (ht->ht_size, sizeof *ht->ht_hashes);
+      for (i = 0; i < old_ht_size; i++)
+	{
+	  if (! HASH_VACANT (old_vec[i]))
+	    {
+	      void **slot = hash_find_empty_tagged_slot (ht, old_hashes[i]);
+	      unsigned long j = slot - ht->ht_vec;
+	      *slot = old_vec[i];
+	      ht->ht_tags[j] = old_tags[i];
+	      ht->ht_hashes[j] = old_hashes[i];
+	    }
+	}
+      ht->ht_last_slot = 0;
+      free (old_tags);
+      free (old_hashes);
+    }
+  else
     {
-      if (! HASH_VACANT (*ovp))
+      for (ovp = old_vec; ovp < &old_vec[old_ht_size]; ovp++)
 	{
-	  void **slot = hash_find_slot (ht, *ovp);
-	  *slot = *ovp;
+	  if (! HASH_VACANT (*ovp))
+	    {
+	      void **slot = hash_find_slot (ht, *ovp);
+	      *slot = *ovp;
+	    }
 	}
     }
   ht->ht_empty_slots = ht->ht_size - ht->ht_fill;
@@ -309,3 +546,134 @@ round_up_2 (unsigned long rough)
     }
   return round;
 }
+
+
+/****************************************************************************/
+/* A fast 64-bit hash of byte strings, after Wang Yi's wyhash.  Each
+   step multiplies two 64-bit words into 128 bits and folds the halves
+   together, so that every input bit affects every output bit, and
+   keys that differ only in their last characters, such as `foo_bar_1'
+   and `foo_bar_2', still land far apart.  */
+
+#define HASH_P0 0xa0761d6478bd642fULL
+#define HASH_P1 0xe7037ed1a0b428dbULL
+#define HASH_P2 0x8ebc6af09c88c6e3ULL
+#define HASH_P3 0x589965cc75374cc3ULL
+
+/* Replace *A and *B with the low and high halves of their product.  */
+
+static inline void
+hash_multiply (uint64_t *a, uint64_t *b)
+{
+#ifdef __SIZEOF_INT128__
+  unsigned __int128 r = (unsigned __int128) *a * *b;
+  *a = (uint64_t) r;
+  *b = (uint64_t) (r >> 64);
+#else
+  uint64_t ha = *a >> 32, la = (uint32_t) *a;
+  uint64_t hb = *b >> 32, lb = (uint32_t) *b;
+  uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+  uint64_t t = rl + (rm0 << 32);
+  uint64_t carry = t < rl;
+  uint64_t lo = t + (rm1 << 32);
+  carry += lo < t;
+  *a = lo;
+  *b = rh + (rm0 >> 32) + (rm1 >> 32) + carry;
+#endif
+}
+
+static inline uint64_t
+hash_fold (uint64_t a, uint64_t b)
+{
+  hash_multiply (&a, &b);
+  return a ^ b;
+}
+
+static inline uint64_t
+hash_read_8 (unsigned char const *p)
+{
+  uint64_t v;
+  memcpy (&v, p, 8);
+  return v;
+}
+
+static inline uint64_t
+hash_read_4 (unsigned char const *p)
+{
+  uint32_t v;
+  memcpy (&v, p, 4);
+  return v;
+}
+
+/* Return the hash of the LENGTH bytes at DATA, varied by SEED.  */
+
+uint64_t
+hash_bytes (void const *data, size_t length, uint64_t seed)
+{
+  unsigned char const *p = data;
+  uint64_t a;
+  uint64_t b;
+
+  seed ^= hash_fold (seed ^ HASH_P0, HASH_P1);
+  if (length <= 16)
+    {
+      if (length >= 4)
+	{
+	  size_t middle = (length >> 3) << 2;
+	  a = (hash_read_4 (p) << 32) | hash_read_4 (p + middle);
+	  b = ((hash_read_4 (p + length - 4) << 32)
+	       | hash_read_4 (p + length - 4 - middle));
+	}
+      else if (length > 0)
+	{
+	  a = ((uint64_t) p[0] << 16) | ((uint64_t) p[length >> 1] << 8)
+	    | p[length - 1];
+	  b = 0;
+	}
+      else
+	a = b = 0;
+    }
+  else
+    {
+      size_t i = length;
+      if (i > 48)
+	{
+	  uint64_t seed_1 = seed;
+	  uint64_t seed_2 = seed;
+	  do
+	    {
+	      seed = hash_fold (hash_read_8 (p) ^ HASH_P1,
+				hash_read_8 (p + 8) ^ seed);
+	      seed_1 = hash_fold (hash_read_8 (p + 16) ^ HASH_P2,
+				  hash_read_8 (p + 24) ^ seed_1);
+	      seed_2 = hash_fold (hash_read_8 (p + 32) ^ HASH_P3,
+				  hash_read_8 (p + 40) ^ seed_2);
+	      p += 48;
+	      i -= 48;
+	    }
+	  while (i > 48);
+	  seed ^= seed_1 ^ seed_2;
+	}
+      while (i > 16)
+	{
+	  seed = hash_fold (hash_read_8 (p) ^ HASH_P1,
+			    hash_read_8 (p + 8) ^ seed);
+	  p += 16;
+	  i -= 16;
+	}
+      a = hash_read_8 (p + i - 16);
+      b = hash_read_8 (p + i - 8);
+    }
+  a ^= HASH_P1;
+  b ^= seed;
+  hash_multiply (&a, &b);
+  return hash_fold (a ^ HASH_P0 ^ length, b ^ HASH_P1);
+}
+
+/* Return the hash of the integer KEY.  */
+
+uint64_t
+hash_integer (uint64_t key)
+{
+  return hash_fold (key ^ HASH_P0, HASH_P1);
+}
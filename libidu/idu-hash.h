@@ -20,6 +20,9 @@
 #define _hash_h_
 
 #include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
 
 typedef unsigned long (*hash_func_t) (void const *key);
 typedef int (*hash_cmp_func_t) (void const *x, void const *y);
@@ -36,8 +39,12 @@ struct hash_table
   unsigned long ht_lookups;	/* # of queries */
   unsigned int ht_rehashes;	/* # of times we've expanded table */
   hash_func_t ht_hash_1;	/* primary hash function */
-  hash_func_t ht_hash_2;	/* secondary hash function */
+  hash_func_t ht_hash_2;	/* secondary hash function, or 0 */
   hash_cmp_func_t ht_compare;	/* comparison function */
+  unsigned char *ht_tags;	/* per-slot tags of a tagged table, or 0 */
+  unsigned long *ht_hashes;	/* per-slot hashes of a tagged table */
+  void **ht_last_slot;		/* slot of the last lookup ... */
+  unsigned long ht_last_hash;	/* ... and the hash of its key */
 };
 
 typedef int (*qsort_cmp_t) (void const *, void const *);
@@ -45,6 +52,8 @@ typedef int (*qsort_cmp_t) (void const *, void const *);
 extern void hash_init (struct hash_table *ht, unsigned long size,
 		       hash_func_t hash_1, hash_func_t hash_2,
 		       hash_cmp_func_t hash_cmp);
+extern void hash_init_tagged (struct hash_table *ht, unsigned long size,
+			      hash_func_t hash, hash_cmp_func_t hash_cmp);
 extern void hash_load (struct hash_table *ht, void *item_table,
 		       unsigned long cardinality, unsigned long size);
 extern void **hash_find_slot (struct hash_table *ht, void const *key);
@@ -57,38 +66,24 @@ extern void *hash_delete_at (struct hash_table *ht, void const *slot);
 extern void hash_delete_items (struct hash_table *ht);
 extern void hash_free_items (struct hash_table *ht);
 extern void hash_free (struct hash_table *ht, int free_items);
+extern void hash_free_slots (struct hash_table *ht);
 extern void hash_map (struct hash_table *ht, hash_map_func_t map);
 extern void hash_print_stats (struct hash_table const *ht, FILE *out_FILE);
 extern void **hash_dump (struct hash_table const *ht, void **vector_0,
 			 qsort_cmp_t compare);
 
+extern uint64_t hash_bytes (void const *data, size_t length, uint64_t seed)
+  _GL_ATTRIBUTE_PURE;
+extern uint64_t hash_integer (uint64_t key) _GL_ATTRIBUTE_CONST;
+
 extern void *hash_deleted_item;
 #define HASH_VACANT(item) ((item) == 0 || (void *) (item) == hash_deleted_item)
 
 
 /* hash and comparison macros for string keys. */
 
-#define STRING_HASH_1(_key_, _result_) { \
-  unsigned char const *kk = (unsigned char const *) (_key_) - 1; \
-  while (*++kk) \
-    (_result_) += (*kk << (kk[1] & 0xf)); \
-} while (0)
-#define return_STRING_HASH_1(_key_) do { \
-  unsigned long result = 0; \
-  STRING_HASH_1 ((_key_), result); \
-  return result; \
-} while (0)
-
-#define STRING_HASH_2(_key_, _result_) do { \
-  unsigned char const *kk = (unsigned char const *) (_key_) - 1; \
-  while (*++kk) \
-    (_result_) += (*kk << (kk[1] & 0x7)); \
-} while (0)
-#define return_STRING_HASH_2(_key_) do { \
-  unsigned long result = 0; \
-  STRING_HASH_2 ((_key_), result); \
-  return result; \
-} while (0)
+#define STRING_HASH(_key_) hash_bytes ((_key_), strlen (_key_), 0)
+#define return_STRING_HASH(_key_) return STRING_HASH (_key_)
 
 #define STRING_COMPARE(_x_, _y_, _result_) do { \
   unsigned char const *xx = (unsigned char const *) (_x_) - 1; \
@@ -109,23 +104,8 @@ extern void *hash_deleted_item;
 
 /* hash and comparison macros for integer keys. */
 
-#define INTEGER_HASH_1(_key_, _result_) do { \
-  (_result_) += ((unsigned long)(_key_)); \
-} while (0)
-#define return_INTEGER_HASH_1(_key_) do { \
-  unsigned long result = 0; \
-  INTEGER_HASH_1 ((_key_), result); \
-  return result; \
-} while (0)
-
-#define INTEGER_HASH_2(_key_, _result_) do { \
-  (_result_) += ~((unsigned long)(_key_)); \
-} while (0)
-#define return_INTEGER_HASH_2(_key_) do { \
-  unsigned long result = 0; \
-  INTEGER_HASH_2 ((_key_), result); \
-  return result; \
-} while (0)
+#define INTEGER_HASH(_key_) hash_integer ((uint64_t) (_key_))
+#define return_INTEGER_HASH(_key_) return INTEGER_HASH (_key_)
 
 #define INTEGER_COMPARE(_x_, _y_, _result_) do { \
   (_result_) = _x_ - _y_; \
@@ -138,11 +118,9 @@ extern void *hash_deleted_item;
 
 /* hash and comparison macros for address keys. */
 
-#define ADDRESS_HASH_1(_key_, _result_) INTEGER_HASH_1 (((unsigned long)(_key_)) >> 3, (_result_))
-#define ADDRESS_HASH_2(_key_, _result_) INTEGER_HASH_2 (((unsigned long)(_key_)) >> 3, (_result_))
+#define ADDRESS_HASH(_key_) INTEGER_HASH ((uintptr_t) (_key_))
 #define ADDRESS_COMPARE(_x_, _y_, _result_) INTEGER_COMPARE ((_x_), (_y_), (_result_))
-#define return_ADDRESS_HASH_1(_key_) return_INTEGER_HASH_1 (((unsigned long)(_key_)) >> 3)
-#define return_ADDRESS_HASH_2(_key_) return_INTEGER_HASH_2 (((unsigned long)(_key_)) >> 3)
+#define return_ADDRESS_HASH(_key_) return ADDRESS_HASH (_key_)
 #define return_ADDRESS_COMPARE(_x_, _y_) return_INTEGER_COMPARE ((_x_), (_y_))
 
 #endif /* not _hash_h_ */
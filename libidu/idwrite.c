@@ -18,16 +18,33 @@
 
 #include <config.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#if HAVE_SYS_UIO_H
+# include <sys/uio.h>
+#endif
 #include <obstack.h>
 #include <xalloc.h>
 #include <error.h>
 
 #include "idfile.h"
-#include "ignore-value.h"
 #include "idu-hash.h"
+#include "iduglobal.h"
 #include "xnls.h"
 
 static int file_link_qsort_compare (void const *x, void const *y);
+static int file_link_name_compare (struct file_link const *flx,
+				   struct file_link const *fly);
+static unsigned long trigram_hash (void const *key);
+static int trigram_hash_compare (void const *x, void const *y);
+static int trigram_qsort_compare (void const *x, void const *y);
+static int write_id_blocks (struct id_output *ido,
+			    struct id_block const *blocks, int count,
+			    off_t offset);
+static void put_id_blocks (struct id_output *ido,
+			   struct id_block const *blocks, int count);
 
 
 /****************************************************************************/
@@ -58,11 +75,11 @@ serialize_file_links (struct idhead *idhp)
       name_length = strlen (flink->fl_name);
       if (name_length > max_link)
 	max_link = name_length;
-      io_write (idhp->idh_FILE, flink->fl_name, 0, IO_TYPE_STR);
-      io_write (idhp->idh_FILE, &flink->fl_flags, sizeof (flink->fl_flags), IO_TYPE_INT);
-      io_write (idhp->idh_FILE, (IS_ROOT_FILE_LINK (flink)
+      io_write (&idhp->idh_output, flink->fl_name, 0, IO_TYPE_STR);
+      io_write (&idhp->idh_output, &flink->fl_flags, sizeof (flink->fl_flags), IO_TYPE_INT);
+      io_write (&idhp->idh_output, (IS_ROOT_FILE_LINK (flink)
 				? &parent_index : &flink->fl_parent->fl_index),
-		FL_PARENT_INDEX_BYTES, IO_TYPE_INT);
+		FL_PARENT_INDEX_BYTES (idhp->idh_version), IO_TYPE_INT);
       *parents++ = flink->fl_parent; /* save parent link before clobbering */
       flink->fl_index = parent_index++;
     }
@@ -84,7 +101,8 @@ serialize_file_links (struct idhead *idhp)
 /* Collation sequence:
    - Used before unused.
    - Among used: breadth-first (dirs before files, parent dirs before children)
-   - Among files: collate by mf_index.  */
+   - Among files: collate by mf_index.
+   - Among dirs of equal depth: collate by name, parents first.  */
 
 static int
 file_link_qsort_compare (void const *x, void const *y)
@@ -116,56 +134,417 @@ file_link_qsort_compare (void const *x, void const *y)
     {
       int x_depth = links_depth (flx);
       int y_depth = links_depth (fly);
-      return (x_depth - y_depth);
+      if (x_depth != y_depth)
+	return (x_depth - y_depth);
+      return file_link_name_compare (flx, fly);
     }
 }
 
+/* Compare the names of two links of equal depth, starting at the
+   root, so that the order of directories doesn't depend on where
+   they happen to be in the hash table.  */
+
+static int
+file_link_name_compare (struct file_link const *flx,
+			struct file_link const *fly)
+{
+  int result;
+
+  if (flx == fly || IS_ROOT_FILE_LINK (flx) || IS_ROOT_FILE_LINK (fly))
+    return 0;
+  result = file_link_name_compare (flx->fl_parent, fly->fl_parent);
+  if (result)
+    return result;
+  return strcmp (flx->fl_name, fly->fl_name);
+}
+
 
 /****************************************************************************/
 
+/****************************************************************************/
+/* Collect the trigrams of token names, and write their postings.  */
+
+struct trigram
+{
+  unsigned long tg_key;
+  unsigned long tg_last;	/* ordinal of the last token posted */
+  size_t tg_size;
+  size_t tg_alloc;
+  unsigned char *tg_postings;
+};
+
+static struct hash_table trigram_table;
+static struct obstack trigram_obstack;
+
+void
+init_trigrams (void)
+{
+  hash_init (&trigram_table, 64*1024, trigram_hash, 0,
+	     trigram_hash_compare);
+  obstack_init (&trigram_obstack);
+}
+
+/* Post the token whose ordinal is ORDINAL to each trigram of its
+   NAME.  Tokens must be added in ascending order of ordinal.  Each
+   posting is stored as the number of ordinals skipped since the
+   previous one, seven bits to a byte, least significant first, with
+   the high bit set on all but the last byte.  */
+
+void
+add_token_trigrams (char const *name, unsigned long ordinal)
+{
+  struct trigram key;
+
+  for (; name[0] && name[1] && name[2]; name++)
+    {
+      struct trigram **slot;
+      struct trigram *tg;
+      unsigned long delta;
+
+      key.tg_key = TRIGRAM_KEY (name);
+      slot = (struct trigram **) hash_find_slot (&trigram_table, &key);
+      if (HASH_VACANT (*slot))
+	{
+	  tg = obstack_alloc (&trigram_obstack, sizeof *tg);
+	  tg->tg_key = key.tg_key;
+	  tg->tg_last = -1;
+	  tg->tg_size = 0;
+	  tg->tg_alloc = 0;
+	  tg->tg_postings = 0;
+	  hash_insert_at (&trigram_table, tg, slot);
+	}
+      else
+	{
+	  tg = *slot;
+	  if (tg->tg_last == ordinal)
+	    continue;
+	}
+      if (tg->tg_alloc - tg->tg_size < TRIGRAM_POSTING_MAX)
+	tg->tg_postings = x2nrealloc (tg->tg_postings, &tg->tg_alloc,
+				      TRIGRAM_POSTING_MAX);
+      delta = ordinal - tg->tg_last - 1;
+      while (delta >= 0x80)
+	{
+	  tg->tg_postings[tg->tg_size++] = (delta & 0x7f) | 0x80;
+	  delta >>= 7;
+	}
+      tg->tg_postings[tg->tg_size++] = delta;
+      tg->tg_last = ordinal;
+    }
+}
+
+/* Write the trigram postings section at the current position of the
+   ID file, and free them.  The section begins with the number of
+   trigrams, followed by a directory, sorted by trigram, of each one
+   and the offset of its postings relative to the start of the
+   section.  The postings of a trigram end where those of the next
+   begin.  */
+
+void
+write_trigrams (struct idhead *idhp)
+{
+  struct id_section *section = find_id_section (idhp, IDS_TRIGRAMS);
+  struct trigram **trigrams_0
+    = (struct trigram **) hash_dump (&trigram_table, 0,
+				     trigram_qsort_compare);
+  struct trigram **end = &trigrams_0[trigram_table.ht_fill];
+  struct trigram **trigrams;
+  unsigned long count = trigram_table.ht_fill;
+  uint64_t offset = 4 + (uint64_t) count * TRIGRAM_ENTRY_BYTES;
+
+  section->ids_offset = id_output_tell (&idhp->idh_output);
+  io_write (&idhp->idh_output, &count, 4, IO_TYPE_INT);
+  for (trigrams = trigrams_0; trigrams < end; trigrams++)
+    {
+      io_write (&idhp->idh_output, &(*trigrams)->tg_key, 4, IO_TYPE_INT);
+      io_write (&idhp->idh_output, &offset, 8, IO_TYPE_INT);
+      offset += (*trigrams)->tg_size;
+    }
+  for (trigrams = trigrams_0; trigrams < end; trigrams++)
+    {
+      id_output_write (&idhp->idh_output, (*trigrams)->tg_postings,
+		       (*trigrams)->tg_size);
+      free ((*trigrams)->tg_postings);
+    }
+  section->ids_length = (id_output_tell (&idhp->idh_output)
+			 - section->ids_offset);
+
+  free (trigrams_0);
+  hash_free (&trigram_table, 0);
+  obstack_free (&trigram_obstack, 0);
+}
+
+static unsigned long _GL_ATTRIBUTE_PURE
+trigram_hash (void const *key)
+{
+  return_INTEGER_HASH (((struct trigram const *) key)->tg_key);
+}
+
+static int _GL_ATTRIBUTE_PURE
+trigram_hash_compare (void const *x, void const *y)
+{
+  unsigned long kx = ((struct trigram const *) x)->tg_key;
+  unsigned long ky = ((struct trigram const *) y)->tg_key;
+  return (kx > ky) - (kx < ky);
+}
+
+static int _GL_ATTRIBUTE_PURE
+trigram_qsort_compare (void const *x, void const *y)
+{
+  return trigram_hash_compare (*(void const *const *) x,
+			       *(void const *const *) y);
+}
+
+
 int
 write_idhead (struct idhead *idhp)
 {
-  return io_idhead (idhp->idh_FILE, io_write, idhp);
+  id_output_seek (&idhp->idh_output, 0);
+  return io_idhead (&idhp->idh_output, io_write, idhp);
 }
 
 int
-io_write (FILE *output_FILE, void *addr, unsigned int size, int io_type)
+io_write (void *output, void *addr, unsigned int size, int io_type)
 {
+  struct id_output *ido = output;
+
   if (io_type == IO_TYPE_INT || size == 1)
     {
+      unsigned char buf[8];
+      uint64_t value;
+      unsigned int i;
+
       switch (size)
 	{
-	case 4:
-	  putc (*(unsigned long *)addr, output_FILE);
-	  putc (*(unsigned long *)addr >> 010, output_FILE);
-	  putc (*(unsigned long *)addr >> 020, output_FILE);
-	  putc (*(unsigned long *)addr >> 030, output_FILE);
+	case 8:
+	  value = *(uint64_t *)addr;
 	  break;
+	case 4:
 	case 3:
-	  putc (*(unsigned long *)addr, output_FILE);
-	  putc (*(unsigned long *)addr >> 010, output_FILE);
-	  putc (*(unsigned long *)addr >> 020, output_FILE);
+	  value = *(unsigned long *)addr;
 	  break;
 	case 2:
-	  putc (*(unsigned short *)addr, output_FILE);
-	  putc (*(unsigned short *)addr >> 010, output_FILE);
+	  value = *(unsigned short *)addr;
 	  break;
 	case 1:
-	  putc (*(unsigned char *)addr, output_FILE);
+	  value = *(unsigned char *)addr;
 	  break;
 	default:
 	  error (EXIT_FAILURE, 0, _("unsupported size in io_write (): %d"), size);
 	}
+      for (i = 0; i < size; i++, value >>= 010)
+	buf[i] = value;
+      id_output_write (ido, buf, size);
     }
   else if (io_type == IO_TYPE_STR)
-    {
-      fputs (addr, output_FILE);
-      putc ('\0', output_FILE);
-    }
+    id_output_write (ido, addr, strlen (addr) + 1);
   else if (io_type == IO_TYPE_FIX)
-    ignore_value (fwrite (addr, size, 1, output_FILE));
+    id_output_write (ido, addr, size);
   else
     error (0, 0, _("unknown I/O type: %d"), io_type);
   return size;
 }
+
+
+/****************************************************************************/
+/* Buffered output to an ID file. */
+
+/* Begin buffered output to the file open for writing on FD, at its
+   start, with the default sink.  */
+
+void
+open_id_output (struct id_output *ido, int fd)
+{
+  ido->ido_fd = fd;
+  ido->ido_sink = write_id_blocks;
+  ido->ido_sink_data = 0;
+  ido->ido_alloc = ID_OUTPUT_BUFFER_SIZE;
+  ido->ido_buf = xmalloc (ido->ido_alloc);
+  ido->ido_fill = 0;
+  ido->ido_offset = 0;
+  ido->ido_fd_offset = 0;
+  ido->ido_errno = 0;
+}
+
+/* Flush the buffer, free it, wait for the file to reach the disk, and
+   close it.  Return 0, or -1 with errno set to the first error from
+   writing, syncing or closing.  Files that can't be synced, like
+   /dev/null, are closed all the same.  */
+
+int
+close_id_output (struct id_output *ido)
+{
+  id_output_flush (ido);
+  if (ido->ido_errno == 0 && fsync (ido->ido_fd) != 0
+      && errno != EINVAL && errno != ENOTSUP)
+    ido->ido_errno = errno;
+  free (ido->ido_buf);
+  ido->ido_buf = 0;
+  ido->ido_alloc = 0;
+  if (close (ido->ido_fd) != 0 && ido->ido_errno == 0)
+    ido->ido_errno = errno;
+  if (ido->ido_errno == 0)
+    return 0;
+  errno = ido->ido_errno;
+  return -1;
+}
+
+/* Append SIZE bytes at ADDR.  A block too large for the buffer goes
+   straight to the sink, together with what is buffered.  */
+
+void
+id_output_write (struct id_output *ido, void const *addr, size_t size)
+{
+  struct id_block blocks[2];
+
+  if (size <= ido->ido_alloc - ido->ido_fill)
+    {
+      memcpy (ido->ido_buf + ido->ido_fill, addr, size);
+      ido->ido_fill += size;
+      return;
+    }
+  if (size < ido->ido_alloc / 2)
+    {
+      id_output_flush (ido);
+      memcpy (ido->ido_buf, addr, size);
+      ido->ido_fill = size;
+      return;
+    }
+  blocks[0].idb_base = ido->ido_buf;
+  blocks[0].idb_size = ido->ido_fill;
+  blocks[1].idb_base = addr;
+  blocks[1].idb_size = size;
+  put_id_blocks (ido, blocks, 2);
+}
+
+/* The slow path of id_output_putc: the buffer is full.  */
+
+void
+id_output_putc_1 (struct id_output *ido, int c)
+{
+  id_output_flush (ido);
+  ido->ido_buf[ido->ido_fill++] = c;
+}
+
+void
+id_output_flush (struct id_output *ido)
+{
+  struct id_block block;
+
+  if (ido->ido_fill == 0)
+    return;
+  block.idb_base = ido->ido_buf;
+  block.idb_size = ido->ido_fill;
+  put_id_blocks (ido, &block, 1);
+}
+
+/* Continue writing at OFFSET.  Seeking past the end leaves a hole that
+   must be written later.  */
+
+void
+id_output_seek (struct id_output *ido, off_t offset)
+{
+  if (offset == id_output_tell (ido))
+    return;
+  id_output_flush (ido);
+  ido->ido_offset = offset;
+}
+
+/* Hand the COUNT BLOCKS, which begin with any buffered bytes, to the
+   sink, and empty the buffer.  Remember the first error, and write no
+   more after it.  */
+
+static void
+put_id_blocks (struct id_output *ido, struct id_block const *blocks,
+	       int count)
+{
+  off_t size = 0;
+  int i;
+
+  for (i = 0; i < count; i++)
+    size += blocks[i].idb_size;
+  if (ido->ido_errno == 0
+      && ido->ido_sink (ido, blocks, count, ido->ido_offset) != 0)
+    ido->ido_errno = errno;
+  ido->ido_offset += size;
+  ido->ido_fill = 0;
+}
+
+/* The default sink: write the COUNT BLOCKS at OFFSET of ido_fd, with
+   one writev if the system has it, and seek only when OFFSET isn't
+   where the last write left off.  */
+
+static int
+write_id_blocks (struct id_output *ido, struct id_block const *blocks,
+		 int count, off_t offset)
+{
+  off_t end = offset;
+  int i;
+
+  for (i = 0; i < count; i++)
+    end += blocks[i].idb_size;
+  if (offset != ido->ido_fd_offset
+      && lseek (ido->ido_fd, offset, SEEK_SET) < 0)
+    return -1;
+  ido->ido_fd_offset = -1;
+
+#if HAVE_WRITEV && HAVE_SYS_UIO_H
+  {
+    struct iovec iov[2];
+    struct iovec *iovp = iov;
+    int iovcnt = 0;
+
+    if (count > (int) (sizeof iov / sizeof iov[0]))
+      iovp = xnmalloc (count, sizeof *iovp);
+    for (i = 0; i < count; i++)
+      if (blocks[i].idb_size)
+	{
+	  iovp[iovcnt].iov_base = (void *) blocks[i].idb_base;
+	  iovp[iovcnt].iov_len = blocks[i].idb_size;
+	  iovcnt++;
+	}
+    for (i = 0; i < iovcnt; )
+      {
+	ssize_t n = writev (ido->ido_fd, iovp + i, iovcnt - i);
+	if (n < 0)
+	  {
+	    if (errno == EINTR)
+	      continue;
+	    if (iovp != iov)
+	      free (iovp);
+	    return -1;
+	  }
+	while (i < iovcnt && (size_t) n >= iovp[i].iov_len)
+	  n -= iovp[i++].iov_len;
+	if (n > 0)
+	  {
+	    iovp[i].iov_base = (char *) iovp[i].iov_base + n;
+	    iovp[i].iov_len -= n;
+	  }
+      }
+    if (iovp != iov)
+      free (iovp);
+  }
+#else
+  for (i = 0; i < count; i++)
+    {
+      char const *base = blocks[i].idb_base;
+      size_t size = blocks[i].idb_size;
+      while (size > 0)
+	{
+	  ssize_t n = write (ido->ido_fd, base, size);
+	  if (n < 0)
+	    {
+	      if (errno == EINTR)
+		continue;
+	      return -1;
+	    }
+	  base += n;
+	  size -= n;
+	}
+    }
+#endif
+
+  ido->ido_fd_offset = end;
+  return 0;
+}
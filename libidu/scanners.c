@@ -29,16 +29,26 @@
 #include <xalloc.h>
 #include <error.h>
 #include <sys/stat.h>
+#if HAVE_MMAP && HAVE_SYS_MMAN_H
+# include <sys/mman.h>
+#endif
+#if defined __AVX2__ && defined __GNUC__
+# include <immintrin.h>
+#elif defined __SSE2__ && defined __GNUC__
+# include <emmintrin.h>
+#endif
 
 #include "xnls.h"
 #include "scanners.h"
 #include "tokflags.h"
+#include "idu-hash.h"
 #include "iduglobal.h"
 
 static struct obstack lang_args_obstack;
 struct lang_args *lang_args_default = 0;
 struct lang_args *lang_args_list = 0;
-struct obstack tokens_obstack;
+struct lang_args *lang_args_globs = 0;
+SCANNER_LOCAL struct obstack tokens_obstack;
 size_t log_8_member_files = 0;
 
 extern void usage (void) __attribute__((__noreturn__));
@@ -49,27 +59,35 @@ extern char *program_name;
 static struct lang_args **parse_language_map_file (char const *file_name,
 						   struct lang_args **next_ptr);
 static char *read_language_map_file (char const *file_name);
+static void compile_language_map (void);
+static unsigned long lang_literal_hash (void const *key);
+static int lang_literal_hash_compare (void const *x, void const *y);
 static void tokenize_args_string (char *args_string, int *argcp, char ***argvp);
 
-static struct token *get_token_c (FILE *in_FILE, void const *args, int *flags);
+static struct token *get_token_c (char const **in, char const *end,
+				  void const *args, int *flags);
 static void *parse_args_c (char **argv, int argc);
 static void help_me_c (void);
 static void help_me_cpp (void);
 static void help_me_java (void);
 
-static struct token *get_token_asm (FILE *in_FILE, void const *args, int *flags);
+static struct token *get_token_asm (char const **in, char const *end,
+				    void const *args, int *flags);
 static void *parse_args_asm (char **argv, int argc);
 static void help_me_asm (void);
 
-static struct token *get_token_text (FILE *in_FILE, void const *args, int *flags);
+static struct token *get_token_text (char const **in, char const *end,
+				     void const *args, int *flags);
 static void *parse_args_text (char **argv, int argc);
 static void help_me_text (void);
 
-static struct token *get_token_perl (FILE *in_FILE, void const *args, int *flags);
+static struct token *get_token_perl (char const **in, char const *end,
+				     void const *args, int *flags);
 static void *parse_args_perl (char **argv, int argc);
 static void help_me_perl (void);
 
-static struct token *get_token_lisp (FILE *in_FILE, void const *args, int *flags);
+static struct token *get_token_lisp (char const **in, char const *end,
+				     void const *args, int *flags);
 static void *parse_args_lisp (char **argv, int argc);
 static void help_me_lisp (void);
 
@@ -169,6 +187,7 @@ parse_language_map (char const *file_name)
   if (file_name == 0)
     file_name = LANGUAGE_MAP_FILE;
   parse_language_map_file (file_name, &lang_args_list);
+  compile_language_map ();
 }
 
 static struct lang_args **
@@ -303,6 +322,130 @@ read_language_map_file (char const *file_name)
   return lang_map_buffer;
 }
 
+/****************************************************************************/
+/* Most map patterns are either a plain file name, such as `Makefile',
+   or `*' followed by a plain suffix, such as `*.c'.  Those go in hash
+   tables, keyed on the name or the suffix, so that matching a file
+   name costs one lookup for the name and one for each of its suffixes
+   whose length some pattern has.  The remaining patterns, the true
+   globs, are chained through la_next_glob and left to fnmatch.
+
+   A file name takes the lang_args of the first pattern in the map that
+   matches it: the one with the smallest la_index.  So of the patterns
+   with the same literal only the first is kept, and the globs need only
+   be tried while their index is smaller than that of the best literal
+   match.  */
+
+struct lang_literal
+{
+  char const *ll_string;
+  struct lang_args *ll_args;
+};
+
+/* Suffixes longer than this are left to fnmatch.  */
+#define MAX_LANG_SUFFIX 31
+
+static struct hash_table lang_names_table;
+static struct hash_table lang_suffixes_table;
+static unsigned char lang_suffix_lengths[MAX_LANG_SUFFIX + 1];
+
+static void
+compile_language_map (void)
+{
+  static char const glob_chars[] = "*?[\\";
+  struct lang_args **next_glob = &lang_args_globs;
+  struct lang_args *args;
+
+  hash_init (&lang_names_table, 64, lang_literal_hash, 0,
+	     lang_literal_hash_compare);
+  hash_init (&lang_suffixes_table, 256, lang_literal_hash, 0,
+	     lang_literal_hash_compare);
+  for (args = lang_args_list; args; args = args->la_next)
+    {
+      char const *pattern = args->la_pattern;
+      struct hash_table *table = 0;
+      struct lang_literal *literal;
+      struct lang_literal **slot;
+
+      /* With case folding, leave every pattern to fnmatch.  */
+      if (MAYBE_FNM_CASEFOLD || strchr (pattern, SLASH_CHAR))
+	;
+      else if (!strpbrk (pattern, glob_chars))
+	table = &lang_names_table;
+      else if (*pattern == '*' && !strpbrk (pattern + 1, glob_chars)
+	       && strlen (pattern + 1) <= MAX_LANG_SUFFIX)
+	{
+	  pattern++;
+	  lang_suffix_lengths[strlen (pattern)] = 1;
+	  table = &lang_suffixes_table;
+	}
+
+      args->la_next_glob = 0;
+      if (table == 0)
+	{
+	  *next_glob = args;
+	  next_glob = &args->la_next_glob;
+	  continue;
+	}
+      literal = obstack_alloc (&lang_args_obstack, sizeof *literal);
+      literal->ll_string = pattern;
+      literal->ll_args = args;
+      slot = (struct lang_literal **) hash_find_slot (table, literal);
+      if (HASH_VACANT (*slot))
+	hash_insert_at (table, literal, slot);
+      else
+	obstack_free (&lang_args_obstack, literal);
+    }
+}
+
+/* Return the first lang_args in the map whose pattern is `name' or a
+   suffix of it, or 0.  A glob in lang_args_globs with a smaller
+   la_index might match `name' as well.  */
+
+struct lang_args *
+find_literal_lang_args (char const *name)
+{
+  struct lang_args *best = 0;
+  struct lang_literal key;
+  struct lang_literal *literal;
+  size_t length = strlen (name);
+  size_t suffix_length;
+
+  key.ll_string = name;
+  literal = hash_find_item (&lang_names_table, &key);
+  if (literal)
+    best = literal->ll_args;
+
+  suffix_length = length < MAX_LANG_SUFFIX ? length : MAX_LANG_SUFFIX;
+  for (;; suffix_length--)
+    {
+      if (lang_suffix_lengths[suffix_length])
+	{
+	  key.ll_string = name + length - suffix_length;
+	  literal = hash_find_item (&lang_suffixes_table, &key);
+	  if (literal && (best == 0
+			  || literal->ll_args->la_index < best->la_index))
+	    best = literal->ll_args;
+	}
+      if (suffix_length == 0)
+	break;
+    }
+  return best;
+}
+
+static unsigned long _GL_ATTRIBUTE_PURE
+lang_literal_hash (void const *key)
+{
+  return_STRING_HASH (((struct lang_literal const *) key)->ll_string);
+}
+
+static int _GL_ATTRIBUTE_PURE
+lang_literal_hash_compare (void const *x, void const *y)
+{
+  return_STRING_COMPARE (((struct lang_literal const *) x)->ll_string,
+			 ((struct lang_literal const *) y)->ll_string);
+}
+
 /****************************************************************************/
 
 static void
@@ -531,7 +674,152 @@ parse_args_c (char **argv, int argc)
   return args;
 }
 
-unsigned char *scanner_buffer;
+SCANNER_LOCAL unsigned char *scanner_buffer;
+
+/* Bring the contents of FILE_NAME into memory for the scanners, which
+   read them as a range of bytes rather than from a stdio stream, one
+   locked call per byte.  Prefer mmap, but fall back to reading the file
+   into a malloc'd buffer.  Return 0 on success, or -1 with errno set.  */
+
+int
+open_source_file (char const *file_name, struct source_file *sf)
+{
+  struct stat st;
+  size_t alloc;
+  size_t size = 0;
+  char *buf;
+  ssize_t n;
+  int fd = open (file_name, O_RDONLY);
+
+  if (fd < 0)
+    return -1;
+  sf->sf_mapped = 0;
+
+  if (fstat (fd, &st) == 0 && S_ISREG (st.st_mode))
+    {
+      alloc = st.st_size + 1;
+#if HAVE_MMAP && HAVE_SYS_MMAN_H
+      if (st.st_size > 0)
+	{
+	  buf = mmap (0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	  if (buf != MAP_FAILED)
+	    {
+	      close (fd);
+	      sf->sf_buf = buf;
+	      sf->sf_size = st.st_size;
+	      sf->sf_mapped = 1;
+	      sf->sf_begin = buf;
+	      sf->sf_end = buf + st.st_size;
+	      return 0;
+	    }
+	}
+#endif
+    }
+  else
+    alloc = BUFSIZ;
+
+  /* The file may have grown since we looked, so read until EOF.  */
+  buf = xmalloc (alloc);
+  while ((n = read (fd, buf + size, alloc - size)) != 0)
+    {
+      if (n < 0)
+	{
+	  int saved_errno = errno;
+	  if (errno == EINTR)
+	    continue;
+	  free (buf);
+	  close (fd);
+	  errno = saved_errno;
+	  return -1;
+	}
+      size += n;
+      if (size == alloc)
+	buf = x2nrealloc (buf, &alloc, 1);
+    }
+  close (fd);
+  sf->sf_buf = buf;
+  sf->sf_size = size;
+  sf->sf_begin = buf;
+  sf->sf_end = buf + size;
+  return 0;
+}
+
+void
+close_source_file (struct source_file *sf)
+{
+#if HAVE_MMAP && HAVE_SYS_MMAN_H
+  if (sf->sf_mapped)
+    munmap (sf->sf_buf, sf->sf_size);
+  else
+#endif
+    free (sf->sf_buf);
+  sf->sf_buf = 0;
+}
+
+/* Read the next byte of the range that begins at *IN and ends at END,
+   or push back the byte just read, as getc and ungetc would.  */
+
+#define scan_getc(in, end) \
+  (*(in) < (end) ? (unsigned char) *(*(in))++ : EOF)
+#define scan_ungetc(c, in) \
+  ((c) == EOF ? (void) 0 : (void) --*(in))
+
+/* Return the address of the first byte in [P, END) that is A, B or C,
+   or END if there is none.  Comments, strings and character constants
+   are runs of bytes that end at one of a few fixed characters, so
+   compare a vector of them at once where the compiler lets us.  */
+
+static char const *
+scan_find_any3 (char const *p, char const *end, int a, int b, int c)
+{
+#if defined __AVX2__ && defined __GNUC__
+  __m256i va32 = _mm256_set1_epi8 (a);
+  __m256i vb32 = _mm256_set1_epi8 (b);
+  __m256i vc32 = _mm256_set1_epi8 (c);
+  while (end - p >= 32)
+    {
+      __m256i x = _mm256_loadu_si256 ((__m256i const *) p);
+      unsigned int mask
+	= _mm256_movemask_epi8 (_mm256_or_si256
+				(_mm256_or_si256 (_mm256_cmpeq_epi8 (x, va32),
+						  _mm256_cmpeq_epi8 (x, vb32)),
+				 _mm256_cmpeq_epi8 (x, vc32)));
+      if (mask)
+	return p + __builtin_ctz (mask);
+      p += 32;
+    }
+#endif
+#if defined __SSE2__ && defined __GNUC__
+  __m128i va = _mm_set1_epi8 (a);
+  __m128i vb = _mm_set1_epi8 (b);
+  __m128i vc = _mm_set1_epi8 (c);
+  while (end - p >= 16)
+    {
+      __m128i x = _mm_loadu_si128 ((__m128i const *) p);
+      unsigned int mask
+	= _mm_movemask_epi8 (_mm_or_si128 (_mm_or_si128 (_mm_cmpeq_epi8 (x, va),
+							  _mm_cmpeq_epi8 (x, vb)),
+					   _mm_cmpeq_epi8 (x, vc)));
+      if (mask)
+	return p + __builtin_ctz (mask);
+      p += 16;
+    }
+#endif
+  for (; p < end; p++)
+    if (*p == a || *p == b || *p == c)
+      return p;
+  return end;
+}
+
+/* Return the address of the first C in [P, END), or END.  memchr is
+   already vectorized wherever it matters.  */
+
+static char const *
+scan_find (char const *p, char const *end, int c)
+{
+  char const *found = memchr (p, c, end - p);
+  return found ? found : end;
+}
 
 #define SCAN_CPP_DIRECTIVE						\
   do									\
@@ -539,7 +827,7 @@ unsigned char *scanner_buffer;
       new_line = 0;							\
       /* Cope with leading whitespace before CPP lines */		\
       while (c == ' ' || c == '\t')					\
-	c = getc (in_FILE);						\
+	c = scan_getc (in, end);					\
       if (c == '\n')							\
 	{								\
 	  new_line = 1;							\
@@ -547,20 +835,20 @@ unsigned char *scanner_buffer;
 	}								\
       else if (c != '#')						\
 	goto next;							\
-      c = getc (in_FILE);						\
+      c = scan_getc (in, end);						\
       while (ISBORING (c))						\
-	c = getc (in_FILE);						\
+	c = scan_getc (in, end);					\
       if (!ISID1ST (c))							\
 	goto next;							\
       id = scanner_buffer;						\
       *id++ = c;							\
-      while (ISIDREST (c = getc (in_FILE)))				\
+      while (ISIDREST (c = scan_getc (in, end)))			\
 	*id++ = c;							\
       *id = '\0';							\
       if (strequ (scanner_buffer, "include"))				\
 	{								\
 	  while (c == ' ' || c == '\t')					\
-	    c = getc (in_FILE);						\
+	    c = scan_getc (in, end);					\
 	  if (c == '\n')						\
 	    {								\
 	      new_line = 1;						\
@@ -569,43 +857,44 @@ unsigned char *scanner_buffer;
 	  id = scanner_buffer;						\
 	  if (c == '"')							\
 	    {								\
-	      c = getc (in_FILE);					\
+	      c = scan_getc (in, end);					\
 	      while (c != '\n' && c != '"' && c != EOF)			\
 		{							\
 		  *id++ = c;						\
-		  c = getc (in_FILE);					\
+		  c = scan_getc (in, end);				\
 		}							\
 	      *flags = TOK_STRING;					\
 	    }								\
 	  else if (c == '<')						\
 	    {								\
-	      c = getc (in_FILE);					\
+	      c = scan_getc (in, end);					\
 	      while (c != '\n' && c != '>' && c != EOF)			\
 		{							\
 		  *id++ = c;						\
-		  c = getc (in_FILE);					\
+		  c = scan_getc (in, end);				\
 		}							\
 	      *flags = TOK_STRING;					\
 	    }								\
 	  else if (ISID1ST (c))						\
 	    {								\
 	      *id++ = c;						\
-	      while (ISIDREST (c = getc (in_FILE)))			\
+	      while (ISIDREST (c = scan_getc (in, end)))		\
 		*id++ = c;						\
 	      *flags = TOK_NAME;					\
 	    }								\
 	  else								\
 	    {								\
 	      while (c != '\n' && c != EOF)				\
-		c = getc (in_FILE);					\
+		c = scan_getc (in, end);				\
 	      new_line = 1;						\
 	      goto top;							\
 	    }								\
 	  while (c != '\n' && c != EOF)					\
-	    c = getc (in_FILE);						\
+	    c = scan_getc (in, end);					\
 	  new_line = 1;							\
 	  obstack_grow0 (&tokens_obstack, scanner_buffer,		\
 			 id - scanner_buffer);				\
+	  *in_p = cursor;						\
 	  return (struct token *) obstack_finish (&tokens_obstack);	\
 	}								\
       if (strnequ (scanner_buffer, "if", 2)				\
@@ -614,7 +903,7 @@ unsigned char *scanner_buffer;
 	  || strequ (scanner_buffer, "undef"))				\
 	goto next;							\
       while ((c != '\n') && (c != EOF))					\
-	c = getc (in_FILE);						\
+	c = scan_getc (in, end);					\
       new_line = 1;							\
       goto top;								\
   } while (0)
@@ -624,37 +913,47 @@ unsigned char *scanner_buffer;
    machine is built for speed, not elegance.  */
 
 static struct token *
-get_token_c (FILE *in_FILE, void const *args, int *flags)
+get_token_c (char const **in_p, char const *end,
+	     void const *args, int *flags)
 {
 #define ARGS ((struct args_c const *) args)
-  static int new_line = 1;
+  static SCANNER_LOCAL int new_line = 1;
   unsigned short const *rct = &ARGS->ctype[1];
   unsigned char *id = scanner_buffer;
   int c; int d;
+  /* Scan from a local copy of *IN_P, which the compiler can keep in a
+     register, since stores through ID might otherwise alias it.  */
+  char const *cursor = *in_p;
+  char const **in = &cursor;
 
   obstack_blank (&tokens_obstack, OFFSETOF_TOKEN_NAME);
 
 top:
-  c = getc (in_FILE);
+  c = scan_getc (in, end);
   if (new_line)
     SCAN_CPP_DIRECTIVE;
 
 next:
   while (ISBORING (c))
-    c = getc (in_FILE);
+    c = scan_getc (in, end);
 
   switch (c)
     {
     case '"':
       id = scanner_buffer;
-      *id++ = c = getc (in_FILE);
+      *id++ = c = scan_getc (in, end);
       for (;;)
 	{
-	  while (ISQ2BORING (c))
-	    *id++ = c = getc (in_FILE);
+	  if (ISQ2BORING (c))
+	    {
+	      char const *run = scan_find_any3 (*in, end, '"', '\\', '\n');
+	      id = mempcpy (id, *in, run - *in);
+	      *in = run;
+	      *id++ = c = scan_getc (in, end);
+	    }
 	  if (c == '\\')
 	    {
-	      *id++ = c = getc (in_FILE);
+	      *id++ = c = scan_getc (in, end);
 	      continue;
 	    }
 	  else if (c != '"')
@@ -667,7 +966,7 @@ next:
 	id++;
       if (*id || id == scanner_buffer)
 	{
-	  c = getc (in_FILE);
+	  c = scan_getc (in, end);
 	  goto next;
 	}
       *flags = TOK_STRING;
@@ -675,50 +974,58 @@ next:
 	obstack_grow0 (&tokens_obstack, scanner_buffer + 1, id - scanner_buffer - 1);
       else
 	obstack_grow0 (&tokens_obstack, scanner_buffer, id - scanner_buffer);
+      *in_p = cursor;
       return (struct token *) obstack_finish (&tokens_obstack);
 
     case '\'':
-      c = getc (in_FILE);
+      c = scan_getc (in, end);
       for (;;)
 	{
-	  while (ISQ1BORING (c))
-	    c = getc (in_FILE);
+	  if (ISQ1BORING (c))
+	    {
+	      *in = scan_find_any3 (*in, end, '\'', '\\', '\n');
+	      c = scan_getc (in, end);
+	    }
 	  if (c == '\\')
 	    {
-	      c = getc (in_FILE);
+	      c = scan_getc (in, end);
 	      continue;
 	    }
 	  else if (c == '\'')
-	    c = getc (in_FILE);
+	    c = scan_getc (in, end);
 	  goto next;
 	}
 
     case '/':
-      c = getc (in_FILE);
+      c = scan_getc (in, end);
       if (c == '/')
 	{			/* Cope with C++ comment */
-	  while (ISCCBORING (c))
-	    c = getc (in_FILE);
+	  *in = scan_find (*in, end, '\n');
+	  c = scan_getc (in, end);
 	  new_line = 1;
 	  goto top;
 	}
       else if (c != '*')
 	goto next;
-      c = getc (in_FILE);
+      c = scan_getc (in, end);
       for (;;)
 	{
-	  while (ISCBORING (c))
-	    c = getc (in_FILE);
-	  c = getc (in_FILE);
+	  if (ISCBORING (c))
+	    {
+	      *in = scan_find (*in, end, '*');
+	      c = scan_getc (in, end);
+	    }
+	  c = scan_getc (in, end);
 	  if (c == '/')
 	    {
-	      c = getc (in_FILE);
+	      c = scan_getc (in, end);
 	      goto next;
 	    }
 	  else if (ISEOF (c))
 	    {
 	      new_line = 1;
 	      obstack_free (&tokens_obstack, obstack_finish (&tokens_obstack));
+	      *in_p = cursor;
 	      return 0;
 	    }
 	}
@@ -732,6 +1039,7 @@ next:
 	{
 	  new_line = 1;
 	  obstack_free (&tokens_obstack, obstack_finish (&tokens_obstack));
+	  *in_p = cursor;
 	  return 0;
 	}
       id = scanner_buffer;
@@ -739,13 +1047,13 @@ next:
       if (ISID1ST (c))
 	{
 	  *flags = TOK_NAME;
-	  while (ISIDREST (c = getc (in_FILE)))
+	  while (ISIDREST (c = scan_getc (in, end)))
 	    *id++ = c;
 	}
       else if (ISDIGIT (c))
 	{
 	  *flags = TOK_NUMBER;
-	  while (ISNUMBER (c = getc (in_FILE)))
+	  while (ISNUMBER (c = scan_getc (in, end)))
 	    *id++ = c;
 	}
       else
@@ -755,9 +1063,10 @@ next:
 	  else
 	    fprintf (stderr, _("junk: `\\%03o'"), c);
 	}
-      ungetc (c, in_FILE);
+      scan_ungetc (c, in);
       *flags |= TOK_LITERAL;
       obstack_grow0 (&tokens_obstack, scanner_buffer, id - scanner_buffer);
+      *in_p = cursor;
       return (struct token *) obstack_finish (&tokens_obstack);
     }
 #undef ARGS
@@ -934,29 +1243,33 @@ parse_args_asm (char **argv, int argc)
    state machine is built for speed, not elegance.  */
 
 static struct token *
-get_token_asm (FILE *in_FILE, void const *args, int *flags)
+get_token_asm (char const **in_p, char const *end,
+	       void const *args, int *flags)
 {
 #define ARGS ((struct args_asm const *) args)
-  static int new_line = 1;
+  static SCANNER_LOCAL int new_line = 1;
   unsigned char const *rct = &ARGS->ctype[1];
   unsigned char *id = scanner_buffer;
   int c, d;
+  /* As in get_token_c, scan from a local copy of *IN_P.  */
+  char const *cursor = *in_p;
+  char const **in = &cursor;
 
   obstack_blank (&tokens_obstack, OFFSETOF_TOKEN_NAME);
 
 top:
-  c = getc (in_FILE);
+  c = scan_getc (in, end);
   if (ARGS->handle_cpp > 0 && new_line)
     SCAN_CPP_DIRECTIVE;
 
 next:
   while (ISBORING (c))
-    c = getc (in_FILE);
+    c = scan_getc (in, end);
 
   if (ISCOMMENT (c))
     {
       while (ISCBORING (c))
-	c = getc (in_FILE);
+	c = scan_getc (in, end);
       new_line = 1;
     }
 
@@ -964,6 +1277,7 @@ next:
     {
       new_line = 1;
       obstack_free (&tokens_obstack, obstack_finish (&tokens_obstack));
+      *in_p = cursor;
       return 0;
     }
 
@@ -975,23 +1289,24 @@ next:
 
   if (c == '/')
     {
-      if ((c = getc (in_FILE)) != '*')
+      if ((c = scan_getc (in, end)) != '*')
 	goto next;
-      c = getc (in_FILE);
+      c = scan_getc (in, end);
       for (;;)
 	{
 	  while (ISCCBORING (c))
-	    c = getc (in_FILE);
-	  c = getc (in_FILE);
+	    c = scan_getc (in, end);
+	  c = scan_getc (in, end);
 	  if (c == '/')
 	    {
-	      c = getc (in_FILE);
+	      c = scan_getc (in, end);
 	      break;
 	    }
 	  else if (ISEOF (c))
 	    {
 	      new_line = 1;
 	      obstack_free (&tokens_obstack, obstack_finish (&tokens_obstack));
+	      *in_p = cursor;
 	      return 0;
 	    }
 	}
@@ -999,22 +1314,23 @@ next:
     }
 
   id = scanner_buffer;
-  if (ARGS->strip_underscore && c == '_' && !ISID1ST (c = getc (in_FILE)))
+  if (ARGS->strip_underscore && c == '_' && !ISID1ST (c = scan_getc (in, end)))
     {
       obstack_grow0 (&tokens_obstack, "_", 1);
+      *in_p = cursor;
       return (struct token *) obstack_finish (&tokens_obstack);
     }
   *id++ = c;
   if (ISID1ST (c))
     {
       *flags = TOK_NAME;
-      while (ISIDREST (c = getc (in_FILE)))
+      while (ISIDREST (c = scan_getc (in, end)))
 	*id++ = c;
     }
   else if (ISNUMBER (c))
     {
       *flags = TOK_NUMBER;
-      while (ISNUMBER (c = getc (in_FILE)))
+      while (ISNUMBER (c = scan_getc (in, end)))
 	*id++ = c;
     }
   else
@@ -1030,9 +1346,10 @@ next:
   for (id = scanner_buffer; *id; id++)
     if (ISIGNORE (d = *id))
       goto next;
-  ungetc (c, in_FILE);
+  scan_ungetc (c, in);
   *flags |= TOK_LITERAL;
   obstack_grow0 (&tokens_obstack, scanner_buffer, id - scanner_buffer);
+  *in_p = cursor;
   return (struct token *) obstack_finish (&tokens_obstack);
 #undef ARGS
 }
@@ -1187,7 +1504,8 @@ parse_args_text (char **argv, int argc)
    is built for speed, not elegance.  */
 
 static struct token *
-get_token_text (FILE *in_FILE, void const *args, int *flags)
+get_token_text (char const **in, char const *end,
+		void const *args, int *flags)
 {
 #define ARGS ((struct args_text const *) args)
   unsigned char const *rct = &ARGS->ctype[1];
@@ -1197,9 +1515,9 @@ get_token_text (FILE *in_FILE, void const *args, int *flags)
   obstack_blank (&tokens_obstack, OFFSETOF_TOKEN_NAME);
 
 top:
-  c = getc (in_FILE);
+  c = scan_getc (in, end);
   while (ISBORING (c))
-    c = getc (in_FILE);
+    c = scan_getc (in, end);
   if (ISEOF (c))
     {
       obstack_free (&tokens_obstack, obstack_finish (&tokens_obstack));
@@ -1210,14 +1528,14 @@ top:
   if (ISID1ST (c))
     {
       *flags = TOK_NAME;
-      while (ISIDREST (c = getc (in_FILE)))
+      while (ISIDREST (c = scan_getc (in, end)))
 	if (!ISIDSQUEEZE (c))
 	  *id++ = c;
     }
   else if (ISNUMBER (c))
     {
       *flags = TOK_NUMBER;
-      while (ISNUMBER (c = getc (in_FILE)))
+      while (ISNUMBER (c = scan_getc (in, end)))
 	*id++ = c;
     }
   else
@@ -1229,7 +1547,7 @@ top:
       goto top;
     }
 
-  ungetc (c, in_FILE);
+  scan_ungetc (c, in);
   *flags |= TOK_LITERAL;
   obstack_grow0 (&tokens_obstack, scanner_buffer, id - scanner_buffer);
   return (struct token *) obstack_finish (&tokens_obstack);
@@ -1398,10 +1716,11 @@ parse_args_perl (char **argv, int argc)
    is built for speed, not elegance.  */
 
 static struct token *
-get_token_perl (FILE *in_FILE, void const *args, int *flags)
+get_token_perl (char const **in, char const *end,
+		void const *args, int *flags)
 {
 #define ARGS ((struct args_perl const *) args)
-  static int new_line = 1;
+  static SCANNER_LOCAL int new_line = 1;
   /*  static char id_0[BUFSIZ]; */
   unsigned short const *rct = &ARGS->ctype[1];
   int c, state = 0, skip_doc = 0;
@@ -1411,9 +1730,9 @@ get_token_perl (FILE *in_FILE, void const *args, int *flags)
   obstack_blank (&tokens_obstack, OFFSETOF_TOKEN_NAME);
 
 top:
-  c = getc (in_FILE);
+  c = scan_getc (in, end);
   while (ISBORING (c))
-    c = getc (in_FILE);
+    c = scan_getc (in, end);
 
   switch (c)
     {
@@ -1424,7 +1743,7 @@ top:
         break;
 
       case '\\':
-        c = getc (in_FILE); /* Skip next character */
+        c = scan_getc (in, end); /* Skip next character */
         new_line = 0;
         goto top;
         break;
@@ -1477,17 +1796,17 @@ top:
   if (ISID1ST (c))
     {
       *flags = TOK_NAME;
-      while (ISIDREST (c = getc (in_FILE)))
+      while (ISIDREST (c = scan_getc (in, end)))
         if (!ISIDSQUEEZE (c))
           *id++ = c;
     }
   else if (ISNUMBER (c))
     {
       *flags = TOK_NUMBER;
-      while (ISNUMBER (c = getc (in_FILE)))
+      while (ISNUMBER (c = scan_getc (in, end)))
         *id++ = c;
 
-      ungetc (c, in_FILE);
+      scan_ungetc (c, in);
       goto top;			/* skip all numbers */
     }
   else
@@ -1499,7 +1818,7 @@ top:
       goto top;
     }
 
-  ungetc (c, in_FILE);
+  scan_ungetc (c, in);
 
   *id = '\0';
   if (skip_doc)
@@ -1609,7 +1928,8 @@ parse_args_lisp (char **argv, int argc)
    state machine is built for speed, not elegance.  */
 
 static struct token *
-get_token_lisp (FILE *in_FILE, void const *args, int *flags)
+get_token_lisp (char const **in, char const *end,
+		void const *args, int *flags)
 {
   unsigned char const *rct = &ctype_lisp[1];
   unsigned char *id = scanner_buffer;
@@ -1618,7 +1938,7 @@ get_token_lisp (FILE *in_FILE, void const *args, int *flags)
   obstack_blank (&tokens_obstack, OFFSETOF_TOKEN_NAME);
 
  top:
-  c = getc (in_FILE);
+  c = scan_getc (in, end);
  recheck:
   switch (c)
     {
@@ -1631,24 +1951,24 @@ get_token_lisp (FILE *in_FILE, void const *args, int *flags)
       goto top;
 
     case ',':				/* unquote */
-      c = getc (in_FILE);
+      c = scan_getc (in, end);
       if (c == '@')			/* unquote-splicing */
 	goto top;
       goto recheck;
 
     case ';':				/* comment */
       do {
-	c = getc (in_FILE);
+	c = scan_getc (in, end);
       } while ( (c != EOF) && (c != '\n'));
       goto top;
 
     case '"':				/* string with/without ansi-C escapes*/
     string:
       do {
-	c = getc (in_FILE);
+	c = scan_getc (in, end);
 	if (c == '\\')
 	  {
-	    c = getc (in_FILE);
+	    c = scan_getc (in, end);
 	    goto string;
 	  }
       } while ( (c != EOF) && (c != '"'));
@@ -1657,10 +1977,10 @@ get_token_lisp (FILE *in_FILE, void const *args, int *flags)
     case '?':			/* character constant */
     cconstant:
       do {
-	c = getc(in_FILE);
+	c = scan_getc (in, end);
 	if (c == '\\')
 	  {
-	    c = getc(in_FILE);
+	    c = scan_getc (in, end);
 	    goto cconstant;
 	  }
       } while (c != EOF && is_IDENT(c));
@@ -1670,19 +1990,19 @@ get_token_lisp (FILE *in_FILE, void const *args, int *flags)
     case '+': case '-':
       id = scanner_buffer;
       *id++ = c;
-      c = getc (in_FILE);
+      c = scan_getc (in, end);
       if (is_DIGIT (c) ||
 	  (scanner_buffer[0] != '.' && (c == '.' || c == 'i' || c == 'I')))
 	goto number;
       if (c != EOF)
-	ungetc (c, in_FILE);
+	scan_ungetc (c, in);
       goto ident;
 
     case '#':
       id = scanner_buffer;
       *id++ = c;
 
-      c = getc (in_FILE);
+      c = scan_getc (in, end);
       if (c == EOF)
 	goto top;
       else if (is_RADIX (c))
@@ -1690,14 +2010,14 @@ get_token_lisp (FILE *in_FILE, void const *args, int *flags)
       else if (c == '\\')	/* #\... literal Character */
 	{
 	  *id++ = c;
-	  c = getc (in_FILE);
+	  c = scan_getc (in, end);
 	  *id++ = c;
 	  if (is_LETTER (c))
 	    {
-	      while (is_LETTER (c = getc (in_FILE)))
+	      while (is_LETTER (c = scan_getc (in, end)))
 		*id++ = c;
 	      if (c != EOF)
-		ungetc (c, in_FILE);
+		scan_ungetc (c, in);
 	    }
 	  *flags = TOK_LITERAL;
 	  obstack_grow0 (&tokens_obstack, scanner_buffer, id - scanner_buffer);
@@ -1709,10 +2029,10 @@ get_token_lisp (FILE *in_FILE, void const *args, int *flags)
 	goto string;
       else if (c == '!')	/* #!... Kawa key/eof/null/... */
 	{
-	  while (is_LETTER (c = getc (in_FILE)))
+	  while (is_LETTER (c = scan_getc (in, end)))
 	    *id++ = c;
 	  if (c != EOF)
-	    ungetc (c, in_FILE);
+	    scan_ungetc (c, in);
 	  *flags = TOK_LITERAL;
 	  obstack_grow0 (&tokens_obstack, scanner_buffer, id - scanner_buffer);
 	  return (struct token *) obstack_finish (&tokens_obstack);
@@ -1720,10 +2040,10 @@ get_token_lisp (FILE *in_FILE, void const *args, int *flags)
       else if (c == '|')	/* #|...|# Guile/Kawa multi-lines comment */
 	{
 	  do {
-	    c = getc (in_FILE);
+	    c = scan_getc (in, end);
 	    if (c == '|')
 	      {
-		while ( (c = getc (in_FILE)) == '|')
+		while ( (c = scan_getc (in, end)) == '|')
 		  ;
 		if (c == '#')
 		  break;
@@ -1734,7 +2054,7 @@ get_token_lisp (FILE *in_FILE, void const *args, int *flags)
       else if (c == '@')	/* #@LENGTH ...^_ EMACS byte-code comment */
 	{
 	  do {
-	    c = getc (in_FILE);
+	    c = scan_getc (in, end);
 	  } while ( (c != EOF) && (c != '\037'));
 	  goto top;
 	}
@@ -1757,11 +2077,11 @@ get_token_lisp (FILE *in_FILE, void const *args, int *flags)
 	  /* Emacs end-of-vector vs Kawa ident: allow [] as a part of an ident. */
 	  for (;;)
 	    {
-	      while (is_IDENT (c = getc (in_FILE)))
+	      while (is_IDENT (c = scan_getc (in, end)))
 		*id++ = c;
 	      if (0 /* c == '[' */)
 		{
-		  c = getc (in_FILE);
+		  c = scan_getc (in, end);
 		  if (c == ']')
 		    {
 		      *id++ = '[';
@@ -1769,13 +2089,13 @@ get_token_lisp (FILE *in_FILE, void const *args, int *flags)
 		      continue;
 		    }
 		  if (c != EOF)
-		    ungetc (c, in_FILE);
-		  ungetc ('[', in_FILE);
+		    scan_ungetc (c, in);
+		  scan_ungetc ('[', in);
 		}
 	      break;
 	    }
 	  if (c != EOF)
-	    ungetc (c, in_FILE);
+	    scan_ungetc (c, in);
 	  *flags = TOK_NAME | TOK_LITERAL;
 	  obstack_grow0 (&tokens_obstack, scanner_buffer, id - scanner_buffer);
 	  return (struct token *) obstack_finish (&tokens_obstack);
@@ -1785,10 +2105,10 @@ get_token_lisp (FILE *in_FILE, void const *args, int *flags)
 	  id = scanner_buffer;
 	number:
 	  *id++ = c;
-	  while (is_NUMBER (c = getc (in_FILE)))
+	  while (is_NUMBER (c = scan_getc (in, end)))
 	    *id++ = c;
 	  if (c != EOF)
-	    ungetc (c, in_FILE);
+	    scan_ungetc (c, in);
 	  *flags = TOK_NUMBER | TOK_LITERAL;
 	  obstack_grow0 (&tokens_obstack, scanner_buffer, id - scanner_buffer);
 	  return (struct token *) obstack_finish (&tokens_obstack);
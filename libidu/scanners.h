@@ -36,7 +36,10 @@ struct token
 #define TOKEN_NAME(TOKEN) (char *)((TOKEN)->tok_hits_name + log_8_member_files)
 #define OFFSETOF_TOKEN_NAME (offsetof (struct token, tok_hits_name) + log_8_member_files)
 
-typedef struct token *(*get_token_func_t) (FILE *in_FILE, void const *args, int *flags);
+/* A scanner returns the next token of the range that begins at *IN
+   and ends at END, and advances *IN past it.  */
+typedef struct token *(*get_token_func_t) (char const **in, char const *end,
+					   void const *args, int *flags);
 typedef void *(*parse_args_func_t) (char **argv, int argc);
 typedef void (*help_me_func_t) (void);
 
@@ -58,6 +61,7 @@ struct lang_args
   void const *la_args_digested;	/* pre-parsed scanner args */
   int la_index;
   struct lang_args *la_next;
+  struct lang_args *la_next_glob; /* in lang_args_globs */
 };
 
 extern void language_help_me (void);
@@ -67,11 +71,35 @@ extern struct language *get_language (char const *lang_name)
   _GL_ATTRIBUTE_PURE;
 extern void parse_language_map (char const *file_name);
 extern void set_default_language (char const *lang_name);
+extern struct lang_args *find_literal_lang_args (char const *name);
+
+/* The contents of a member file, ready to be scanned.  */
+
+struct source_file
+{
+  char const *sf_begin;
+  char const *sf_end;
+  void *sf_buf;			/* mapped or malloc'd storage */
+  size_t sf_size;
+  int sf_mapped;		/* nonzero if sf_buf came from mmap */
+};
+
+extern int open_source_file (char const *file_name, struct source_file *sf);
+extern void close_source_file (struct source_file *sf);
 
 extern struct lang_args *lang_args_default;
 extern struct lang_args *lang_args_list;
+extern struct lang_args *lang_args_globs;
+
+/* The scanners' working storage is private to each thread, so that
+   mkid can scan several files at once.  */
+#ifdef IDU_THREAD_LOCAL
+# define SCANNER_LOCAL IDU_THREAD_LOCAL
+#else
+# define SCANNER_LOCAL
+#endif
 
-extern struct obstack tokens_obstack;
-extern unsigned char *scanner_buffer;
+extern SCANNER_LOCAL struct obstack tokens_obstack;
+extern SCANNER_LOCAL unsigned char *scanner_buffer;
 
 #endif /* not _scanners_h_ */
@@ -0,0 +1,197 @@
+/* strsort.c -- sort items by the strings within them
+   Copyright (C) 2012 Free Software Foundation, Inc.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* This is a multikey quicksort (Bentley and Sedgewick) that takes
+   eight bytes of each string at a time rather than one.  Beside the
+   pointer to each item, it keeps the next eight bytes of its string
+   as a 64-bit number whose order is that of the bytes, and partitions
+   on these numbers alone.  Only the items whose numbers equal the
+   pivot go on to the next eight bytes, so each string is read once
+   for every eight bytes that it shares with others, rather than once
+   for every comparison as qsort does.  */
+
+#include <config.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <xalloc.h>
+#include "strsort.h"
+
+struct sort_key
+{
+  uint64_t sk_key;		/* eight bytes of the name, from a depth */
+  void *sk_item;
+};
+
+/* Subarrays no longer than this are sorted by insertion.  */
+#define SORT_INSERTION_MAX 16
+
+static uint64_t name_key (void const *item, size_t name_offset,
+			  size_t depth) _GL_ATTRIBUTE_PURE;
+static void sort_keys (struct sort_key *keys, size_t count,
+		       size_t name_offset, size_t depth);
+static void insertion_sort_keys (struct sort_key *keys, size_t count,
+				 size_t name_offset, size_t depth);
+
+/* Sort the COUNT pointers ITEMS into ascending order of the
+   NUL-terminated strings that lie NAME_OFFSET bytes into the items
+   they point to.  Bytes compare as unsigned chars, as with strcmp and
+   STRING_COMPARE.  Items with equal strings end in no certain order.  */
+
+void
+sort_by_name (void **items, size_t count, size_t name_offset)
+{
+  struct sort_key *keys;
+  size_t i;
+
+  if (count < 2)
+    return;
+  keys = xnmalloc (count, sizeof *keys);
+  for (i = 0; i < count; i++)
+    {
+      keys[i].sk_key = name_key (items[i], name_offset, 0);
+      keys[i].sk_item = items[i];
+    }
+  sort_keys (keys, count, name_offset, 0);
+  for (i = 0; i < count; i++)
+    items[i] = keys[i].sk_item;
+  free (keys);
+}
+
+/* Return the eight bytes of the name of ITEM that begin DEPTH bytes
+   into it, as a big-endian number, with zeros past the end of the
+   name.  The name must be at least DEPTH bytes long.  */
+
+static uint64_t
+name_key (void const *item, size_t name_offset, size_t depth)
+{
+  unsigned char const *name = (unsigned char const *) item + name_offset;
+  unsigned char const *s = name + depth;
+  uint64_t key = 0;
+  int i;
+
+  for (i = 0; i < 8; i++)
+    {
+      key <<= 8;
+      if (*s)
+	key |= *s++;
+    }
+  return key;
+}
+
+#define SWAP_KEYS(x, y) do { \
+  struct sort_key tmp = (x); \
+  (x) = (y); \
+  (y) = tmp; \
+} while (0)
+
+/* Sort the COUNT KEYS, whose names are all the same for their first
+   DEPTH bytes, and whose sk_key holds the eight bytes after those.  */
+
+static void
+sort_keys (struct sort_key *keys, size_t count, size_t name_offset,
+	   size_t depth)
+{
+  while (count > SORT_INSERTION_MAX)
+    {
+      uint64_t a = keys[0].sk_key;
+      uint64_t b = keys[count / 2].sk_key;
+      uint64_t c = keys[count - 1].sk_key;
+      uint64_t pivot;
+      size_t less = 0;
+      size_t greater = count;
+      size_t i = 0;
+
+      if (a < b)
+	pivot = b < c ? b : a < c ? c : a;
+      else
+	pivot = a < c ? a : b < c ? c : b;
+
+      /* Divide the keys into those below the pivot, from 0 to LESS,
+	 those equal to it, up to GREATER, and those above it.  */
+      while (i < greater)
+	{
+	  if (keys[i].sk_key < pivot)
+	    {
+	      SWAP_KEYS (keys[less], keys[i]);
+	      less++;
+	      i++;
+	    }
+	  else if (keys[i].sk_key > pivot)
+	    {
+	      greater--;
+	      SWAP_KEYS (keys[i], keys[greater]);
+	    }
+	  else
+	    i++;
+	}
+
+      /* Names that end within the pivot's eight bytes are equal.  The
+	 others go on to the next eight.  */
+      if ((pivot & 0xff) && greater - less > 1)
+	{
+	  for (i = less; i < greater; i++)
+	    keys[i].sk_key = name_key (keys[i].sk_item, name_offset,
+				       depth + 8);
+	  sort_keys (keys + less, greater - less, name_offset, depth + 8);
+	}
+
+      /* Recurse on the smaller side, and loop on the larger.  */
+      if (less < count - greater)
+	{
+	  sort_keys (keys, less, name_offset, depth);
+	  keys += greater;
+	  count -= greater;
+	}
+      else
+	{
+	  sort_keys (keys + greater, count - greater, name_offset, depth);
+	  count = less;
+	}
+    }
+  insertion_sort_keys (keys, count, name_offset, depth);
+}
+
+static void
+insertion_sort_keys (struct sort_key *keys, size_t count, size_t name_offset,
+		     size_t depth)
+{
+  size_t i;
+
+  for (i = 1; i < count; i++)
+    {
+      struct sort_key key = keys[i];
+      char const *name = (char const *) key.sk_item + name_offset;
+      size_t j = i;
+
+      while (j > 0)
+	{
+	  struct sort_key const *prev = &keys[j - 1];
+
+	  if (prev->sk_key < key.sk_key)
+	    break;
+	  if (prev->sk_key == key.sk_key
+	      && ((key.sk_key & 0xff) == 0
+		  || strcmp ((char const *) prev->sk_item + name_offset
+			     + depth + 8, name + depth + 8) <= 0))
+	    break;
+	  keys[j] = *prev;
+	  j--;
+	}
+      keys[j] = key;
+    }
+}
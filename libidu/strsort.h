@@ -0,0 +1,25 @@
+/* strsort.h -- decls for sorting items by the strings within them
+   Copyright (C) 2012 Free Software Foundation, Inc.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _strsort_h_
+#define _strsort_h_
+
+#include <stddef.h>
+
+extern void sort_by_name (void **items, size_t count, size_t name_offset);
+
+#endif /* not _strsort_h_ */
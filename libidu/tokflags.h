@@ -28,7 +28,13 @@
 #define TOK_STRING	0x08	/* occurs in a string */
 #define TOK_LITERAL	0x10	/* occurs as a literal */
 #define TOK_COMMENT	0x20	/* occurs in a comment */
-#define TOK_UNUSED_1	0x40
+#define TOK_RUNS	0x40	/* hits are stored as runs of files */
 #define TOK_SHORT_COUNT	0x80	/* count is two bytes */
 
+/* The hits of a token are a tree8 unless one of TOK_VECTOR and TOK_RUNS
+   is set, in which case they are a postings container (see idfile.h).
+   Both together mean a bitmap.  */
+#define TOK_BITMAP	(TOK_VECTOR | TOK_RUNS)
+#define TOK_POSTINGS(flags) ((flags) & TOK_BITMAP)
+
 #endif /* not _tokflags_h_ */
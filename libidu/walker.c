@@ -24,6 +24,7 @@
 #include <string.h>
 #include <fnmatch.h>
 #include <dirent.h>
+#include <fcntl.h>
 #include <errno.h>
 #include <alloca.h>
 #include <xalloc.h>
@@ -37,7 +38,23 @@
 #include "scanners.h"
 #include "iduglobal.h"
 
+/* With openat, fstatat and fdopendir, directories are read through
+   file descriptors rather than by changing the working directory,
+   and, with threads, are read ahead of the walk.  */
+#if HAVE_OPENAT && HAVE_FSTATAT && HAVE_FDOPENDIR && defined O_DIRECTORY
+# define FD_WALK 1
+#else
+# define FD_WALK 0
+#endif
+#if FD_WALK && HAVE_PTHREAD_H && HAVE_PTHREAD_CREATE
+# include <pthread.h>
+# define PARALLEL_WALK 1
+#else
+# define PARALLEL_WALK 0
+#endif
+
 int walker_verbose_flag = 0;
+int walker_jobs = 1;
 off_t largest_member_file = 0;
 
 static char **vectorize_string (char *string, char const *delimiter_class);
@@ -45,13 +62,13 @@ static int walk_dir (struct file_link *dir_link);
 static struct member_file *get_member_file (struct file_link *flink);
 static struct lang_args *get_lang_args (struct file_link const *flink);
 static void print_member_file (struct member_file *member);
-static int walk_sub_dirs (struct dynvec *sub_dirs_vec);
+static void walk_classified_link (struct file_link *flink,
+				  unsigned int new_flags, struct stat *stp,
+				  struct dynvec *sub_dirs_vec);
 static void reparent_children (struct file_link *dlink, struct file_link *slink);
 static int classify_link (struct file_link *flink, struct stat *stp);
-static struct file_link *get_link_from_dirent (struct dirent *dirent,
-					       struct file_link *parent);
-static struct file_link *make_link_from_dirent (struct dirent *dirent,
-						struct file_link *parent);
+static unsigned int classify_stat (struct stat const *stp,
+				   unsigned int flags) _GL_ATTRIBUTE_PURE;
 static struct file_link *get_link_from_string (char const *name,
 					       struct file_link *parent);
 static struct file_link *make_link_from_string (char const *name,
@@ -69,14 +86,11 @@ static struct file_link const
 			struct file_link const *flink);
 static char *fill_dot_dots (char *buf, int levels);
 static char *absolute_file_name_1 (char *buffer, struct file_link const *flink);
-static unsigned long member_file_hash_1 (void const *key);
-static unsigned long member_file_hash_2 (void const *key);
+static unsigned long member_file_hash (void const *key);
 static int member_file_hash_compare (void const *x, void const *y);
-static unsigned long file_link_hash_1 (void const *key);
-static unsigned long file_link_hash_2 (void const *key);
+static unsigned long file_link_hash (void const *key);
 static int file_link_hash_compare (void const *x, void const *y);
-static unsigned long dev_ino_hash_1 (void const *key);
-static unsigned long dev_ino_hash_2 (void const *key);
+static unsigned long dev_ino_hash (void const *key);
 static int dev_ino_hash_compare (void const *x, void const *y);
 static int symlink_ancestry (struct file_link *flink);
 
@@ -105,6 +119,413 @@ char* xgetcwd (void);
 /* Walk the file-system tree rooted at `dir_link', looking for files
    that are eligible for scanning.  */
 
+#if FD_WALK
+
+/* Directories are read through descriptors: each is opened with
+   openat relative to its parent, and its entries are classified with
+   fstatat, so the walk never changes the working directory.  When
+   walker_jobs > 1, threads read the directories that the walk has
+   queued but not yet reached.  The walk itself, which builds the
+   file_link and member_file tables, stays in the calling thread and
+   takes the directories in the same order as a serial walk, so the
+   tables come out the same.  */
+
+/* One entry of a directory, with the result of classifying it.  */
+
+struct dir_entry
+{
+  struct dir_entry *de_next;
+  struct stat de_stat;
+  unsigned int de_flags;	/* as returned by classify_link */
+  int de_errno;			/* nonzero if fstatat failed */
+  int de_stat_failed;		/* the failure was in following a symlink */
+  char de_name[1];
+};
+
+enum dir_scan_state
+{
+  DS_QUEUED,			/* waiting for a thread */
+  DS_READING,
+  DS_READ
+};
+
+/* A directory to be read ahead of the walk.  */
+
+struct dir_scan
+{
+  struct dir_scan *ds_next;	/* in walk_queue */
+  struct dir_scan *ds_parent;	/* ds_name is relative to this one, until opened */
+  char const *ds_name;
+  DIR *ds_dirp;			/* open from reading until ds_refs drops to 0 */
+  int ds_errno;			/* why ds_dirp is 0 */
+  enum dir_scan_state ds_state;
+  int ds_refs;			/* the walk, plus subdirectories not yet opened */
+  struct dir_entry *ds_entries;
+  struct dir_entry **ds_entries_tail;
+  struct obstack ds_obstack;
+};
+
+/* Threads read at most this many directories per job ahead of the
+   walk; each of them holds a descriptor until the walk reaches it.  */
+#define WALK_AHEAD_PER_JOB 32
+
+/* Directories queued to be read, in the order the walk will reach
+   them, and the count of those read or being read but not yet
+   walked.  All of the following, as well as ds_state and ds_refs, are
+   guarded by walk_lock.  */
+static struct dir_scan *walk_queue;
+static unsigned long walk_ahead;
+static unsigned long walk_ahead_limit;
+static int walk_done;
+static unsigned long walk_thread_count;
+
+#if PARALLEL_WALK
+static pthread_mutex_t walk_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t walk_queued = PTHREAD_COND_INITIALIZER;	/* or the walk moved on */
+static pthread_cond_t walk_read = PTHREAD_COND_INITIALIZER;	/* some dir_scan was read */
+static pthread_t *walk_threads;
+# define LOCK_WALK() pthread_mutex_lock (&walk_lock)
+# define UNLOCK_WALK() pthread_mutex_unlock (&walk_lock)
+#else
+# define LOCK_WALK()
+# define UNLOCK_WALK()
+#endif
+
+static struct dir_scan *make_dir_scan (struct dir_scan *parent, char const *name);
+static void read_dir_scan (struct dir_scan *ds);
+static void release_dir_scan (struct dir_scan *ds);
+static void wait_dir_scan (struct dir_scan *ds);
+static void finish_dir_scan (struct dir_scan *ds, struct dir_scan **sub_scans,
+			     unsigned long count);
+static int walk_dir_scan (struct file_link *dir_link, struct dir_scan *ds);
+static int walk_sub_dirs (struct dynvec *sub_dirs_vec, struct dir_scan *parent);
+static void start_walk_threads (void);
+static void stop_walk_threads (void);
+#if PARALLEL_WALK
+static void *walk_thread (void *arg);
+#endif
+
+static int
+walk_dir (struct file_link *dir_link)
+{
+  char *dir_name = alloca (PATH_MAX);
+  struct dir_scan *ds;
+  int scannable_files;
+
+  absolute_file_name (dir_name, dir_link);
+  ds = make_dir_scan (0, dir_name);
+  start_walk_threads ();
+  scannable_files = walk_dir_scan (dir_link, ds);
+  stop_walk_threads ();
+  return scannable_files;
+}
+
+/* Walk the entries of `ds', which are those of `dir_link', then its
+   subdirectories.  */
+
+static int
+walk_dir_scan (struct file_link *dir_link, struct dir_scan *ds)
+{
+  int scannable_files;
+  struct dynvec *sub_dirs_vec;
+  struct dir_entry *dent;
+
+  wait_dir_scan (ds);
+  if (ds->ds_dirp == 0)
+    {
+      char *file_name = alloca (PATH_MAX);
+      absolute_file_name (file_name, dir_link);
+      error (0, ds->ds_errno, _("can't read directory `%s'"), file_name);
+      finish_dir_scan (ds, 0, 0);
+      return 0;
+    }
+  sub_dirs_vec = make_dynvec (32);
+  for (dent = ds->ds_entries; dent; dent = dent->de_next)
+    {
+      struct file_link *flink = get_link_from_string (dent->de_name, dir_link);
+
+      if (flink->fl_flags & FL_PRUNE)
+	continue;
+      if (dent->de_errno)
+	{
+	  char *dir_name = alloca (PATH_MAX);
+	  absolute_file_name (dir_name, dir_link);
+	  error (0, dent->de_errno, (dent->de_stat_failed
+				     ? _("can't stat `%s' from `%s'")
+				     : _("can't lstat `%s' from `%s'")),
+		 flink->fl_name, dir_name);
+	}
+      else if (dent->de_flags)
+	walk_classified_link (flink, dent->de_flags, &dent->de_stat,
+			      sub_dirs_vec);
+    }
+
+  scannable_files = walk_sub_dirs (sub_dirs_vec, ds);
+  dynvec_free (sub_dirs_vec);
+  return scannable_files;
+}
+
+/* Queue the directories found by walk_dir_scan to be read, then walk
+   each of them in turn.  */
+
+static int
+walk_sub_dirs (struct dynvec *sub_dirs_vec, struct dir_scan *parent)
+{
+  struct file_link **sub_dirs;
+  struct dir_scan **sub_scans;
+  unsigned long count = sub_dirs_vec->dv_fill;
+  unsigned long i;
+  int total_scannable_files = 0;
+
+  dynvec_freeze (sub_dirs_vec);
+  sub_dirs = (struct file_link **) sub_dirs_vec->dv_vec;
+  sub_scans = xnmalloc (count, sizeof *sub_scans);
+  for (i = 0; i < count; i++)
+    sub_scans[i] = make_dir_scan (parent, sub_dirs[i]->fl_name);
+  finish_dir_scan (parent, sub_scans, count);
+
+  for (i = 0; i < count; i++)
+    total_scannable_files += walk_dir_scan (sub_dirs[i], sub_scans[i]);
+  free (sub_scans);
+  return total_scannable_files;
+}
+
+static struct dir_scan *
+make_dir_scan (struct dir_scan *parent, char const *name)
+{
+  struct dir_scan *ds = xmalloc (sizeof *ds);
+
+  obstack_init (&ds->ds_obstack);
+  ds->ds_next = 0;
+  ds->ds_parent = parent;
+  ds->ds_name = (parent ? name
+		 : obstack_copy0 (&ds->ds_obstack, name, strlen (name)));
+  ds->ds_dirp = 0;
+  ds->ds_errno = 0;
+  ds->ds_state = DS_QUEUED;
+  ds->ds_refs = 1;
+  ds->ds_entries = 0;
+  ds->ds_entries_tail = &ds->ds_entries;
+  return ds;
+}
+
+/* Open the directory of `ds' and read and classify its entries.
+   This runs without walk_lock, and touches nothing shared but the
+   parent's descriptor.  */
+
+static void
+read_dir_scan (struct dir_scan *ds)
+{
+  struct dirent *dirent;
+  int fd;
+
+  fd = openat (ds->ds_parent ? dirfd (ds->ds_parent->ds_dirp) : AT_FDCWD,
+	       ds->ds_name, O_RDONLY | O_DIRECTORY | O_NOCTTY);
+  if (fd < 0)
+    ds->ds_errno = errno;
+  if (ds->ds_parent)
+    {
+      release_dir_scan (ds->ds_parent);
+      ds->ds_parent = 0;
+    }
+  if (fd < 0)
+    return;
+  ds->ds_dirp = fdopendir (fd);
+  if (ds->ds_dirp == 0)
+    {
+      ds->ds_errno = errno;
+      close (fd);
+      return;
+    }
+
+  while ((dirent = readdir (ds->ds_dirp)) != 0)
+    {
+      struct dir_entry *dent;
+      unsigned int flags = 0;
+
+      if (IS_DOT_or_DOT_DOT (dirent->d_name))
+	continue;
+      dent = obstack_alloc (&ds->ds_obstack,
+			    sizeof (struct dir_entry) + strlen (dirent->d_name));
+      strcpy (dent->de_name, dirent->d_name);
+      dent->de_errno = 0;
+      dent->de_stat_failed = 0;
+      if (fstatat (fd, dent->de_name, &dent->de_stat, AT_SYMLINK_NOFOLLOW) < 0)
+	dent->de_errno = errno;
+      else if (S_ISLNK (dent->de_stat.st_mode))
+	{
+	  if (fstatat (fd, dent->de_name, &dent->de_stat, 0) < 0)
+	    {
+	      dent->de_errno = errno;
+	      dent->de_stat_failed = 1;
+	    }
+	  flags |= FL_SYM_LINK;
+	}
+      dent->de_flags = dent->de_errno ? 0 : classify_stat (&dent->de_stat, flags);
+      dent->de_next = 0;
+      *ds->ds_entries_tail = dent;
+      ds->ds_entries_tail = &dent->de_next;
+    }
+}
+
+/* Drop a reference to `ds', and free it with the last one.  */
+
+static void
+release_dir_scan (struct dir_scan *ds)
+{
+  int refs;
+
+  LOCK_WALK ();
+  refs = --ds->ds_refs;
+  UNLOCK_WALK ();
+  if (refs)
+    return;
+  if (ds->ds_dirp)
+    closedir (ds->ds_dirp);
+  obstack_free (&ds->ds_obstack, 0);
+  free (ds);
+}
+
+/* Return once `ds' has been read, reading it here if no thread has
+   taken it yet.  */
+
+static void
+wait_dir_scan (struct dir_scan *ds)
+{
+  LOCK_WALK ();
+  if (ds->ds_state == DS_QUEUED)
+    {
+      struct dir_scan **link;
+
+      /* It's usually at the head; a top-level directory isn't queued.  */
+      for (link = &walk_queue; *link; link = &(*link)->ds_next)
+	if (*link == ds)
+	  {
+	    *link = ds->ds_next;
+	    break;
+	  }
+      ds->ds_state = DS_READING;
+      walk_ahead++;
+      UNLOCK_WALK ();
+      read_dir_scan (ds);
+      LOCK_WALK ();
+      ds->ds_state = DS_READ;
+    }
+#if PARALLEL_WALK
+  while (ds->ds_state != DS_READ)
+    pthread_cond_wait (&walk_read, &walk_lock);
+#endif
+  UNLOCK_WALK ();
+}
+
+/* The walk is done with the entries of `ds'.  Queue its
+   subdirectories `sub_scans' at the head of walk_queue, since the walk
+   takes them next, and drop the walk's reference to `ds'.  */
+
+static void
+finish_dir_scan (struct dir_scan *ds, struct dir_scan **sub_scans,
+		 unsigned long count)
+{
+  unsigned long i;
+
+  LOCK_WALK ();
+  walk_ahead--;
+  if (count)
+    {
+      for (i = count - 1; i > 0; i--)
+	sub_scans[i - 1]->ds_next = sub_scans[i];
+      sub_scans[count - 1]->ds_next = walk_queue;
+      walk_queue = sub_scans[0];
+      ds->ds_refs += count;
+    }
+#if PARALLEL_WALK
+  pthread_cond_broadcast (&walk_queued);
+#endif
+  UNLOCK_WALK ();
+  release_dir_scan (ds);
+}
+
+static void
+start_walk_threads (void)
+{
+  walk_queue = 0;
+  walk_ahead = 0;
+  walk_done = 0;
+  walk_thread_count = 0;
+#if PARALLEL_WALK
+  if (walker_jobs > 1)
+    {
+      unsigned long i;
+
+      walk_thread_count = walker_jobs;
+      walk_ahead_limit = walk_thread_count * WALK_AHEAD_PER_JOB;
+      walk_threads = xnmalloc (walk_thread_count, sizeof *walk_threads);
+      for (i = 0; i < walk_thread_count; i++)
+	{
+	  int err = pthread_create (&walk_threads[i], 0, walk_thread, 0);
+	  if (err)
+	    error (EXIT_FAILURE, err, _("can't create walking thread"));
+	}
+    }
+#endif
+}
+
+static void
+stop_walk_threads (void)
+{
+#if PARALLEL_WALK
+  unsigned long i;
+
+  if (walk_thread_count == 0)
+    return;
+  LOCK_WALK ();
+  walk_done = 1;
+  pthread_cond_broadcast (&walk_queued);
+  UNLOCK_WALK ();
+  for (i = 0; i < walk_thread_count; i++)
+    pthread_join (walk_threads[i], 0);
+  free (walk_threads);
+  walk_thread_count = 0;
+#endif
+}
+
+#if PARALLEL_WALK
+
+/* Read queued directories, in queue order, while no more than
+   walk_ahead_limit are waiting for the walk.  */
+
+static void *
+walk_thread (void *arg)
+{
+  LOCK_WALK ();
+  for (;;)
+    {
+      struct dir_scan *ds;
+
+      while (!walk_done && (walk_queue == 0 || walk_ahead >= walk_ahead_limit))
+	pthread_cond_wait (&walk_queued, &walk_lock);
+      if (walk_done)
+	break;
+      ds = walk_queue;
+      walk_queue = ds->ds_next;
+      ds->ds_state = DS_READING;
+      walk_ahead++;
+      UNLOCK_WALK ();
+      read_dir_scan (ds);
+      LOCK_WALK ();
+      ds->ds_state = DS_READ;
+      pthread_cond_broadcast (&walk_read);
+    }
+  UNLOCK_WALK ();
+  return 0;
+}
+
+#endif /* PARALLEL_WALK */
+
+#else /* !FD_WALK */
+
+static int walk_sub_dirs (struct dynvec *sub_dirs_vec);
+
 static int
 walk_dir (struct file_link *dir_link)
 {
@@ -134,7 +555,7 @@ walk_dir (struct file_link *dir_link)
       if (IS_DOT_or_DOT_DOT (dirent->d_name))
 	continue;
 
-      flink = get_link_from_dirent (dirent, dir_link);
+      flink = get_link_from_string (dirent->d_name, dir_link);
       if (!(flink->fl_flags & FL_PRUNE))
 	walk_flink (flink, sub_dirs_vec);
     }
@@ -169,16 +590,30 @@ walk_sub_dirs (struct dynvec *sub_dirs_vec)
   return total_scannable_files;
 }
 
+#endif /* !FD_WALK */
+
 void
 walk_flink (struct file_link *flink, struct dynvec *sub_dirs_vec)
 {
   struct stat st;
-  unsigned int old_flags;
   unsigned int new_flags;
 
   new_flags = classify_link (flink, &st);
   if (new_flags == 0)
     return;
+  walk_classified_link (flink, new_flags, &st, sub_dirs_vec);
+}
+
+/* Record `flink', whose type and status classify_link found to be
+   `new_flags' and `*stp': a directory is walked, or added to
+   `sub_dirs_vec' to be walked later; a file becomes a member file if
+   its name matches a language.  */
+
+static void
+walk_classified_link (struct file_link *flink, unsigned int new_flags,
+		      struct stat *stp, struct dynvec *sub_dirs_vec)
+{
+  unsigned int old_flags;
 
   old_flags = flink->fl_flags;
   if ((old_flags & FL_TYPE_MASK)
@@ -197,7 +632,7 @@ walk_flink (struct file_link *flink, struct dynvec *sub_dirs_vec)
 
       struct file_link *alias_link;
 #if HAVE_LINK
-      alias_link = find_alias_link (flink, &st);
+      alias_link = find_alias_link (flink, stp);
 #else
       alias_link = 0;
 #endif /* HAVE_LINK */
@@ -216,14 +651,15 @@ walk_flink (struct file_link *flink, struct dynvec *sub_dirs_vec)
     {
       struct member_file *member;
 #if HAVE_LINK
-      member = maybe_get_member_file (flink, &st);
+      member = maybe_get_member_file (flink, stp);
 #else
       member = get_member_file (flink);
 #endif
       if (member)
 	{
-	  if (st.st_size > largest_member_file)
-	    largest_member_file = st.st_size;
+	  member->mf_size = stp->st_size;
+	  if (stp->st_size > largest_member_file)
+	    largest_member_file = stp->st_size;
 	  if (walker_verbose_flag)
 	    print_member_file (member);
 	}
@@ -400,6 +836,7 @@ get_member_file (struct file_link *flink)
   if (HASH_VACANT (*slot))
     {
       member->mf_index = -1;
+      member->mf_size = -1;
       hash_insert_at (&idh.idh_member_file_table, member, slot);
       flink->fl_flags |= FL_MEMBER;
     }
@@ -434,31 +871,46 @@ find_member_file (struct file_link const *flink)
   return *slot;
 }
 
-/* March down the list of lang_args, and return the first one whose
-   pattern matches FLINK.  Return the matching lang_args, if a
-   scanner exists for that language, otherwise return 0.  */
+/* Return the first lang_args in the map whose pattern matches FLINK:
+   look up its name among the literal patterns, then try those globs
+   that come before the literal match.  Return the matching lang_args,
+   if a scanner exists for that language, otherwise return 0.  */
 
 static struct lang_args *
 get_lang_args (struct file_link const *flink)
 {
-  struct lang_args *args = lang_args_list;
-  char *file_name = alloca (PATH_MAX);
+  struct lang_args *best = find_literal_lang_args (flink->fl_name);
+  struct lang_args *args;
+  char *file_name = 0;
 
-  while (args)
+  for (args = lang_args_globs;
+       args && (best == 0 || args->la_index < best->la_index);
+       args = args->la_next_glob)
     {
       if (strchr (args->la_pattern, SLASH_CHAR))
 	{
-	  absolute_file_name (file_name, flink);
+	  if (file_name == 0)
+	    {
+	      file_name = alloca (PATH_MAX);
+	      absolute_file_name (file_name, flink);
+	    }
 	  if (fnmatch (args->la_pattern, file_name, MAYBE_FNM_CASEFOLD | FNM_FILE_NAME) == 0)
-	    return (args->la_language ? args : 0);
+	    {
+	      best = args;
+	      break;
+	    }
 	}
       else
 	{
 	  if (fnmatch (args->la_pattern, flink->fl_name, MAYBE_FNM_CASEFOLD) == 0)
-	    return (args->la_language ? args : 0);
+	    {
+	      best = args;
+	      break;
+	    }
 	}
-      args = args->la_next;
     }
+  if (best)
+    return (best->la_language ? best : 0);
   return ((lang_args_default && lang_args_default->la_language)
 	  ? lang_args_default : 0);
 }
@@ -747,6 +1199,15 @@ classify_link (struct file_link *flink, struct stat *stp)
       flags |= FL_SYM_LINK;
     }
 #endif
+  return classify_stat (stp, flags);
+}
+
+/* Add the type of the file with status `*stp' to `flags', or return 0
+   if it is neither a directory nor a nonempty regular file.  */
+
+static unsigned int
+classify_stat (struct stat const *stp, unsigned int flags)
+{
   if (S_ISDIR (stp->st_mode))
     flags |= FL_TYPE_DIR;
   else if (stp->st_size == 0)
@@ -762,22 +1223,6 @@ classify_link (struct file_link *flink, struct stat *stp)
 /****************************************************************************/
 /* Retrieve an existing flink; or if none exists, create one. */
 
-static struct file_link *
-get_link_from_dirent (struct dirent *dirent, struct file_link *parent)
-{
-  struct file_link **slot;
-  struct file_link *new_link;
-
-  new_link = make_link_from_dirent (dirent, parent);
-  slot = (struct file_link **) hash_find_slot (&idh.idh_file_link_table, new_link);
-  if (HASH_VACANT (*slot))
-    slot = (struct file_link **) hash_insert_at (&idh.idh_file_link_table,
-						 new_link, slot);
-  else
-    obstack_free (&idh.idh_file_link_obstack, new_link);
-  return *slot;
-}
-
 static struct file_link *
 get_link_from_string (char const *name, struct file_link *parent)
 {
@@ -794,20 +1239,6 @@ get_link_from_string (char const *name, struct file_link *parent)
   return *slot;
 }
 
-struct file_link *
-make_link_from_dirent (struct dirent* dirent, struct file_link *parent)
-{
-  struct file_link *flink;
-
-  flink = (struct file_link *) obstack_alloc (&idh.idh_file_link_obstack,
-					      sizeof (struct file_link) + strlen (dirent->d_name));
-  strcpy (flink->fl_name, dirent->d_name);
-  flink->fl_parent = parent ? parent : flink;
-  flink->fl_flags = 0;
-
-  return flink;
-}
-
 static struct file_link *
 make_link_from_string (char const* name, struct file_link *parent)
 {
@@ -997,16 +1428,10 @@ absolute_file_name_1 (char *buf, struct file_link const *flink)
 /****************************************************************************/
 /* Hash stuff for `struct member_file'.  */
 
-static unsigned long
-member_file_hash_1 (void const *key)
-{
-  return_ADDRESS_HASH_1 (((struct member_file const *) key)->mf_link);
-}
-
-static unsigned long
-member_file_hash_2 (void const *key)
+static unsigned long _GL_ATTRIBUTE_PURE
+member_file_hash (void const *key)
 {
-  return_ADDRESS_HASH_2 (((struct member_file const *) key)->mf_link);
+  return_ADDRESS_HASH (((struct member_file const *) key)->mf_link);
 }
 
 static int
@@ -1052,25 +1477,13 @@ member_file_qsort_compare (void const *x, void const *y)
 /* Hash stuff for `struct file_link'.  */
 
 static unsigned long _GL_ATTRIBUTE_PURE
-file_link_hash_1 (void const *key)
-{
-  unsigned long result = 0;
-  struct file_link const *parent = (IS_ROOT_FILE_LINK (((struct file_link const *) key))
-				    ? 0 : ((struct file_link const *) key)->fl_parent);
-  STRING_HASH_1 (((struct file_link const *) key)->fl_name, result);
-  ADDRESS_HASH_1 (parent, result);
-  return result;
-}
-
-static unsigned long _GL_ATTRIBUTE_PURE
-file_link_hash_2 (void const *key)
+file_link_hash (void const *key)
 {
-  unsigned long result = 0;
-  struct file_link const *parent = (IS_ROOT_FILE_LINK (((struct file_link const *) key))
-				    ? 0 : ((struct file_link const *) key)->fl_parent);
-  STRING_HASH_2 (((struct file_link const *) key)->fl_name, result);
-  ADDRESS_HASH_2 (parent, result);
-  return result;
+  struct file_link const *flink = (struct file_link const *) key;
+  struct file_link const *parent = (IS_ROOT_FILE_LINK (flink)
+				    ? 0 : flink->fl_parent);
+  return hash_bytes (flink->fl_name, strlen (flink->fl_name),
+		     (uintptr_t) parent);
 }
 
 static int _GL_ATTRIBUTE_PURE
@@ -1108,22 +1521,11 @@ links_depth (struct file_link const *flink)
 /****************************************************************************/
 /* Hash stuff for `struct dev_ino'.  */
 
-static unsigned long
-dev_ino_hash_1 (void const *key)
-{
-  unsigned long result = 0;
-  INTEGER_HASH_1 (((struct dev_ino const *) key)->di_dev, result);
-  INTEGER_HASH_1 (((struct dev_ino const *) key)->di_ino, result);
-  return result;
-}
-
-static unsigned long
-dev_ino_hash_2 (void const *key)
+static unsigned long _GL_ATTRIBUTE_PURE
+dev_ino_hash (void const *key)
 {
-  unsigned long result = 0;
-  INTEGER_HASH_2 (((struct dev_ino const *) key)->di_dev, result);
-  INTEGER_HASH_2 (((struct dev_ino const *) key)->di_ino, result);
-  return result;
+  struct dev_ino const *dev_ino = (struct dev_ino const *) key;
+  return hash_integer (hash_integer (dev_ino->di_dev) ^ dev_ino->di_ino);
 }
 
 static int
@@ -1164,12 +1566,38 @@ init_idh_obstacks (struct idhead *idhp)
 void
 init_idh_tables (struct idhead *idhp)
 {
-  hash_init (&idhp->idh_member_file_table, 16*1024,
-	     member_file_hash_1, member_file_hash_2, member_file_hash_compare);
-  hash_init (&idhp->idh_file_link_table, 16*1024,
-	     file_link_hash_1, file_link_hash_2, file_link_hash_compare);
+  hash_init_tagged (&idhp->idh_member_file_table, 16*1024,
+		    member_file_hash, member_file_hash_compare);
+  hash_init_tagged (&idhp->idh_file_link_table, 16*1024,
+		    file_link_hash, file_link_hash_compare);
+#if HAVE_LINK
+  hash_init_tagged (&idhp->idh_dev_ino_table, 16*1024,
+		    dev_ino_hash, dev_ino_hash_compare);
+#endif
+}
+
+/* Free what init_idh_obstacks and init_idh_tables set up, and what
+   has been allocated from them, so that another ID file can be
+   read.  */
+
+void
+free_idh_obstacks (struct idhead *idhp)
+{
+  obstack_free (&idhp->idh_member_file_obstack, 0);
+  obstack_free (&idhp->idh_file_link_obstack, 0);
+#if HAVE_LINK
+  obstack_free (&idhp->idh_dev_ino_obstack, 0);
+#endif
+  /* It was allocated from idh_file_link_obstack.  */
+  current_dir_link = 0;
+}
+
+void
+free_idh_tables (struct idhead *idhp)
+{
+  hash_free (&idhp->idh_member_file_table, 0);
+  hash_free (&idhp->idh_file_link_table, 0);
 #if HAVE_LINK
-  hash_init (&idhp->idh_dev_ino_table, 16*1024,
-	     dev_ino_hash_1, dev_ino_hash_2, dev_ino_hash_compare);
+  hash_free (&idhp->idh_dev_ino_table, 0);
 #endif
 }
@@ -0,0 +1,4 @@
+[NAME]
+idmerge \- merge ID databases built by separate runs of mkid
+[DESCRIPTION]
+.\" Add any additional description here
@@ -0,0 +1,4 @@
+[NAME]
+idserver \- Answer queries on an ID database over a local socket.
+[DESCRIPTION]
+.\" Add any additional description here
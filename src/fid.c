@@ -35,7 +35,7 @@
 #include "progname.h"
 
 static int get_file_index (char *file_name);
-static int is_hit (unsigned char const *hits, int file_number);
+static int is_hit (char const *tok, int file_number);
 static int is_hit_1 (unsigned char const **hits, int level, int file_number);
 static void skip_hits (unsigned char const **hits, int level);
 void usage (void) __attribute__((__noreturn__));
@@ -56,7 +56,6 @@ static int show_version;
 static struct file_link *cw_dlink;
 static struct file_link **members_0;
 static unsigned int bits_vec_size;
-static char *hits_buf;
 
 static struct option const long_options[] =
 {
@@ -168,6 +167,7 @@ main (int argc, char **argv)
   /* Determine absolute name of the directory name to which database
      constituent files are relative. */
   members_0 = read_id_file (idh.idh_file_name, &idh);
+  map_id_file (&idh);
   bits_vec_size = (idh.idh_files + 7) / 4; /* more than enough */
   tree8_levels = tree8_count_levels (idh.idh_files);
 
@@ -178,22 +178,17 @@ main (int argc, char **argv)
   if (index_1 < 0)
     return 1;
 
-  hits_buf = xmalloc (idh.idh_buf_size);
-  fseek (idh.idh_FILE, idh.idh_tokens_offset, SEEK_SET);
   {
     int count = 0;
     int i;
     int separator = (isatty (STDOUT_FILENO) ? ' ' : '\n');
+    char const *tok = ID_TOKENS_BEGIN (&idh);
 
-    for (i = 0; i < idh.idh_tokens; i++)
+    for (i = 0; i < idh.idh_tokens; i++, tok = skip_token (tok))
       {
-	unsigned char const *hits;
-
-	gets_past_00 (hits_buf, idh.idh_FILE);
-	hits = token_hits_addr (hits_buf);
-	if (is_hit (hits, index_1) && (index_2 < 0 || is_hit (hits, index_2)))
+	if (is_hit (tok, index_1) && (index_2 < 0 || is_hit (tok, index_2)))
 	  {
-	    fputs (token_string (hits_buf), stdout);
+	    fputs (token_string (tok), stdout);
 	    putchar (separator);
 	    count++;
 	  }
@@ -252,9 +247,18 @@ get_file_index (char *file_name)
 }
 
 static int
-is_hit (unsigned char const *hits, int file_number)
+is_hit (char const *tok, int file_number)
 {
-  return is_hit_1 (&hits, tree8_levels, file_number);
+  unsigned char const *hits = token_hits_addr (tok);
+  struct hits_postings hp;
+  unsigned long file;
+
+  if (!init_hits_postings (&hp, tok))
+    return is_hit_1 (&hits, tree8_levels, file_number);
+  while (next_hit_file (&hp, &file))
+    if (file >= file_number)
+      return file == (unsigned long) file_number;
+  return 0;
 }
 
 static int
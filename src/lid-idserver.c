@@ -0,0 +1,2 @@
+#include "lid.h"
+enum lid_mode lid_mode = LID_MODE_SERVER;
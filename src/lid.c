@@ -29,6 +29,7 @@
 #include <getopt.h>
 #include <limits.h>
 #include <string.h>
+#include <stdint.h>
 #include <dirname.h>
 #include <unistd.h>
 #include <termios.h>
@@ -37,6 +38,16 @@
 #include <xalloc.h>
 #include <pathmax.h>
 #include <error.h>
+#include <sys/stat.h>
+#if HAVE_SYS_SOCKET_H && HAVE_SYS_UN_H && HAVE_POLL_H && HAVE_FORK
+# include <sys/socket.h>
+# include <sys/un.h>
+# include <poll.h>
+# include <fcntl.h>
+# define ID_SERVER 1
+#else
+# define ID_SERVER 0
+#endif
 
 #include "closeout.h"
 #include "xnls.h"
@@ -52,6 +63,31 @@
 typedef void (*report_func_t) (char const *name, struct file_link **flinkv);
 typedef int (*query_func_t) (char const *arg, report_func_t);
 
+/* The ordinals of the tokens that might match a query, as found from
+   the trigram postings of the ID file.  */
+
+struct candidates
+{
+  unsigned long *c_ordinals;	/* null if any token might match */
+  unsigned long *c_next;
+  unsigned long *c_end;
+};
+
+/* A pattern read with --patterns-from, and the tokens found for it
+   when it is answered together with the others.  */
+
+struct batch_query
+{
+  char *bq_pattern;
+  query_func_t bq_func;
+  char const *bq_regexp;	/* with word delimiters; 0 unless a regexp */
+  regex_t bq_compiled;
+  int bq_batched;		/* nonzero if answered by a batch pass */
+  char const **bq_tokens;
+  size_t bq_count;
+  size_t bq_alloc;
+};
+
 enum delimiter_style
 {
   ds_bogus,
@@ -94,6 +130,17 @@ enum radix
 };
 
 void usage (void) __attribute__((__noreturn__));
+static void parse_options (int argc, char **argv);
+static void load_id_file (void);
+static void run_queries (int argc, char **argv);
+static char **read_patterns (char const *file_name, size_t *count);
+static void run_batch_queries (char const *file_name);
+static void batch_literal_words (struct batch_query **words, size_t count);
+static void batch_scan (struct batch_query **scans, size_t count);
+static void add_batch_token (struct batch_query *query, char const *tok);
+static void report_batch_query (struct batch_query *query,
+				report_func_t report_func);
+static int batch_query_qsort_cmp (void const *x, void const *y);
 static void lower_caseify (char *str);
 static enum key_style parse_key_style (char const *arg);
 static enum result_style parse_result_style (char const *arg);
@@ -101,6 +148,12 @@ static query_func_t get_query_func (char *pattern);
 static report_func_t get_report_func (void);
 static void report_filenames (char const *name, struct file_link **flinkv);
 static void report_grep (char const *name, struct file_link **flinkv);
+static int grep_positions (char const *name, regex_t *compiled,
+			   char const *file_name, FILE *source_FILE,
+			   struct position_postings *pp, char *line,
+			   size_t line_size, unsigned long *printed);
+static int grep_line_matches (char const *name, regex_t *compiled,
+			      char const *line);
 static void report_edit (char const *name, struct file_link **flinkv);
 static void report_nothing (char const *name, struct file_link **flinkv);
 static int vector_cardinality (void *vector);
@@ -113,11 +166,16 @@ static int query_number (char const *pattern, report_func_t report_func);
 static int query_ambiguous_prefix (unsigned int, report_func_t report_func);
 static int query_literal_substring (char const *pattern,
 				    report_func_t report_func);
+static void compile_regexp (regex_t *compiled, char const *pattern);
+static int regexp_matches (regex_t *compiled, char const *tok);
+static int substring_matches (char const *arg, size_t arg_length,
+			      char const *tok);
 static void parse_frequency_arg (char const *arg);
 static int desired_frequency (char const *tok);
 static char const *file_regexp (char const *name_0, char const *left_delimit,
 				char const *right_delimit);
-static off_t query_binary_search (char const *token);
+static char const *query_binary_search (char const *token);
+static char const *query_binary_search_bytes (char const *token);
 static int is_regexp (char *name);
 static int has_left_delimiter (char const *pattern);
 static int has_right_delimiter (char const *pattern);
@@ -128,13 +186,38 @@ static int stoi (char const *str);
 static int otoi (char const *str);
 static int dtoi (char const *str);
 static int xtoi (char const *str);
-static unsigned char *tree8_to_bits (unsigned char *bits_vec,
-				     unsigned char const *hits_tree8);
-static void tree8_to_bits_1 (unsigned char **bits_vec,
-			     unsigned char const **hits_tree8, int level);
-static struct file_link **tree8_to_flinkv (unsigned char const *hits_tree8);
+static void tree8_to_bits (unsigned char *bits_vec,
+			   unsigned char const *hits_tree8);
 static struct file_link **bits_to_flinkv (unsigned char const *bits_vec);
-
+static struct file_link **get_flinkv (void);
+static struct file_link **hits_to_flinkv (char const *tok);
+static void hits_to_bits (unsigned char *bits_vec, char const *tok);
+static void find_candidates (char const *pattern, int regexp,
+			     struct candidates *cand);
+static char const *next_candidate (char const *tok, struct candidates *cand);
+static size_t pattern_trigrams (char const *pattern, int regexp,
+				unsigned long *keys);
+static size_t run_trigrams (char const *run, size_t length,
+			    unsigned long *keys, size_t count);
+static char const *skip_bracket (char const *p) _GL_ATTRIBUTE_PURE;
+static char const *skip_group (char const *p) _GL_ATTRIBUTE_PURE;
+static int postings_qsort_cmp (void const *x, void const *y);
+
+#if ID_SERVER
+struct client;
+static void serve (char const *socket_name) __attribute__((__noreturn__));
+static void unload_id_file (void);
+static int id_file_changed (void);
+static int serve_client (struct client *client, struct pollfd const *fds);
+static int read_requests (struct client *client);
+static void next_request (struct client *client);
+static void serve_request (struct client *client, char *request);
+static void read_query_output (struct client *client);
+static void add_reply (struct client *client, char const *buf, size_t size);
+static int send_reply (struct client *client);
+static void drop_client (struct client *client);
+static int split_request (char *request, char **argv);
+#endif
 static void savetty (void);
 static void restoretty (void);
 static void chartty (void);
@@ -147,9 +230,10 @@ static void chartty (void);
 static int tree8_levels;
 static unsigned int bits_vec_size;
 struct idhead idh;
-static char *hits_buf_1;
-static char *hits_buf_2;
 static unsigned char *bits_vec;
+static unsigned long *file_numbers;	/* of one token's hits */
+static struct file_link **flinkv_0;	/* for get_flinkv */
+#define RESERVED_FLINKV_SLOTS 3
 
 /* If nonzero, display usage information and exit.  */
 
@@ -208,6 +292,23 @@ static unsigned int frequency_high = USHRT_MAX;
 static struct file_link *cw_dlink;
 static struct file_link **members_0;
 
+/* The status of the ID file when it was read, so that idserver can
+   tell when it changes.  */
+
+static struct stat id_file_stat;
+
+/* If non-null, read the patterns from this file rather than from the
+   command line, and answer them together.  */
+
+static char const *patterns_from;
+
+/* For long options that have no equivalent short option, use a
+   non-character as a pseudo short option, starting with CHAR_MAX + 1.  */
+enum
+{
+  PATTERNS_FROM_OPTION = CHAR_MAX + 1
+};
+
 static struct option const long_options[] =
 {
   { "file", required_argument, 0, 'f' },
@@ -224,6 +325,7 @@ static struct option const long_options[] =
   { "hex", no_argument, 0, 'x' },
   { "decimal", no_argument, 0, 'd' },
   { "octal", no_argument, 0, 'o' },
+  { "patterns-from", required_argument, 0, PATTERNS_FROM_OPTION },
   { "help", no_argument, &show_help, 1 },
   { "version", no_argument, &show_version, 1 },
   {NULL, 0, NULL, 0}
@@ -240,7 +342,18 @@ usage (void)
 static void __attribute__((__noreturn__))
 help_me (void)
 {
-  printf (_("\
+  if (lid_mode == LID_MODE_SERVER)
+    printf (_("\
+Usage: %s [OPTION]... SOCKET\n\
+Load the ID database once, and answer queries on the Unix-domain SOCKET.\n\
+Each query is a line of the arguments that lid would accept, separated by\n\
+blanks, and the OPTIONs given here are their defaults.  The reply is the\n\
+output of lid, with a `.' added to lines that begin with one, followed by\n\
+a line that is `.ok' or `.error'.\n\
+\n\
+"), program_name);
+  else
+    printf (_("\
 Usage: %s [OPTION]... PATTERN...\n\
 "), program_name);
 
@@ -271,6 +384,8 @@ matched identifier followed by the list of file names in which it occurs.\n\
                         is a range expressed as `N..M'.  If N is omitted, it\n\
                         defaults to 1, if M is omitted it defaults to MAX_USHRT\n\
   -a, --ambiguous=LEN   find tokens whose names are ambiguous for LEN chars\n\
+      --patterns-from=FILE  read the patterns from FILE, one per line or\n\
+                        terminated by NUL; if FILE is `-', read standard input\n\
 \n\
   -x, --hex             only find numbers expressed as hexadecimal\n\
   -d, --decimal         only find numbers expressed as decimal\n\
@@ -319,12 +434,55 @@ main (int argc, char **argv)
       break;
 
     case LID_MODE_LID:
+    case LID_MODE_SERVER:
       break;
 
     default:
       abort ();
     }
 
+  parse_options (argc, argv);
+
+  if (show_version)
+    {
+      printf ("%s - %s\n", program_name, PACKAGE_VERSION);
+      exit (EXIT_SUCCESS);
+    }
+
+  if (show_help)
+    help_me ();
+
+  argc -= optind;
+  argv += optind;
+  if (lid_mode == LID_MODE_SERVER && argc != 1)
+    {
+      error (0, 0, argc ? _("too many arguments") : _("missing socket name"));
+      usage ();
+    }
+
+  /* Look for the ID database up the tree */
+  idh.idh_file_name = locate_id_file_name (idh.idh_file_name);
+  if (idh.idh_file_name == 0)
+    error (EXIT_FAILURE, errno, _("can't locate `ID'"));
+
+  load_id_file ();
+#if ID_SERVER
+  if (lid_mode == LID_MODE_SERVER)
+    serve (argv[0]);
+#else
+  if (lid_mode == LID_MODE_SERVER)
+    error (EXIT_FAILURE, 0, _("this system doesn't support idserver"));
+#endif
+  run_queries (argc, argv);
+
+  unmap_id_file (&idh);
+  fclose (idh.idh_FILE);
+  exit (EXIT_SUCCESS);
+}
+
+static void
+parse_options (int argc, char **argv)
+{
   for (;;)
     {
       int optc = getopt_long (argc, argv, "f:F:a:k:R:S:ilrwsxdo",
@@ -397,20 +555,47 @@ main (int argc, char **argv)
 	  radix_flag |= radix_oct;
 	  break;
 
+	case PATTERNS_FROM_OPTION:
+	  patterns_from = optarg;
+	  break;
+
 	default:
 	  usage ();
 	}
     }
+}
 
-  if (show_version)
-    {
-      printf ("%s - %s\n", program_name, PACKAGE_VERSION);
-      exit (EXIT_SUCCESS);
-    }
+/* Read and map the ID file, and set up the tables that go with it.  */
 
-  if (show_help)
-    help_me ();
+static void
+load_id_file (void)
+{
+  init_idh_obstacks (&idh);
+  init_idh_tables (&idh);
 
+  cw_dlink = get_current_dir_link ();
+
+  /* Determine absolute name of the directory name to which database
+     constituent files are relative. */
+  members_0 = read_id_file (idh.idh_file_name, &idh);
+  if (fstat (fileno (idh.idh_FILE), &id_file_stat) < 0)
+    error (EXIT_FAILURE, errno, _("can't stat `%s'"), idh.idh_file_name);
+  map_id_file (&idh);
+  bits_vec_size = (idh.idh_files + 7) / 4; /* more than enough */
+  tree8_levels = tree8_count_levels (idh.idh_files);
+
+  bits_vec = xmalloc (bits_vec_size);
+  file_numbers = xnmalloc (idh.idh_files + 1, sizeof *file_numbers);
+  flinkv_0 = xnmalloc (idh.idh_files + RESERVED_FLINKV_SLOTS + 2,
+		       sizeof *flinkv_0);
+}
+
+/* Answer the queries for the ARGC patterns in ARGV, or for all tokens
+   if there are none.  */
+
+static void
+run_queries (int argc, char **argv)
+{
   if (radix_flag == 0)
     radix_flag = radix_all;
   if (separator_style == ss_contextual)
@@ -423,8 +608,13 @@ main (int argc, char **argv)
 	separator_style = ss_space;
     }
 
-  argc -= optind;
-  argv += optind;
+  if (patterns_from && argc)
+    {
+      error (0, 0, _("extra operand `%s'"), argv[0]);
+      fprintf (stderr, "%s\n",
+	       _("patterns cannot be combined with --patterns-from"));
+      usage ();
+    }
   if (argc == 0)
     {
       static char dot[] = ".";
@@ -433,26 +623,6 @@ main (int argc, char **argv)
       argv = &dotp;
     }
 
-  /* Look for the ID database up the tree */
-  idh.idh_file_name = locate_id_file_name (idh.idh_file_name);
-  if (idh.idh_file_name == 0)
-    error (EXIT_FAILURE, errno, _("can't locate `ID'"));
-
-  init_idh_obstacks (&idh);
-  init_idh_tables (&idh);
-
-  cw_dlink = get_current_dir_link ();
-
-  /* Determine absolute name of the directory name to which database
-     constituent files are relative. */
-  members_0 = read_id_file (idh.idh_file_name, &idh);
-  bits_vec_size = (idh.idh_files + 7) / 4; /* more than enough */
-  tree8_levels = tree8_count_levels (idh.idh_files);
-
-  hits_buf_1 = xmalloc (idh.idh_buf_size);
-  hits_buf_2 = xmalloc (idh.idh_buf_size);
-  bits_vec = xmalloc (bits_vec_size);
-
   report_function = get_report_func ();
   if (ambiguous_prefix_length)
     {
@@ -460,6 +630,8 @@ main (int argc, char **argv)
 	fprintf (stderr, _("All identifiers are non-ambiguous within the first %d characters\n"),
 		 ambiguous_prefix_length);
     }
+  else if (patterns_from)
+    run_batch_queries (patterns_from);
   else
     {
       while (argc)
@@ -471,9 +643,291 @@ main (int argc, char **argv)
 	  (*query_function) (pattern, report_function);
 	}
     }
+}
 
-  fclose (idh.idh_FILE);
-  exit (EXIT_SUCCESS);
+/* Read the patterns in FILE_NAME, or standard input if it is `-', and
+   return them, storing their number in *COUNT.  Patterns are
+   terminated by NUL if there is one in the file, and by newline
+   otherwise.  Empty patterns are ignored.  */
+
+static char **
+read_patterns (char const *file_name, size_t *count)
+{
+  FILE *stream = stdin;
+  size_t size = 0;
+  size_t alloc = BUFSIZ;
+  char *buf = xmalloc (alloc);
+  char const *end;
+  char **patterns;
+  char *p;
+  int separator;
+  size_t n;
+
+  if (!strequ (file_name, "-"))
+    {
+      stream = fopen (file_name, "r");
+      if (stream == 0)
+	error (EXIT_FAILURE, errno, _("cannot open `%s' for reading"),
+	       file_name);
+    }
+  while ((n = fread (buf + size, 1, alloc - size - 1, stream)) > 0)
+    {
+      size += n;
+      if (size + 1 == alloc)
+	buf = x2nrealloc (buf, &alloc, 1);
+    }
+  if (ferror (stream))
+    error (EXIT_FAILURE, errno, _("can't read `%s'"), file_name);
+  if (stream != stdin)
+    fclose (stream);
+  buf[size] = '\0';
+  end = buf + size;
+
+  separator = (memchr (buf, '\0', size) ? '\0' : '\n');
+  n = 0;
+  for (p = buf; p < end; p++)
+    if (*p == separator)
+      n++;
+  patterns = xmalloc ((n + 1) * sizeof *patterns);
+
+  *count = 0;
+  for (p = buf; p < end; p++)
+    {
+      char *pattern = p;
+      while (p < end && *p != separator)
+	p++;
+      *p = '\0';
+      if (*pattern)
+	patterns[(*count)++] = pattern;
+    }
+  return patterns;
+}
+
+/* Answer the queries for the patterns read from FILE_NAME, reporting
+   them in the order read.  Rather than looking up each pattern in
+   turn, look up all the literal words in one merged pass over the
+   sorted tokens, and match all the regular expressions and substrings
+   in one scan, so that the cost of a batch grows with the size of the
+   ID file only once.  */
+
+static void
+run_batch_queries (char const *file_name)
+{
+  size_t count;
+  char **patterns = read_patterns (file_name, &count);
+  struct batch_query *queries = xcalloc (count ? count : 1, sizeof *queries);
+  struct batch_query **words = xmalloc ((count + 1) * sizeof *words);
+  struct batch_query **scans = xmalloc ((count + 1) * sizeof *scans);
+  size_t word_count = 0;
+  size_t scan_count = 0;
+  size_t i;
+
+  for (i = 0; i < count; i++)
+    {
+      struct batch_query *query = &queries[i];
+      char *pattern = patterns[i];
+      struct candidates cand;
+
+      if (ignore_case_flag)
+	lower_caseify (pattern);
+      query->bq_pattern = pattern;
+      query->bq_func = get_query_func (pattern);
+      if (query->bq_func == query_literal_word)
+	{
+	  if (!ignore_case_flag)
+	    {
+	      query->bq_batched = 1;
+	      words[word_count++] = query;
+	      continue;
+	    }
+	  query->bq_func = query_literal_substring;
+	}
+
+      if (query->bq_func == query_regexp)
+	{
+	  query->bq_regexp = pattern;
+	  if (delimiter_style == ds_word)
+	    query->bq_regexp = add_regexp_word_delimiters (pattern);
+	  find_candidates (query->bq_regexp, 1, &cand);
+	}
+      else if (query->bq_func == query_literal_substring)
+	find_candidates (pattern, 0, &cand);
+      else
+	continue;
+
+      /* The few tokens that the trigram postings leave are quicker to
+	 check on their own than every token is in the shared scan.  */
+      if (cand.c_ordinals)
+	{
+	  free (cand.c_ordinals);
+	  continue;
+	}
+      if (query->bq_regexp)
+	compile_regexp (&query->bq_compiled, query->bq_regexp);
+      query->bq_batched = 1;
+      scans[scan_count++] = query;
+    }
+
+  if (word_count)
+    batch_literal_words (words, word_count);
+  if (scan_count)
+    batch_scan (scans, scan_count);
+
+  for (i = 0; i < count; i++)
+    {
+      struct batch_query *query = &queries[i];
+      if (query->bq_batched)
+	report_batch_query (query, report_function);
+      else
+	{
+	  query_function = query->bq_func;
+	  (*query_function) (query->bq_pattern, report_function);
+	}
+      if (query->bq_batched && query->bq_regexp)
+	regfree (&query->bq_compiled);
+      if (query->bq_regexp && query->bq_regexp != query->bq_pattern)
+	free ((char *) query->bq_regexp);
+      free (query->bq_tokens);
+    }
+
+  free (scans);
+  free (words);
+  free (queries);
+  free (patterns);
+}
+
+/* Look up the literal words of the COUNT queries in WORDS.  Sort
+   them, so that each search can begin where the previous one ended.  */
+
+static void
+batch_literal_words (struct batch_query **words, size_t count)
+{
+  size_t i;
+  int order;
+
+  qsort (words, count, sizeof *words, batch_query_qsort_cmp);
+  if (idh.idh_flags & IDH_TOKEN_INDEX)
+    {
+      unsigned long low = 0;
+
+      for (i = 0; i < count; i++)
+	{
+	  char const *pattern = words[i]->bq_pattern;
+	  unsigned long high = idh.idh_tokens;
+	  char const *tok;
+
+	  while (low < high)
+	    {
+	      unsigned long middle = low + (high - low) / 2;
+	      STRING_COMPARE (pattern, token_at (&idh, middle), order);
+	      if (order > 0)
+		low = middle + 1;
+	      else
+		high = middle;
+	    }
+	  if (low == idh.idh_tokens)
+	    break;
+	  tok = token_at (&idh, low);
+	  if (strequ (pattern, tok))
+	    add_batch_token (words[i], tok);
+	}
+    }
+  else
+    {
+      char const *tok = ID_TOKENS_BEGIN (&idh);
+      char const *end = ID_TOKENS_END (&idh);
+
+      i = 0;
+      while (i < count && tok < end)
+	{
+	  STRING_COMPARE (words[i]->bq_pattern, tok, order);
+	  if (order > 0)
+	    tok = skip_token (tok);
+	  else
+	    {
+	      if (order == 0)
+		add_batch_token (words[i], tok);
+	      i++;
+	    }
+	}
+    }
+}
+
+/* Match every token of the desired frequency against each of the
+   COUNT regular-expression and substring queries in SCANS.  */
+
+static void
+batch_scan (struct batch_query **scans, size_t count)
+{
+  char const *tok;
+  char const *end = ID_TOKENS_END (&idh);
+  size_t i;
+
+  for (tok = ID_TOKENS_BEGIN (&idh); tok < end; tok = skip_token (tok))
+    {
+      assert (*tok);
+      if (!desired_frequency (tok))
+	continue;
+      for (i = 0; i < count; i++)
+	{
+	  struct batch_query *query = scans[i];
+	  int match = (query->bq_regexp
+		       ? regexp_matches (&query->bq_compiled, tok)
+		       : substring_matches (query->bq_pattern,
+					    strlen (query->bq_pattern), tok));
+	  if (match)
+	    add_batch_token (query, tok);
+	}
+    }
+}
+
+static void
+add_batch_token (struct batch_query *query, char const *tok)
+{
+  if (query->bq_count == query->bq_alloc)
+    query->bq_tokens = x2nrealloc (query->bq_tokens, &query->bq_alloc,
+				   sizeof *query->bq_tokens);
+  query->bq_tokens[query->bq_count++] = tok;
+}
+
+/* Report the tokens found for QUERY just as its query function
+   would have.  */
+
+static void
+report_batch_query (struct batch_query *query, report_func_t report_func)
+{
+  size_t i;
+
+  if (query->bq_func == query_literal_word)
+    {
+      if (query->bq_count && desired_frequency (query->bq_tokens[0]))
+	(*report_func) (query->bq_tokens[0],
+			hits_to_flinkv (query->bq_tokens[0]));
+      return;
+    }
+
+  if (key_style == ks_token)
+    {
+      for (i = 0; i < query->bq_count; i++)
+	(*report_func) (query->bq_tokens[i],
+			hits_to_flinkv (query->bq_tokens[i]));
+      return;
+    }
+  if (query->bq_count == 0)
+    return;
+  memset (bits_vec, 0, bits_vec_size);
+  for (i = 0; i < query->bq_count; i++)
+    hits_to_bits (bits_vec, query->bq_tokens[i]);
+  (*report_func) (query->bq_regexp ? query->bq_regexp : query->bq_pattern,
+		  bits_to_flinkv (bits_vec));
+}
+
+static int
+batch_query_qsort_cmp (void const *x, void const *y)
+{
+  struct batch_query const *const *qx = x;
+  struct batch_query const *const *qy = y;
+  return_STRING_COMPARE ((*qx)->bq_pattern, (*qy)->bq_pattern);
 }
 
 static void
@@ -566,6 +1020,9 @@ report_grep (char const *name, struct file_link **flinkv)
   char const *pattern = 0;
   regex_t compiled;
   char *file_name = alloca (PATH_MAX);
+  struct position_postings pp;
+  unsigned long ordinal;
+  int positions;
 
   if (key_style == ks_pattern)
     {
@@ -583,13 +1040,21 @@ report_grep (char const *name, struct file_link **flinkv)
 	}
     }
 
+  /* If NAME is a token entry and mkid recorded its positions, go
+     straight to the lines on which it occurs.  */
+  positions = ((idh.idh_flags & IDH_POSITIONS)
+	       && token_ordinal (&idh, name, &ordinal)
+	       && find_position_postings (&idh, ordinal, &pp));
+
   line[0] = ' ';		/* sentinel */
   while (*flinkv)
     {
-      int line_number = 0;
+      struct file_link *flink = *flinkv++;
+      unsigned long line_number = 0;
+      unsigned long printed = 0;
       FILE *source_FILE;
 
-      maybe_relative_file_name (file_name, *flinkv++, cw_dlink);
+      maybe_relative_file_name (file_name, flink, cw_dlink);
       source_FILE = fopen (file_name, "r");
       if (source_FILE == 0)
 	{
@@ -597,25 +1062,81 @@ report_grep (char const *name, struct file_link **flinkv)
 	  continue;
 	}
 
-      while (fgets (line + 1, sizeof (line) - 1, source_FILE))
+      if (positions)
 	{
-	  line_number++;
-	  if (pattern)
+	  unsigned long file;
+
+	  do
+	    positions = (next_position_file (&pp, &file)
+			 && file < idh.idh_files);
+	  while (positions && members_0[file] != flink);
+	  if (positions
+	      && grep_positions (name, pattern ? &compiled : 0, file_name,
+				 source_FILE, &pp, line, sizeof line,
+				 &printed))
 	    {
-	      int regexec_errno = regexec (&compiled, line, 0, 0, 0);
-	      if (regexec_errno == REG_ESPACE)
-		error (EXIT_FAILURE, 0,
-		       _("can't match regular-expression: memory exhausted"));
-	      else if (regexec_errno)
-		continue;
+	      fclose (source_FILE);
+	      continue;
 	    }
-	  else if (word_match (name, line))
-	    printf ("%s:%d:%s", file_name, line_number, line + 1);
+	  rewind (source_FILE);
+	}
+
+      while (fgets (line + 1, sizeof (line) - 1, source_FILE))
+	{
+	  line_number++;
+	  if (line_number > printed
+	      && grep_line_matches (name, pattern ? &compiled : 0, line))
+	    printf ("%s:%lu:%s", file_name, line_number, line + 1);
 	}
       fclose (source_FILE);
     }
 }
 
+/* Print the lines of SOURCE_FILE, named FILE_NAME, on which the
+   positions PP say that NAME occurs, reading each one into LINE, a
+   buffer of LINE_SIZE bytes whose first byte is a sentinel.  Return
+   zero if NAME isn't on one of them, as when the file has changed
+   since mkid ran, and store in *PRINTED the number of the last line
+   printed.  */
+
+static int
+grep_positions (char const *name, regex_t *compiled, char const *file_name,
+		FILE *source_FILE, struct position_postings *pp, char *line,
+		size_t line_size, unsigned long *printed)
+{
+  unsigned long line_number;
+  uint64_t offset;
+  unsigned long occurrences;
+
+  while (next_position_line (pp, &line_number, &offset, &occurrences))
+    {
+      if (fseeko (source_FILE, offset, SEEK_SET) != 0
+	  || !fgets (line + 1, line_size - 1, source_FILE)
+	  || !grep_line_matches (name, compiled, line))
+	return 0;
+      printf ("%s:%lu:%s", file_name, line_number, line + 1);
+      *printed = line_number;
+    }
+  return 1;
+}
+
+/* Return nonzero if LINE, which follows a sentinel byte, matches the
+   regular expression COMPILED, if any, or else has the word NAME.  */
+
+static int
+grep_line_matches (char const *name, regex_t *compiled, char const *line)
+{
+  if (compiled)
+    {
+      int regexec_errno = regexec (compiled, line, 0, 0, 0);
+      if (regexec_errno == REG_ESPACE)
+	error (EXIT_FAILURE, 0,
+	       _("can't match regular-expression: memory exhausted"));
+      return regexec_errno == 0;
+    }
+  return word_match (name, line);
+}
+
 static char **
 get_editor_argv(char const *fullstring, int* argc)
 {
@@ -850,13 +1371,13 @@ query_literal_word (char const *arg, report_func_t report_func)
   if (ignore_case_flag)
     return query_literal_substring (arg, report_func);
 
-  if (query_binary_search (arg) == 0)
+  char const *tok = query_binary_search (arg);
+  if (tok == 0)
     return 0;
-  gets_past_00 (hits_buf_1, idh.idh_FILE);
-  assert (*hits_buf_1);
-  if (!desired_frequency (hits_buf_1))
+  assert (*tok);
+  if (!desired_frequency (tok))
     return 0;
-  (*report_func) (hits_buf_1, tree8_to_flinkv (token_hits_addr (hits_buf_1)));
+  (*report_func) (tok, hits_to_flinkv (tok));
   return 1;
 }
 
@@ -865,28 +1386,31 @@ query_literal_prefix (char const *arg, report_func_t report_func)
 {
   int count;
   unsigned int length;
+  char const *tok;
+  char const *end = ID_TOKENS_END (&idh);
 
   if (ignore_case_flag)
     return query_regexp (arg, report_func);
 
-  if (query_binary_search (++arg) == 0)
+  tok = query_binary_search (++arg);
+  if (tok == 0)
     return 0;
 
   length = strlen (arg);
   count = 0;
   if (key_style != ks_token)
     memset (bits_vec, 0, bits_vec_size);
-  while (gets_past_00 (hits_buf_1, idh.idh_FILE) > 0)
+  for (; tok < end; tok = skip_token (tok))
     {
-      assert (*hits_buf_1);
-      if (!desired_frequency (hits_buf_1))
+      assert (*tok);
+      if (!desired_frequency (tok))
 	continue;
-      if (!strnequ (arg, hits_buf_1, length))
+      if (!strnequ (arg, tok, length))
 	break;
       if (key_style == ks_token)
-	(*report_func) (hits_buf_1, tree8_to_flinkv (token_hits_addr (hits_buf_1)));
+	(*report_func) (tok, hits_to_flinkv (tok));
       else
-	tree8_to_bits (bits_vec, token_hits_addr (hits_buf_1));
+	hits_to_bits (bits_vec, tok);
       count++;
     }
   if (key_style != ks_token && count)
@@ -900,44 +1424,38 @@ query_regexp (char const *pattern_0, report_func_t report_func)
 {
   int count;
   regex_t compiled;
-  int regcomp_errno;
   char const *pattern = pattern_0;
+  char const *tok;
+  char const *end = ID_TOKENS_END (&idh);
+  struct candidates cand;
 
   if (delimiter_style == ds_word)
     pattern = add_regexp_word_delimiters (pattern);
-  regcomp_errno = regcomp (&compiled, pattern,
-			   ignore_case_flag | REG_EXTENDED);
-  if (regcomp_errno)
-    {
-      char buf[BUFSIZ];
-      regerror (regcomp_errno, &compiled, buf, sizeof (buf));
-      error (EXIT_FAILURE, 0, "%s", buf);
-    }
-  fseek (idh.idh_FILE, idh.idh_tokens_offset, SEEK_SET);
+  compile_regexp (&compiled, pattern);
 
   count = 0;
   if (key_style != ks_token)
     memset (bits_vec, 0, bits_vec_size);
-  while (gets_past_00 (hits_buf_1, idh.idh_FILE) > 0)
+  find_candidates (pattern, 1, &cand);
+  for (tok = next_candidate (0, &cand); tok < end;
+       tok = next_candidate (tok, &cand))
     {
-      int regexec_errno;
-      assert (*hits_buf_1);
-      if (!desired_frequency (hits_buf_1))
+      assert (*tok);
+      if (!desired_frequency (tok))
 	continue;
-      regexec_errno = regexec (&compiled, hits_buf_1, 0, 0, 0);
-      if (regexec_errno == REG_ESPACE)
-	error (0, 0, _("can't match regular-expression: memory exhausted"));
-      else if (regexec_errno)
+      if (!regexp_matches (&compiled, tok))
 	continue;
       if (key_style == ks_token)
-	(*report_func) (hits_buf_1, tree8_to_flinkv (token_hits_addr (hits_buf_1)));
+	(*report_func) (tok, hits_to_flinkv (tok));
       else
-	tree8_to_bits (bits_vec, token_hits_addr (hits_buf_1));
+	hits_to_bits (bits_vec, tok);
       count++;
     }
   if (key_style != ks_token && count)
     (*report_func) (pattern, bits_to_flinkv (bits_vec));
 
+  free (cand.c_ordinals);
+  regfree (&compiled);
   if (pattern != pattern_0)
     free ((char *) pattern);
 
@@ -976,33 +1494,34 @@ query_number (char const *arg, report_func_t report_func)
   int radix;
   int val;
   int hit_digits = 0;
+  char const *tok;
+  char const *end = ID_TOKENS_END (&idh);
 
   radix = (val = stoi (arg)) ? radix_all : get_radix (arg);
-  fseek (idh.idh_FILE, idh.idh_tokens_offset, SEEK_SET);
 
   count = 0;
   if (key_style != ks_token)
     memset (bits_vec, 0, bits_vec_size);
-  while (gets_past_00 (hits_buf_1, idh.idh_FILE) > 0)
+  for (tok = ID_TOKENS_BEGIN (&idh); tok < end; tok = skip_token (tok))
     {
       if (hit_digits)
 	{
-	  if (!isdigit (*hits_buf_1))
+	  if (!isdigit (*tok))
 	    break;
 	}
       else
 	{
-	  if (isdigit (*hits_buf_1))
+	  if (isdigit (*tok))
 	    hit_digits = 1;
 	}
 
-      if (!((radix_flag ? radix_flag : radix) & get_radix (hits_buf_1))
-	  || stoi (hits_buf_1) != val)
+      if (!((radix_flag ? radix_flag : radix) & get_radix (tok))
+	  || stoi (tok) != val)
 	continue;
       if (key_style == ks_token)
-	(*report_func) (hits_buf_1, tree8_to_flinkv (token_hits_addr (hits_buf_1)));
+	(*report_func) (tok, hits_to_flinkv (tok));
       else
-	tree8_to_bits (bits_vec, token_hits_addr (hits_buf_1));
+	hits_to_bits (bits_vec, tok);
       count++;
     }
   if (key_style != ks_token && count)
@@ -1017,8 +1536,10 @@ query_number (char const *arg, report_func_t report_func)
 static int
 query_ambiguous_prefix (unsigned int limit, report_func_t report_func)
 {
-  char *old = hits_buf_1;
-  char *new = hits_buf_2;
+  char const *old = "";
+  char const *new = "";
+  char const *tok;
+  char const *end = ID_TOKENS_END (&idh);
   int consecutive = 0;
   int count = 0;
   char name[1024];
@@ -1028,16 +1549,13 @@ query_ambiguous_prefix (unsigned int limit, report_func_t report_func)
   assert (limit < sizeof(name));
 
   name[0] = '^';
-  *new = '\0';
-  fseek (idh.idh_FILE, idh.idh_tokens_offset, SEEK_SET);
-  while (gets_past_00 (old, idh.idh_FILE) > 0)
+  name[limit + 1] = '\0';
+  for (tok = ID_TOKENS_BEGIN (&idh); tok < end; tok = skip_token (tok))
     {
-      char *tmp;
-      if (!(token_flags (old) & TOK_NAME))
+      if (!(token_flags (tok) & TOK_NAME))
 	continue;
-      tmp = old;
       old = new;
-      new = tmp;
+      new = tok;
       if (!strnequ (new, old, limit))
 	{
 	  if (consecutive && key_style != ks_token)
@@ -1051,15 +1569,18 @@ query_ambiguous_prefix (unsigned int limit, report_func_t report_func)
       if (!consecutive++)
 	{
 	  if (key_style != ks_token)
-	    tree8_to_bits (bits_vec, token_hits_addr (old));
+	    {
+	      memset (bits_vec, 0, bits_vec_size);
+	      hits_to_bits (bits_vec, old);
+	    }
 	  else
-	    (*report_func) (old, tree8_to_flinkv (token_hits_addr (old)));
+	    (*report_func) (old, hits_to_flinkv (old));
 	  count++;
 	}
       if (key_style == ks_token)
-	(*report_func) (new, tree8_to_flinkv (token_hits_addr (new)));
+	(*report_func) (new, hits_to_flinkv (new));
       else
-	tree8_to_bits (bits_vec, token_hits_addr (new));
+	hits_to_bits (bits_vec, new);
       count++;
     }
   if (consecutive && key_style != ks_token)
@@ -1074,42 +1595,74 @@ static int
 query_literal_substring (char const *arg, report_func_t report_func)
 {
   int count;
-  int arg_length = 0;
-  char *(*strstr_func) (char const *, char const *);
-
-  fseek (idh.idh_FILE, idh.idh_tokens_offset, SEEK_SET);
+  size_t arg_length = strlen (arg);
+  char const *tok;
+  char const *end = ID_TOKENS_END (&idh);
+  struct candidates cand;
 
-  if (delimiter_style == ds_word)
-    arg_length = strlen (arg);
   count = 0;
   if (key_style != ks_token)
     memset (bits_vec, 0, bits_vec_size);
-  strstr_func = (ignore_case_flag ? strcasestr : strstr);
-  while (gets_past_00 (hits_buf_1, idh.idh_FILE) > 0)
+  find_candidates (arg, 0, &cand);
+  for (tok = next_candidate (0, &cand); tok < end;
+       tok = next_candidate (tok, &cand))
     {
-      char *match;
-      assert (*hits_buf_1);
-      if (!desired_frequency (hits_buf_1))
-	continue;
-      match = (*strstr_func) (hits_buf_1, arg);
-      if (match == 0)
+      assert (*tok);
+      if (!desired_frequency (tok))
 	continue;
-      if (delimiter_style == ds_word &&
-	  (match > hits_buf_1 || strlen (hits_buf_1) > arg_length))
+      if (!substring_matches (arg, arg_length, tok))
 	continue;
 
       if (key_style == ks_token)
-	(*report_func) (hits_buf_1, tree8_to_flinkv (token_hits_addr (hits_buf_1)));
+	(*report_func) (tok, hits_to_flinkv (tok));
       else
-	tree8_to_bits (bits_vec, token_hits_addr (hits_buf_1));
+	hits_to_bits (bits_vec, tok);
       count++;
     }
   if (key_style != ks_token && count)
     (*report_func) (arg, bits_to_flinkv (bits_vec));
 
+  free (cand.c_ordinals);
   return count;
 }
 
+static void
+compile_regexp (regex_t *compiled, char const *pattern)
+{
+  int regcomp_errno = regcomp (compiled, pattern,
+			       ignore_case_flag | REG_EXTENDED);
+  if (regcomp_errno)
+    {
+      char buf[BUFSIZ];
+      regerror (regcomp_errno, compiled, buf, sizeof (buf));
+      error (EXIT_FAILURE, 0, "%s", buf);
+    }
+}
+
+static int
+regexp_matches (regex_t *compiled, char const *tok)
+{
+  int regexec_errno = regexec (compiled, tok, 0, 0, 0);
+  if (regexec_errno == REG_ESPACE)
+    error (0, 0, _("can't match regular-expression: memory exhausted"));
+  return regexec_errno == 0;
+}
+
+/* Return nonzero if TOK contains ARG, whose length is ARG_LENGTH, or
+   if it is ARG when matching words.  */
+
+static int
+substring_matches (char const *arg, size_t arg_length, char const *tok)
+{
+  char *match = (ignore_case_flag ? strcasestr (tok, arg) : strstr (tok, arg));
+  if (match == 0)
+    return 0;
+  if (delimiter_style == ds_word
+      && (match > tok || strlen (tok) > arg_length))
+    return 0;
+  return 1;
+}
+
 static void
 parse_frequency_arg (char const *arg)
 {
@@ -1183,58 +1736,89 @@ file_regexp (char const *name_0, char const *left_delimit, char const *right_del
   return pat_buf;
 }
 
-static off_t
-query_binary_search (char const *token_0)
+/* Find the entry for TOKEN_0 in the sorted token section and return
+   its address.  When looking for a prefix, return the first entry
+   that begins with TOKEN_0.  Return 0 if there is no such entry.  */
+
+static char const *
+query_binary_search (char const *token_0)
+{
+  char const *tok = 0;
+
+  if (idh.idh_flags & IDH_TOKEN_INDEX)
+    {
+      unsigned long low = 0;
+      unsigned long high = idh.idh_tokens;
+      int order;
+
+      /* find the first token that doesn't collate before token_0 */
+      while (low < high)
+	{
+	  unsigned long middle = low + (high - low) / 2;
+	  STRING_COMPARE (token_0, token_at (&idh, middle), order);
+	  if (order > 0)
+	    low = middle + 1;
+	  else
+	    high = middle;
+	}
+      if (low == idh.idh_tokens)
+	return 0;
+      tok = token_at (&idh, low);
+      if (strequ (token_0, tok))
+	return tok;
+      if (query_function == query_literal_prefix
+	  && strnequ (token_0, tok, strlen (token_0)))
+	return tok;
+      return 0;
+    }
+
+  return query_binary_search_bytes (token_0);
+}
+
+/* Older ID files have no token index, so bisect the token section by
+   byte offset, resynchronizing on an entry boundary at each probe.  */
+
+static char const *
+query_binary_search_bytes (char const *token_0)
 {
-  off_t offset = 0;
-  off_t start = idh.idh_tokens_offset - 2;
-  off_t end = idh.idh_end_offset;
-  off_t anchor_offset = 0;
+  char const *tok = 0;
+  char const *start = ID_TOKENS_BEGIN (&idh) - 2;
+  char const *end = ID_TOKENS_END (&idh);
+  char const *anchor = 0;
   int order = -1;
 
   while (start < end)
     {
-      int c;
-      int incr = 1;
+      unsigned char const *name;
       char const *token;
 
-      offset = start + (end - start) / 2;
-      fseek (idh.idh_FILE, offset, SEEK_SET);
-      offset += skip_past_00 (idh.idh_FILE);
-      if (offset >= end)
-	{
-	  offset = start + 2;
-	  fseek (idh.idh_FILE, offset, SEEK_SET);
-	}
+      tok = skip_token (start + (end - start) / 2);
+      if (tok >= end)
+	tok = start + 2;
 
       /* compare the token names */
       token = token_0;
-      while (*token == (c = getc (idh.idh_FILE)) && *token && c)
+      name = (unsigned char const *) tok;
+      while (*token == *name && *token && *name)
 	{
 	  token++;
-	  incr++;
+	  name++;
 	}
-      if (c && !*token && query_function == query_literal_prefix)
-	anchor_offset = offset;
-      order = *token - c;
+      if (*name && !*token && query_function == query_literal_prefix)
+	anchor = tok;
+      order = *token - *name;
 
       if (order < 0)
-	end = offset - 2;
+	end = tok - 2;
       else if (order > 0)
-	start = offset + incr + skip_past_00 (idh.idh_FILE) - 2;
+	start = skip_token ((char const *) name) - 2;
       else
 	break;
     }
 
   if (order)
-    {
-      if (anchor_offset)
-	offset = anchor_offset;
-      else
-	return 0;
-    }
-  fseek (idh.idh_FILE, offset, SEEK_SET);
-  return offset;
+    return anchor;
+  return tok;
 }
 
 /* Are there any regexp meta-characters in name?? */
@@ -1428,53 +2012,73 @@ xtoi (char const *str)
   return (*str ? -1 : n);
 }
 
-static unsigned char *
-tree8_to_bits (unsigned char *bv_0, unsigned char const *hits_tree8)
+/* OR the leaves of the tree8 at HITS_TREE8 into BV.  Each leaf covers
+   eight files that start on a byte of BV.  */
+
+static void
+tree8_to_bits (unsigned char *bv, unsigned char const *hits_tree8)
 {
-  unsigned char* bv = bv_0;
-  tree8_to_bits_1 (&bv, &hits_tree8, tree8_levels);
-  return bv_0;
+  struct tree8_walk tw;
+  unsigned long base;
+  int leaf;
+
+  init_tree8_walk (&tw, hits_tree8, tree8_levels);
+  while ((leaf = next_tree8_leaf (&tw, &base)))
+    bv[base >> 3] |= leaf;
 }
 
-static void
-tree8_to_bits_1 (unsigned char **bv, unsigned char const **hits_tree8, int level)
+#if defined __SSE2__ && defined __GNUC__
+# include <emmintrin.h>
+# define BITS_CHUNK 16
+
+static inline int
+bits_chunk_is_zero (unsigned char const *bv)
 {
-  int hits = *(*hits_tree8)++;
+  __m128i chunk = _mm_loadu_si128 ((__m128i const *) bv);
+  return _mm_movemask_epi8 (_mm_cmpeq_epi8 (chunk, _mm_setzero_si128 ()))
+	 == 0xffff;
+}
+#else
+# define BITS_CHUNK 8
 
-  if (--level)
-    {
-      int incr = 1 << ((level - 1) * 3);
-      int bit;
-      for (bit = 1; bit & 0xff; bit <<= 1)
-	{
-	  if (bit & hits)
-	    tree8_to_bits_1 (bv, hits_tree8, level);
-	  else
-	    *bv += incr;
-	}
-    }
-  else
-    *(*bv)++ |= hits;
+static inline int
+bits_chunk_is_zero (unsigned char const *bv)
+{
+  uint64_t chunk;
+  memcpy (&chunk, bv, sizeof chunk);
+  return chunk == 0;
+}
+#endif
+
+/* Return the vector into which the file links of a query are stored,
+   which has room before it for a few more.  */
+
+static struct file_link **
+get_flinkv (void)
+{
+  return &flinkv_0[RESERVED_FLINKV_SLOTS];
 }
 
 static struct file_link **
 bits_to_flinkv (unsigned char const *bv)
 {
-  int const reserved_flinkv_slots = 3;
-  static struct file_link **flinkv_0;
-  struct file_link **flinkv;
+  struct file_link **flinkv_begin = get_flinkv ();
+  struct file_link **flinkv = flinkv_begin;
   struct file_link **members = members_0;
   struct file_link **end = &members_0[idh.idh_files];
 
-  if (flinkv_0 == 0)
-    flinkv_0 = xmalloc (sizeof(struct file_link *) * (idh.idh_files + reserved_flinkv_slots + 2));
-  flinkv = &flinkv_0[reserved_flinkv_slots];
-
   for (;;)
     {
       int hits;
       int bit;
 
+      /* The files of a union of a few tokens are sparse, so pass over
+	 the empty stretches of BV a vector at a time.  */
+      while (end - members >= 8 * BITS_CHUNK && bits_chunk_is_zero (bv))
+	{
+	  bv += BITS_CHUNK;
+	  members += 8 * BITS_CHUNK;
+	}
       while (*bv == 0)
 	{
 	  bv++;
@@ -1493,14 +2097,54 @@ bits_to_flinkv (unsigned char const *bv)
     }
 out:
   *flinkv = 0;
-  return &flinkv_0[reserved_flinkv_slots];
+  return flinkv_begin;
 }
 
+/* Return the file links of the token entry TOK.  Its files come
+   straight out of its hits, in order, without expanding them into
+   bits_vec.  */
+
 static struct file_link **
-tree8_to_flinkv (unsigned char const *hits_tree8)
+hits_to_flinkv (char const *tok)
 {
-  memset (bits_vec, 0, bits_vec_size);
-  return bits_to_flinkv (tree8_to_bits (bits_vec, hits_tree8));
+  struct hits_postings hp;
+  struct file_link **flinkv_begin = get_flinkv ();
+  struct file_link **flinkv = flinkv_begin;
+  unsigned long file;
+
+  if (init_hits_postings (&hp, tok))
+    {
+      while (next_hit_file (&hp, &file) && file < idh.idh_files)
+	*flinkv++ = members_0[file];
+    }
+  else
+    {
+      unsigned long count = tree8_file_numbers (token_hits_addr (tok),
+						tree8_levels, file_numbers);
+      unsigned long i;
+
+      for (i = 0; i < count && file_numbers[i] < idh.idh_files; i++)
+	*flinkv++ = members_0[file_numbers[i]];
+    }
+  *flinkv = 0;
+  return flinkv_begin;
+}
+
+/* Add the files of the token entry TOK to BV.  */
+
+static void
+hits_to_bits (unsigned char *bv, char const *tok)
+{
+  struct hits_postings hp;
+  unsigned long file;
+
+  if (!init_hits_postings (&hp, tok))
+    {
+      tree8_to_bits (bv, token_hits_addr (tok));
+      return;
+    }
+  while (next_hit_file (&hp, &file) && file < idh.idh_files)
+    bv[file >> 3] |= 1 << (file & 7);
 }
 
 #if HAVE_TERMIOS_H
@@ -1609,3 +2253,723 @@ chartty (void)
 {
   SET_TTY_MODES (&charmode);
 }
+
+/* Set CAND to the tokens that might match PATTERN, which is a regular
+   expression if REGEXP is nonzero, and a literal string otherwise.
+   Every token that matches contains all the trigrams that PATTERN
+   requires, so only the tokens on all their postings need be tried.
+   If the ID file has no trigram postings, or PATTERN requires no
+   trigram, any token might match.  */
+
+static void
+find_candidates (char const *pattern, int regexp, struct candidates *cand)
+{
+  struct trigram_postings *postings;
+  unsigned long *keys;
+  unsigned long *ordinals;
+  unsigned long ordinal;
+  size_t count;
+  size_t n = 0;
+  size_t i;
+
+  cand->c_ordinals = 0;
+  if (!(idh.idh_flags & IDH_TOKEN_INDEX))
+    return;
+  keys = xnmalloc (strlen (pattern) + 1, sizeof *keys);
+  count = pattern_trigrams (pattern, regexp, keys);
+  postings = xnmalloc (count + 1, sizeof *postings);
+  for (i = 0; i < count; i++)
+    {
+      int found = find_trigram_postings (&idh, keys[i], &postings[i]);
+      if (found == 0)
+	goto done;
+      if (found < 0)
+	{
+	  /* No token has this trigram, so none can match.  */
+	  cand->c_ordinals = xmalloc (sizeof *cand->c_ordinals);
+	  goto done;
+	}
+    }
+  if (count == 0)
+    goto done;
+
+  /* Start with the shortest postings, and keep only those ordinals
+     that are on all the others.  An ordinal takes at least a byte.  */
+  qsort (postings, count, sizeof *postings, postings_qsort_cmp);
+  ordinals = xnmalloc (postings[0].tp_end - postings[0].tp_next + 1,
+		       sizeof *ordinals);
+  while (next_trigram_ordinal (&postings[0], &ordinal))
+    ordinals[n++] = ordinal;
+  for (i = 1; i < count && n; i++)
+    {
+      size_t from;
+      size_t to = 0;
+      int more = next_trigram_ordinal (&postings[i], &ordinal);
+
+      for (from = 0; from < n && more; from++)
+	{
+	  while (more && ordinal < ordinals[from])
+	    more = next_trigram_ordinal (&postings[i], &ordinal);
+	  if (more && ordinal == ordinals[from])
+	    ordinals[to++] = ordinals[from];
+	}
+      n = to;
+    }
+  cand->c_ordinals = ordinals;
+
+done:
+  cand->c_next = cand->c_ordinals;
+  cand->c_end = cand->c_ordinals + n;
+  free (postings);
+  free (keys);
+}
+
+/* Return the token entry that follows TOK among the candidates CAND,
+   or the first candidate if TOK is null.  Return the end of the
+   token entries when there are no more.  */
+
+static char const *
+next_candidate (char const *tok, struct candidates *cand)
+{
+  if (cand->c_ordinals == 0)
+    return tok ? skip_token (tok) : ID_TOKENS_BEGIN (&idh);
+  if (cand->c_next == cand->c_end)
+    return ID_TOKENS_END (&idh);
+  return token_at (&idh, *cand->c_next++);
+}
+
+/* Store in KEYS the distinct trigrams that every token matching
+   PATTERN must contain, and return their number.  KEYS must have room
+   for as many trigrams as PATTERN has bytes.  A regular expression
+   requires the trigrams of the runs of literal characters at its top
+   level, less any character made optional by the operator that
+   follows it.  Bracket expressions and groups, which might be
+   optional or have alternatives, end a run, and an alternative at
+   the top level means nothing is required.  */
+
+static size_t
+pattern_trigrams (char const *pattern, int regexp, unsigned long *keys)
+{
+  char *run;
+  size_t length = 0;
+  size_t count = 0;
+  char const *p = pattern;
+
+  if (!regexp)
+    return run_trigrams (pattern, strlen (pattern), keys, 0);
+
+  run = alloca (strlen (pattern) + 1);
+  while (*p)
+    {
+      switch (*p)
+	{
+	case '\\':
+	  if (p[1] == '\0')
+	    return 0;
+	  if (IS_ALNUM (p[1]) || strchr ("<>`'", p[1]))
+	    {
+	      count = run_trigrams (run, length, keys, count);
+	      length = 0;
+	    }
+	  else
+	    run[length++] = p[1];
+	  p += 2;
+	  continue;
+
+	case '|':
+	  return 0;
+
+	case '*': case '?': case '{':
+	  if (length)
+	    length--;
+	  if (*p == '{')
+	    {
+	      p = strchr (p, '}');
+	      if (p == 0)
+		return 0;
+	    }
+	  break;
+
+	case '[':
+	  p = skip_bracket (p);
+	  if (p == 0)
+	    return 0;
+	  count = run_trigrams (run, length, keys, count);
+	  length = 0;
+	  continue;
+
+	case '(':
+	  p = skip_group (p);
+	  if (p == 0)
+	    return 0;
+	  count = run_trigrams (run, length, keys, count);
+	  length = 0;
+	  continue;
+
+	case '+': case '.': case '^': case '$': case ')':
+	  break;
+
+	default:
+	  run[length++] = *p++;
+	  continue;
+	}
+      count = run_trigrams (run, length, keys, count);
+      length = 0;
+      p++;
+    }
+  return run_trigrams (run, length, keys, count);
+}
+
+/* Add to the COUNT trigrams in KEYS those of the LENGTH bytes of RUN
+   that aren't already there, and return the new count.  */
+
+static size_t
+run_trigrams (char const *run, size_t length, unsigned long *keys,
+	      size_t count)
+{
+  size_t i;
+  size_t j;
+
+  for (i = 0; i + 3 <= length; i++)
+    {
+      unsigned long key;
+
+      /* Letters beyond ASCII aren't folded in the postings.  */
+      if (ignore_case_flag && ((run[i] | run[i + 1] | run[i + 2]) & 0x80))
+	continue;
+      key = TRIGRAM_KEY (&run[i]);
+      for (j = 0; j < count; j++)
+	if (keys[j] == key)
+	  break;
+      if (j == count)
+	keys[count++] = key;
+    }
+  return count;
+}
+
+/* Return the address just past the bracket expression at P, or null
+   if it has no end.  */
+
+static char const *
+skip_bracket (char const *p)
+{
+  p++;
+  if (*p == '^')
+    p++;
+  if (*p == ']')
+    p++;
+  for (; *p != ']'; p++)
+    {
+      if (*p == '\0')
+	return 0;
+      if (*p == '[' && (p[1] == ':' || p[1] == '.' || p[1] == '='))
+	{
+	  char close = p[1];
+	  for (p += 2; !(p[0] == close && p[1] == ']'); p++)
+	    if (*p == '\0')
+	      return 0;
+	  p++;
+	}
+    }
+  return p + 1;
+}
+
+/* Return the address just past the group at P, and any groups nested
+   within it, or null if it has no end.  */
+
+static char const *
+skip_group (char const *p)
+{
+  int depth = 0;
+
+  while (*p)
+    {
+      switch (*p)
+	{
+	case '\\':
+	  if (p[1] == '\0')
+	    return 0;
+	  p += 2;
+	  continue;
+
+	case '[':
+	  p = skip_bracket (p);
+	  if (p == 0)
+	    return 0;
+	  continue;
+
+	case '(':
+	  depth++;
+	  break;
+
+	case ')':
+	  if (--depth == 0)
+	    return p + 1;
+	  break;
+	}
+      p++;
+    }
+  return 0;
+}
+
+static int _GL_ATTRIBUTE_PURE
+postings_qsort_cmp (void const *x, void const *y)
+{
+  struct trigram_postings const *px = x;
+  struct trigram_postings const *py = y;
+  ptrdiff_t lx = px->tp_end - px->tp_next;
+  ptrdiff_t ly = py->tp_end - py->tp_next;
+
+  return (lx > ly) - (lx < ly);
+}
+
+#if ID_SERVER
+
+/* A connection to idserver: the part of a request read from it, the
+   query being run for it, and the part of the reply that it has yet
+   to read.  */
+
+struct client
+{
+  int cl_fd;
+  char *cl_buf;
+  size_t cl_size;
+  size_t cl_alloc;
+  int cl_eof;			/* it has sent all its requests */
+  int cl_pipe;			/* output of the running query, or -1 */
+  pid_t cl_pid;			/* the process that runs it */
+  int cl_at_line_start;		/* of that output */
+  char *cl_reply;
+  size_t cl_reply_start;	/* the first byte not yet sent */
+  size_t cl_reply_end;
+  size_t cl_reply_alloc;
+  size_t cl_poll;		/* index of cl_fd in the poll vector */
+  size_t cl_pipe_poll;		/* and of cl_pipe, or 0 */
+};
+
+/* Requests longer than this are refused.  */
+#define MAX_REQUEST 65536
+
+/* While this much of a reply is unsent, the output of the query is
+   left in its pipe, so that a client that reads slowly holds up only
+   its own query.  */
+#define MAX_REPLY_BACKLOG 65536
+
+/* Listen on SOCKET_NAME, and answer the queries of each client that
+   connects, one request at a time.  The queries of different clients
+   run at once, and no client waits on another: the sockets don't
+   block, and each reply is kept until its client reads it.  */
+
+static void
+serve (char const *socket_name)
+{
+  struct sockaddr_un addr;
+  struct pollfd *fds = 0;
+  struct client *clients = 0;
+  size_t clients_count = 0;
+  size_t clients_alloc = 0;
+  struct stat st;
+  int listen_fd;
+  size_t i;
+
+  memset (&addr, 0, sizeof addr);
+  addr.sun_family = AF_UNIX;
+  if (strlen (socket_name) >= sizeof addr.sun_path)
+    error (EXIT_FAILURE, 0, _("socket name `%s' is too long"), socket_name);
+  strcpy (addr.sun_path, socket_name);
+
+  /* A socket left behind by an idserver that has gone away would
+     make bind fail.  */
+  if (lstat (socket_name, &st) == 0 && S_ISSOCK (st.st_mode))
+    unlink (socket_name);
+
+  listen_fd = socket (AF_UNIX, SOCK_STREAM, 0);
+  if (listen_fd < 0
+      || bind (listen_fd, (struct sockaddr *) &addr, sizeof addr) < 0
+      || listen (listen_fd, 16) < 0)
+    error (EXIT_FAILURE, errno, _("can't listen on `%s'"), socket_name);
+  signal (SIGPIPE, SIG_IGN);
+
+  for (;;)
+    {
+      size_t nfds = 1;
+
+      /* Read more requests only from a client that has its replies;
+	 read the output of a query only while its reply is short.  */
+      fds = xnrealloc (fds, 2 * clients_count + 1, sizeof *fds);
+      fds[0].fd = listen_fd;
+      fds[0].events = POLLIN;
+      for (i = 0; i < clients_count; i++)
+	{
+	  struct client *client = &clients[i];
+	  size_t unsent = client->cl_reply_end - client->cl_reply_start;
+
+	  client->cl_poll = nfds;
+	  fds[nfds].fd = client->cl_fd;
+	  fds[nfds].events = 0;
+	  if (unsent)
+	    fds[nfds].events |= POLLOUT;
+	  else if (client->cl_pipe < 0 && !client->cl_eof)
+	    fds[nfds].events |= POLLIN;
+	  nfds++;
+	  client->cl_pipe_poll = 0;
+	  if (client->cl_pipe >= 0 && unsent < MAX_REPLY_BACKLOG)
+	    {
+	      client->cl_pipe_poll = nfds;
+	      fds[nfds].fd = client->cl_pipe;
+	      fds[nfds].events = POLLIN;
+	      nfds++;
+	    }
+	}
+      if (poll (fds, nfds, -1) < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  error (EXIT_FAILURE, errno, _("can't poll clients"));
+	}
+
+      /* Serve the clients in turn, dropping those that have gone.  */
+      for (i = clients_count; i > 0; i--)
+	if (!serve_client (&clients[i - 1], fds))
+	  {
+	    drop_client (&clients[i - 1]);
+	    clients[i - 1] = clients[--clients_count];
+	  }
+
+      if (fds[0].revents & POLLIN)
+	{
+	  struct client *client;
+	  int fd = accept (listen_fd, 0, 0);
+	  if (fd < 0)
+	    {
+	      if (errno != EINTR && errno != ECONNABORTED && errno != EAGAIN)
+		error (0, errno, _("can't accept connection"));
+	      continue;
+	    }
+	  if (fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) | O_NONBLOCK) < 0)
+	    {
+	      error (0, errno, _("can't accept connection"));
+	      close (fd);
+	      continue;
+	    }
+	  if (clients_count == clients_alloc)
+	    clients = x2nrealloc (clients, &clients_alloc, sizeof *clients);
+	  client = &clients[clients_count++];
+	  memset (client, 0, sizeof *client);
+	  client->cl_fd = fd;
+	  client->cl_pipe = -1;
+	}
+    }
+}
+
+/* Do what the poll vector FDS says that CLIENT is ready for: read its
+   requests and the output of its query, start the next query, and
+   send what it can of the reply.  Return zero if the connection
+   should be closed.  */
+
+static int
+serve_client (struct client *client, struct pollfd const *fds)
+{
+  short revents = fds[client->cl_poll].revents;
+
+  if (revents & (POLLERR | POLLHUP | POLLNVAL))
+    return 0;
+  if (client->cl_pipe_poll && fds[client->cl_pipe_poll].revents)
+    read_query_output (client);
+  if ((revents & POLLIN) && !read_requests (client))
+    return 0;
+  next_request (client);
+  if (!send_reply (client))
+    return 0;
+  return !(client->cl_eof && client->cl_pipe < 0
+	   && client->cl_reply_start == client->cl_reply_end);
+}
+
+/* Read what CLIENT has sent.  Return zero if the connection should be
+   closed.  */
+
+static int
+read_requests (struct client *client)
+{
+  ssize_t n;
+
+  if (client->cl_alloc - client->cl_size < BUFSIZ)
+    {
+      client->cl_alloc = client->cl_size + BUFSIZ;
+      client->cl_buf = xrealloc (client->cl_buf, client->cl_alloc);
+    }
+  n = read (client->cl_fd, client->cl_buf + client->cl_size, BUFSIZ);
+  if (n < 0)
+    return errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK;
+  if (n == 0)
+    client->cl_eof = 1;
+  client->cl_size += n;
+
+  if (client->cl_size > MAX_REQUEST
+      && !memchr (client->cl_buf, '\n', client->cl_size))
+    {
+      static char const too_long[] = "request is too long\n.error\n";
+      add_reply (client, too_long, sizeof too_long - 1);
+      client->cl_size = 0;
+      client->cl_eof = 1;
+    }
+  return 1;
+}
+
+/* Unless a query is running for CLIENT, start the next of its complete
+   requests.  */
+
+static void
+next_request (struct client *client)
+{
+  char *newline;
+
+  while (client->cl_pipe < 0
+	 && (newline = memchr (client->cl_buf, '\n', client->cl_size)))
+    {
+      size_t length = newline - client->cl_buf + 1;
+      *newline = '\0';
+      serve_request (client, client->cl_buf);
+      client->cl_size -= length;
+      memmove (client->cl_buf, client->cl_buf + length, client->cl_size);
+    }
+}
+
+/* Start answering REQUEST for CLIENT.  The query runs in a child
+   process, so that it starts with the options given to idserver, and
+   so that an error that makes it exit doesn't take the server with it.
+   Its output and diagnostics come back through a pipe, which
+   read_query_output reads as they come.  */
+
+static void
+serve_request (struct client *client, char *request)
+{
+  int pipe_fds[2];
+  pid_t pid;
+
+  if (id_file_changed ())
+    {
+      unload_id_file ();
+      load_id_file ();
+    }
+
+  fflush (stdout);
+  if (pipe (pipe_fds) < 0)
+    pid = -1;
+  else if ((pid = fork ()) < 0)
+    {
+      close (pipe_fds[0]);
+      close (pipe_fds[1]);
+    }
+  if (pid < 0)
+    {
+      static char const failed[] = "can't run query\n.error\n";
+      add_reply (client, failed, sizeof failed - 1);
+      return;
+    }
+
+  if (pid == 0)
+    {
+      char **argv = xnmalloc (strlen (request) / 2 + 3, sizeof *argv);
+      int argc;
+
+      close (pipe_fds[0]);
+      if (dup2 (pipe_fds[1], STDOUT_FILENO) < 0
+	  || dup2 (pipe_fds[1], STDERR_FILENO) < 0)
+	_exit (EXIT_FAILURE);
+      close (pipe_fds[1]);
+      signal (SIGPIPE, SIG_DFL);
+
+      argv[0] = (char *) program_name;
+      argc = split_request (request, argv + 1) + 1;
+      optind = 0;
+      parse_options (argc, argv);
+      if (show_version)
+	{
+	  printf ("%s - %s\n", program_name, PACKAGE_VERSION);
+	  exit (EXIT_SUCCESS);
+	}
+      if (show_help)
+	help_me ();
+      if (result_style == rs_edit)
+	error (EXIT_FAILURE, 0, _("idserver can't run an editor"));
+      run_queries (argc - optind, argv + optind);
+      exit (EXIT_SUCCESS);
+    }
+
+  close (pipe_fds[1]);
+  client->cl_pipe = pipe_fds[0];
+  client->cl_pid = pid;
+  client->cl_at_line_start = 1;
+}
+
+/* Add what the query of CLIENT has written to its reply.  Lines that
+   begin with `.' gain another, so that they can't be mistaken for the
+   line that ends the reply, which is added once the query is done.  */
+
+static void
+read_query_output (struct client *client)
+{
+  char buf[BUFSIZ];
+  char const *start = buf;
+  char const *end;
+  int status;
+  pid_t pid;
+  ssize_t n = read (client->cl_pipe, buf, sizeof buf);
+
+  if (n < 0 && errno == EINTR)
+    return;
+  end = buf + (n < 0 ? 0 : n);
+  while (start < end)
+    {
+      char const *newline = memchr (start, '\n', end - start);
+      char const *stop = newline ? newline + 1 : end;
+      if (client->cl_at_line_start && *start == '.')
+	add_reply (client, ".", 1);
+      add_reply (client, start, stop - start);
+      client->cl_at_line_start = newline != 0;
+      start = stop;
+    }
+  if (n > 0)
+    return;
+
+  close (client->cl_pipe);
+  client->cl_pipe = -1;
+  while ((pid = waitpid (client->cl_pid, &status, 0)) < 0 && errno == EINTR)
+    ;
+  if (!client->cl_at_line_start)
+    add_reply (client, "\n", 1);
+  if (n == 0 && pid == client->cl_pid
+      && WIFEXITED (status) && WEXITSTATUS (status) == EXIT_SUCCESS)
+    add_reply (client, ".ok\n", 4);
+  else
+    add_reply (client, ".error\n", 7);
+}
+
+/* Append the SIZE bytes at BUF to the reply to CLIENT.  */
+
+static void
+add_reply (struct client *client, char const *buf, size_t size)
+{
+  if (client->cl_reply_alloc - client->cl_reply_end < size)
+    {
+      client->cl_reply_end -= client->cl_reply_start;
+      memmove (client->cl_reply, client->cl_reply + client->cl_reply_start,
+	       client->cl_reply_end);
+      client->cl_reply_start = 0;
+    }
+  if (client->cl_reply_alloc - client->cl_reply_end < size)
+    {
+      client->cl_reply_alloc = client->cl_reply_end + size + BUFSIZ;
+      client->cl_reply = xrealloc (client->cl_reply, client->cl_reply_alloc);
+    }
+  memcpy (client->cl_reply + client->cl_reply_end, buf, size);
+  client->cl_reply_end += size;
+}
+
+/* Send CLIENT as much of its reply as its socket takes without
+   blocking.  Return zero if the connection should be closed.  */
+
+static int
+send_reply (struct client *client)
+{
+  while (client->cl_reply_start < client->cl_reply_end)
+    {
+      ssize_t n = write (client->cl_fd,
+			 client->cl_reply + client->cl_reply_start,
+			 client->cl_reply_end - client->cl_reply_start);
+      if (n < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  return errno == EAGAIN || errno == EWOULDBLOCK;
+	}
+      client->cl_reply_start += n;
+    }
+  client->cl_reply_start = client->cl_reply_end = 0;
+  return 1;
+}
+
+/* Close the connection to CLIENT, and stop its query if one is
+   running.  */
+
+static void
+drop_client (struct client *client)
+{
+  close (client->cl_fd);
+  if (client->cl_pipe >= 0)
+    {
+      kill (client->cl_pid, SIGKILL);
+      close (client->cl_pipe);
+      while (waitpid (client->cl_pid, 0, 0) < 0 && errno == EINTR)
+	;
+    }
+  free (client->cl_buf);
+  free (client->cl_reply);
+}
+
+/* Split REQUEST into words separated by blanks, where a backslash
+   quotes the character that follows it, and store them in ARGV,
+   which has room for them and a terminating null pointer.  Return
+   the number of words.  */
+
+static int
+split_request (char *request, char **argv)
+{
+  char *in = request;
+  char *out = request;
+  int argc = 0;
+
+  for (;;)
+    {
+      while (*in == ' ' || *in == '\t' || *in == '\r')
+	in++;
+      if (*in == '\0')
+	break;
+      argv[argc++] = out;
+      while (*in && *in != ' ' && *in != '\t' && *in != '\r')
+	{
+	  if (*in == '\\' && in[1])
+	    in++;
+	  *out++ = *in++;
+	}
+      if (*in)
+	in++;
+      *out++ = '\0';
+    }
+  argv[argc] = 0;
+  return argc;
+}
+
+/* Return nonzero if the ID file has been replaced or modified since it
+   was read.  An ID file that has gone away is left as it was.  */
+
+static int
+id_file_changed (void)
+{
+  struct stat st;
+
+  if (stat (idh.idh_file_name, &st) < 0)
+    return 0;
+  return (st.st_mtime != id_file_stat.st_mtime
+	  || st.st_size != id_file_stat.st_size
+	  || st.st_ino != id_file_stat.st_ino
+	  || st.st_dev != id_file_stat.st_dev);
+}
+
+/* Release everything that load_id_file set up.  */
+
+static void
+unload_id_file (void)
+{
+  unmap_id_file (&idh);
+  fclose (idh.idh_FILE);
+  free (members_0);
+  free (bits_vec);
+  free (file_numbers);
+  free (flinkv_0);
+  free_idh_tables (&idh);
+  free_idh_obstacks (&idh);
+}
+
+#endif /* ID_SERVER */
@@ -3,7 +3,8 @@ enum lid_mode
     LID_MODE_AID,
     LID_MODE_EID,
     LID_MODE_GID,
-    LID_MODE_LID
+    LID_MODE_LID,
+    LID_MODE_SERVER
   };
 
 extern enum lid_mode lid_mode;
@@ -0,0 +1,2 @@
+#include "mkid.h"
+enum mkid_mode mkid_mode = MKID_MODE_MERGE;
@@ -22,11 +22,26 @@
 #include <assert.h>
 #include <stdio.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
+#include <signal.h>
 #include <unistd.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <limits.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include <sys/time.h>
+#if HAVE_GETRUSAGE && HAVE_SYS_RESOURCE_H
+# include <sys/resource.h>
+#endif
+#if HAVE_PTHREAD_H && HAVE_PTHREAD_CREATE && defined IDU_THREAD_LOCAL
+# include <pthread.h>
+# define PARALLEL_SCAN 1
+#else
+# define PARALLEL_SCAN 0
+#endif
 
 #include "alloca.h"
 #include "argv-iter.h"
@@ -39,17 +54,21 @@
 #include "quote.h"
 #include "quotearg.h"
 #include "xalloc.h"
+#include "xstrtol.h"
 
 #include "xnls.h"
 #include "idfile.h"
 #include "idu-hash.h"
+#include "strsort.h"
 #include "scanners.h"
 #include "iduglobal.h"
+#include "mkid.h"
 
 struct summary
 {
   struct token **sum_tokens;
   unsigned char const *sum_hits;
+  unsigned char *sum_hits_base;	/* as allocated */
   struct summary *sum_parent;
   union {
     struct summary *u_kids[8];	/* when sum_level > 0 */
@@ -62,40 +81,357 @@ struct summary
   int sum_level;
 };
 
+/* Resource usage, as sampled at the start and end of a phase of the
+   run, or as accumulated over all the times a phase ran.  */
+
+struct usage
+{
+  double u_wall;			/* seconds */
+  double u_user;			/* CPU seconds in user mode */
+  double u_system;			/* CPU seconds in the kernel */
+  long u_maxrss;			/* peak resident set size, in Kb */
+  unsigned long long u_read_bytes;	/* block input */
+  unsigned long long u_write_bytes;	/* block output */
+};
+
+/* The phases of a run that --statistics times, in the order they are
+   reported.  summarize runs for each level of the tree8 summaries from
+   within the scan, so it has one phase per level.  */
+
+#define MAX_SUMMARY_LEVELS 24
+enum
+{
+  PHASE_WALK,
+  PHASE_MARK,
+  PHASE_UPDATE,
+  PHASE_SCAN,
+  PHASE_SUMMARIZE,
+  PHASE_SORT = PHASE_SUMMARIZE + MAX_SUMMARY_LEVELS,
+  PHASE_SPILL,
+  PHASE_WRITE,
+  PHASE_COUNT
+};
+
+struct phase
+{
+  struct usage ph_start;
+  struct usage ph_total;
+  unsigned long ph_runs;
+};
+
+/* How long it took to scan the files of one language.  */
+
+struct lang_time
+{
+  struct language const *lt_language;
+  unsigned long lt_files;
+  unsigned long long lt_bytes;
+  double lt_seconds;
+  struct lang_time *lt_next;
+};
+
+/* One of the files that took longest to scan.  */
+
+struct file_time
+{
+  struct file_link const *ft_link;
+  off_t ft_bytes;
+  double ft_seconds;
+};
+
+/* An occurrence of a token in a member file, for --positions.  */
+
+struct token_position
+{
+  struct token const *tpos_token;
+  unsigned long tpos_line;
+  uint64_t tpos_offset;		/* of the first byte of the line */
+};
+
+/* The line on which the scanner is in one member file, and, for a
+   scanning thread, the occurrences of tokens it has found there, in
+   order, and then grouped by token.  */
+
+struct file_positions
+{
+  struct token_position *fps_positions;
+  size_t fps_count;
+  size_t fps_alloc;
+  char const *fps_begin;	/* the file's contents */
+  char const *fps_counted;	/* the newlines before this are counted */
+  char const *fps_line_start;
+  unsigned long fps_line;
+};
+
+/* The positions of a token in the member files merged so far, encoded
+   as in the IDS_POSITIONS section, except that the occurrences on the
+   last line are still being counted.  */
+
+struct token_lines
+{
+  struct token const *tl_token;
+  unsigned long tl_file;	/* the file last added */
+  unsigned long tl_line;	/* the line last added */
+  uint64_t tl_offset;		/* the offset of that line */
+  unsigned long tl_line_count;	/* occurrences on it, or 0 when done */
+  size_t tl_size;
+  size_t tl_alloc;
+  unsigned char *tl_postings;
+};
+
+/* A token found in a file that mkid scans with --incremental, whether
+   to build the ID file or to update it, with the number of its
+   occurrences in that file and their flags.  */
+
+struct update_hit
+{
+  struct token *uh_token;
+  unsigned long uh_file;		/* mf_index of the file */
+  unsigned short uh_count;
+  unsigned char uh_flags;
+};
+
+/* The occurrences of a token in one file, as the IDS_TOKEN_TALLIES
+   section records them.  */
+
+struct token_tally
+{
+  unsigned long tt_file;
+  unsigned short tt_count;
+  unsigned char tt_flags;
+};
+
 void usage (void);
 static int ceil_log_8 (unsigned long n);
 static int ceil_log_2 (unsigned long n);
 static void assert_writeable (char const *file_name);
+static void parse_shard (char const *arg);
+static void select_shard_members (struct idhead *idhp);
+static struct file_link *shard_group (struct file_link *flink)
+  _GL_ATTRIBUTE_PURE;
+static int shard_group_cmp (struct file_link const *x,
+			    struct file_link const *y) _GL_ATTRIBUTE_PURE;
+static int shard_member_qsort_cmp (void const *x, void const *y);
+static int shard_group_qsort_cmp (void const *x, void const *y);
+static void write_shard_files (struct idhead *idhp);
+static void parse_memory_limit (char const *arg);
+static uintmax_t scan_memory_used (void) _GL_ATTRIBUTE_PURE;
+static void spill_run (unsigned long next_file);
+static void restart_run (void);
+static void compact_spill_runs (void);
+static void close_spill_runs (unsigned long first);
+static FILE *create_spill_file (void);
+static void finish_spill_file (FILE *fp);
+static void put_spill_number (FILE *fp, uintmax_t value);
+static uintmax_t get_spill_number (FILE *fp);
+static void put_spill_token (FILE *fp, char const *name, int flags,
+			     unsigned long count, unsigned long const *files,
+			     unsigned long n, struct token_tally const *tallies,
+			     struct token_lines *tl);
+struct spill_input;
+static void read_spill_token (struct spill_input *si);
+static void write_spilled_id_file (struct idhead *idhp);
+static unsigned long merge_spilled_tokens (struct idhead *idhp,
+					   off_t *token_offsets, off_t *off,
+					   FILE *run_file,
+					   unsigned long first_run);
 static void scan_files (struct idhead const *idhp);
 static void scan_member_file (struct member_file const *member);
 static void scan_member_file_1 (get_token_func_t get_token,
-				void const *args, FILE *source_FILE);
+				void const *args, struct source_file *source,
+				unsigned long file);
+struct file_scan;
+typedef void (*file_scan_func_t) (struct member_file const *member,
+				  struct file_scan *fs, unsigned long i);
+static void gather_files (struct member_file **members, unsigned long count,
+			  file_scan_func_t consume);
+#if PARALLEL_SCAN
+static void scan_files_in_parallel (struct member_file **members,
+				    unsigned long count,
+				    file_scan_func_t consume);
+static void *scan_thread (void *arg);
+#endif
+static void gather_file_tokens (struct member_file const *member,
+				struct file_scan *fs);
+static void release_file_scan (struct file_scan *fs);
+static bool report_file_scan (struct member_file const *member,
+			      struct file_scan const *fs);
+static void merge_file_scan (struct member_file const *member,
+			     struct file_scan *fs, unsigned long i);
+static void add_file_scan (struct member_file const *member,
+			   struct file_scan *fs);
+static void scan_member_file_copy (struct member_file const *member);
+static void init_copy_groups (struct member_file **members,
+			      unsigned long count);
+static void free_copy_groups (void);
+struct copy_group;
+static struct copy_group *find_copy_group (struct member_file const *member);
+static struct file_copy *find_file_copy (struct copy_group const *group,
+					 uint64_t hash) _GL_ATTRIBUTE_PURE;
+static void drop_file_copies (struct copy_group *group);
+static void evict_file_copies (void);
+static void free_file_copy (struct file_copy *fc);
+static size_t file_scan_size (struct file_scan const *fs) _GL_ATTRIBUTE_PURE;
+static void note_file_copy (struct member_file const *member,
+			    struct file_scan *fs);
+static unsigned long copy_group_hash (void const *key) _GL_ATTRIBUTE_PURE;
+static int copy_group_hash_cmp (void const *x, void const *y)
+  _GL_ATTRIBUTE_PURE;
 static void report_statistics (void);
+static void get_usage (struct usage *u);
+static void start_phase (int phase);
+static void stop_phase (int phase);
+static double wall_seconds (void);
+static char const *phase_name (int phase) _GL_ATTRIBUTE_CONST;
+static void note_file_time (struct member_file const *member, off_t bytes,
+			    double seconds);
+static void report_phases_text (void);
+static void report_statistics_json (void);
+static void print_json_string (char const *str);
 static void write_id_file (struct idhead *idhp);
-static unsigned long token_hash_1 (void const *key);
-static unsigned long token_hash_2 (void const *key);
+static off_t begin_id_file (struct idhead *idhp, unsigned long tokens);
+static int write_token_header (struct id_output *ido, char const *name,
+			       int flags, unsigned int count);
+static void note_token_size (struct idhead *idhp, char const *name,
+			     unsigned long buf_size, unsigned long vec_size);
+static void finish_id_file (struct idhead *idhp, off_t off,
+			    off_t const *token_offsets);
+static int create_id_file (char const *file_name);
+static void replace_id_file (char const *file_name);
+static void remove_temp_id_file (void);
+static void remove_temp_id_file_on_signal (int sig);
+static int choose_id_file_version (struct idhead *idhp);
+static unsigned long count_summary_hits (struct summary const *summary);
+static unsigned long token_hash (void const *key);
 static int token_hash_cmp (void const *x, void const *y);
-static int token_qsort_cmp (void const *x, void const *y);
 static void bump_current_hits_signature (void);
 static void init_hits_signature (int i);
 static void free_summary_tokens (void);
+static void free_summary (struct summary *summary);
 static void summarize (void);
 static void init_summary (void);
 static struct summary *make_sibling_summary (struct summary *summary);
 static int count_vec_size (struct summary *summary,
 			   unsigned char const *tail_hits);
-static int count_buf_size (struct summary *summary,
-			   unsigned char const *tail_hits);
 static int check_hits (struct summary* summary) _GL_ATTRIBUTE_PURE;
-static void write_hits (FILE *fp, struct summary *summary,
+static void write_hits (struct obstack *tree8_obstack,
+			struct summary *summary,
 			unsigned char const *tail_hits);
+static int choose_hits_postings (unsigned long const *files, unsigned long n,
+				 unsigned long tree8_size,
+				 unsigned long *buf_size);
+static int hits_number_size (unsigned long value) _GL_ATTRIBUTE_CONST;
+static void put_hits_number (struct id_output *ido, unsigned long value);
+static void write_hits_postings (struct id_output *ido, int kind,
+				 unsigned long const *files, unsigned long n);
+static unsigned long write_token_hits (struct id_output *ido,
+				       char const *name, int flags,
+				       unsigned int count,
+				       struct obstack *tree8_obstack,
+				       unsigned long const *files,
+				       unsigned long n, int *tok_size);
 static void sign_token (struct token *token);
 static void add_token_to_summary (struct summary *summary, struct token *token);
+static void stat_member_files (struct idhead const *idhp);
+static void write_member_stats (struct idhead *idhp);
+static uint64_t get_uint64 (unsigned char const *buf) _GL_ATTRIBUTE_PURE;
+struct member_stat;
+static bool member_unchanged (struct member_stat const *ms,
+			      unsigned char const *old_stat,
+			      uint64_t old_start) _GL_ATTRIBUTE_PURE;
+static struct file_link *find_new_link (struct file_link const *old_link,
+					struct file_link *new_root);
+static bool update_id_file (struct idhead *idhp);
+static void collect_file_scan (struct member_file const *member,
+			       struct file_scan *fs, unsigned long i);
+static int update_hit_qsort_cmp (void const *x, void const *y);
+static int file_number_qsort_cmp (void const *x, void const *y);
+static int token_tally_qsort_cmp (void const *x, void const *y);
+static struct update_hit *finish_update_hits (unsigned long *count);
+static unsigned long take_token_tallies (struct token const *token,
+					 struct update_hit const **hits,
+					 struct update_hit const *hits_end,
+					 struct token_tally *tallies);
+static void put_token_tallies (struct token_tally const *tallies,
+			       unsigned long n);
+static void put_tally_number (uintmax_t value);
+static void get_token_tally (unsigned char const **p,
+			     unsigned char const *end,
+			     char const *file_name, struct token_tally *tally);
+static void write_token_tallies (struct idhead *idhp);
+static unsigned long merge_id_tokens (struct idhead *old_idhp,
+				      long const *old_to_new,
+				      struct update_hit const *hits,
+				      unsigned long hits_count,
+				      struct idhead *idhp,
+				      off_t *token_offsets, off_t *off);
+static unsigned long token_entry_files (struct idhead const *idhp,
+				       char const *tok, int levels,
+				       unsigned long *files);
+static void put_merged_token (struct idhead *idhp, char const *name,
+			      int flags, unsigned long count,
+			      unsigned long const *files, unsigned long n,
+			      int levels, struct obstack *tree8_obstack,
+			      unsigned long ordinal, off_t *token_offsets,
+			      off_t *off);
+struct merge_input;
+static void merge_id_files (struct idhead *idhp, int count, char **file_names);
+static void read_merge_input (struct merge_input *mi, char const *file_name);
+static struct file_link *merge_file_link (struct file_link const *flink);
+static void number_merged_files (struct merge_input *inputs, int count);
+static unsigned long merge_input_tokens (struct merge_input *inputs, int count,
+					 struct idhead *idhp,
+					 off_t *token_offsets, off_t *off);
+static struct token_lines *merge_token_lines (struct merge_input *inputs,
+					      int count, char const *name);
+static void note_merged_token_size (char const *name,
+				    unsigned long const *files,
+				    unsigned long n, int levels,
+				    struct obstack *tree8_obstack);
+static void file_numbers_to_tree8 (struct obstack *tree8_obstack,
+				   unsigned long const **files,
+				   unsigned long const *end,
+				   int level, unsigned long base);
+static void init_file_positions (struct file_positions *fps,
+				 char const *begin);
+static void count_file_lines (struct file_positions *fps, char const *in);
+static void note_token_position (struct file_positions *fps,
+				 struct token const *token, char const *in);
+static void sort_file_positions (struct file_positions *fps);
+static int token_position_qsort_cmp (void const *x, void const *y);
+static struct token_position const *find_file_positions
+  (struct file_positions const *fps, struct token const *token)
+  _GL_ATTRIBUTE_PURE;
+static void post_token_positions (struct token const *token,
+				  unsigned long file,
+				  struct token_position const *positions,
+				  struct token_position const *end);
+static struct token_lines *get_token_lines (struct token const *token);
+static struct token_lines *make_token_lines (struct token const *token);
+static void add_token_line (struct token_lines *tl, unsigned long file,
+			    unsigned long line, uint64_t offset);
+static void finish_token_lines (struct token_lines *tl);
+static void copy_position_lines (struct token_lines *tl, unsigned long file,
+				 struct position_postings *pp);
+static void put_position_number (struct token_lines *tl, uint64_t value);
+static unsigned long token_lines_hash (void const *key);
+static int token_lines_hash_cmp (void const *x, void const *y);
+static void write_token_positions (struct idhead *idhp);
 
 static struct hash_table token_table;
+static struct hash_table token_lines_table;	/* for --positions */
+static struct obstack token_lines_obstack;
+static struct file_positions scan_positions;	/* of the file being scanned */
+static struct token_lines **ordered_token_lines;	/* by token ordinal */
+static uintmax_t token_lines_size;	/* bytes of the postings of them all */
+static struct obstack update_obstack;	/* of struct update_hit */
+static struct obstack tallies_obstack;	/* the IDS_TOKEN_TALLIES section */
 
 /* Miscellaneous statistics */
 static unsigned long input_chars;
+static unsigned long copied_files;	/* not scanned, as copies of others */
+static uintmax_t copied_bytes;
+static uintmax_t kept_copies_size;	/* bytes of the scans kept for copies */
 static unsigned long name_tokens;
 static unsigned long number_tokens;
 static unsigned long string_tokens;
@@ -103,11 +439,51 @@ static unsigned long literal_tokens;
 static unsigned long comment_tokens;
 static unsigned long occurrences;
 static unsigned long hits_length = 0;
+static uintmax_t tokens_size;		/* bytes of tokens in tokens_obstack */
+static uintmax_t summary_hits_size;	/* bytes of the summaries' hits */
 static unsigned long tokens_length = 0;
 static unsigned long output_length = 0;
 
+static struct phase phases[PHASE_COUNT];
+static struct lang_time *lang_times;
+#define SLOWEST_FILES 10
+static struct file_time slowest_files[SLOWEST_FILES];
+static int slowest_files_count;
+
+enum stats_format
+{
+  stats_text,
+  stats_json
+};
+static enum stats_format stats_format = stats_text;
+
 static int verbose_flag = 0;
 static int statistics_flag = 0;
+static long scan_jobs = 1;		/* # of files to scan at once */
+static int incremental_flag = 0;
+static int trigrams_flag = 0;
+static int tree8_flag = 1;		/* store no hits postings */
+static int positions_flag = 0;		/* record the lines of tokens */
+static unsigned long shard_index;	/* index only this shard, counting from 0 */
+static unsigned long shard_count = 0;	/* of this many; 0 means no sharding */
+static unsigned long shard_members;	/* member files of the whole tree */
+static unsigned long *shard_file_numbers; /* in it, of those of the shard */
+static uintmax_t merged_tokens_size;	/* of merged token entries, when
+					   all of them are tree8s */
+static uintmax_t memory_limit = 0;	/* spill runs of tokens beyond this */
+static struct spill_input *spill_runs;	/* the runs spilled so far */
+static unsigned long spill_run_count;
+static size_t spill_runs_alloc;
+static unsigned long run_base;		/* the first file of this run */
+static unsigned long spilled_runs;	/* written by spill_run */
+static unsigned long spill_merges;	/* by compact_spill_runs */
+static uintmax_t spilled_bytes;		/* written to temporary files */
+static unsigned long run_table_slots;	/* of token_table, as each run starts */
+#define SPILL_MERGE_WIDTH 64	/* runs of a level merged into one */
+/* The bytes of a slot of a tagged hash table: the item, its tag and
+   its hash.  */
+#define HASH_SLOT_SIZE (sizeof (void *) + 1 + sizeof (unsigned long))
+#define MAX_SCAN_JOBS 1024
 
 static int levels = 0;			/* ceil(log(8)) of file_name_count */
 
@@ -122,6 +498,10 @@ static int show_help = 0;
 struct idhead idh;
 static struct file_link *cw_dlink;
 
+/* The file that becomes the ID file once it is complete, or null if
+   mkid writes the ID file in place.  It is removed if mkid dies.  */
+static char *volatile temp_id_file_name;
+
 void usage (void) __attribute__((__noreturn__));
 void
 usage (void)
@@ -136,6 +516,14 @@ usage (void)
 enum
 {
   FILES0_FROM_OPTION = CHAR_MAX +1,
+  INCREMENTAL_OPTION,
+  TRIGRAMS_OPTION,
+  TREE8_OPTION,
+  POSTINGS_OPTION,
+  POSITIONS_OPTION,
+  SHARD_OPTION,
+  MEMORY_LIMIT_OPTION,
+  STATS_OPTION
 };
 
 static struct option const long_options[] =
@@ -150,15 +538,63 @@ static struct option const long_options[] =
   { "prune", required_argument, 0, 'p' },
   { "verbose", no_argument, 0, 'v' },
   { "statistics", no_argument, 0, 's' },
+  { "stats", optional_argument, NULL, STATS_OPTION },
+  { "jobs", required_argument, 0, 'j' },
   { "help", no_argument, &show_help, 1 },
   { "version", no_argument, &show_version, 1 },
   { "files0-from", required_argument, NULL, FILES0_FROM_OPTION },
+  { "incremental", no_argument, NULL, INCREMENTAL_OPTION },
+  { "trigrams", no_argument, NULL, TRIGRAMS_OPTION },
+  { "tree8", no_argument, NULL, TREE8_OPTION },
+  { "postings", no_argument, NULL, POSTINGS_OPTION },
+  { "positions", no_argument, NULL, POSITIONS_OPTION },
+  { "shard", required_argument, NULL, SHARD_OPTION },
+  { "memory-limit", required_argument, NULL, MEMORY_LIMIT_OPTION },
+  {NULL, 0, NULL, 0}
+};
+
+/* The options of idmerge.  */
+
+static struct option const merge_long_options[] =
+{
+  { "file", required_argument, 0, 'f' },
+  { "output", required_argument, 0, 'o' },
+  { "verbose", no_argument, 0, 'v' },
+  { "help", no_argument, &show_help, 1 },
+  { "version", no_argument, &show_version, 1 },
+  { "tree8", no_argument, NULL, TREE8_OPTION },
+  { "postings", no_argument, NULL, POSTINGS_OPTION },
   {NULL, 0, NULL, 0}
 };
 
 static void __attribute__((__noreturn__))
 help_me (void)
 {
+  if (mkid_mode == MKID_MODE_MERGE)
+    {
+      printf (_("\
+Usage: %s [OPTION]... ID-FILE...\n\
+"), program_name);
+      printf (_("\
+Merge ID databases of disjoint sets of files, such as those that\n\
+mkid --shard builds, into one, without scanning any files.\n\
+  -o, --output=OUTFILE    file name of ID database output\n\
+  -f, --file=OUTFILE      synonym for --output\n\
+  -v, --verbose           report what is merged\n\
+      --postings          store the files of every token in the smallest\n\
+                           form, as mkid --postings does\n\
+      --tree8             store them as a tree of bits (the default)\n\
+\n\
+      --help              display this help and exit\n\
+      --version           output version information and exit\n\
+\n\
+The output records the file status, trigrams and positions that all of\n\
+the ID-FILEs record.\n\
+"));
+      printf (_("\nReport bugs to " PACKAGE_BUGREPORT "\n\n"));
+      exit (EXIT_SUCCESS);
+    }
+
   printf (_("\
 Usage: %s [OPTION]... [FILE]...\n\
 "), program_name);
@@ -175,9 +611,30 @@ Build an identifier database.\n\
   -p, --prune=NAMES       exclude the named files and/or directories\n\
   -v, --verbose           report per file statistics\n\
   -s, --statistics        report statistics at end of run\n\
+      --stats[=FORMAT]    report statistics, with the time and resources\n\
+                           taken by each phase, as FORMAT `text' (the\n\
+                           default) or `json'\n\
+  -j, --jobs=N            scan N files, and read N directories, at once\n\
+                           (0 means one per processor)\n\
 \n\
       --files0-from=F     tokenize only the files specified by\n\
                            NUL-terminated names in file F\n\
+      --incremental       rescan only the files that have changed since\n\
+                           OUTFILE was built\n\
+      --trigrams          index the trigrams of token names, to speed up\n\
+                           substring and regular expression queries\n\
+      --postings          store the files of every token as the smallest\n\
+                           of a tree of bits, a list, a list of runs\n\
+                           and a bitmap; older versions of idutils\n\
+                           can't read the result\n\
+      --tree8             store them as a tree of bits (the default)\n\
+      --positions         record the lines on which each token occurs,\n\
+                           so that gid can go straight to them\n\
+      --shard=I/N         index only the Ith of N shards of the files,\n\
+                           for idmerge to combine with the others\n\
+      --memory-limit=SIZE  when the tokens take more than SIZE bytes,\n\
+                           write them to a temporary file and start\n\
+                           afresh, then merge those files at the end\n\
 \n\
        --help              display this help and exit\n\
       --version           output version information and exit\n\
@@ -230,8 +687,10 @@ main (int argc, char **argv)
 
   for (;;)
     {
-      int optc = getopt_long (argc, argv, "o:f:i:x:l:m:d:p:vVs",
-			      long_options, (int *) 0);
+      int optc = (mkid_mode == MKID_MODE_MERGE
+		  ? getopt_long (argc, argv, "o:f:v", merge_long_options, 0)
+		  : getopt_long (argc, argv, "o:f:i:x:l:m:d:p:j:vVs",
+				 long_options, (int *) 0));
       if (optc < 0)
 	break;
       switch (optc)
@@ -270,10 +729,63 @@ main (int argc, char **argv)
 	  prune_file_names (optarg, cw_dlink);
 	  break;
 
+	case 'j':
+	  {
+	    char *end;
+	    errno = 0;
+	    scan_jobs = strtol (optarg, &end, 10);
+	    if (errno || end == optarg || *end
+		|| scan_jobs < 0 || scan_jobs > MAX_SCAN_JOBS)
+	      error (EXIT_FAILURE, 0, _("invalid number of jobs: %s"),
+		     quote (optarg));
+	  }
+	  break;
+
 	case FILES0_FROM_OPTION:
 	  files_from = optarg;
 	  break;
 
+	case INCREMENTAL_OPTION:
+	  incremental_flag = 1;
+	  break;
+
+	case TRIGRAMS_OPTION:
+	  trigrams_flag = 1;
+	  break;
+
+	case TREE8_OPTION:
+	  tree8_flag = 1;
+	  break;
+
+	case POSTINGS_OPTION:
+	  tree8_flag = 0;
+	  break;
+
+	case POSITIONS_OPTION:
+	  positions_flag = 1;
+	  break;
+
+	case SHARD_OPTION:
+	  parse_shard (optarg);
+	  break;
+
+	case MEMORY_LIMIT_OPTION:
+	  parse_memory_limit (optarg);
+	  break;
+
+	case STATS_OPTION:
+	  if (optarg == 0 || strequ (optarg, "text"))
+	    stats_format = stats_text;
+	  else if (strequ (optarg, "json"))
+	    stats_format = stats_json;
+	  else
+	    {
+	      error (0, 0, _("invalid `--stats' format: `%s'"), optarg);
+	      usage ();
+	    }
+	  statistics_flag = 1;
+	  break;
+
 	case 'V':
 	  walker_verbose_flag = 1;
 	case 'v':
@@ -296,6 +808,37 @@ main (int argc, char **argv)
   if (show_help)
     help_me ();
 
+  if (mkid_mode == MKID_MODE_MERGE)
+    {
+      if (optind == argc)
+	{
+	  error (0, 0, _("no ID files to merge"));
+	  usage ();
+	}
+      assert_writeable (idh.idh_file_name);
+      merge_id_files (&idh, argc - optind, argv + optind);
+      exit (EXIT_SUCCESS);
+    }
+
+  if (scan_jobs == 0)
+    {
+#ifdef _SC_NPROCESSORS_ONLN
+      scan_jobs = sysconf (_SC_NPROCESSORS_ONLN);
+#endif
+      if (scan_jobs < 1)
+	scan_jobs = 1;
+      else if (scan_jobs > MAX_SCAN_JOBS)
+	scan_jobs = MAX_SCAN_JOBS;
+    }
+#if !PARALLEL_SCAN
+  if (scan_jobs > 1)
+    {
+      error (0, 0, _("parallel scanning is not supported on this system"));
+      scan_jobs = 1;
+    }
+#endif
+  walker_jobs = scan_jobs;
+
   nfiles = argc - optind;
 
   struct argv_iterator *ai;
@@ -333,6 +876,7 @@ main (int argc, char **argv)
   parse_language_map (lang_map_file_name);
 
   /* Walk the file and directory names given on the command line.  */
+  start_phase (PHASE_WALK);
   ok = true;
   while (true)
     {
@@ -401,7 +945,11 @@ main (int argc, char **argv)
   argv_iter_free (ai);
 
   heap_after_walk = get_process_heap();
+  stop_phase (PHASE_WALK);
 
+  start_phase (PHASE_MARK);
+  if (shard_count)
+    select_shard_members (&idh);
   mark_member_file_links (&idh);
   log_8_member_files = ceil_log_8 (idh.idh_member_file_table.ht_fill);
 
@@ -420,19 +968,40 @@ main (int argc, char **argv)
   /* hack end */
 
   current_hits_signature = xmalloc (log_8_member_files);
+  stop_phase (PHASE_MARK);
 
   /* If scannable files were given, then scan them.  */
   if (idh.idh_member_file_table.ht_fill)
     {
-      scan_files (&idh);
-      heap_after_scan = get_process_heap();
-
-      free_summary_tokens ();
-      free (token_table.ht_vec);
-      chdir_to_link (cw_dlink);
-      write_id_file (&idh);
+      if (incremental_flag)
+	{
+	  start_phase (PHASE_UPDATE);
+	  stat_member_files (&idh);
+	}
+      if (!incremental_flag || !update_id_file (&idh))
+	{
+	  if (incremental_flag)
+	    stop_phase (PHASE_UPDATE);
+	  start_phase (PHASE_SCAN);
+	  scan_files (&idh);
+	  heap_after_scan = get_process_heap();
+	  stop_phase (PHASE_SCAN);
+
+	  chdir_to_link (cw_dlink);
+	  if (spill_run_count)
+	    write_spilled_id_file (&idh);
+	  else
+	    {
+	      free_summary_tokens ();
+	      hash_free_slots (&token_table);
+	      write_id_file (&idh);
+	    }
+	}
+      else
+	stop_phase (PHASE_UPDATE);
 
-      if (statistics_flag)
+      /* Nothing is written if the ID file was already up to date.  */
+      if (statistics_flag && output_length)
 	report_statistics ();
     }
   else
@@ -495,6 +1064,195 @@ assert_writeable (char const *filename)
     }
 }
 
+/****************************************************************************/
+/* Sharding (--shard).  */
+
+/* Parse ARG, the I/N of --shard=I/N.  */
+
+static void
+parse_shard (char const *arg)
+{
+  char *end;
+  unsigned long i;
+
+  errno = 0;
+  i = strtoul (arg, &end, 10);
+  if (errno == 0 && end != arg && *end == '/')
+    {
+      char const *n_arg = end + 1;
+      shard_count = strtoul (n_arg, &end, 10);
+      if (errno == 0 && end != n_arg && *end == '\0'
+	  && 1 <= i && i <= shard_count)
+	{
+	  shard_index = i - 1;
+	  return;
+	}
+    }
+  error (EXIT_FAILURE, 0, _("invalid shard: %s"), quote (arg));
+}
+
+/* A group of member files that goes whole to one shard: those from
+   SG_FIRST of the sorted vector of shard_members, SG_COUNT of them.  */
+
+struct shard_group
+{
+  unsigned long sg_first;
+  unsigned long sg_count;
+};
+
+struct shard_member
+{
+  struct member_file *sm_member;
+  struct file_link *sm_group;
+  unsigned long sm_number;	/* in the whole tree */
+};
+
+/* Drop from IDHP the member files that belong to other shards than
+   this one.  The files of each top-level directory, that is, each
+   directory or file in the current directory, go to the same shard.
+   Largest first, each top-level directory goes to the shard that has
+   the fewest files so far.  Every mkid run given the same tree makes
+   the same choice, so each file is in exactly one shard.  */
+
+static void
+select_shard_members (struct idhead *idhp)
+{
+  unsigned long members = idhp->idh_member_file_table.ht_fill;
+  struct member_file **members_0
+    = (struct member_file **) hash_dump (&idhp->idh_member_file_table,
+					 0, member_file_qsort_compare);
+  struct shard_member *sm = xnmalloc (members, sizeof *sm);
+  struct shard_group *groups = xnmalloc (members, sizeof *groups);
+  unsigned long *loads = xcalloc (shard_count, sizeof *loads);
+  char *keep = xcalloc (members, 1);
+  unsigned long group_count = 0;
+  unsigned long kept = 0;
+  unsigned long i;
+
+  for (i = 0; i < members; i++)
+    {
+      sm[i].sm_member = members_0[i];
+      sm[i].sm_group = shard_group (members_0[i]->mf_link);
+      sm[i].sm_number = i;
+    }
+  qsort (sm, members, sizeof *sm, shard_member_qsort_cmp);
+  for (i = 0; i < members; i++)
+    {
+      if (i == 0 || sm[i].sm_group != sm[i - 1].sm_group)
+	{
+	  groups[group_count].sg_first = i;
+	  groups[group_count++].sg_count = 0;
+	}
+      groups[group_count - 1].sg_count++;
+    }
+  qsort (groups, group_count, sizeof *groups, shard_group_qsort_cmp);
+
+  for (i = 0; i < group_count; i++)
+    {
+      unsigned long shard = 0;
+      unsigned long j;
+
+      for (j = 1; j < shard_count; j++)
+	if (loads[j] < loads[shard])
+	  shard = j;
+      loads[shard] += groups[i].sg_count;
+      if (shard == shard_index)
+	for (j = groups[i].sg_first;
+	     j < groups[i].sg_first + groups[i].sg_count; j++)
+	  keep[sm[j].sm_number] = 1;
+    }
+
+  /* mark_member_file_links numbers the files that are kept in the
+     same order as the whole tree, so the Nth of them is the Nth in
+     shard_file_numbers.  */
+  shard_file_numbers = xnmalloc (members, sizeof *shard_file_numbers);
+  shard_members = members;
+  for (i = 0; i < members; i++)
+    if (keep[i])
+      shard_file_numbers[kept++] = i;
+    else
+      {
+	hash_delete (&idhp->idh_member_file_table, members_0[i]);
+	members_0[i]->mf_link->fl_flags &= ~FL_MEMBER;
+      }
+  if (verbose_flag)
+    printf (_("Shard %lu of %lu: %lu of %lu files\n"),
+	    shard_index + 1, shard_count, kept, members);
+
+  free (keep);
+  free (members_0);
+  free (loads);
+  free (groups);
+  free (sm);
+}
+
+/* The shard section holds the number of member files of the whole
+   tree, then the number in the whole tree of each member file of the
+   shard, so that idmerge can put them back in order.  */
+
+static void
+write_shard_files (struct idhead *idhp)
+{
+  struct id_section *section = find_id_section (idhp, IDS_SHARD);
+  struct id_output *ido = &idhp->idh_output;
+  uint64_t number = shard_members;
+  unsigned long i;
+
+  section->ids_offset = id_output_tell (ido);
+  io_write (ido, &number, 8, IO_TYPE_INT);
+  for (i = 0; i < idhp->idh_files; i++)
+    {
+      number = shard_file_numbers[i];
+      io_write (ido, &number, 8, IO_TYPE_INT);
+    }
+  section->ids_length = id_output_tell (ido) - section->ids_offset;
+}
+
+/* Return the top-level directory or file whose shard FLINK goes to:
+   its ancestor in the current directory, or, if it is elsewhere, in
+   the root directory.  */
+
+static struct file_link *
+shard_group (struct file_link *flink)
+{
+  while (flink->fl_parent != cw_dlink && !IS_ROOT_FILE_LINK (flink->fl_parent))
+    flink = flink->fl_parent;
+  return flink;
+}
+
+/* Order top-level links by name, those in the current directory
+   first, so that the order is the same from one run to the next.  */
+
+static int
+shard_group_cmp (struct file_link const *x, struct file_link const *y)
+{
+  int result = (x->fl_parent != cw_dlink) - (y->fl_parent != cw_dlink);
+  if (result)
+    return result;
+  return strcmp (x->fl_name, y->fl_name);
+}
+
+static int
+shard_member_qsort_cmp (void const *x, void const *y)
+{
+  return shard_group_cmp (((struct shard_member const *) x)->sm_group,
+			  ((struct shard_member const *) y)->sm_group);
+}
+
+/* Larger groups first, then in the order of shard_group_cmp, which is
+   that of sg_first.  */
+
+static int
+shard_group_qsort_cmp (void const *x, void const *y)
+{
+  struct shard_group const *gx = x;
+  struct shard_group const *gy = y;
+
+  if (gx->sg_count != gy->sg_count)
+    return gx->sg_count < gy->sg_count ? 1 : -1;
+  return (gx->sg_first > gy->sg_first) - (gx->sg_first < gy->sg_first);
+}
+
 /* Iterate over all eligible files (the members of the set of scannable files).
    Create a tree8 to store the set of files where a token occurs.  */
 
@@ -514,7 +1272,14 @@ scan_files (struct idhead const *idhp)
   else if (n > 1024*1024)
     n = 1024*1024;
 
-  hash_init (&token_table, n, token_hash_1, token_hash_2, token_hash_cmp);
+  /* A tagged table may fill to 7/8 rather than 15/16, but it probes
+     no further when it does, so half the slots serve as well.  With
+     --memory-limit, the tables start with no more slots than a
+     sixteenth of the limit holds, and grow as they fill.  */
+  run_table_slots = n / 2;
+  if (memory_limit && memory_limit / 16 / HASH_SLOT_SIZE < run_table_slots)
+    run_table_slots = memory_limit / 16 / HASH_SLOT_SIZE;
+  hash_init_tagged (&token_table, run_table_slots, token_hash, token_hash_cmp);
   if (verbose_flag) {
     char offstr[INT_BUFSIZE_BOUND(off_t)];
 
@@ -526,23 +1291,55 @@ scan_files (struct idhead const *idhp)
   init_hits_signature (0);
   init_summary ();
   obstack_init (&tokens_obstack);
+  if (positions_flag)
+    {
+      hash_init_tagged (&token_lines_table, run_table_slots, token_lines_hash,
+			token_lines_hash_cmp);
+      obstack_init (&token_lines_obstack);
+    }
+  if (incremental_flag)
+    obstack_init (&update_obstack);
 
   if (largest_member_file > MAX_LARGEST_MEMBER_FILE)
     largest_member_file = MAX_LARGEST_MEMBER_FILE;
-  scanner_buffer = xmalloc (largest_member_file + 1);
 
-  for (;;)
+  run_base = 0;
+  init_copy_groups (members, end - members);
+#if PARALLEL_SCAN
+  if (scan_jobs > 1 && end - members > 1)
+    scan_files_in_parallel (members, end - members, merge_file_scan);
+  else
+#endif
     {
-      const struct member_file *member = *members++;
-      scan_member_file (member);
-      if (members == end)
-	break;
-      if (current_hits_signature[0] & 0x80)
-	summarize ();
-      bump_current_hits_signature ();
+      scanner_buffer = xmalloc (largest_member_file + 1);
+      for (;;)
+	{
+	  const struct member_file *member = *members++;
+	  /* Only gather_file_tokens keeps apart the occurrences of a
+	     token in each file, which --incremental records.  */
+	  if (incremental_flag || find_copy_group (member))
+	    scan_member_file_copy (member);
+	  else
+	    scan_member_file (member);
+	  if (members == end)
+	    break;
+	  if (memory_limit && scan_memory_used () > memory_limit)
+	    {
+	      spill_run ((*members)->mf_index);
+	      restart_run ();
+	      continue;
+	    }
+	  if (current_hits_signature[0] & 0x80)
+	    summarize ();
+	  bump_current_hits_signature ();
+	}
+      free (scanner_buffer);
     }
 
-  free (scanner_buffer);
+  /* Once some tokens are spilled, so are the rest.  */
+  if (spill_run_count)
+    spill_run (idhp->idh_member_file_table.ht_fill);
+  free_copy_groups ();
   free (members_0);
 }
 
@@ -555,52 +1352,54 @@ scan_member_file (struct member_file const *member)
   struct language const *lang = lang_args->la_language;
   get_token_func_t get_token = lang->lg_get_token;
   struct file_link *flink = member->mf_link;
-  struct stat st;
-  FILE *source_FILE;
+  struct source_file source;
+  double start = 0;
 
   chdir_to_link (flink->fl_parent);
-  source_FILE = fopen (flink->fl_name, "r");
-  if (source_FILE)
+  if (statistics_flag)
+    start = wall_seconds ();
+  if (open_source_file (flink->fl_name, &source) == 0)
     {
       char *file_name = alloca (PATH_MAX);
       if (statistics_flag)
-	{
-	  if (fstat (fileno (source_FILE), &st) < 0)
-	    {
-	      maybe_relative_file_name (file_name, flink, cw_dlink);
-	      error (0, errno, _("can't stat `%s'"), file_name);
-	    }
-	  else
-	    input_chars += st.st_size;
-	}
+	input_chars += source.sf_end - source.sf_begin;
       if (verbose_flag)
 	{
 	  maybe_relative_file_name (file_name, flink, cw_dlink);
 	  printf ("%ld: %s: %s", member->mf_index, lang->lg_name, file_name);
 	  fflush (stdout);
 	}
-      scan_member_file_1 (get_token, lang_args->la_args_digested, source_FILE);
+      scan_member_file_1 (get_token, lang_args->la_args_digested, &source,
+			  member->mf_index);
       if (verbose_flag)
 	putchar ('\n');
-      fclose (source_FILE);
+      if (statistics_flag)
+	note_file_time (member, source.sf_end - source.sf_begin,
+			wall_seconds () - start);
+      close_source_file (&source);
     }
   else
     error (0, errno, _("can't open `%s'"), flink->fl_name);
 }
 
 /* Iterate over all tokens in the file, and merge the file's tree8
-   signature into the token table entry.  */
+   signature into the token table entry.  With --positions, add the
+   line of each token to its positions in the file numbered FILE.  */
 
 static void
-scan_member_file_1 (get_token_func_t get_token, void const *args, FILE *source_FILE)
+scan_member_file_1 (get_token_func_t get_token, void const *args,
+		    struct source_file *source, unsigned long file)
 {
   struct token **slot;
   struct token *token;
   int flags;
   int new_tokens = 0;
   int distinct_tokens = 0;
+  char const *in = source->sf_begin;
 
-  while ((token = (*get_token) (source_FILE, args, &flags)) != NULL)
+  if (positions_flag)
+    init_file_positions (&scan_positions, in);
+  while ((token = (*get_token) (&in, source->sf_end, args, &flags)) != NULL)
     {
       if (*TOKEN_NAME (token) == '\0') {
 	obstack_free (&tokens_obstack, token);
@@ -611,6 +1410,7 @@ scan_member_file_1 (get_token_func_t get_token, void const *args, FILE *source_F
 	{
 	  token->tok_flags = flags;
 	  token->tok_count = 1;
+	  tokens_size += OFFSETOF_TOKEN_NAME + strlen (TOKEN_NAME (token)) + 1;
 	  memset (TOKEN_HITS (token), 0, log_8_member_files);
 	  sign_token (token);
 	  if (verbose_flag)
@@ -634,6 +1434,14 @@ scan_member_file_1 (get_token_func_t get_token, void const *args, FILE *source_F
 		distinct_tokens++;
 	    }
 	}
+      if (positions_flag)
+	{
+	  count_file_lines (&scan_positions, in);
+	  add_token_line (get_token_lines (token), file,
+			  scan_positions.fps_line,
+			  (scan_positions.fps_line_start
+			   - scan_positions.fps_begin));
+	}
     }
   if (verbose_flag)
     {
@@ -643,426 +1451,3802 @@ scan_member_file_1 (get_token_func_t get_token, void const *args, FILE *source_F
     }
 }
 
-static void
-report_statistics (void)
-{
-  printf (_("Name=%ld, "), name_tokens);
-  printf (_("Number=%ld, "), number_tokens);
-  printf (_("String=%ld, "), string_tokens);
-  printf (_("Literal=%ld, "), literal_tokens);
-  printf (_("Comment=%ld\n"), comment_tokens);
+/* The distinct tokens of one member file, as gathered by
+   gather_file_tokens.  Each token carries its count of occurrences in
+   this file, but no hits: those are set when merge_file_scan adds it
+   to token_table.  */
 
-  printf (_("Files=%ld, "), idh.idh_files);
-  printf (_("Tokens=%ld, "), occurrences);
-  printf (_("Bytes=%ld Kb, "), input_chars / 1024);
-  printf (_("Heap=%llu+%llu Kb, "),
-	  (unsigned long long) ((char *) heap_after_scan
-				- (char *) heap_after_walk) / 1024,
-	  (unsigned long long) ((char *) heap_after_walk
-				- (char *) heap_initial) / 1024);
-  printf (_("Output=%ld (%ld tok, %ld hit)\n"),
-	  output_length, tokens_length, hits_length);
+struct file_scan
+{
+  struct obstack fs_tokens_obstack;	/* storage for fs_tokens */
+  struct token **fs_tokens;		/* null-terminated vector */
+  unsigned long fs_tokens_count;
+  struct file_positions fs_positions;	/* of fs_tokens, for --positions */
+  off_t fs_size;
+  uint64_t fs_hash;			/* of the contents, if fs_group */
+  struct copy_group *fs_group;		/* of files that may be copies */
+  struct file_copy *fs_copy;		/* an earlier file just the same */
+  double fs_seconds;			/* time taken to scan, if statistics */
+  int fs_open_errno;			/* nonzero if the file can't be read */
+  int fs_done;				/* ready to be merged */
+};
 
-  hash_print_stats (&token_table, stdout);
-  printf (_(", Freq=%ld/%ld=%.2f\n"), occurrences, token_table.ht_fill,
-	  (double) occurrences / (double) token_table.ht_fill);
-}
+/* The member files of one size and language, any of which may be a
+   copy of another, and the tokens of those of them that have been
+   scanned, kept until the last of them has been merged.  */
 
-/* As the database is written, may need to adjust the file names.  If
-   we are generating the ID file in a remote directory, then adjust
-   the file names to be relative to the location of the ID database.
+struct copy_group
+{
+  off_t cg_size;
+  struct lang_args const *cg_lang_args;
+  unsigned long cg_members;
+  unsigned long cg_pending;		/* members yet to be merged */
+  struct file_copy *cg_copies;
+};
 
-   (This would be a common usage if you want to make a database for a
-   directory which you have no write access to, so you cannot create
-   the ID file.)  */
+/* The tokens of a member file that has been scanned, and the hash of
+   its contents, for later files that turn out to be copies of it.  A
+   file_copy that is dropped from its group while files that copy it
+   are still to be merged is freed once the last of them is.  */
 
-static void
-write_id_file (struct idhead *idhp)
+struct file_copy
 {
-  struct token **tokens;
-  int i;
-  int buf_size;
-  int vec_size;
-  int tok_size;
-  int max_buf_size = 0;
-  int max_vec_size = 0;
+  struct file_copy *fc_next;
+  uint64_t fc_hash;
+  unsigned long fc_users;		/* copies of it yet to be merged */
+  int fc_dropped;			/* no longer in its group */
+  size_t fc_size;			/* bytes of fc_scan */
+  struct file_scan fc_scan;
+};
 
-  if (verbose_flag)
-    printf (_("Sorting tokens...\n"));
+static struct hash_table copy_group_table;
+#if PARALLEL_SCAN
+static pthread_mutex_t copy_lock = PTHREAD_MUTEX_INITIALIZER;
+# define LOCK_COPIES() pthread_mutex_lock (&copy_lock)
+# define UNLOCK_COPIES() pthread_mutex_unlock (&copy_lock)
+#else
+# define LOCK_COPIES()
+# define UNLOCK_COPIES()
+#endif
 
-  assert (summary_root->sum_hits_count == token_table.ht_fill);
-  tokens = xnrealloc (summary_root->sum_tokens,
-		      token_table.ht_fill, sizeof *tokens);
-  qsort (tokens, token_table.ht_fill, sizeof (struct token *), token_qsort_cmp);
+/* Scan COUNT files from MEMBERS, and pass the file_scan of each to
+   CONSUME in turn, along with its position in MEMBERS.  */
 
-  if (verbose_flag)
+static void
+gather_files (struct member_file **members, unsigned long count,
+	      file_scan_func_t consume)
+{
+  struct file_scan fs;
+  unsigned long i;
+
+#if PARALLEL_SCAN
+  if (scan_jobs > 1 && count > 1)
+    {
+      scan_files_in_parallel (members, count, consume);
+      return;
+    }
+#endif
+  scanner_buffer = xmalloc (largest_member_file + 1);
+  for (i = 0; i < count; i++)
+    {
+      gather_file_tokens (members[i], &fs);
+      (*consume) (members[i], &fs, i);
+      release_file_scan (&fs);
+    }
+  free (scanner_buffer);
+}
+
+#if PARALLEL_SCAN
+
+/* Scanning threads may run ahead of the merge by this many files per
+   thread, which bounds the memory held by unmerged file_scans.  */
+#define SCAN_WINDOW_PER_JOB 4
+
+struct scan_queue
+{
+  pthread_mutex_t sq_lock;
+  pthread_cond_t sq_scanned;		/* some file_scan became done */
+  pthread_cond_t sq_merged;		/* the window moved forward */
+  struct member_file **sq_members;
+  unsigned long sq_count;
+  unsigned long sq_next_scan;		/* next member to hand out */
+  unsigned long sq_next_merge;		/* next member to merge */
+  struct file_scan *sq_window;		/* ring of pending file_scans */
+  unsigned long sq_window_size;
+};
+
+/* Scan MEMBERS with a pool of threads, each of which gathers the
+   tokens of one file at a time into a file_scan.  The file_scans are
+   passed to CONSUME in the same order scan_files would have scanned
+   the files, so that merge_file_scan builds the same ID file as a
+   serial run.  */
+
+static void
+scan_files_in_parallel (struct member_file **members, unsigned long count,
+			file_scan_func_t consume)
+{
+  struct scan_queue sq;
+  pthread_t *threads;
+  unsigned long jobs = scan_jobs;
+  unsigned long i;
+  int err;
+
+  if (jobs > count)
+    jobs = count;
+
+  /* Scanning threads open member files relative to cw_dlink.  */
+  chdir_to_link (cw_dlink);
+
+  pthread_mutex_init (&sq.sq_lock, 0);
+  pthread_cond_init (&sq.sq_scanned, 0);
+  pthread_cond_init (&sq.sq_merged, 0);
+  sq.sq_members = members;
+  sq.sq_count = count;
+  sq.sq_next_scan = 0;
+  sq.sq_next_merge = 0;
+  sq.sq_window_size = jobs * SCAN_WINDOW_PER_JOB;
+  sq.sq_window = xcalloc (sq.sq_window_size, sizeof *sq.sq_window);
+
+  threads = xnmalloc (jobs, sizeof *threads);
+  for (i = 0; i < jobs; i++)
+    {
+      err = pthread_create (&threads[i], 0, scan_thread, &sq);
+      if (err)
+	error (EXIT_FAILURE, err, _("can't create scanning thread"));
+    }
+
+  for (i = 0;;)
+    {
+      struct file_scan *fs = &sq.sq_window[i % sq.sq_window_size];
+
+      pthread_mutex_lock (&sq.sq_lock);
+      while (!fs->fs_done)
+	pthread_cond_wait (&sq.sq_scanned, &sq.sq_lock);
+      pthread_mutex_unlock (&sq.sq_lock);
+
+      (*consume) (members[i], fs, i);
+      release_file_scan (fs);
+
+      pthread_mutex_lock (&sq.sq_lock);
+      fs->fs_done = 0;
+      sq.sq_next_merge++;
+      pthread_cond_broadcast (&sq.sq_merged);
+      pthread_mutex_unlock (&sq.sq_lock);
+
+      if (++i == count)
+	break;
+    }
+
+  for (i = 0; i < jobs; i++)
+    pthread_join (threads[i], 0);
+  free (threads);
+  free (sq.sq_window);
+  pthread_cond_destroy (&sq.sq_merged);
+  pthread_cond_destroy (&sq.sq_scanned);
+  pthread_mutex_destroy (&sq.sq_lock);
+}
+
+/* The body of a scanning thread: take the next member file from the
+   queue, wait for its slot in the window to come free, and scan it.  */
+
+static void *
+scan_thread (void *arg)
+{
+  struct scan_queue *sq = arg;
+
+  scanner_buffer = xmalloc (largest_member_file + 1);
+  for (;;)
+    {
+      struct file_scan *fs;
+      unsigned long i;
+
+      pthread_mutex_lock (&sq->sq_lock);
+      while (sq->sq_next_scan < sq->sq_count
+	     && sq->sq_next_scan - sq->sq_next_merge >= sq->sq_window_size)
+	pthread_cond_wait (&sq->sq_merged, &sq->sq_lock);
+      i = sq->sq_next_scan;
+      if (i < sq->sq_count)
+	sq->sq_next_scan++;
+      pthread_mutex_unlock (&sq->sq_lock);
+      if (i == sq->sq_count)
+	break;
+
+      fs = &sq->sq_window[i % sq->sq_window_size];
+      gather_file_tokens (sq->sq_members[i], fs);
+
+      pthread_mutex_lock (&sq->sq_lock);
+      fs->fs_done = 1;
+      pthread_cond_broadcast (&sq->sq_scanned);
+      pthread_mutex_unlock (&sq->sq_lock);
+    }
+  free (scanner_buffer);
+  return 0;
+}
+
+#endif /* PARALLEL_SCAN */
+
+/* Scan MEMBER into FS, keeping one token for each distinct name.  This
+   may run in a scanning thread, so it must not change directory, and
+   it leaves diagnostics to the consumer of FS so that they come out in
+   order.  */
+
+static void
+gather_file_tokens (struct member_file const *member, struct file_scan *fs)
+{
+  struct lang_args const *lang_args = member->mf_lang_args;
+  get_token_func_t get_token = lang_args->la_language->lg_get_token;
+  void const *args = lang_args->la_args_digested;
+  char *file_name = alloca (PATH_MAX);
+  struct hash_table file_table;
+  struct token **slot;
+  struct token *token;
+  struct source_file source;
+  char const *in;
+  int flags;
+
+  fs->fs_tokens = 0;
+  fs->fs_tokens_count = 0;
+  fs->fs_positions.fps_positions = 0;
+  fs->fs_positions.fps_alloc = 0;
+  fs->fs_copy = 0;
+  fs->fs_seconds = (statistics_flag ? wall_seconds () : 0);
+  /* Even a file that can't be read counts as merged in its group.  */
+  fs->fs_group = find_copy_group (member);
+
+  maybe_relative_file_name (file_name, member->mf_link, cw_dlink);
+  if (open_source_file (file_name, &source) < 0)
+    {
+      fs->fs_open_errno = errno;
+      return;
+    }
+  fs->fs_open_errno = 0;
+  fs->fs_size = source.sf_end - source.sf_begin;
+
+  /* A file that is the same as one already scanned isn't scanned
+     again: merge_file_scan takes the tokens of the other.  */
+  if (fs->fs_group)
+    {
+      fs->fs_hash = hash_bytes (source.sf_begin, fs->fs_size, 0);
+      LOCK_COPIES ();
+      fs->fs_copy = find_file_copy (fs->fs_group, fs->fs_hash);
+      if (fs->fs_copy)
+	fs->fs_copy->fc_users++;
+      UNLOCK_COPIES ();
+      if (fs->fs_copy)
+	{
+	  close_source_file (&source);
+	  if (statistics_flag)
+	    fs->fs_seconds = wall_seconds () - fs->fs_seconds;
+	  return;
+	}
+    }
+
+  obstack_init (&tokens_obstack);
+  hash_init_tagged (&file_table, 256, token_hash, token_hash_cmp);
+  in = source.sf_begin;
+  if (positions_flag)
+    init_file_positions (&fs->fs_positions, in);
+  while ((token = (*get_token) (&in, source.sf_end, args, &flags)) != NULL)
+    {
+      if (*TOKEN_NAME (token) == '\0')
+	{
+	  obstack_free (&tokens_obstack, token);
+	  continue;
+	}
+      slot = (struct token **) hash_find_slot (&file_table, token);
+      if (HASH_VACANT (*slot))
+	{
+	  token->tok_flags = flags;
+	  token->tok_count = 1;
+	  hash_insert_at (&file_table, token, slot);
+	}
+      else
+	{
+	  obstack_free (&tokens_obstack, token);
+	  token = *slot;
+	  token->tok_flags |= flags;
+	  if (token->tok_count < USHRT_MAX)
+	    token->tok_count++;
+	}
+      if (positions_flag)
+	note_token_position (&fs->fs_positions, token, in);
+    }
+  close_source_file (&source);
+  if (positions_flag)
+    sort_file_positions (&fs->fs_positions);
+  if (statistics_flag)
+    fs->fs_seconds = wall_seconds () - fs->fs_seconds;
+
+  fs->fs_tokens = (struct token **) hash_dump (&file_table, 0, 0);
+  fs->fs_tokens_count = file_table.ht_fill;
+  hash_free_slots (&file_table);
+
+  /* The tokens now belong to FS; the next file starts a new obstack.  */
+  fs->fs_tokens_obstack = tokens_obstack;
+}
+
+static void
+release_file_scan (struct file_scan *fs)
+{
+  free (fs->fs_positions.fps_positions);
+  fs->fs_positions.fps_positions = 0;
+  if (fs->fs_tokens == 0)
+    return;
+  free (fs->fs_tokens);
+  obstack_free (&fs->fs_tokens_obstack, 0);
+  fs->fs_tokens = 0;
+}
+
+/* Report the diagnostics that gathering the tokens of MEMBER into FS
+   produced, and, if verbose, begin its line of per-file statistics.
+   Return false if MEMBER couldn't be opened.  */
+
+static bool
+report_file_scan (struct member_file const *member,
+		  struct file_scan const *fs)
+{
+  char *file_name;
+
+  if (fs->fs_open_errno)
+    {
+      error (0, fs->fs_open_errno, _("can't open `%s'"),
+	     member->mf_link->fl_name);
+      return false;
+    }
+
+  file_name = alloca (PATH_MAX);
+  if (statistics_flag)
+    {
+      input_chars += fs->fs_size;
+      note_file_time (member, fs->fs_size, fs->fs_seconds);
+    }
+  if (verbose_flag)
+    {
+      maybe_relative_file_name (file_name, member->mf_link, cw_dlink);
+      printf ("%ld: %s: %s", member->mf_index,
+	      member->mf_lang_args->la_language->lg_name, file_name);
+    }
+  return true;
+}
+
+/* Merge the tokens gathered from MEMBER, the Ith file to be scanned,
+   into token_table, and sign them with its hits signature.  Apart from
+   the junk warnings the scanners print as they go, the output is the
+   same as that of scan_member_file.  */
+
+static void
+merge_file_scan (struct member_file const *member, struct file_scan *fs,
+		 unsigned long i)
+{
+  if (i > 0 && memory_limit && scan_memory_used () > memory_limit)
+    {
+      spill_run (member->mf_index);
+      restart_run ();
+    }
+  else if (i > 0)
+    {
+      if (current_hits_signature[0] & 0x80)
+	summarize ();
+      bump_current_hits_signature ();
+    }
+  add_file_scan (member, fs);
+}
+
+/* Merge the tokens gathered from MEMBER into token_table, or those of
+   the earlier file of which it is a copy, under the current hits
+   signature.  */
+
+static void
+add_file_scan (struct member_file const *member, struct file_scan *fs)
+{
+  struct file_scan const *scan = fs->fs_copy ? &fs->fs_copy->fc_scan : fs;
+  struct token **tokens = scan->fs_tokens;
+  int new_tokens = 0;
+  int distinct_tokens = 0;
+
+  if (!report_file_scan (member, fs))
+    {
+      note_file_copy (member, fs);
+      return;
+    }
+  if (fs->fs_copy)
+    {
+      copied_files++;
+      copied_bytes += fs->fs_size;
+    }
+
+  for (; *tokens; tokens++)
+    {
+      struct token *file_token = *tokens;
+      struct token **slot
+	= (struct token **) hash_find_slot (&token_table, file_token);
+      struct token *token;
+
+      if (HASH_VACANT (*slot))
+	{
+	  size_t size = (OFFSETOF_TOKEN_NAME
+			 + strlen (TOKEN_NAME (file_token)) + 1);
+	  token = obstack_copy (&tokens_obstack, file_token, size);
+	  tokens_size += size;
+	  memset (TOKEN_HITS (token), 0, log_8_member_files);
+	  sign_token (token);
+	  new_tokens++;
+	  distinct_tokens++;
+	  hash_insert_at (&token_table, token, slot);
+	}
+      else
+	{
+	  unsigned int count;
+
+	  token = *slot;
+	  token->tok_flags |= file_token->tok_flags;
+	  count = token->tok_count + file_token->tok_count;
+	  token->tok_count = (count < USHRT_MAX ? count : USHRT_MAX);
+	  if (!(TOKEN_HITS (token)[0] & current_hits_signature[0]))
+	    {
+	      sign_token (token);
+	      distinct_tokens++;
+	    }
+	}
+      if (incremental_flag)
+	{
+	  struct update_hit hit;
+
+	  hit.uh_token = token;
+	  hit.uh_file = member->mf_index;
+	  hit.uh_count = file_token->tok_count;
+	  hit.uh_flags = file_token->tok_flags;
+	  obstack_grow (&update_obstack, &hit, sizeof hit);
+	}
+      if (positions_flag)
+	post_token_positions (token, member->mf_index,
+			      find_file_positions (&scan->fs_positions,
+						   file_token),
+			      (scan->fs_positions.fps_positions
+			       + scan->fs_positions.fps_count));
+    }
+
+  if (verbose_flag)
+    {
+      printf (_("  new = %d/%d"), new_tokens, distinct_tokens);
+      if (distinct_tokens != 0)
+	printf (" = %.0f%%", 100.0 * (double) new_tokens / (double) distinct_tokens);
+      if (fs->fs_copy)
+	printf (_("  (a copy)"));
+      putchar ('\n');
+    }
+  note_file_copy (member, fs);
+}
+
+/****************************************************************************/
+/* Copies of member files.  */
+
+/* Scan MEMBER, which may be a copy of a file already scanned, in the
+   way the scanning threads do, so that its tokens can be kept for
+   later copies of it, or so that it needn't be scanned at all, and so
+   that their occurrences in it are counted apart from the rest.  */
+
+static void
+scan_member_file_copy (struct member_file const *member)
+{
+  struct obstack scan_tokens_obstack = tokens_obstack;
+  struct file_scan fs;
+
+  /* gather_file_tokens opens files relative to cw_dlink, and hands its
+     own tokens_obstack to FS.  */
+  chdir_to_link (cw_dlink);
+  gather_file_tokens (member, &fs);
+  tokens_obstack = scan_tokens_obstack;
+  add_file_scan (member, &fs);
+  release_file_scan (&fs);
+}
+
+/* Divide the COUNT MEMBERS into groups of one size and language, as
+   the walk found them.  Only the members of groups of more than one
+   are fingerprinted as they are scanned.  */
+
+static void
+init_copy_groups (struct member_file **members, unsigned long count)
+{
+  unsigned long i;
+
+  hash_init (&copy_group_table, count, copy_group_hash, 0,
+	     copy_group_hash_cmp);
+  for (i = 0; i < count; i++)
+    {
+      struct copy_group key;
+      struct copy_group **slot;
+
+      if (members[i]->mf_size <= 0)
+	continue;
+      key.cg_size = members[i]->mf_size;
+      key.cg_lang_args = members[i]->mf_lang_args;
+      slot = (struct copy_group **) hash_find_slot (&copy_group_table, &key);
+      if (HASH_VACANT (*slot))
+	{
+	  struct copy_group *group = xmalloc (sizeof *group);
+	  *group = key;
+	  group->cg_members = 0;
+	  group->cg_copies = 0;
+	  hash_insert_at (&copy_group_table, group, slot);
+	}
+      (*slot)->cg_members++;
+      (*slot)->cg_pending = (*slot)->cg_members;
+    }
+}
+
+static void
+free_copy_groups (void)
+{
+  void **slot = copy_group_table.ht_vec;
+  void **end = &copy_group_table.ht_vec[copy_group_table.ht_size];
+
+  if (verbose_flag && copied_files)
+    printf (_("%lu files were copies of others\n"), copied_files);
+  for (; slot < end; slot++)
+    if (!HASH_VACANT (*slot))
+      drop_file_copies (*slot);
+  hash_free (&copy_group_table, 1);
+}
+
+/* Return the group of MEMBER, if other members may be copies of it.  */
+
+static struct copy_group *
+find_copy_group (struct member_file const *member)
+{
+  struct copy_group key;
+  struct copy_group *group;
+
+  if (copy_group_table.ht_vec == 0 || member->mf_size <= 0)
+    return 0;
+  key.cg_size = member->mf_size;
+  key.cg_lang_args = member->mf_lang_args;
+  /* Even a lookup changes the table's cache of the last slot.  */
+  LOCK_COPIES ();
+  group = hash_find_item (&copy_group_table, &key);
+  UNLOCK_COPIES ();
+  return group && group->cg_members > 1 ? group : 0;
+}
+
+/* Return the file of GROUP whose contents have HASH, if any has been
+   scanned.  */
+
+static struct file_copy *
+find_file_copy (struct copy_group const *group, uint64_t hash)
+{
+  struct file_copy *fc;
+
+  for (fc = group->cg_copies; fc; fc = fc->fc_next)
+    if (fc->fc_hash == hash)
+      return fc;
+  return 0;
+}
+
+/* Note that MEMBER, scanned into FS, has been merged.  Keep its tokens
+   if later members of its group may be copies of it; once the last of
+   the group is merged, free the tokens kept for it.  */
+
+static void
+note_file_copy (struct member_file const *member, struct file_scan *fs)
+{
+  struct copy_group *group = fs->fs_group;
+  struct file_copy *copy = fs->fs_copy;
+
+  if (group == 0)
+    return;
+  LOCK_COPIES ();
+  if (copy && --copy->fc_users == 0 && copy->fc_dropped)
+    free_file_copy (copy);
+  if (--group->cg_pending == 0)
+    drop_file_copies (group);
+  else if (copy == 0 && fs->fs_tokens
+	   && find_file_copy (group, fs->fs_hash) == 0)
+    {
+      struct file_copy *fc = xmalloc (sizeof *fc);
+
+      fc->fc_hash = fs->fs_hash;
+      fc->fc_users = 0;
+      fc->fc_dropped = 0;
+      fc->fc_size = file_scan_size (fs);
+      fc->fc_scan = *fs;
+      fc->fc_next = group->cg_copies;
+      group->cg_copies = fc;
+      kept_copies_size += fc->fc_size;
+      fs->fs_tokens = 0;
+      fs->fs_positions.fps_positions = 0;
+    }
+  UNLOCK_COPIES ();
+}
+
+/* Drop the tokens kept for copies in GROUP, freeing those that no
+   file waiting to be merged takes.  */
+
+static void
+drop_file_copies (struct copy_group *group)
+{
+  struct file_copy *fc = group->cg_copies;
+
+  while (fc)
+    {
+      struct file_copy *next = fc->fc_next;
+
+      if (fc->fc_users == 0)
+	free_file_copy (fc);
+      else
+	fc->fc_dropped = 1;
+      fc = next;
+    }
+  group->cg_copies = 0;
+}
+
+/* Drop the tokens kept for copies in every group, as a run of tokens
+   is spilled, so that they take no more than --memory-limit allows.
+   Later copies of the files are scanned again.  */
+
+static void
+evict_file_copies (void)
+{
+  void **slot;
+  void **end;
+
+  if (copy_group_table.ht_vec == 0)
+    return;
+  LOCK_COPIES ();
+  end = &copy_group_table.ht_vec[copy_group_table.ht_size];
+  for (slot = copy_group_table.ht_vec; slot < end; slot++)
+    if (!HASH_VACANT (*slot))
+      drop_file_copies (*slot);
+  UNLOCK_COPIES ();
+}
+
+static void
+free_file_copy (struct file_copy *fc)
+{
+  kept_copies_size -= fc->fc_size;
+  release_file_scan (&fc->fc_scan);
+  free (fc);
+}
+
+/* Return the bytes taken by the tokens and positions of FS.  */
+
+static size_t
+file_scan_size (struct file_scan const *fs)
+{
+  return (obstack_memory_used ((struct obstack *) &fs->fs_tokens_obstack)
+	  + (fs->fs_tokens_count + 1) * sizeof *fs->fs_tokens
+	  + (fs->fs_positions.fps_alloc
+	     * sizeof *fs->fs_positions.fps_positions));
+}
+
+static unsigned long
+copy_group_hash (void const *key)
+{
+  struct copy_group const *group = key;
+  return hash_integer ((uint64_t) group->cg_size
+		       ^ ((uint64_t) (uintptr_t) group->cg_lang_args << 17));
+}
+
+static int
+copy_group_hash_cmp (void const *x, void const *y)
+{
+  struct copy_group const *gx = x;
+  struct copy_group const *gy = y;
+
+  if (gx->cg_size != gy->cg_size)
+    return gx->cg_size < gy->cg_size ? -1 : 1;
+  return_ADDRESS_COMPARE (gx->cg_lang_args, gy->cg_lang_args);
+}
+
+static void
+report_statistics (void)
+{
+  if (stats_format == stats_json)
+    {
+      report_statistics_json ();
+      return;
+    }
+
+  printf (_("Name=%ld, "), name_tokens);
+  printf (_("Number=%ld, "), number_tokens);
+  printf (_("String=%ld, "), string_tokens);
+  printf (_("Literal=%ld, "), literal_tokens);
+  printf (_("Comment=%ld\n"), comment_tokens);
+
+  printf (_("Files=%ld, "), idh.idh_files);
+  printf (_("Copies=%lu (%ju Kb), "), copied_files, copied_bytes / 1024);
+  printf (_("Tokens=%ld, "), occurrences);
+  printf (_("Bytes=%ld Kb, "), input_chars / 1024);
+  printf (_("Heap=%llu+%llu Kb, "),
+	  (unsigned long long) ((char *) heap_after_scan
+				- (char *) heap_after_walk) / 1024,
+	  (unsigned long long) ((char *) heap_after_walk
+				- (char *) heap_initial) / 1024);
+  printf (_("Output=%ld (%ld tok, %ld hit)\n"),
+	  output_length, tokens_length, hits_length);
+  if (spilled_runs)
+    printf (_("Spilled=%lu runs, Merges=%lu, Temporary=%ju Kb\n"),
+	    spilled_runs, spill_merges, spilled_bytes / 1024);
+
+  hash_print_stats (&token_table, stdout);
+  printf (_(", Freq=%ld/%ld=%.2f\n"), occurrences, token_table.ht_fill,
+	  (double) occurrences / (double) token_table.ht_fill);
+  report_phases_text ();
+}
+
+/* Sample the resources used by the process so far.  */
+
+static void
+get_usage (struct usage *u)
+{
+  memset (u, 0, sizeof *u);
+  u->u_wall = wall_seconds ();
+#if HAVE_GETRUSAGE && HAVE_SYS_RESOURCE_H
+  struct rusage ru;
+  if (getrusage (RUSAGE_SELF, &ru) == 0)
+    {
+      u->u_user = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6;
+      u->u_system = ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+      u->u_maxrss = ru.ru_maxrss;
+      u->u_read_bytes = ru.ru_inblock * 512ULL;
+      u->u_write_bytes = ru.ru_oublock * 512ULL;
+    }
+#endif
+}
+
+static double
+wall_seconds (void)
+{
+  struct timeval tv;
+  gettimeofday (&tv, 0);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static char const *
+phase_name (int phase)
+{
+  switch (phase)
+    {
+    case PHASE_WALK: return "walk";
+    case PHASE_MARK: return "mark";
+    case PHASE_UPDATE: return "update";
+    case PHASE_SCAN: return "scan";
+    case PHASE_SORT: return "sort";
+    case PHASE_SPILL: return "spill";
+    case PHASE_WRITE: return "write";
+    default: return "summarize";
+    }
+}
+
+static void
+start_phase (int phase)
+{
+  if (statistics_flag)
+    get_usage (&phases[phase].ph_start);
+}
+
+/* Add the resources used since the matching start_phase to the total
+   for PHASE.  The peak resident set size is that of the process when
+   the phase last ended.  */
+
+static void
+stop_phase (int phase)
+{
+  struct phase *ph = &phases[phase];
+  struct usage now;
+
+  if (!statistics_flag)
+    return;
+  get_usage (&now);
+  ph->ph_total.u_wall += now.u_wall - ph->ph_start.u_wall;
+  ph->ph_total.u_user += now.u_user - ph->ph_start.u_user;
+  ph->ph_total.u_system += now.u_system - ph->ph_start.u_system;
+  ph->ph_total.u_maxrss = now.u_maxrss;
+  ph->ph_total.u_read_bytes += now.u_read_bytes - ph->ph_start.u_read_bytes;
+  ph->ph_total.u_write_bytes += now.u_write_bytes - ph->ph_start.u_write_bytes;
+  ph->ph_runs++;
+}
+
+/* Tally the SECONDS it took to scan the BYTES of MEMBER by language,
+   and remember MEMBER if it is one of the slowest files.  */
+
+static void
+note_file_time (struct member_file const *member, off_t bytes,
+		double seconds)
+{
+  struct language const *lang = member->mf_lang_args->la_language;
+  struct lang_time *lt;
+  int i;
+
+  for (lt = lang_times; lt; lt = lt->lt_next)
+    if (lt->lt_language == lang)
+      break;
+  if (lt == 0)
+    {
+      lt = xcalloc (1, sizeof *lt);
+      lt->lt_language = lang;
+      lt->lt_next = lang_times;
+      lang_times = lt;
+    }
+  lt->lt_files++;
+  lt->lt_bytes += bytes;
+  lt->lt_seconds += seconds;
+
+  i = slowest_files_count;
+  if (i == SLOWEST_FILES)
+    {
+      if (seconds <= slowest_files[i - 1].ft_seconds)
+	return;
+      i--;
+    }
+  else
+    slowest_files_count++;
+  for (; i > 0 && slowest_files[i - 1].ft_seconds < seconds; i--)
+    slowest_files[i] = slowest_files[i - 1];
+  slowest_files[i].ft_link = member->mf_link;
+  slowest_files[i].ft_bytes = bytes;
+  slowest_files[i].ft_seconds = seconds;
+}
+
+static void
+report_phases_text (void)
+{
+  char *file_name = alloca (PATH_MAX);
+  struct lang_time *lt;
+  int i;
+
+  printf (_("%-14s %9s %9s %9s %10s %10s %10s\n"), _("Phase"), _("Wall"),
+	  _("User"), _("System"), _("MaxRSS Kb"), _("Read Kb"), _("Write Kb"));
+  for (i = 0; i < PHASE_COUNT; i++)
+    {
+      struct usage const *u = &phases[i].ph_total;
+      char name[32];
+
+      if (phases[i].ph_runs == 0)
+	continue;
+      if (i >= PHASE_SUMMARIZE && i < PHASE_SORT)
+	sprintf (name, "  %s %d", phase_name (i), i - PHASE_SUMMARIZE);
+      else
+	strcpy (name, phase_name (i));
+      printf ("%-14s %9.3f %9.3f %9.3f %10ld %10llu %10llu\n", name,
+	      u->u_wall, u->u_user, u->u_system, u->u_maxrss,
+	      u->u_read_bytes / 1024, u->u_write_bytes / 1024);
+    }
+
+  if (lang_times)
+    printf (_("%-14s %9s %10s %9s %10s\n"), _("Language"), _("Files"),
+	    _("Kb"), _("Seconds"), _("Kb/s"));
+  for (lt = lang_times; lt; lt = lt->lt_next)
+    printf ("%-14s %9lu %10llu %9.3f %10.0f\n", lt->lt_language->lg_name,
+	    lt->lt_files, lt->lt_bytes / 1024, lt->lt_seconds,
+	    lt->lt_seconds > 0 ? lt->lt_bytes / 1024.0 / lt->lt_seconds : 0);
+
+  if (slowest_files_count)
+    printf (_("Slowest files:\n"));
+  for (i = 0; i < slowest_files_count; i++)
+    {
+      maybe_relative_file_name (file_name, slowest_files[i].ft_link, cw_dlink);
+      printf ("%9.3f s %10llu Kb  %s\n", slowest_files[i].ft_seconds,
+	      (unsigned long long) slowest_files[i].ft_bytes / 1024, file_name);
+    }
+}
+
+/* Report the same statistics as report_statistics, as one JSON
+   object, for programs that track the cost of building ID files.  */
+
+static void
+report_statistics_json (void)
+{
+  char *file_name = alloca (PATH_MAX);
+  struct lang_time *lt;
+  char const *sep;
+  int i;
+
+  printf ("{\n  \"tokens\": {\"name\": %lu, \"number\": %lu, "
+	  "\"string\": %lu, \"literal\": %lu, \"comment\": %lu, "
+	  "\"occurrences\": %lu, \"distinct\": %lu},\n",
+	  name_tokens, number_tokens, string_tokens, literal_tokens,
+	  comment_tokens, occurrences, token_table.ht_fill);
+  printf ("  \"files\": %lu,\n  \"input_bytes\": %lu,\n",
+	  (unsigned long) idh.idh_files, input_chars);
+  printf ("  \"copies\": {\"files\": %lu, \"bytes\": %ju},\n",
+	  copied_files, copied_bytes);
+  printf ("  \"spill\": {\"runs\": %lu, \"merges\": %lu, \"bytes\": %ju},\n",
+	  spilled_runs, spill_merges, spilled_bytes);
+  printf ("  \"heap_kb\": {\"walk\": %llu, \"scan\": %llu},\n",
+	  (unsigned long long) ((char *) heap_after_walk
+				- (char *) heap_initial) / 1024,
+	  (unsigned long long) ((char *) heap_after_scan
+				- (char *) heap_after_walk) / 1024);
+  printf ("  \"output\": {\"bytes\": %lu, \"tokens\": %lu, "
+	  "\"hits\": %lu},\n", output_length, tokens_length, hits_length);
+  printf ("  \"token_table\": {\"fill\": %lu, \"size\": %lu, "
+	  "\"rehashes\": %u, \"collisions\": %lu, \"lookups\": %lu},\n",
+	  token_table.ht_fill, token_table.ht_size, token_table.ht_rehashes,
+	  token_table.ht_collisions, token_table.ht_lookups);
+
+  printf ("  \"phases\": [");
+  sep = "\n";
+  for (i = 0; i < PHASE_COUNT; i++)
+    {
+      struct usage const *u = &phases[i].ph_total;
+
+      if (phases[i].ph_runs == 0)
+	continue;
+      if (i >= PHASE_SUMMARIZE && i < PHASE_SORT)
+	printf ("%s    {\"name\": \"summarize\", \"level\": %d, ",
+		sep, i - PHASE_SUMMARIZE);
+      else
+	printf ("%s    {\"name\": \"%s\", ", sep, phase_name (i));
+      printf ("\"runs\": %lu, \"wall\": %.6f, \"user\": %.6f, "
+	      "\"system\": %.6f, \"maxrss_kb\": %ld, \"read_bytes\": %llu, "
+	      "\"write_bytes\": %llu}",
+	      phases[i].ph_runs, u->u_wall, u->u_user, u->u_system,
+	      u->u_maxrss, u->u_read_bytes, u->u_write_bytes);
+      sep = ",\n";
+    }
+  printf ("\n  ],\n");
+
+  printf ("  \"languages\": [");
+  sep = "\n";
+  for (lt = lang_times; lt; lt = lt->lt_next)
+    {
+      printf ("%s    {\"name\": ", sep);
+      print_json_string (lt->lt_language->lg_name);
+      printf (", \"files\": %lu, \"bytes\": %llu, \"seconds\": %.6f, "
+	      "\"bytes_per_second\": %.0f}",
+	      lt->lt_files, lt->lt_bytes, lt->lt_seconds,
+	      lt->lt_seconds > 0 ? lt->lt_bytes / lt->lt_seconds : 0);
+      sep = ",\n";
+    }
+  printf ("\n  ],\n");
+
+  printf ("  \"slowest_files\": [");
+  sep = "\n";
+  for (i = 0; i < slowest_files_count; i++)
+    {
+      maybe_relative_file_name (file_name, slowest_files[i].ft_link, cw_dlink);
+      printf ("%s    {\"name\": ", sep);
+      print_json_string (file_name);
+      printf (", \"bytes\": %llu, \"seconds\": %.6f}",
+	      (unsigned long long) slowest_files[i].ft_bytes,
+	      slowest_files[i].ft_seconds);
+      sep = ",\n";
+    }
+  printf ("\n  ]\n}\n");
+}
+
+/* Print STR as a JSON string.  Bytes beyond ASCII pass through as
+   they are, which is right for file names in UTF-8.  */
+
+static void
+print_json_string (char const *str)
+{
+  unsigned char const *p = (unsigned char const *) str;
+
+  putchar ('"');
+  for (; *p; p++)
+    {
+      if (*p == '"' || *p == '\\')
+	printf ("\\%c", *p);
+      else if (*p < 0x20)
+	printf ("\\u%04x", *p);
+      else
+	putchar (*p);
+    }
+  putchar ('"');
+}
+
+/* As the database is written, may need to adjust the file names.  If
+   we are generating the ID file in a remote directory, then adjust
+   the file names to be relative to the location of the ID database.
+
+   (This would be a common usage if you want to make a database for a
+   directory which you have no write access to, so you cannot create
+   the ID file.)  */
+
+static void
+write_id_file (struct idhead *idhp)
+{
+  struct token **tokens;
+  off_t *token_offsets;
+  off_t off;
+  int i;
+  unsigned long buf_size;
+  int vec_size;
+  int tok_size;
+  unsigned long member_files = idhp->idh_member_file_table.ht_fill;
+  int tree8_levels = tree8_count_levels (member_files);
+  unsigned long *files = 0;
+  struct update_hit *hits = 0;
+  struct update_hit const *hit = 0;
+  struct update_hit const *hits_end = 0;
+  struct token_tally *tallies = 0;
+  struct obstack tree8_obstack;
+
+  if (verbose_flag)
+    printf (_("Sorting tokens...\n"));
+
+  assert (summary_root->sum_hits_count == token_table.ht_fill);
+  start_phase (PHASE_SORT);
+  tokens = xnrealloc (summary_root->sum_tokens,
+		      token_table.ht_fill, sizeof *tokens);
+  sort_by_name ((void **) tokens, token_table.ht_fill, OFFSETOF_TOKEN_NAME);
+  if (incremental_flag)
+    {
+      unsigned long hits_count;
+
+      hits = finish_update_hits (&hits_count);
+      hit = hits;
+      hits_end = hits + hits_count;
+      tallies = xnmalloc (member_files, sizeof *tallies);
+    }
+  stop_phase (PHASE_SORT);
+  start_phase (PHASE_WRITE);
+
+  off = begin_id_file (idhp, token_table.ht_fill);
+
+  token_offsets = xnmalloc (token_table.ht_fill, sizeof *token_offsets);
+  if (!tree8_flag)
+    files = xnmalloc (member_files, sizeof *files);
+  if (positions_flag)
+    ordered_token_lines = xnmalloc (token_table.ht_fill,
+				    sizeof *ordered_token_lines);
+  obstack_init (&tree8_obstack);
+  for (i = 0; i < token_table.ht_fill; i++, tokens++)
+    {
+      struct token *token = *tokens;
+
+      token_offsets[i] = off;
+      vec_size = count_vec_size (summary_root, TOKEN_HITS (token) + levels);
+      write_hits (&tree8_obstack, summary_root, TOKEN_HITS (token) + levels);
+      if (files)
+	tree8_file_numbers (obstack_base (&tree8_obstack), tree8_levels, files);
+      buf_size = write_token_hits (&idhp->idh_output, TOKEN_NAME (token),
+				   token->tok_flags, token->tok_count,
+				   &tree8_obstack, files, vec_size, &tok_size);
+      hits_length += buf_size;
+      off += tok_size + buf_size + 2;
+      note_token_size (idhp, TOKEN_NAME (token), buf_size, vec_size);
+      if (tallies)
+	put_token_tallies (tallies, take_token_tallies (token, &hit, hits_end,
+							tallies));
+      if (trigrams_flag)
+	add_token_trigrams (TOKEN_NAME (token), i);
+      if (positions_flag)
+	{
+	  ordered_token_lines[i] = get_token_lines (token);
+	  finish_token_lines (ordered_token_lines[i]);
+	}
+    }
+  assert (check_hits (summary_root) == 0);
+  obstack_free (&tree8_obstack, 0);
+  free (files);
+  if (incremental_flag)
+    {
+      obstack_free (&update_obstack, 0);
+      free (tallies);
+    }
+  finish_id_file (idhp, off, token_offsets);
+  free (token_offsets);
+  stop_phase (PHASE_WRITE);
+}
+
+/* Create the ID file, and write everything that precedes the token
+   entries, leaving room for the offsets of TOKENS entries.  Return the
+   offset of the first token entry.  */
+
+static off_t
+begin_id_file (struct idhead *idhp, unsigned long tokens)
+{
+  struct id_output *ido = &idhp->idh_output;
+
+  if (verbose_flag)
     printf (_("Writing `%s'...\n"), idhp->idh_file_name);
-  idhp->idh_FILE = fopen (idhp->idh_file_name, "w+b");
-  if (idhp->idh_FILE == NULL)
-    error (EXIT_FAILURE, errno, _("can't create `%s'"), idhp->idh_file_name);
+  open_id_output (&idhp->idh_output, create_id_file (idhp->idh_file_name));
+
+  idhp->idh_magic[0] = IDH_MAGIC_0;
+  idhp->idh_magic[1] = IDH_MAGIC_1;
+  idhp->idh_flags = IDH_COUNTS | IDH_TOKEN_INDEX;
+  idhp->idh_tokens = tokens;
+  idhp->idh_version = choose_id_file_version (idhp);
+  idhp->idh_buf_size = 0;
+  idhp->idh_vec_size = 0;
+  idhp->idh_section_count = 0;
+  if (incremental_flag)
+    {
+      add_id_section (idhp, IDS_MEMBER_STATS);
+      add_id_section (idhp, IDS_TOKEN_TALLIES);
+      obstack_init (&tallies_obstack);
+    }
+  if (trigrams_flag)
+    {
+      add_id_section (idhp, IDS_TRIGRAMS);
+      init_trigrams ();
+    }
+  if (positions_flag)
+    {
+      idhp->idh_flags |= IDH_POSITIONS;
+      add_id_section (idhp, IDS_POSITIONS);
+    }
+  if (shard_count)
+    add_id_section (idhp, IDS_SHARD);
+
+  /* write out the list of pathnames */
+
+  id_output_seek (ido, sizeof_idhead (idhp));
+  idhp->idh_flinks_offset = id_output_tell (ido);
+  serialize_file_links (idhp);
+
+  /* leave room for the token offsets, which come before the tokens
+     so that older readers, which scan the tokens up to end of file,
+     don't trip over them */
+
+  id_output_putc (ido, '\0');
+  id_output_putc (ido, '\0');
+  idhp->idh_index_offset = id_output_tell (ido);
+  id_output_seek (ido, (idhp->idh_index_offset
+			+ ((off_t) tokens
+			   * IDH_TOKEN_INDEX_BYTES (idhp->idh_version))));
+
+  /* write out the list of identifiers */
+
+  id_output_putc (ido, '\0');
+  id_output_putc (ido, '\0');
+  idhp->idh_tokens_offset = id_output_tell (ido);
+  return idhp->idh_tokens_offset;
+}
+
+/* Write the name, flags and count of a token entry, and tally them in
+   the statistics.  Return the number of bytes written.  */
+
+static int
+write_token_header (struct id_output *ido, char const *name, int flags,
+		    unsigned int count)
+{
+  int tok_size = strlen (name) + 1;
+
+  occurrences += count;
+  if (flags & TOK_NUMBER)
+    number_tokens++;
+  if (flags & TOK_NAME)
+    name_tokens++;
+  if (flags & TOK_STRING)
+    string_tokens++;
+  if (flags & TOK_LITERAL)
+    literal_tokens++;
+  if (flags & TOK_COMMENT)
+    comment_tokens++;
+  tokens_length += tok_size;
+
+  id_output_write (ido, name, tok_size);
+  if (count > 0xff)
+    flags |= TOK_SHORT_COUNT;
+  id_output_putc (ido, flags);
+  id_output_putc (ido, count & 0xff);
+  if (flags & TOK_SHORT_COUNT)
+    id_output_putc (ido, count >> 8);
+  return tok_size + 1 + (flags & TOK_SHORT_COUNT ? 2 : 1);
+}
+
+/* Write a token entry: the name, flags and count, then the hits, and
+   the `\0\0' that ends it.  The token occurs in the N files numbered
+   in the ascending vector FILES, and its tree8 is the object growing
+   on TREE8_OBSTACK, which is freed.  Write the tree8, or, unless FILES
+   is null, whichever hits postings container is smaller.  Store the
+   number of bytes that precede the hits in *TOK_SIZE, and return the
+   number of bytes of hits.  */
+
+static unsigned long
+write_token_hits (struct id_output *ido, char const *name, int flags,
+		  unsigned int count, struct obstack *tree8_obstack,
+		  unsigned long const *files, unsigned long n, int *tok_size)
+{
+  unsigned long buf_size = obstack_object_size (tree8_obstack);
+  unsigned char *tree8 = obstack_finish (tree8_obstack);
+  int kind = files ? choose_hits_postings (files, n, buf_size, &buf_size) : 0;
+
+  *tok_size = write_token_header (ido, name, flags | kind, count);
+  if (kind)
+    write_hits_postings (ido, kind, files, n);
+  else
+    id_output_write (ido, tree8, buf_size);
+  obstack_free (tree8_obstack, tree8);
+  id_output_putc (ido, '\0');
+  id_output_putc (ido, '\0');
+  return buf_size;
+}
+
+/* Return the hits postings container that takes fewer bytes than a
+   tree8 of TREE8_SIZE bytes, and the fewest of the three, for the N
+   files numbered in the ascending vector FILES, and store its size in
+   *BUF_SIZE.  Return zero if the tree8 is smallest.  A list of runs
+   or a bitmap must be strictly smaller than a plain list.  */
+
+static int
+choose_hits_postings (unsigned long const *files, unsigned long n,
+		      unsigned long tree8_size, unsigned long *buf_size)
+{
+  unsigned long vector_size = 0;
+  unsigned long runs_size = 0;
+  unsigned long bitmap_size;
+  unsigned long next = 0;	/* past the previous file */
+  unsigned long run_end = 0;	/* past the previous run */
+  unsigned long i;
+  int kind;
+
+  if (n == 0)
+    return 0;
+  for (i = 0; i < n; i++)
+    {
+      vector_size += hits_number_size (files[i] + 1 - next);
+      if (i == 0 || files[i] != next)
+	{
+	  unsigned long length = 1;
+	  while (i + length < n && files[i + length] == files[i] + length)
+	    length++;
+	  runs_size += (hits_number_size (files[i] + 1 - run_end)
+			+ hits_number_size (length));
+	  run_end = files[i] + length;
+	}
+      next = files[i] + 1;
+    }
+  bitmap_size = (hits_number_size (files[0] + 1)
+		 + (files[n - 1] - files[0]) / 7 + 1);
+
+  kind = TOK_VECTOR;
+  *buf_size = vector_size;
+  if (runs_size < *buf_size)
+    {
+      kind = TOK_RUNS;
+      *buf_size = runs_size;
+    }
+  if (bitmap_size < *buf_size)
+    {
+      kind = TOK_BITMAP;
+      *buf_size = bitmap_size;
+    }
+  if (tree8_size < *buf_size)
+    {
+      *buf_size = tree8_size;
+      return 0;
+    }
+  return kind;
+}
+
+/* Return the number of bytes that put_hits_number writes for VALUE.  */
+
+static int
+hits_number_size (unsigned long value)
+{
+  int size = 1;
+  while (value >>= 7)
+    size++;
+  return size;
+}
+
+/* Write the nonzero VALUE seven bits at a time, least significant
+   first, with bit 7 set in all but the last byte.  */
+
+static void
+put_hits_number (struct id_output *ido, unsigned long value)
+{
+  while (value >= 0x80)
+    {
+      id_output_putc (ido, (value & 0x7f) | 0x80);
+      value >>= 7;
+    }
+  id_output_putc (ido, value);
+}
+
+/* Write the KIND of hits postings container for the N files numbered
+   in the ascending vector FILES.  */
+
+static void
+write_hits_postings (struct id_output *ido, int kind,
+		     unsigned long const *files, unsigned long n)
+{
+  unsigned long const *end = files + n;
+  unsigned long next = 0;
+
+  switch (kind)
+    {
+    case TOK_VECTOR:
+      for (; files < end; files++)
+	{
+	  put_hits_number (ido, *files + 1 - next);
+	  next = *files + 1;
+	}
+      break;
+
+    case TOK_RUNS:
+      while (files < end)
+	{
+	  unsigned long length = 1;
+	  while (files + length < end && files[length] == files[0] + length)
+	    length++;
+	  put_hits_number (ido, *files + 1 - next);
+	  put_hits_number (ido, length);
+	  next = *files + length;
+	  files += length;
+	}
+      break;
+
+    case TOK_BITMAP:
+      {
+	unsigned long base = *files;
+	int bits = 0;
+
+	put_hits_number (ido, base + 1);
+	for (; files < end; files++)
+	  {
+	    while (*files >= base + 7)
+	      {
+		id_output_putc (ido, bits | 0x80);
+		bits = 0;
+		base += 7;
+	      }
+	    bits |= 1 << (*files - base);
+	  }
+	id_output_putc (ido, bits | 0x80);
+      }
+      break;
+    }
+}
+
+/* Keep track of the largest token entry, which has BUF_SIZE bytes of
+   hits for VEC_SIZE files, for the sake of readers' buffers.  */
+
+static void
+note_token_size (struct idhead *idhp, char const *name,
+		 unsigned long buf_size, unsigned long vec_size)
+{
+  buf_size += strlen (name) + 1 + sizeof (unsigned char) /* flags */
+	      + sizeof (unsigned short) /* count */ + 2;
+  if (buf_size > idhp->idh_buf_size)
+    idhp->idh_buf_size = buf_size;
+  if (vec_size > idhp->idh_vec_size)
+    idhp->idh_vec_size = vec_size;
+}
+
+/* Write what follows the token entries, which end at offset OFF, fill
+   in the table of TOKEN_OFFSETS, and write the header.  */
+
+static void
+finish_id_file (struct idhead *idhp, off_t off, off_t const *token_offsets)
+{
+  unsigned long i;
+
+  assert (off == id_output_tell (&idhp->idh_output));
+  assert (idhp->idh_version >= IDH_VERSION_5 || off <= UINT32_MAX);
+  output_length = off;
+  idhp->idh_end_offset = output_length - 2;
+
+  if (incremental_flag)
+    {
+      write_member_stats (idhp);
+      write_token_tallies (idhp);
+    }
+  if (trigrams_flag)
+    write_trigrams (idhp);
+  if (positions_flag)
+    write_token_positions (idhp);
+  if (shard_count)
+    write_shard_files (idhp);
+
+  /* fill in the token offsets, so that readers can find the Nth
+     token without scanning */
+
+  id_output_seek (&idhp->idh_output, idhp->idh_index_offset);
+  for (i = 0; i < idhp->idh_tokens; i++)
+    {
+      uint64_t offset = token_offsets[i];
+      unsigned long offset_4 = offset;
+      if (idhp->idh_version < IDH_VERSION_5)
+	io_write (&idhp->idh_output, &offset_4, 4, IO_TYPE_INT);
+      else
+	io_write (&idhp->idh_output, &offset, 8, IO_TYPE_INT);
+    }
+
+  write_idhead (idhp);
+  if (close_id_output (&idhp->idh_output) != 0)
+    error (EXIT_FAILURE, errno, _("error closing `%s'"), idhp->idh_file_name);
+  replace_id_file (idhp->idh_file_name);
+}
+
+/* Open a file to which to write the ID file FILE_NAME, and return its
+   descriptor.  So that a reader never sees the ID file half written,
+   and the old ID file survives if mkid fails, this is a new file in
+   the same directory, which replace_id_file renames over FILE_NAME.
+   It takes the permissions of the old ID file, if there is one.
+   Something other than a regular file, like /dev/null, is written in
+   place.  */
+
+static int
+create_id_file (char const *file_name)
+{
+  static int cleanup_installed;
+  static int const signals[] = {
+#ifdef SIGHUP
+    SIGHUP,
+#endif
+    SIGINT, SIGTERM
+  };
+  struct stat st;
+  mode_t mode;
+  char *temp_name;
+  int fd;
+  int i;
+
+  if (stat (file_name, &st) == 0)
+    {
+      if (!S_ISREG (st.st_mode))
+	{
+	  fd = open (file_name, O_WRONLY | O_TRUNC);
+	  if (fd < 0)
+	    error (EXIT_FAILURE, errno, _("can't create `%s'"), file_name);
+	  return fd;
+	}
+      mode = st.st_mode & (S_IRWXU | S_IRWXG | S_IRWXO);
+    }
+  else
+    {
+      mode = umask (0);
+      umask (mode);
+      mode = 0666 & ~mode;
+    }
+
+  if (!cleanup_installed)
+    {
+      atexit (remove_temp_id_file);
+      for (i = 0; i < sizeof signals / sizeof signals[0]; i++)
+	if (signal (signals[i], remove_temp_id_file_on_signal) == SIG_IGN)
+	  signal (signals[i], SIG_IGN);
+      cleanup_installed = 1;
+    }
+
+  temp_name = xmalloc (strlen (file_name) + sizeof ".XXXXXX");
+  strcat (strcpy (temp_name, file_name), ".XXXXXX");
+  fd = mkstemp (temp_name);
+  if (fd < 0)
+    error (EXIT_FAILURE, errno, _("can't create `%s'"), file_name);
+  temp_id_file_name = temp_name;
+  if (fchmod (fd, mode) != 0)
+    error (EXIT_FAILURE, errno, _("can't create `%s'"), file_name);
+  return fd;
+}
+
+/* Put the complete ID file, which close_id_output has flushed to the
+   disk, in place of the old one.  A reader that has the old one open
+   or mapped keeps reading it.  */
+
+static void
+replace_id_file (char const *file_name)
+{
+  char *temp_name = temp_id_file_name;
+
+  if (temp_name == 0)
+    return;
+  if (rename (temp_name, file_name) != 0)
+    error (EXIT_FAILURE, errno, _("can't rename `%s' to `%s'"),
+	   temp_name, file_name);
+  temp_id_file_name = 0;
+  free (temp_name);
+}
+
+static void
+remove_temp_id_file (void)
+{
+  if (temp_id_file_name)
+    unlink (temp_id_file_name);
+}
+
+static void
+remove_temp_id_file_on_signal (int sig)
+{
+  remove_temp_id_file ();
+  signal (sig, SIG_DFL);
+  raise (sig);
+}
+
+/* Version 4 ID files are readable by older versions of idutils, so
+   write one unless some count or offset would overflow its fixed-size
+   fields.  The file size computed here is an upper bound: it counts
+   all file links rather than only those in use, and the storage for
+   tokens rather than the lengths of their names.  */
+
+static int
+choose_id_file_version (struct idhead *idhp)
+{
+  unsigned long file_links = idhp->idh_file_link_table.ht_fill;
+  unsigned long tokens = idhp->idh_tokens;
+  uintmax_t size;
+
+  /* Only version 5 has room for the status of the member files, the
+     trigram postings, the positions and the shard's file numbers, and
+     only its readers know hits postings.  */
+  if (incremental_flag || trigrams_flag || positions_flag || shard_count
+      || !tree8_flag
+      || file_links >> (8 * FL_PARENT_INDEX_BYTES (IDH_VERSION_4)))
+    return IDH_VERSION_5;
+
+  idhp->idh_version = IDH_VERSION_4;
+  size = (sizeof_idhead (idhp)
+	  + obstack_memory_used (&idhp->idh_file_link_obstack)
+	  + (uintmax_t) file_links * (1 + FL_PARENT_INDEX_BYTES (IDH_VERSION_4))
+	  + 2 + (uintmax_t) tokens * IDH_TOKEN_INDEX_BYTES (IDH_VERSION_4)
+	  + 2);
+  if (mkid_mode == MKID_MODE_MERGE || spill_run_count)
+    size += merged_tokens_size;
+  else
+    size += (obstack_memory_used (&tokens_obstack)
+	     + (uintmax_t) tokens * (sizeof (unsigned char) /* flags */
+				     + sizeof (unsigned short) /* count */
+				     + 2)
+	     + count_summary_hits (summary_root));
+  return size <= UINT32_MAX ? IDH_VERSION_4 : IDH_VERSION_5;
+}
+
+/* Every token has one tree8 byte in the ID file for each node of the
+   summary tree that covers a file in which the token occurs, and
+   that is just what the nodes' sum_hits_count tally.  */
+
+static unsigned long _GL_ATTRIBUTE_PURE
+count_summary_hits (struct summary const *summary)
+{
+  unsigned long count = summary->sum_hits_count;
+  struct summary *const *kids = summary->sum_kids;
+  struct summary *const *end = &kids[8];
+
+  while (kids < end && *kids)
+    count += count_summary_hits (*kids++);
+  return count;
+}
+
+/* Define hash and comparison functions for the token table.  */
+
+static unsigned long _GL_ATTRIBUTE_PURE
+token_hash (void const *key)
+{
+  return_STRING_HASH (TOKEN_NAME ((struct token const *) key));
+}
+
+static int _GL_ATTRIBUTE_PURE
+token_hash_cmp (void const *x, void const *y)
+{
+  return_STRING_COMPARE (TOKEN_NAME ((struct token const *) x),
+			 TOKEN_NAME ((struct token const *) y));
+}
+
+
+
+/****************************************************************************/
+
+/* Advance the tree8 hit signature that corresponds to the file
+   we are now scanning.  */
+
+static void
+bump_current_hits_signature (void)
+{
+  unsigned char *hits = current_hits_signature;
+  while (*hits & 0x80)
+    *hits++ = 1;
+  *hits <<= 1;
+}
+
+/* Initialize the tree8 hit signature for the first file we scan.  */
+
+static void
+init_hits_signature (int i)
+{
+  unsigned char *hits = current_hits_signature;
+  unsigned char const *end = current_hits_signature + log_8_member_files;
+  while (hits < end)
+    {
+      *hits = 1 << (i & 7);
+      i >>= 3;
+      hits++;
+    }
+}
+
+static void
+free_summary_tokens (void)
+{
+  struct summary *summary = summary_leaf;
+  while (summary != summary_root)
+    {
+      free (summary->sum_tokens);
+      summary->sum_tokens = 0;
+      summary = summary->sum_parent;
+    }
+}
+
+/* Free SUMMARY and the summaries below it.  */
+
+static void
+free_summary (struct summary *summary)
+{
+  if (summary->sum_level > 0)
+    {
+      int i;
+      for (i = 0; i < 8 && summary->sum_kids[i]; i++)
+	free_summary (summary->sum_kids[i]);
+    }
+  free (summary->sum_hits_base);
+  free (summary->sum_tokens);
+  free (summary);
+}
+
+static void
+summarize (void)
+{
+  unsigned char const *hits_sig = current_hits_signature;
+  struct summary *summary = summary_leaf;
+
+  do
+    {
+      unsigned long count = summary->sum_hits_count;
+      unsigned char *hits = xmalloc (count + 1);
+      unsigned int level = summary->sum_level;
+      struct token **tokens = summary->sum_tokens;
+      unsigned long init_size = INIT_TOKENS_SIZE (summary->sum_level);
+      int phase = PHASE_SUMMARIZE + (level < MAX_SUMMARY_LEVELS
+				     ? level : MAX_SUMMARY_LEVELS - 1);
+
+      start_phase (phase);
+      if (verbose_flag)
+	printf (_("level %d: %ld/%ld = %.0f%%\n"),
+		summary->sum_level, count, init_size,
+		100.0 * (double) count / (double) init_size);
+
+      sort_by_name ((void **) tokens, count, OFFSETOF_TOKEN_NAME);
+      summary->sum_hits = summary->sum_hits_base = hits;
+      summary_hits_size += count + 1;
+      while (count--)
+	{
+	  unsigned char *hit = TOKEN_HITS (*tokens++) + level;
+	  *hits++ = *hit;
+	  *hit = 0;
+	}
+      *hits++ = 0;
+      if (summary->sum_parent)
+	{
+	  free (summary->sum_tokens);
+	  summary->sum_tokens = 0;
+	}
+      stop_phase (phase);
+      summary = summary->sum_parent;
+    }
+  while (*++hits_sig & 0x80);
+  summary_leaf = make_sibling_summary (summary_leaf);
+}
+
+static void
+init_summary (void)
+{
+  unsigned long size = INIT_TOKENS_SIZE (0);
+  summary_root = summary_leaf = xcalloc (1, sizeof(struct summary));
+  summary_root->sum_tokens_size = size;
+  summary_root->sum_tokens = xmalloc (sizeof(struct token *) * size);
+}
+
+static struct summary *
+make_sibling_summary (struct summary *summary)
+{
+  struct summary *parent = summary->sum_parent;
+  size_t size;
+
+  if (parent == NULL)
+    {
+      levels++;
+      summary_root = summary->sum_parent = parent
+	= xcalloc (1, sizeof(struct summary));
+      parent->sum_level = levels;
+      parent->sum_kids[0] = summary;
+      parent->sum_hits_count = summary->sum_hits_count;
+      parent->sum_free_index = 1;
+      size = INIT_TOKENS_SIZE (levels);
+      if (summary->sum_tokens_size >= size)
+	{
+	  parent->sum_tokens_size = summary->sum_tokens_size;
+	  parent->sum_tokens = summary->sum_tokens;
+	}
+      else
+	{
+	  parent->sum_tokens_size = size;
+	  parent->sum_tokens = xnrealloc (summary->sum_tokens, size,
+					  sizeof *summary->sum_tokens);
+	}
+      summary->sum_tokens = 0;
+    }
+  if (parent->sum_free_index == 8)
+    parent = make_sibling_summary (parent);
+  summary = xcalloc (1, sizeof(struct summary));
+  summary->sum_level = parent->sum_level - 1;
+  parent->sum_kids[parent->sum_free_index++] = summary;
+  summary->sum_parent = parent;
+  size = INIT_TOKENS_SIZE (summary->sum_level);
+  summary->sum_tokens_size = size;
+  summary->sum_tokens = xmalloc (sizeof(struct token *) * size);
+  return summary;
+}
+
+static int _GL_ATTRIBUTE_PURE
+count_vec_size (struct summary *summary, unsigned char const *tail_hits)
+{
+  struct summary **kids;
+  unsigned int hits = (summary->sum_hits ? *summary->sum_hits : *tail_hits);
+
+  kids = summary->sum_kids;
+  if (*kids == NULL)
+    {
+      static char bits_per_nybble[] = { 0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4 };
+      return bits_per_nybble[hits & 0xf] + bits_per_nybble[hits >> 4];
+    }
+  else
+    {
+      int bit;
+      int count = 0;
+      --tail_hits;
+      for (bit = 1; bit & 0xff; bit <<= 1, ++kids)
+	if (bit & hits)
+	  count += count_vec_size (*kids, tail_hits);
+      return count;
+    }
+}
+
+/* Sanity-check hit counts.  Return nonzero if there's a problem.
+   Otherwise, return 0.  */
+static int
+check_hits (struct summary* summary)
+{
+  struct summary **kids = summary->sum_kids;
+  struct summary **end = &kids[8];
+
+  if ( ! (summary->sum_hits == NULL || *summary->sum_hits == 0))
+    return 1;
+
+  while (end > kids && end[-1] == 0)
+    end--;
+  while (kids < end)
+    if (check_hits (*kids++))
+      return 1;
+
+  return 0;
+}
+
+/* Grow onto TREE8_OBSTACK the tree8 of a token whose hits in the
+   leaves of the summary tree are at TAIL_HITS.  */
+
+static void
+write_hits (struct obstack *tree8_obstack, struct summary *summary,
+	    unsigned char const *tail_hits)
+{
+  struct summary **kids;
+  unsigned int hits = (summary->sum_hits ? *summary->sum_hits++ : *tail_hits);
+
+  assert (hits);
+  obstack_1grow (tree8_obstack, hits);
+
+  kids = summary->sum_kids;
+  if (*kids)
+    {
+      int bit;
+      --tail_hits;
+      for (bit = 1; (bit & 0xff) && *kids; bit <<= 1, ++kids)
+	if (bit & hits)
+	  write_hits (tree8_obstack, *kids, tail_hits);
+    }
+}
+
+static void
+sign_token (struct token *token)
+{
+  unsigned char *tok_hits = TOKEN_HITS (token);
+  unsigned char *hits_sig = current_hits_signature;
+  unsigned char *end = current_hits_signature + log_8_member_files;
+  struct summary *summary = summary_leaf;
+
+  while (summary)
+    {
+      if (*tok_hits == 0)
+	add_token_to_summary (summary, token);
+      if (*tok_hits & *hits_sig)
+	break;
+      *tok_hits |= *hits_sig;
+      summary = summary->sum_parent;
+      tok_hits++;
+      hits_sig++;
+    }
+  while (hits_sig < end)
+    {
+      if (*tok_hits & *hits_sig)
+	break;
+      *tok_hits |= *hits_sig;
+      tok_hits++;
+      hits_sig++;
+    }
+}
+
+static void
+add_token_to_summary (struct summary *summary, struct token *token)
+{
+  size_t size = summary->sum_tokens_size;
+
+  if (summary->sum_hits_count >= size)
+    {
+      summary->sum_tokens = x2nrealloc (summary->sum_tokens, &size,
+					sizeof *summary->sum_tokens);
+      summary->sum_tokens_size = size;
+    }
+  summary->sum_tokens[summary->sum_hits_count++] = token;
+}
+
+/****************************************************************************/
+/* Incremental update (--incremental).  */
+
+/* The status of a member file, by which mkid --incremental tells
+   whether it has changed.  */
+
+struct member_stat
+{
+  uint64_t ms_mtime;
+  uint64_t ms_size;
+  uint64_t ms_ino;
+};
+
+static time_t scan_start_time;
+static struct member_stat *member_stats;	/* indexed by mf_index */
+static struct obstack update_tokens_obstack;	/* storage for their tokens */
+
+
+/* Record the modification time, size and inode number of every member
+   file, in mf_index order, so that the next mkid --incremental can
+   tell which files have changed.  A file that can't be examined gets
+   impossible values, so that it will be rescanned.  */
+
+static void
+stat_member_files (struct idhead const *idhp)
+{
+  struct member_file **members_0
+    = (struct member_file **) hash_dump (&idhp->idh_member_file_table,
+					 0, member_file_qsort_compare);
+  struct member_file **end = &members_0[idhp->idh_member_file_table.ht_fill];
+  struct member_file **members;
+  char *file_name = alloca (PATH_MAX);
+
+  scan_start_time = time (0);
+  member_stats = xnmalloc (idhp->idh_member_file_table.ht_fill,
+			   sizeof *member_stats);
+  chdir_to_link (cw_dlink);
+  for (members = members_0; members < end; members++)
+    {
+      struct member_stat *ms = &member_stats[(*members)->mf_index];
+      struct stat st;
+
+      maybe_relative_file_name (file_name, (*members)->mf_link, cw_dlink);
+      if (stat (file_name, &st) < 0)
+	memset (ms, 0xff, sizeof *ms);
+      else
+	{
+	  ms->ms_mtime = st.st_mtime;
+	  ms->ms_size = st.st_size;
+	  ms->ms_ino = st.st_ino;
+	}
+    }
+  free (members_0);
+}
+
+/* The member stats section holds the time at which mkid began, then
+   the mtime, size and inode number of each member file.  */
+
+#define MEMBER_STAT_BYTES 24
+
+static void
+write_member_stats (struct idhead *idhp)
+{
+  struct id_section *section = find_id_section (idhp, IDS_MEMBER_STATS);
+  struct id_output *ido = &idhp->idh_output;
+  uint64_t start = scan_start_time;
+  unsigned long i;
+
+  section->ids_offset = id_output_tell (ido);
+  io_write (ido, &start, 8, IO_TYPE_INT);
+  for (i = 0; i < idhp->idh_files; i++)
+    {
+      io_write (ido, &member_stats[i].ms_mtime, 8, IO_TYPE_INT);
+      io_write (ido, &member_stats[i].ms_size, 8, IO_TYPE_INT);
+      io_write (ido, &member_stats[i].ms_ino, 8, IO_TYPE_INT);
+    }
+  section->ids_length = id_output_tell (ido) - section->ids_offset;
+}
+
+static uint64_t _GL_ATTRIBUTE_PURE
+get_uint64 (unsigned char const *buf)
+{
+  uint64_t value = 0;
+  int i = 8;
+
+  while (i--)
+    value = (value << 8) | buf[i];
+  return value;
+}
+
+/* Return true if the file whose status is now MS is the one recorded
+   as OLD_STAT by an mkid that began at OLD_START.  A file modified in
+   the second that mkid began might have changed again unnoticed, so
+   it doesn't count as unchanged.  */
+
+static bool _GL_ATTRIBUTE_PURE
+member_unchanged (struct member_stat const *ms,
+		  unsigned char const *old_stat, uint64_t old_start)
+{
+  uint64_t mtime = get_uint64 (old_stat);
+
+  return (mtime < old_start
+	  && mtime == ms->ms_mtime
+	  && get_uint64 (old_stat + 8) == ms->ms_size
+	  && get_uint64 (old_stat + 16) == ms->ms_ino);
+}
+
+/* Return the link in the tree built by the walker that has the same
+   name as OLD_LINK, which is from the old ID file, or 0 if there is
+   none.  NEW_ROOT is the root of the walker's tree.  */
+
+static struct file_link *
+find_new_link (struct file_link const *old_link, struct file_link *new_root)
+{
+  struct file_link *parent;
+  struct file_link *key;
+  size_t name_size;
+
+  if (IS_ROOT_FILE_LINK (old_link))
+    return new_root;
+  parent = find_new_link (old_link->fl_parent, new_root);
+  if (parent == 0)
+    return 0;
+  name_size = strlen (old_link->fl_name) + 1;
+  key = alloca (offsetof (struct file_link, fl_name) + name_size);
+  memcpy (key->fl_name, old_link->fl_name, name_size);
+  key->fl_parent = parent;
+  return hash_find_item (&idh.idh_file_link_table, key);
+}
+
+/* Bring the existing ID file up to date with the member files in
+   IDHP.  Files whose status is the same as when the ID file was
+   built keep their hits without being scanned; all others are
+   scanned, and their hits are merged with the old ones.  Return
+   false if there is no ID file, or it lacks the status of its member
+   files, in which case the caller must build one from scratch.  */
+
+static bool
+update_id_file (struct idhead *idhp)
+{
+  struct idhead old_idh;
+  struct file_link **old_members;
+  struct id_section *section;
+  struct id_section *tallies;
+  unsigned char const *old_stats;
+  uint64_t old_start;
+  long *old_to_new;
+  char *reused;
+  struct member_file **members_0;
+  struct member_file **rescan;
+  struct update_hit *hits;
+  unsigned long hits_count;
+  unsigned long files = idhp->idh_member_file_table.ht_fill;
+  unsigned long old_files;
+  unsigned long unchanged = 0;
+  unsigned long changed = 0;
+  unsigned long rescans = 0;
+  unsigned long tokens;
+  unsigned long i;
+  struct file_link *new_root;
+  off_t *token_offsets;
+  off_t off;
+
+  /* The positions of the tokens of unchanged files are not carried
+     over from the old ID file, so build a new one from scratch.  */
+  if (positions_flag)
+    {
+      if (verbose_flag)
+	printf (_("Positions are not updated incrementally; rebuilding `%s'\n"),
+		idhp->idh_file_name);
+      return false;
+    }
+
+  chdir_to_link (cw_dlink);
+  memset (&old_idh, 0, sizeof old_idh);
+  old_idh.idh_file_name = idhp->idh_file_name;
+  init_idh_tables (&old_idh);
+  old_members = maybe_read_id_file (idhp->idh_file_name, &old_idh);
+  if (old_members == 0)
+    return false;
+  section = find_id_section (&old_idh, IDS_MEMBER_STATS);
+  tallies = find_id_section (&old_idh, IDS_TOKEN_TALLIES);
+  if (section == 0 || tallies == 0)
+    {
+      if (verbose_flag)
+	printf (section == 0
+		? _("`%s' lacks file status; rebuilding it\n")
+		: _("`%s' lacks token tallies; rebuilding it\n"),
+		idhp->idh_file_name);
+      fclose (old_idh.idh_FILE);
+      return false;
+    }
+  map_id_file (&old_idh);
+  old_files = old_idh.idh_files;
+  if (section->ids_length < 8 + (off_t) old_files * MEMBER_STAT_BYTES
+      || section->ids_offset + section->ids_length > old_idh.idh_map_size
+      || tallies->ids_offset + tallies->ids_length > old_idh.idh_map_size)
+    error (EXIT_FAILURE, 0, _("`%s' is truncated"), idhp->idh_file_name);
+  old_start = get_uint64 (old_idh.idh_map + section->ids_offset);
+  old_stats = old_idh.idh_map + section->ids_offset + 8;
+
+  /* Match the old member files with the new ones.  */
+
+  new_root = cw_dlink;
+  while (!IS_ROOT_FILE_LINK (new_root))
+    new_root = new_root->fl_parent;
+  old_to_new = xnmalloc (old_files, sizeof *old_to_new);
+  reused = xcalloc (files, 1);
+  for (i = 0; i < old_files; i++)
+    {
+      struct file_link *flink;
+      struct member_file *member = 0;
+
+      if (old_members[i] == 0)
+	error (EXIT_FAILURE, 0, _("`%s' is corrupt"), idhp->idh_file_name);
+      flink = find_new_link (old_members[i], new_root);
+      if (flink)
+	member = find_member_file (flink);
+      old_to_new[i] = -1;
+      if (member == 0)
+	continue;
+      if (member_unchanged (&member_stats[member->mf_index],
+			    old_stats + i * MEMBER_STAT_BYTES, old_start))
+	{
+	  old_to_new[i] = member->mf_index;
+	  reused[member->mf_index] = 1;
+	  unchanged++;
+	}
+      else
+	changed++;
+    }
+  free (old_members);
+
+  if (verbose_flag)
+    printf (_("Updating `%s': %lu unchanged, %lu changed, %lu added, %lu removed\n"),
+	    idhp->idh_file_name, unchanged, changed,
+	    files - unchanged - changed, old_files - unchanged - changed);
+  if (unchanged == old_files && unchanged == files)
+    {
+      unmap_id_file (&old_idh);
+      fclose (old_idh.idh_FILE);
+      return true;
+    }
+
+  /* Scan the files that are new or have changed.  */
+
+  members_0 = (struct member_file **) hash_dump (&idhp->idh_member_file_table,
+						 0, member_file_qsort_compare);
+  rescan = members_0;
+  for (i = 0; i < files; i++)
+    if (!reused[i])
+      rescan[rescans++] = members_0[i];
+  free (reused);
+
+  hash_init_tagged (&token_table, rescans * 256, token_hash,
+		    token_hash_cmp);
+  obstack_init (&update_obstack);
+  obstack_init (&update_tokens_obstack);
+  gather_files (rescan, rescans, collect_file_scan);
+  free (members_0);
+  hits = finish_update_hits (&hits_count);
+  heap_after_scan = get_process_heap ();
+
+  /* Count the token entries, then write them.  The old ID file stays
+     mapped while the new one is written beside it.  */
+
+  tokens = merge_id_tokens (&old_idh, old_to_new, hits, hits_count, 0, 0, 0);
+  chdir_to_link (cw_dlink);
+  off = begin_id_file (idhp, tokens);
+  token_offsets = xnmalloc (tokens, sizeof *token_offsets);
+  merge_id_tokens (&old_idh, old_to_new, hits, hits_count,
+		   idhp, token_offsets, &off);
+  finish_id_file (idhp, off, token_offsets);
+
+  free (token_offsets);
+  free (old_to_new);
+  unmap_id_file (&old_idh);
+  fclose (old_idh.idh_FILE);
+  return true;
+}
+
+/* Add the tokens gathered from MEMBER, which has changed since the ID
+   file was built, to token_table, and note that they occur in it.  */
+
+static void
+collect_file_scan (struct member_file const *member, struct file_scan *fs,
+		   unsigned long i)
+{
+  struct token **tokens = fs->fs_tokens;
+  int new_tokens = 0;
+
+  if (!report_file_scan (member, fs))
+    return;
+  for (; *tokens; tokens++)
+    {
+      struct token *file_token = *tokens;
+      struct token **slot
+	= (struct token **) hash_find_slot (&token_table, file_token);
+      struct update_hit hit;
+
+      if (HASH_VACANT (*slot))
+	{
+	  hit.uh_token = obstack_copy (&update_tokens_obstack, file_token,
+				       (OFFSETOF_TOKEN_NAME
+					+ strlen (TOKEN_NAME (file_token)) + 1));
+	  new_tokens++;
+	  hash_insert_at (&token_table, hit.uh_token, slot);
+	}
+      else
+	{
+	  unsigned int count;
+
+	  hit.uh_token = *slot;
+	  hit.uh_token->tok_flags |= file_token->tok_flags;
+	  count = hit.uh_token->tok_count + file_token->tok_count;
+	  hit.uh_token->tok_count = (count < USHRT_MAX ? count : USHRT_MAX);
+	}
+      hit.uh_file = member->mf_index;
+      hit.uh_count = file_token->tok_count;
+      hit.uh_flags = file_token->tok_flags;
+      obstack_grow (&update_obstack, &hit, sizeof hit);
+    }
+  if (verbose_flag)
+    {
+      printf (_("  new = %d/%lu"), new_tokens, fs->fs_tokens_count);
+      putchar ('\n');
+    }
+}
+
+static int
+update_hit_qsort_cmp (void const *x, void const *y)
+{
+  struct update_hit const *hx = x;
+  struct update_hit const *hy = y;
+  int result;
+
+  if (hx->uh_token != hy->uh_token)
+    {
+      STRING_COMPARE (TOKEN_NAME (hx->uh_token), TOKEN_NAME (hy->uh_token),
+		      result);
+      return result;
+    }
+  return (hx->uh_file > hy->uh_file) - (hx->uh_file < hy->uh_file);
+}
+
+static int
+file_number_qsort_cmp (void const *x, void const *y)
+{
+  unsigned long fx = *(unsigned long const *) x;
+  unsigned long fy = *(unsigned long const *) y;
+  return (fx > fy) - (fx < fy);
+}
+
+static int
+token_tally_qsort_cmp (void const *x, void const *y)
+{
+  unsigned long fx = ((struct token_tally const *) x)->tt_file;
+  unsigned long fy = ((struct token_tally const *) y)->tt_file;
+  return (fx > fy) - (fx < fy);
+}
+
+/* Finish the update_hits grown in update_obstack, sort them as their
+   tokens are sorted, and those of each token by file, store how many
+   there are in *COUNT, and return them.  */
+
+static struct update_hit *
+finish_update_hits (unsigned long *count)
+{
+  struct update_hit *hits;
+
+  *count = obstack_object_size (&update_obstack) / sizeof *hits;
+  hits = obstack_finish (&update_obstack);
+  qsort (hits, *count, sizeof *hits, update_hit_qsort_cmp);
+  return hits;
+}
+
+/* Store in TALLIES those of the sorted *HITS, which end at HITS_END,
+   that are of TOKEN, advance *HITS past them, and return how many
+   there are.  */
+
+static unsigned long
+take_token_tallies (struct token const *token, struct update_hit const **hits,
+		    struct update_hit const *hits_end,
+		    struct token_tally *tallies)
+{
+  struct update_hit const *hit;
+  unsigned long n = 0;
+
+  for (hit = *hits; hit < hits_end && hit->uh_token == token; hit++, n++)
+    {
+      tallies[n].tt_file = hit->uh_file;
+      tallies[n].tt_count = hit->uh_count;
+      tallies[n].tt_flags = hit->uh_flags;
+    }
+  *hits = hit;
+  return n;
+}
+
+/* The IDS_TOKEN_TALLIES section holds, for each token entry in turn
+   and each of the files in which it occurs in ascending order, the
+   number of its occurrences in that file and the flags they have,
+   written as the numbers of the IDS_POSITIONS section are.  With it,
+   mkid --incremental takes exactly the share of the files that have
+   changed out of a token's count and flags.  */
+
+static void
+put_token_tallies (struct token_tally const *tallies, unsigned long n)
+{
+  unsigned long i;
+
+  for (i = 0; i < n; i++)
+    {
+      put_tally_number (tallies[i].tt_count);
+      put_tally_number (tallies[i].tt_flags);
+    }
+}
+
+static void
+put_tally_number (uintmax_t value)
+{
+  while (value >= 0x80)
+    {
+      obstack_1grow (&tallies_obstack, (value & 0x7f) | 0x80);
+      value >>= 7;
+    }
+  obstack_1grow (&tallies_obstack, value);
+}
+
+/* Read into TALLY the count and flags of the tally at *P, in the
+   IDS_TOKEN_TALLIES section of the ID file FILE_NAME that ends at
+   END, and advance *P past it.  */
+
+static void
+get_token_tally (unsigned char const **p, unsigned char const *end,
+		 char const *file_name, struct token_tally *tally)
+{
+  uintmax_t values[2];
+  int i;
+
+  for (i = 0; i < 2; i++)
+    {
+      int shift = 0;
+      int c;
+
+      values[i] = 0;
+      do
+	{
+	  if (*p == end || shift > 16)
+	    error (EXIT_FAILURE, 0, _("`%s' is corrupt"), file_name);
+	  c = *(*p)++;
+	  values[i] |= (uintmax_t) (c & 0x7f) << shift;
+	  shift += 7;
+	}
+      while (c & 0x80);
+    }
+  if (values[0] > USHRT_MAX || values[1] > UCHAR_MAX)
+    error (EXIT_FAILURE, 0, _("`%s' is corrupt"), file_name);
+  tally->tt_count = values[0];
+  tally->tt_flags = values[1];
+}
+
+static void
+write_token_tallies (struct idhead *idhp)
+{
+  struct id_section *section = find_id_section (idhp, IDS_TOKEN_TALLIES);
+  struct id_output *ido = &idhp->idh_output;
+
+  section->ids_offset = id_output_tell (ido);
+  section->ids_length = obstack_object_size (&tallies_obstack);
+  id_output_write (ido, obstack_base (&tallies_obstack), section->ids_length);
+  obstack_free (&tallies_obstack, 0);
+}
+
+/* Merge the token entries of the old ID file OLD_IDHP, whose file
+   numbers OLD_TO_NEW maps onto the new ones (or -1 for files that
+   have changed or gone away), with the HITS gathered from the files
+   that have been scanned anew.  If IDHP is null, just count the token
+   entries that result.  Otherwise, write them to IDHP's file, starting
+   at offset *OFF, and record their offsets in TOKEN_OFFSETS.  Return
+   the number of token entries.  The count and flags of a token are
+   those of its tallies in the files that remain and those scanned
+   anew, as a full build would find them.  */
+
+static unsigned long
+merge_id_tokens (struct idhead *old_idhp, long const *old_to_new,
+		 struct update_hit const *hits, unsigned long hits_count,
+		 struct idhead *idhp, off_t *token_offsets, off_t *off)
+{
+  char const *old = ID_TOKENS_BEGIN (old_idhp);
+  char const *old_end = ID_TOKENS_END (old_idhp);
+  struct update_hit const *hits_end = hits + hits_count;
+  struct id_section *section = find_id_section (old_idhp, IDS_TOKEN_TALLIES);
+  unsigned char const *old_tally = old_idhp->idh_map + section->ids_offset;
+  unsigned char const *old_tally_end = old_tally + section->ids_length;
+  int old_levels = tree8_count_levels (old_idhp->idh_files);
+  unsigned long new_files = idh.idh_member_file_table.ht_fill;
+  int new_levels = tree8_count_levels (new_files);
+  unsigned long *old_files = xnmalloc (old_idhp->idh_files + 1,
+				       sizeof *old_files);
+  struct token_tally *old_tallies = xnmalloc (old_idhp->idh_files + 1,
+					      sizeof *old_tallies);
+  struct token_tally *new_tallies = xnmalloc (new_files, sizeof *new_tallies);
+  struct token_tally *tallies = xnmalloc (new_files, sizeof *tallies);
+  unsigned long *files = xnmalloc (new_files, sizeof *files);
+  unsigned long tokens = 0;
+  struct obstack tree8_obstack;
+
+  obstack_init (&tree8_obstack);
+  while (old < old_end || hits < hits_end)
+    {
+      char const *name = 0;
+      int flags = 0;
+      unsigned long count = 0;
+      unsigned long kept = 0;
+      unsigned long added = 0;
+      unsigned long n = 0;
+      unsigned long i = 0;
+      unsigned long j = 0;
+      int order;
+
+      if (old >= old_end)
+	order = 1;
+      else if (hits >= hits_end)
+	order = -1;
+      else
+	STRING_COMPARE (old, TOKEN_NAME (hits->uh_token), order);
+
+      if (order <= 0)
+	{
+	  unsigned long total;
+	  bool sorted = true;
+
+	  total = token_entry_files (old_idhp, old, old_levels, old_files);
+	  for (i = 0; i < total; i++)
+	    {
+	      struct token_tally *tally = &old_tallies[kept];
+
+	      get_token_tally (&old_tally, old_tally_end,
+			       old_idhp->idh_file_name, tally);
+	      if (old_files[i] >= old_idhp->idh_files
+		  || old_to_new[old_files[i]] < 0)
+		continue;
+	      tally->tt_file = old_to_new[old_files[i]];
+	      if (kept && tally->tt_file < tally[-1].tt_file)
+		sorted = false;
+	      kept++;
+	    }
+	  if (!sorted)
+	    qsort (old_tallies, kept, sizeof *old_tallies,
+		   token_tally_qsort_cmp);
+	  name = old;
+	  old = skip_token (old);
+	}
+      if (order >= 0)
+	{
+	  struct token const *token = hits->uh_token;
 
-  idhp->idh_magic[0] = IDH_MAGIC_0;
-  idhp->idh_magic[1] = IDH_MAGIC_1;
-  idhp->idh_version = IDH_VERSION;
-  idhp->idh_flags = IDH_COUNTS;
+	  name = TOKEN_NAME (token);
+	  added = take_token_tallies (token, &hits, hits_end, new_tallies);
+	}
 
-  /* write out the list of pathnames */
+      /* Merge the files that still have the token with those in
+	 which it has just been found.  The two are disjoint.  */
+      i = 0;
+      while (i < kept || j < added)
+	{
+	  if (j == added
+	      || (i < kept && old_tallies[i].tt_file < new_tallies[j].tt_file))
+	    tallies[n] = old_tallies[i++];
+	  else
+	    tallies[n] = new_tallies[j++];
+	  files[n] = tallies[n].tt_file;
+	  count += tallies[n].tt_count;
+	  flags |= tallies[n].tt_flags;
+	  n++;
+	}
+      if (n == 0)
+	continue;
+      if (count > USHRT_MAX)
+	count = USHRT_MAX;
 
-  fseek (idhp->idh_FILE, sizeof_idhead (), 0);
-  off_t off = ftello (idhp->idh_FILE);
-  if (UINT32_MAX < off)
-    error (EXIT_FAILURE, 0, _("internal limitation: offset of 2^32 or larger"));
-  idhp->idh_flinks_offset = off;
-  serialize_file_links (idhp);
+      if (idhp)
+	{
+	  put_merged_token (idhp, name, flags, count, files, n, new_levels,
+			    &tree8_obstack, tokens, token_offsets, off);
+	  put_token_tallies (tallies, n);
+	}
+      tokens++;
+    }
+  obstack_free (&tree8_obstack, 0);
+  free (files);
+  free (tallies);
+  free (new_tallies);
+  free (old_tallies);
+  free (old_files);
+  return tokens;
+}
 
-  /* write out the list of identifiers */
+/* Store in FILES, which has room for one more than the files of the
+   ID file IDHP, the numbers of the files in which the token entry TOK
+   of IDHP occurs, in ascending order, and return how many there are.
+   Its tree8, if it has one, has LEVELS levels.  */
 
-  putc ('\0', idhp->idh_FILE);
-  putc ('\0', idhp->idh_FILE);
-  off = ftello (idhp->idh_FILE);
-  if (UINT32_MAX < off)
-    error (EXIT_FAILURE, 0, _("internal limitation: offset of 2^32 or larger"));
-  idhp->idh_tokens_offset = off;
+static unsigned long
+token_entry_files (struct idhead const *idhp, char const *tok, int levels,
+		   unsigned long *files)
+{
+  unsigned long *end = files;
+  struct hits_postings hp;
+
+  if (!init_hits_postings (&hp, tok))
+    return tree8_file_numbers (token_hits_addr (tok), levels, files);
+  while (end < files + idhp->idh_files && next_hit_file (&hp, end))
+    end++;
+  return end - files;
+}
 
-  for (i = 0; i < token_table.ht_fill; i++, tokens++)
+/* Write the token entry that is number ORDINAL of the ID file IDHP,
+   starting at offset *OFF, and record the offset in TOKEN_OFFSETS.
+   The token is NAME, with FLAGS, and occurs COUNT times in the N files
+   numbered in the ascending vector FILES.  Its tree8 has LEVELS
+   levels, and is grown on TREE8_OBSTACK.  */
+
+static void
+put_merged_token (struct idhead *idhp, char const *name, int flags,
+		  unsigned long count, unsigned long const *files,
+		  unsigned long n, int levels, struct obstack *tree8_obstack,
+		  unsigned long ordinal, off_t *token_offsets, off_t *off)
+{
+  unsigned long const *fp = files;
+  unsigned long buf_size;
+  int tok_size;
+
+  if (count < n)
+    count = n;
+  if (count > USHRT_MAX)
+    count = USHRT_MAX;
+  token_offsets[ordinal] = *off;
+  file_numbers_to_tree8 (tree8_obstack, &fp, files + n, levels, 0);
+  buf_size = write_token_hits (&idhp->idh_output, name, flags, count,
+			       tree8_obstack, tree8_flag ? 0 : files,
+			       n, &tok_size);
+  hits_length += buf_size;
+  *off += tok_size + buf_size + 2;
+  note_token_size (idhp, name, buf_size, n);
+  if (trigrams_flag)
+    add_token_trigrams (name, ordinal);
+}
+
+/* Grow onto TREE8_OBSTACK the tree8 of LEVEL levels that covers the
+   files numbered from BASE, for those of the files in the ascending
+   vector from *FILES to END that it covers.  Advance *FILES past
+   them.  */
+
+static void
+file_numbers_to_tree8 (struct obstack *tree8_obstack,
+		       unsigned long const **files, unsigned long const *end,
+		       int level, unsigned long base)
+{
+  int shift = (level - 1) * 3;
+  unsigned long limit = base + (8UL << shift);
+  unsigned long const *fp;
+  int bits = 0;
+  int i;
+
+  for (fp = *files; fp < end && *fp < limit; fp++)
+    bits |= 1 << ((*fp - base) >> shift);
+  obstack_1grow (tree8_obstack, bits);
+  if (level == 1)
     {
-      struct token *token = *tokens;
+      *files = fp;
+      return;
+    }
+  for (i = 0; i < 8; i++)
+    if (bits & (1 << i))
+      file_numbers_to_tree8 (tree8_obstack, files, end, level - 1,
+			     base + ((unsigned long) i << shift));
+}
+
+/****************************************************************************/
+/* Spilling tokens to disk (--memory-limit).  */
+
+/* A run of tokens that mkid has written to a temporary file: the
+   tokens of the files from one to the next spill, in order, each as
+   its name, then its flags, count of occurrences, number of files and
+   the numbers of the files, the first of them as is and the others as
+   the difference from the one before, then, with --positions, the
+   size of its positions and the positions themselves.  Numbers are
+   written as positions are.  As they are merged, each run holds the
+   name, flags, count and number of files of the token that is next,
+   and its file is at the numbers of the files.  */
+
+struct spill_input
+{
+  FILE *si_file;
+  char const *si_token;		/* si_name, or 0 when there are no more */
+  char *si_name;
+  size_t si_name_alloc;
+  int si_flags;
+  unsigned long si_count;
+  unsigned long si_files;
+  unsigned char *si_positions;
+  size_t si_positions_alloc;
+  int si_matched;
+  int si_level;			/* merged from SPILL_MERGE_WIDTH^level runs */
+};
+
+/* Parse ARG, the SIZE of --memory-limit=SIZE.  */
+
+static void
+parse_memory_limit (char const *arg)
+{
+  if (xstrtoumax (arg, 0, 10, &memory_limit, "kKmMgGtT") != LONGINT_OK
+      || memory_limit == 0)
+    error (EXIT_FAILURE, 0, _("invalid memory limit: %s"), quote (arg));
+}
+
+/* Estimate the memory taken by the tokens of this run, their hits,
+   positions and tallies and the tables that lead to them, and by the
+   tokens kept for copies of files.  */
+
+static uintmax_t
+scan_memory_used (void)
+{
+  uintmax_t used = (tokens_size + summary_hits_size + kept_copies_size
+		    + (uintmax_t) token_table.ht_size * HASH_SLOT_SIZE
+		    + ((uintmax_t) token_table.ht_fill * (levels + 1)
+		       * sizeof (struct token *)));
+
+  if (positions_flag)
+    used += (token_lines_size
+	     + (uintmax_t) token_lines_table.ht_fill * sizeof (struct token_lines)
+	     + (uintmax_t) token_lines_table.ht_size * HASH_SLOT_SIZE);
+  if (incremental_flag)
+    used += obstack_object_size (&update_obstack);
+  return used;
+}
+
+/* Write the tokens of the files scanned since the last spill, up to
+   the file numbered NEXT_FILE, to a new temporary file, and free
+   them.  */
+
+static void
+spill_run (unsigned long next_file)
+{
+  struct spill_input *si;
+  struct token **tokens;
+  unsigned long count = token_table.ht_fill;
+  unsigned long *files = xnmalloc (next_file - run_base, sizeof *files);
+  struct update_hit *hits = 0;
+  struct update_hit const *hit = 0;
+  struct update_hit const *hits_end = 0;
+  struct token_tally *tallies = 0;
+  struct obstack tree8_obstack;
+  unsigned long i;
+
+  start_phase (PHASE_SPILL);
+  if (verbose_flag)
+    printf (_("Spilling %lu tokens of files %lu to %lu\n"),
+	    count, run_base + 1, next_file);
+  if (spill_run_count == spill_runs_alloc)
+    spill_runs = x2nrealloc (spill_runs, &spill_runs_alloc,
+			     sizeof *spill_runs);
+  si = &spill_runs[spill_run_count++];
+  memset (si, 0, sizeof *si);
+  si->si_file = create_spill_file ();
+
+  assert (summary_root->sum_hits_count == count);
+  free_summary_tokens ();
+  tokens = xnrealloc (summary_root->sum_tokens, count, sizeof *tokens);
+  summary_root->sum_tokens = 0;
+  sort_by_name ((void **) tokens, count, OFFSETOF_TOKEN_NAME);
+  if (incremental_flag)
+    {
+      unsigned long hits_count;
+
+      hits = finish_update_hits (&hits_count);
+      hit = hits;
+      hits_end = hits + hits_count;
+      tallies = xnmalloc (next_file - run_base, sizeof *tallies);
+    }
+  obstack_init (&tree8_obstack);
+  for (i = 0; i < count; i++)
+    {
+      struct token *token = tokens[i];
+      struct token_lines *tl;
+      unsigned char *tree8;
+      unsigned long n;
+      unsigned long j;
+
+      write_hits (&tree8_obstack, summary_root, TOKEN_HITS (token) + levels);
+      tree8 = obstack_finish (&tree8_obstack);
+      n = tree8_file_numbers (tree8, levels + 1, files);
+      obstack_free (&tree8_obstack, tree8);
+      for (j = 0; j < n; j++)
+	files[j] += run_base;
+
+      if (tallies && take_token_tallies (token, &hit, hits_end, tallies) != n)
+	abort ();
+      tl = positions_flag ? get_token_lines (token) : 0;
+      put_spill_token (si->si_file, TOKEN_NAME (token), token->tok_flags,
+		       token->tok_count, files, n, tallies, tl);
+      if (tl)
+	free (tl->tl_postings);
+    }
+  assert (check_hits (summary_root) == 0);
+  finish_spill_file (si->si_file);
+  spilled_runs++;
+
+  obstack_free (&tree8_obstack, 0);
+  if (incremental_flag)
+    {
+      obstack_free (&update_obstack, hits);
+      free (tallies);
+    }
+  free (tokens);
+  free (files);
+  free_summary (summary_root);
+  run_base = next_file;
+  compact_spill_runs ();
+  stop_phase (PHASE_SPILL);
+}
+
+/* Start a new run of tokens, after spill_run has written the last.
+   The tables go back to the size they started with, rather than keep
+   the slots that the last run grew them to.  */
+
+static void
+restart_run (void)
+{
+  evict_file_copies ();
+  hash_free (&token_table, 0);
+  hash_init_tagged (&token_table, run_table_slots, token_hash, token_hash_cmp);
+  obstack_free (&tokens_obstack, 0);
+  obstack_init (&tokens_obstack);
+  tokens_size = 0;
+  summary_hits_size = 0;
+  levels = 0;
+  init_hits_signature (0);
+  init_summary ();
+  if (positions_flag)
+    {
+      hash_free (&token_lines_table, 0);
+      hash_init_tagged (&token_lines_table, run_table_slots, token_lines_hash,
+			token_lines_hash_cmp);
+      obstack_free (&token_lines_obstack, 0);
+      obstack_init (&token_lines_obstack);
+      token_lines_size = 0;
+    }
+}
+
+/* While the last SPILL_MERGE_WIDTH runs are all of one level, merge
+   them into one run of the next.  The levels of the runs descend from
+   the first, as the digits of a number do, so a token is written once
+   for each level, about log64 of the number of runs times in all, and
+   no more than SPILL_MERGE_WIDTH - 1 runs of each level are open at
+   once.  */
+
+static void
+compact_spill_runs (void)
+{
+  while (spill_run_count >= SPILL_MERGE_WIDTH)
+    {
+      unsigned long first = spill_run_count - SPILL_MERGE_WIDTH;
+      int level = spill_runs[first].si_level;
+      FILE *fp;
+
+      if (spill_runs[spill_run_count - 1].si_level != level)
+	break;
+      if (verbose_flag)
+	printf (_("Merging %d runs of tokens of level %d into one\n"),
+		SPILL_MERGE_WIDTH, level);
+      fp = create_spill_file ();
+      merge_spilled_tokens (0, 0, 0, fp, first);
+      finish_spill_file (fp);
+      close_spill_runs (first);
+      spill_run_count = first + 1;
+      memset (&spill_runs[first], 0, sizeof spill_runs[first]);
+      spill_runs[first].si_file = fp;
+      spill_runs[first].si_level = level + 1;
+      spill_merges++;
+    }
+}
+
+/* Close the temporary files of the runs from the one numbered FIRST,
+   and free their buffers.  */
+
+static void
+close_spill_runs (unsigned long first)
+{
+  unsigned long i;
+
+  for (i = first; i < spill_run_count; i++)
+    {
+      fclose (spill_runs[i].si_file);
+      free (spill_runs[i].si_name);
+      free (spill_runs[i].si_positions);
+    }
+}
+
+/* Return a new temporary file, in $TMPDIR or else /tmp, open for
+   writing and then reading.  It is unlinked at once, so that it goes
+   away when mkid exits, however it does.  */
+
+static FILE *
+create_spill_file (void)
+{
+  char const *dir = getenv ("TMPDIR");
+  char *file_name;
+  FILE *fp;
+  int fd;
+
+  if (dir == 0 || *dir == '\0')
+    dir = "/tmp";
+  file_name = xmalloc (strlen (dir) + sizeof "/mkidXXXXXX");
+  strcat (strcpy (file_name, dir), "/mkidXXXXXX");
+  fd = mkstemp (file_name);
+  if (fd < 0)
+    error (EXIT_FAILURE, errno, _("cannot create a temporary file in %s"),
+	   quote (dir));
+  unlink (file_name);
+  free (file_name);
+  fp = fdopen (fd, "w+b");
+  if (fp == 0)
+    error (EXIT_FAILURE, errno, _("cannot create a temporary file in %s"),
+	   quote (dir));
+  return fp;
+}
+
+/* Check that a run has been written to FP in full, and count its
+   bytes.  */
+
+static void
+finish_spill_file (FILE *fp)
+{
+  off_t size;
+
+  if (fflush (fp) != 0 || ferror (fp) || (size = ftello (fp)) < 0)
+    error (EXIT_FAILURE, errno, _("error writing a temporary file"));
+  spilled_bytes += size;
+}
+
+static void
+put_spill_number (FILE *fp, uintmax_t value)
+{
+  while (value >= 0x80)
+    {
+      putc ((value & 0x7f) | 0x80, fp);
+      value >>= 7;
+    }
+  putc (value, fp);
+}
+
+static uintmax_t
+get_spill_number (FILE *fp)
+{
+  uintmax_t value = 0;
+  int shift = 0;
+  int c;
+
+  do
+    {
+      c = getc (fp);
+      if (c == EOF)
+	error (EXIT_FAILURE, errno, _("error reading a temporary file"));
+      value |= (uintmax_t) (c & 0x7f) << shift;
+      shift += 7;
+    }
+  while (c & 0x80);
+  return value;
+}
+
+/* Write to FP a token named NAME, with FLAGS and COUNT, that occurs
+   in the N files numbered FILES, in ascending order, as many times in
+   each as TALLIES says if it is not null, and, if TL is not null, on
+   the lines it holds.  */
+
+static void
+put_spill_token (FILE *fp, char const *name, int flags,
+		 unsigned long count, unsigned long const *files,
+		 unsigned long n, struct token_tally const *tallies,
+		 struct token_lines *tl)
+{
+  unsigned long j;
+
+  fputs (name, fp);
+  putc ('\0', fp);
+  put_spill_number (fp, flags);
+  put_spill_number (fp, count);
+  put_spill_number (fp, n);
+  for (j = 0; j < n; j++)
+    put_spill_number (fp, j ? files[j] - files[j - 1] : files[j]);
+  if (tallies)
+    for (j = 0; j < n; j++)
+      {
+	put_spill_number (fp, tallies[j].tt_count);
+	put_spill_number (fp, tallies[j].tt_flags);
+      }
+  if (tl)
+    {
+      finish_token_lines (tl);
+      put_spill_number (fp, tl->tl_size);
+      fwrite (tl->tl_postings, 1, tl->tl_size, fp);
+    }
+}
+
+/* Read the name, flags, count and number of files of the next token of
+   SI, or set its si_token to 0 if there are no more.  */
+
+static void
+read_spill_token (struct spill_input *si)
+{
+  size_t length = 0;
+  int c = getc (si->si_file);
+
+  if (c == EOF)
+    {
+      if (ferror (si->si_file))
+	error (EXIT_FAILURE, errno, _("error reading a temporary file"));
+      si->si_token = 0;
+      return;
+    }
+  do
+    {
+      if (length == si->si_name_alloc)
+	si->si_name = x2nrealloc (si->si_name, &si->si_name_alloc, 1);
+      si->si_name[length++] = c;
+    }
+  while (c && (c = getc (si->si_file)) != EOF);
+  if (c == EOF)
+    error (EXIT_FAILURE, errno, _("error reading a temporary file"));
+  si->si_token = si->si_name;
+  si->si_flags = get_spill_number (si->si_file);
+  si->si_count = get_spill_number (si->si_file);
+  si->si_files = get_spill_number (si->si_file);
+}
+
+/* Write the ID file from the runs of tokens that have been spilled.  */
+
+static void
+write_spilled_id_file (struct idhead *idhp)
+{
+  unsigned long tokens;
+  off_t *token_offsets;
+  off_t off;
+
+  start_phase (PHASE_WRITE);
+  if (verbose_flag)
+    printf (_("Merging %lu runs of tokens...\n"), spill_run_count);
+  tokens = merge_spilled_tokens (0, 0, 0, 0, 0);
+  off = begin_id_file (idhp, tokens);
+  token_offsets = xnmalloc (tokens, sizeof *token_offsets);
+  if (positions_flag)
+    ordered_token_lines = xnmalloc (tokens, sizeof *ordered_token_lines);
+  merge_spilled_tokens (idhp, token_offsets, &off, 0, 0);
+  finish_id_file (idhp, off, token_offsets);
+  free (token_offsets);
+
+  close_spill_runs (0);
+  free (spill_runs);
+  if (incremental_flag)
+    obstack_free (&update_obstack, 0);
+  stop_phase (PHASE_WRITE);
+}
+
+/* Merge the token entries of the runs that have been spilled, from the
+   one numbered FIRST_RUN to the last.  If RUN_FILE is not null, write
+   them to it as one run.  Otherwise, if IDHP is null, just count the
+   token entries that result, and tally their size in
+   merged_tokens_size.  Otherwise, write them to IDHP's file, starting
+   at offset *OFF, and record their offsets in TOKEN_OFFSETS.  Return
+   the number of token entries.  The runs cover ascending ranges of
+   files, so the files of a token are in order if taken from each run
+   in turn.  */
+
+static unsigned long
+merge_spilled_tokens (struct idhead *idhp, off_t *token_offsets, off_t *off,
+		      FILE *run_file, unsigned long first_run)
+{
+  struct token_lines run_tl;
+  unsigned long new_files = idh.idh_member_file_table.ht_fill;
+  int new_levels = tree8_count_levels (new_files);
+  unsigned long *files = xnmalloc (new_files, sizeof *files);
+  struct token_tally *tallies = 0;
+  unsigned long tokens = 0;
+  struct obstack tree8_obstack;
+  unsigned long i;
+
+  if (incremental_flag)
+    tallies = xnmalloc (new_files, sizeof *tallies);
+  for (i = first_run; i < spill_run_count; i++)
+    {
+      rewind (spill_runs[i].si_file);
+      read_spill_token (&spill_runs[i]);
+    }
+  run_tl.tl_token = 0;
+  run_tl.tl_alloc = 0;
+  run_tl.tl_postings = 0;
+  merged_tokens_size = 0;
+  obstack_init (&tree8_obstack);
+  for (;;)
+    {
+      char const *name = 0;
+      int flags = 0;
+      unsigned long count = 0;
+      unsigned long n = 0;
+      struct token_lines *tl = 0;
+
+      for (i = first_run; i < spill_run_count; i++)
+	{
+	  char const *run_name = spill_runs[i].si_token;
+	  int order;
+
+	  spill_runs[i].si_matched = 0;
+	  if (run_name == 0)
+	    continue;
+	  if (name)
+	    STRING_COMPARE (run_name, name, order);
+	  if (name == 0 || order < 0)
+	    name = run_name;
+	}
+      if (name == 0)
+	break;
+
+      if (run_file && positions_flag)
+	{
+	  tl = &run_tl;
+	  tl->tl_file = -1;
+	  tl->tl_line = 0;
+	  tl->tl_offset = 0;
+	  tl->tl_line_count = 0;
+	  tl->tl_size = 0;
+	}
+      else if (idhp && positions_flag)
+	tl = make_token_lines (0);
+      for (i = first_run; i < spill_run_count; i++)
+	{
+	  struct spill_input *si = &spill_runs[i];
+	  unsigned long j;
+
+	  if (si->si_token == 0 || !strequ (si->si_token, name))
+	    continue;
+	  si->si_matched = 1;
+	  flags |= si->si_flags;
+	  count += si->si_count;
+	  if (si->si_files > new_files - n)
+	    error (EXIT_FAILURE, 0, _("error reading a temporary file"));
+	  for (j = 0; j < si->si_files; j++, n++)
+	    files[n] = get_spill_number (si->si_file) + (j ? files[n - 1] : 0);
+	  if (tallies)
+	    for (j = n - si->si_files; j < n; j++)
+	      {
+		tallies[j].tt_file = files[j];
+		tallies[j].tt_count = get_spill_number (si->si_file);
+		tallies[j].tt_flags = get_spill_number (si->si_file);
+	      }
+	  if (positions_flag)
+	    {
+	      size_t size = get_spill_number (si->si_file);
+	      struct position_postings pp;
+	      unsigned long file;
+
+	      if (size > si->si_positions_alloc)
+		{
+		  free (si->si_positions);
+		  si->si_positions = xmalloc (size);
+		  si->si_positions_alloc = size;
+		}
+	      if (fread (si->si_positions, 1, size, si->si_file) != size)
+		error (EXIT_FAILURE, errno, _("error reading a temporary file"));
+	      pp.pp_next = si->si_positions;
+	      pp.pp_end = si->si_positions + size;
+	      pp.pp_file = -1;
+	      pp.pp_in_file = 0;
+	      pp.pp_line = 0;
+	      pp.pp_offset = 0;
+	      while (tl && next_position_file (&pp, &file))
+		copy_position_lines (tl, file, &pp);
+	    }
+	}
+
+      if (run_file)
+	put_spill_token (run_file, name, flags, count, files, n, tallies, tl);
+      else if (idhp)
+	{
+	  put_merged_token (idhp, name, flags, count, files, n, new_levels,
+			    &tree8_obstack, tokens, token_offsets, off);
+	  if (tallies)
+	    put_token_tallies (tallies, n);
+	  if (tl)
+	    {
+	      finish_token_lines (tl);
+	      ordered_token_lines[tokens] = tl;
+	    }
+	}
+      else if (tree8_flag)
+	note_merged_token_size (name, files, n, new_levels, &tree8_obstack);
+      tokens++;
+
+      for (i = first_run; i < spill_run_count; i++)
+	if (spill_runs[i].si_matched)
+	  read_spill_token (&spill_runs[i]);
+    }
+  obstack_free (&tree8_obstack, 0);
+  free (files);
+  free (tallies);
+  if (run_file && positions_flag)
+    free (run_tl.tl_postings);
+  return tokens;
+}
+
+/****************************************************************************/
+/* Merging ID files (idmerge).  */
+
+/* An ID file that idmerge reads, and the token entry of it that is
+   to be merged next.  */
+
+struct merge_input
+{
+  struct idhead mi_idh;
+  struct file_link **mi_members;	/* by file number */
+  unsigned long *mi_to_new;	/* the merged number of each file */
+  int mi_levels;		/* of its tree8s */
+  char const *mi_token;		/* the next token entry */
+  unsigned long mi_ordinal;	/* its number */
+  int mi_matched;		/* it is the one being merged */
+  struct position_postings mi_pp;	/* its positions */
+  int mi_in_file;		/* mi_pp is at the lines of a file */
+  unsigned long mi_file;	/* the merged number of that file */
+  unsigned char const *mi_tallies;	/* its IDS_TOKEN_TALLIES section */
+  unsigned char const *mi_tallies_end;
+  unsigned char const *mi_tally;	/* the tallies of mi_token */
+};
+
+/* Write to IDHP's file the ID file that results from merging the
+   COUNT ID files named in FILE_NAMES, which must have no member file
+   in common.  If they are the shards of one tree that mkid --shard
+   built, the result is the same as that of one mkid run over the
+   tree with the options they share; otherwise the member files of
+   each follow those of the one before.  */
+
+static void
+merge_id_files (struct idhead *idhp, int count, char **file_names)
+{
+  struct merge_input *inputs = xcalloc (count, sizeof *inputs);
+  unsigned long tokens;
+  off_t *token_offsets;
+  off_t off;
+  int i;
+
+  init_idh_obstacks (idhp);
+  init_idh_tables (idhp);
+  incremental_flag = trigrams_flag = positions_flag = 1;
+  for (i = 0; i < count; i++)
+    {
+      struct merge_input *mi = &inputs[i];
+
+      read_merge_input (mi, file_names[i]);
+      if (find_id_section (&mi->mi_idh, IDS_MEMBER_STATS) == 0
+	  || find_id_section (&mi->mi_idh, IDS_TOKEN_TALLIES) == 0)
+	incremental_flag = 0;
+      if (find_id_section (&mi->mi_idh, IDS_TRIGRAMS) == 0)
+	trigrams_flag = 0;
+      if (!(mi->mi_idh.idh_flags & IDH_POSITIONS))
+	positions_flag = 0;
+    }
+  number_merged_files (inputs, count);
+
+  /* The merged ID file was built when the first of the inputs was.  */
+  if (incremental_flag)
+    {
+      uint64_t start = UINT64_MAX;
+
+      member_stats = xnmalloc (idhp->idh_member_file_table.ht_fill,
+			       sizeof *member_stats);
+      for (i = 0; i < count; i++)
+	{
+	  struct merge_input *mi = &inputs[i];
+	  struct id_section *section
+	    = find_id_section (&mi->mi_idh, IDS_MEMBER_STATS);
+	  struct id_section *tallies
+	    = find_id_section (&mi->mi_idh, IDS_TOKEN_TALLIES);
+	  unsigned char const *stats;
+	  unsigned long j;
+
+	  if (section->ids_length < 8 + (off_t) mi->mi_idh.idh_files * MEMBER_STAT_BYTES
+	      || section->ids_offset + section->ids_length > mi->mi_idh.idh_map_size
+	      || tallies->ids_offset + tallies->ids_length > mi->mi_idh.idh_map_size)
+	    error (EXIT_FAILURE, 0, _("`%s' is truncated"),
+		   mi->mi_idh.idh_file_name);
+	  mi->mi_tallies = mi->mi_idh.idh_map + tallies->ids_offset;
+	  mi->mi_tallies_end = mi->mi_tallies + tallies->ids_length;
+	  stats = mi->mi_idh.idh_map + section->ids_offset;
+	  if (start > get_uint64 (stats))
+	    start = get_uint64 (stats);
+	  for (j = 0; j < mi->mi_idh.idh_files; j++)
+	    {
+	      struct member_stat *ms = &member_stats[mi->mi_to_new[j]];
+	      unsigned char const *stat = stats + 8 + j * MEMBER_STAT_BYTES;
+
+	      ms->ms_mtime = get_uint64 (stat);
+	      ms->ms_size = get_uint64 (stat + 8);
+	      ms->ms_ino = get_uint64 (stat + 16);
+	    }
+	}
+      scan_start_time = start;
+    }
+  if (positions_flag)
+    {
+      hash_init_tagged (&token_lines_table, 16, token_lines_hash,
+			token_lines_hash_cmp);
+      obstack_init (&token_lines_obstack);
+    }
+  if (verbose_flag)
+    printf (_("Merging %d ID files of %lu files\n"),
+	    count, idhp->idh_member_file_table.ht_fill);
+
+  /* Count the token entries, then write them.  */
 
-      occurrences += token->tok_count;
-      if (token->tok_flags & TOK_NUMBER)
-	number_tokens++;
-      if (token->tok_flags & TOK_NAME)
-	name_tokens++;
-      if (token->tok_flags & TOK_STRING)
-	string_tokens++;
-      if (token->tok_flags & TOK_LITERAL)
-	literal_tokens++;
-      if (token->tok_flags & TOK_COMMENT)
-	comment_tokens++;
-
-      fputs (TOKEN_NAME (token), idhp->idh_FILE);
-      putc ('\0', idhp->idh_FILE);
-      if (token->tok_count > 0xff)
-	token->tok_flags |= TOK_SHORT_COUNT;
-      putc (token->tok_flags, idhp->idh_FILE);
-      putc (token->tok_count & 0xff, idhp->idh_FILE);
-      if (token->tok_flags & TOK_SHORT_COUNT)
-	putc (token->tok_count >> 8, idhp->idh_FILE);
+  tokens = merge_input_tokens (inputs, count, 0, 0, 0);
+  off = begin_id_file (idhp, tokens);
+  token_offsets = xnmalloc (tokens, sizeof *token_offsets);
+  if (positions_flag)
+    ordered_token_lines = xnmalloc (tokens, sizeof *ordered_token_lines);
+  merge_input_tokens (inputs, count, idhp, token_offsets, &off);
+  finish_id_file (idhp, off, token_offsets);
+  free (token_offsets);
+
+  for (i = 0; i < count; i++)
+    {
+      unmap_id_file (&inputs[i].mi_idh);
+      fclose (inputs[i].mi_idh.idh_FILE);
+      free (inputs[i].mi_members);
+      free (inputs[i].mi_to_new);
+    }
+  free (inputs);
+}
+
+/* Read the ID file FILE_NAME into MI, and add its member files, and
+   the directories that lead to them, to those of idh.  */
+
+static void
+read_merge_input (struct merge_input *mi, char const *file_name)
+{
+  struct file_link **members;
+  unsigned long j;
+
+  mi->mi_idh.idh_file_name = file_name;
+  init_idh_tables (&mi->mi_idh);
+  mi->mi_members = read_id_file (file_name, &mi->mi_idh);
+  map_id_file (&mi->mi_idh);
+  mi->mi_levels = tree8_count_levels (mi->mi_idh.idh_files);
+  mi->mi_to_new = xnmalloc (mi->mi_idh.idh_files, sizeof *mi->mi_to_new);
+
+  members = mi->mi_members;
+  for (j = 0; j < mi->mi_idh.idh_files; j++)
+    {
+      struct member_file *member;
+      struct file_link *flink;
+
+      if (members[j] == 0)
+	error (EXIT_FAILURE, 0, _("`%s' is corrupt"), file_name);
+      flink = merge_file_link (members[j]);
+      if (find_member_file (flink))
+	{
+	  char *name = alloca (PATH_MAX);
+	  absolute_file_name (name, flink);
+	  error (EXIT_FAILURE, 0, _("`%s' is in more than one ID file"), name);
+	}
+      member = obstack_alloc (&idh.idh_member_file_obstack, sizeof *member);
+      member->mf_link = flink;
+      member->mf_lang_args = 0;
+      member->mf_index = -1;
+      member->mf_size = -1;
+      hash_insert (&idh.idh_member_file_table, member);
+    }
+}
+
+/* Return the link of idh that has the same name as FLINK, which is
+   from an ID file being merged, making it and its ancestors if need
+   be.  */
+
+static struct file_link *
+merge_file_link (struct file_link const *flink)
+{
+  static struct file_link *root;
+  struct file_link *parent;
+  struct file_link *new_link;
+  struct file_link **slot;
+
+  if (IS_ROOT_FILE_LINK (flink) && root)
+    return root;
+  parent = IS_ROOT_FILE_LINK (flink) ? 0 : merge_file_link (flink->fl_parent);
+  new_link = obstack_alloc (&idh.idh_file_link_obstack,
+			    sizeof *new_link + strlen (flink->fl_name));
+  strcpy (new_link->fl_name, flink->fl_name);
+  new_link->fl_parent = parent ? parent : new_link;
+  new_link->fl_flags = flink->fl_flags;
+  slot = (struct file_link **) hash_find_slot (&idh.idh_file_link_table,
+					       new_link);
+  if (HASH_VACANT (*slot))
+    hash_insert_at (&idh.idh_file_link_table, new_link, slot);
+  else
+    {
+      obstack_free (&idh.idh_file_link_obstack, new_link);
+      new_link = *slot;
+    }
+  if (parent == 0)
+    root = new_link;
+  return new_link;
+}
+
+/* Number the member files of the merged ID file, and fill in the
+   mi_to_new of each of the COUNT INPUTS.  Shards built by mkid
+   --shard record the number of each of their files in the whole
+   tree, and must all be there.  */
+
+static void
+number_merged_files (struct merge_input *inputs, int count)
+{
+  unsigned long files = idh.idh_member_file_table.ht_fill;
+  int shards = 0;
+  unsigned long base = 0;
+  int i;
+
+  for (i = 0; i < count; i++)
+    if (find_id_section (&inputs[i].mi_idh, IDS_SHARD))
+      shards++;
+  if (shards && shards < count)
+    error (EXIT_FAILURE, 0, _("some of the ID files are shards and some are not"));
+
+  for (i = 0; i < count; i++)
+    {
+      struct merge_input *mi = &inputs[i];
+      struct id_section *section = find_id_section (&mi->mi_idh, IDS_SHARD);
+      unsigned char const *numbers = 0;
+      unsigned long j;
+
+      if (section)
+	{
+	  if (section->ids_length < 8 + (off_t) mi->mi_idh.idh_files * 8
+	      || section->ids_offset + section->ids_length > mi->mi_idh.idh_map_size)
+	    error (EXIT_FAILURE, 0, _("`%s' is truncated"),
+		   mi->mi_idh.idh_file_name);
+	  numbers = mi->mi_idh.idh_map + section->ids_offset;
+	  if (get_uint64 (numbers) != files)
+	    error (EXIT_FAILURE, 0,
+		   _("`%s' is a shard of a tree of %lu files, not %lu"),
+		   mi->mi_idh.idh_file_name,
+		   (unsigned long) get_uint64 (numbers), files);
+	}
+      for (j = 0; j < mi->mi_idh.idh_files; j++)
+	{
+	  unsigned long number = (numbers
+				  ? get_uint64 (numbers + 8 + j * 8)
+				  : base + j);
+	  struct member_file *member;
+	  struct file_link *flink;
+
+	  if (number >= files)
+	    error (EXIT_FAILURE, 0, _("`%s' is corrupt"),
+		   mi->mi_idh.idh_file_name);
+	  member = find_member_file (merge_file_link (mi->mi_members[j]));
+	  member->mf_index = number;
+	  mi->mi_to_new[j] = number;
+	  for (flink = member->mf_link;
+	       !(flink->fl_flags & FL_USED); flink = flink->fl_parent)
+	    flink->fl_flags |= FL_USED;
+	}
+      base += mi->mi_idh.idh_files;
+    }
+
+  /* The shards' numbers, which are all different if they cover the
+     tree, must each be used once.  */
+  if (shards)
+    {
+      char *used = xcalloc (files, 1);
+      for (i = 0; i < count; i++)
+	{
+	  unsigned long j;
+	  for (j = 0; j < inputs[i].mi_idh.idh_files; j++)
+	    {
+	      if (used[inputs[i].mi_to_new[j]])
+		error (EXIT_FAILURE, 0, _("`%s' repeats a shard"),
+		       inputs[i].mi_idh.idh_file_name);
+	      used[inputs[i].mi_to_new[j]] = 1;
+	    }
+	}
+      free (used);
+    }
+}
+
+/* Merge the token entries of the COUNT INPUTS, whose names are in
+   the same order in each.  If IDHP is null, just count the token
+   entries that result, and tally their size in merged_tokens_size.
+   Otherwise, write them to IDHP's file, starting at offset *OFF, and
+   record their offsets in TOKEN_OFFSETS.  Return the number of token
+   entries.  */
+
+static unsigned long
+merge_input_tokens (struct merge_input *inputs, int count,
+		    struct idhead *idhp, off_t *token_offsets, off_t *off)
+{
+  unsigned long new_files = idh.idh_member_file_table.ht_fill;
+  int new_levels = tree8_count_levels (new_files);
+  unsigned long max_files = 0;
+  unsigned long *input_files;
+  unsigned long *files = xnmalloc (new_files, sizeof *files);
+  struct token_tally *tallies = 0;
+  unsigned long tokens = 0;
+  struct obstack tree8_obstack;
+  int i;
+
+  if (incremental_flag)
+    tallies = xnmalloc (new_files, sizeof *tallies);
+  for (i = 0; i < count; i++)
+    {
+      inputs[i].mi_token = ID_TOKENS_BEGIN (&inputs[i].mi_idh);
+      inputs[i].mi_ordinal = 0;
+      inputs[i].mi_tally = inputs[i].mi_tallies;
+      if (max_files < inputs[i].mi_idh.idh_files)
+	max_files = inputs[i].mi_idh.idh_files;
+    }
+  input_files = xnmalloc (max_files + 1, sizeof *input_files);
+  merged_tokens_size = 0;
+  obstack_init (&tree8_obstack);
+  for (;;)
+    {
+      char const *name = 0;
+      int flags = 0;
+      unsigned long token_count_sum = 0;
+      unsigned long n = 0;
+      bool sorted = true;
+
+      for (i = 0; i < count; i++)
+	{
+	  struct merge_input *mi = &inputs[i];
+	  int order;
+
+	  mi->mi_matched = 0;
+	  if (mi->mi_token >= ID_TOKENS_END (&mi->mi_idh))
+	    continue;
+	  if (name)
+	    STRING_COMPARE (mi->mi_token, name, order);
+	  if (name == 0 || order < 0)
+	    name = mi->mi_token;
+	}
+      if (name == 0)
+	break;
+
+      for (i = 0; i < count; i++)
+	{
+	  struct merge_input *mi = &inputs[i];
+	  unsigned long total;
+	  unsigned long j;
+
+	  if (mi->mi_token >= ID_TOKENS_END (&mi->mi_idh)
+	      || !strequ (mi->mi_token, name))
+	    continue;
+	  mi->mi_matched = 1;
+	  flags |= token_flags (mi->mi_token) & ~(TOK_SHORT_COUNT | TOK_BITMAP);
+	  token_count_sum += token_count (mi->mi_token);
+	  total = token_entry_files (&mi->mi_idh, mi->mi_token,
+				     mi->mi_levels, input_files);
+	  for (j = 0; j < total; j++)
+	    {
+	      if (input_files[j] >= mi->mi_idh.idh_files || n == new_files)
+		error (EXIT_FAILURE, 0, _("`%s' is corrupt"),
+		       mi->mi_idh.idh_file_name);
+	      files[n] = mi->mi_to_new[input_files[j]];
+	      if (tallies)
+		{
+		  get_token_tally (&mi->mi_tally, mi->mi_tallies_end,
+				   mi->mi_idh.idh_file_name, &tallies[n]);
+		  tallies[n].tt_file = files[n];
+		}
+	      if (n && files[n] < files[n - 1])
+		sorted = false;
+	      n++;
+	    }
+	}
+      if (!sorted && tallies)
+	{
+	  unsigned long j;
+
+	  qsort (tallies, n, sizeof *tallies, token_tally_qsort_cmp);
+	  for (j = 0; j < n; j++)
+	    files[j] = tallies[j].tt_file;
+	}
+      else if (!sorted)
+	qsort (files, n, sizeof *files, file_number_qsort_cmp);
 
-      vec_size = count_vec_size (summary_root, TOKEN_HITS (token) + levels);
-      buf_size = count_buf_size (summary_root, TOKEN_HITS (token) + levels);
-      hits_length += buf_size;
-      tok_size = strlen (TOKEN_NAME (token)) + 1;
-      tokens_length += tok_size;
-      buf_size += tok_size + sizeof (token->tok_flags) + sizeof (token->tok_count) + 2;
-      if (buf_size > max_buf_size)
-	max_buf_size = buf_size;
-      if (vec_size > max_vec_size)
-	max_vec_size = vec_size;
-
-      write_hits (idhp->idh_FILE, summary_root, TOKEN_HITS (token) + levels);
-      putc ('\0', idhp->idh_FILE);
-      putc ('\0', idhp->idh_FILE);
+      if (idhp)
+	{
+	  put_merged_token (idhp, name, flags, token_count_sum, files, n,
+			    new_levels, &tree8_obstack, tokens,
+			    token_offsets, off);
+	  if (tallies)
+	    put_token_tallies (tallies, n);
+	  if (positions_flag)
+	    ordered_token_lines[tokens] = merge_token_lines (inputs, count,
+							     name);
+	}
+      else if (tree8_flag)
+	note_merged_token_size (name, files, n, new_levels, &tree8_obstack);
+      tokens++;
+
+      for (i = 0; i < count; i++)
+	if (inputs[i].mi_matched)
+	  {
+	    inputs[i].mi_token = skip_token (inputs[i].mi_token);
+	    inputs[i].mi_ordinal++;
+	  }
     }
-  assert (check_hits (summary_root) == 0);
-  idhp->idh_tokens = token_table.ht_fill;
-  off = ftello (idhp->idh_FILE);
-  if (UINT32_MAX < off)
-    error (EXIT_FAILURE, 0, _("internal limitation: offset of 2^32 or larger"));
-  output_length = off;
-  idhp->idh_end_offset = output_length - 2;
-  idhp->idh_buf_size = max_buf_size;
-  idhp->idh_vec_size = max_vec_size;
-
-  write_idhead (&idh);
-  if (ferror (idhp->idh_FILE) || fclose (idhp->idh_FILE) != 0)
-    error (EXIT_FAILURE, errno, _("error closing `%s'"), idhp->idh_file_name);
+  obstack_free (&tree8_obstack, 0);
+  free (input_files);
+  free (files);
+  free (tallies);
+  return tokens;
 }
 
-/* Define primary and secondary hash and comparison functions for the
-   token table.  */
+/* Return the positions of the token NAME, merged from those of the
+   INPUTS whose mi_matched is set, in order of the merged file
+   numbers.  */
 
-static unsigned long _GL_ATTRIBUTE_PURE
-token_hash_1 (void const *key)
+static struct token_lines *
+merge_token_lines (struct merge_input *inputs, int count, char const *name)
 {
-  return_STRING_HASH_1 (TOKEN_NAME ((struct token const *) key));
-}
+  struct token_lines *tl = make_token_lines (0);
+  int i;
 
-static unsigned long _GL_ATTRIBUTE_PURE
-token_hash_2 (void const *key)
-{
-  return_STRING_HASH_2 (TOKEN_NAME ((struct token const *) key));
-}
+  for (i = 0; i < count; i++)
+    {
+      struct merge_input *mi = &inputs[i];
+      unsigned long file;
 
-static int _GL_ATTRIBUTE_PURE
-token_hash_cmp (void const *x, void const *y)
-{
-  return_STRING_COMPARE (TOKEN_NAME ((struct token const *) x),
-			 TOKEN_NAME ((struct token const *) y));
+      mi->mi_in_file = 0;
+      if (!mi->mi_matched)
+	continue;
+      if (!find_position_postings (&mi->mi_idh, mi->mi_ordinal, &mi->mi_pp))
+	error (EXIT_FAILURE, 0, _("`%s' has no positions of `%s'"),
+	       mi->mi_idh.idh_file_name, name);
+      if (next_position_file (&mi->mi_pp, &file))
+	{
+	  mi->mi_in_file = 1;
+	  mi->mi_file = mi->mi_to_new[file];
+	}
+    }
+
+  for (;;)
+    {
+      struct merge_input *first = 0;
+      unsigned long file;
+
+      for (i = 0; i < count; i++)
+	if (inputs[i].mi_in_file
+	    && (first == 0 || inputs[i].mi_file < first->mi_file))
+	  first = &inputs[i];
+      if (first == 0)
+	break;
+      copy_position_lines (tl, first->mi_file, &first->mi_pp);
+      if (next_position_file (&first->mi_pp, &file)
+	  && file < first->mi_idh.idh_files)
+	first->mi_file = first->mi_to_new[file];
+      else
+	first->mi_in_file = 0;
+    }
+  finish_token_lines (tl);
+  return tl;
 }
 
-static int _GL_ATTRIBUTE_PURE
-token_qsort_cmp (void const *x, void const *y)
+/* Add to merged_tokens_size the size of the token entry of NAME, were
+   the N files numbered in the ascending vector FILES stored as a tree8
+   of LEVELS levels, which is grown and freed on TREE8_OBSTACK.  */
+
+static void
+note_merged_token_size (char const *name, unsigned long const *files,
+			unsigned long n, int levels,
+			struct obstack *tree8_obstack)
 {
-  return_STRING_COMPARE (TOKEN_NAME (*(struct token const *const *) x),
-			 TOKEN_NAME (*(struct token const *const *) y));
+  unsigned long const *fp = files;
+
+  file_numbers_to_tree8 (tree8_obstack, &fp, files + n, levels, 0);
+  merged_tokens_size += (strlen (name) + 1
+			 + sizeof (unsigned char) /* flags */
+			 + sizeof (unsigned short) /* count */
+			 + obstack_object_size (tree8_obstack) + 2);
+  obstack_free (tree8_obstack, obstack_finish (tree8_obstack));
 }
 
-
 /****************************************************************************/
+/* Token positions (--positions).  */
 
-/* Advance the tree8 hit signature that corresponds to the file
-   we are now scanning.  */
+/* Begin counting the lines of the file whose contents begin at
+   BEGIN, and noting the positions of its tokens.  */
 
 static void
-bump_current_hits_signature (void)
+init_file_positions (struct file_positions *fps, char const *begin)
 {
-  unsigned char *hits = current_hits_signature;
-  while (*hits & 0x80)
-    *hits++ = 1;
-  *hits <<= 1;
+  fps->fps_count = 0;
+  fps->fps_begin = begin;
+  fps->fps_counted = begin;
+  fps->fps_line_start = begin;
+  fps->fps_line = 1;
 }
 
-/* Initialize the tree8 hit signature for the first file we scan.  */
+/* Advance FPS to the line of the token that ends just before IN.  A
+   scanner may have consumed the newline that follows a token, but no
+   more, so the token is on the line of the byte before its last.  */
 
 static void
-init_hits_signature (int i)
+count_file_lines (struct file_positions *fps, char const *in)
 {
-  unsigned char *hits = current_hits_signature;
-  unsigned char const *end = current_hits_signature + log_8_member_files;
-  while (hits < end)
+  char const *last = in - 1;
+
+  while (fps->fps_counted < last)
     {
-      *hits = 1 << (i & 7);
-      i >>= 3;
-      hits++;
+      char const *newline = memchr (fps->fps_counted, '\n',
+				    last - fps->fps_counted);
+      if (newline == 0)
+	{
+	  fps->fps_counted = last;
+	  break;
+	}
+      fps->fps_line++;
+      fps->fps_counted = fps->fps_line_start = newline + 1;
     }
 }
 
+/* Note that TOKEN occurs just before IN.  */
+
 static void
-free_summary_tokens (void)
+note_token_position (struct file_positions *fps, struct token const *token,
+		     char const *in)
 {
-  struct summary *summary = summary_leaf;
-  while (summary != summary_root)
-    {
-      free (summary->sum_tokens);
-      summary = summary->sum_parent;
-    }
+  struct token_position *pos;
+
+  count_file_lines (fps, in);
+  if (fps->fps_count == fps->fps_alloc)
+    fps->fps_positions = x2nrealloc (fps->fps_positions, &fps->fps_alloc,
+				     sizeof *fps->fps_positions);
+  pos = &fps->fps_positions[fps->fps_count++];
+  pos->tpos_token = token;
+  pos->tpos_line = fps->fps_line;
+  pos->tpos_offset = fps->fps_line_start - fps->fps_begin;
 }
 
+/* Group the positions of FPS by token, each group in order of line, so
+   that merge_file_scan can find those of each token.  */
+
 static void
-summarize (void)
+sort_file_positions (struct file_positions *fps)
 {
-  unsigned char const *hits_sig = current_hits_signature;
-  struct summary *summary = summary_leaf;
+  qsort (fps->fps_positions, fps->fps_count, sizeof *fps->fps_positions,
+	 token_position_qsort_cmp);
+}
 
-  do
-    {
-      unsigned long count = summary->sum_hits_count;
-      unsigned char *hits = xmalloc (count + 1);
-      unsigned int level = summary->sum_level;
-      struct token **tokens = summary->sum_tokens;
-      unsigned long init_size = INIT_TOKENS_SIZE (summary->sum_level);
+static int _GL_ATTRIBUTE_PURE
+token_position_qsort_cmp (void const *x, void const *y)
+{
+  struct token_position const *px = x;
+  struct token_position const *py = y;
+  uintptr_t tx = (uintptr_t) px->tpos_token;
+  uintptr_t ty = (uintptr_t) py->tpos_token;
+
+  if (tx != ty)
+    return tx < ty ? -1 : 1;
+  return (px->tpos_line > py->tpos_line) - (px->tpos_line < py->tpos_line);
+}
 
-      if (verbose_flag)
-	printf (_("level %d: %ld/%ld = %.0f%%\n"),
-		summary->sum_level, count, init_size,
-		100.0 * (double) count / (double) init_size);
+/* Return the first of the sorted positions of FPS that are of TOKEN.  */
 
-      qsort (tokens, count, sizeof (struct token *), token_qsort_cmp);
-      summary->sum_hits = hits;
-      while (count--)
-	{
-	  unsigned char *hit = TOKEN_HITS (*tokens++) + level;
-	  *hits++ = *hit;
-	  *hit = 0;
-	}
-      *hits++ = 0;
-      if (summary->sum_parent)
-	{
-	  free (summary->sum_tokens);
-	  summary->sum_tokens = 0;
-	}
-      summary = summary->sum_parent;
+static struct token_position const *
+find_file_positions (struct file_positions const *fps,
+		     struct token const *token)
+{
+  struct token_position const *positions = fps->fps_positions;
+  size_t low = 0;
+  size_t high = fps->fps_count;
+
+  while (low < high)
+    {
+      size_t middle = low + (high - low) / 2;
+      if ((uintptr_t) positions[middle].tpos_token < (uintptr_t) token)
+	low = middle + 1;
+      else
+	high = middle;
     }
-  while (*++hits_sig & 0x80);
-  summary_leaf = make_sibling_summary (summary_leaf);
+  return &positions[low];
 }
 
+/* Add to the positions of TOKEN in the file numbered FILE the group of
+   sorted positions that begins at POSITIONS and ends before END or at
+   the first position of another token.  */
+
 static void
-init_summary (void)
+post_token_positions (struct token const *token, unsigned long file,
+		      struct token_position const *positions,
+		      struct token_position const *end)
 {
-  unsigned long size = INIT_TOKENS_SIZE (0);
-  summary_root = summary_leaf = xcalloc (1, sizeof(struct summary));
-  summary_root->sum_tokens_size = size;
-  summary_root->sum_tokens = xmalloc (sizeof(struct token *) * size);
+  struct token_lines *tl = get_token_lines (token);
+  struct token const *file_token = positions->tpos_token;
+
+  for (; positions < end && positions->tpos_token == file_token; positions++)
+    add_token_line (tl, file, positions->tpos_line, positions->tpos_offset);
 }
 
-static struct summary *
-make_sibling_summary (struct summary *summary)
-{
-  struct summary *parent = summary->sum_parent;
-  size_t size;
+/* Return the positions of TOKEN, which are empty if it has none yet.  */
 
-  if (parent == NULL)
-    {
-      levels++;
-      summary_root = summary->sum_parent = parent
-	= xcalloc (1, sizeof(struct summary));
-      parent->sum_level = levels;
-      parent->sum_kids[0] = summary;
-      parent->sum_hits_count = summary->sum_hits_count;
-      parent->sum_free_index = 1;
-      size = INIT_TOKENS_SIZE (levels);
-      if (summary->sum_tokens_size >= size)
-	{
-	  parent->sum_tokens_size = summary->sum_tokens_size;
-	  parent->sum_tokens = summary->sum_tokens;
-	}
-      else
-	{
-	  parent->sum_tokens_size = size;
-	  parent->sum_tokens = xnrealloc (summary->sum_tokens, size,
-					  sizeof *summary->sum_tokens);
-	}
-      summary->sum_tokens = 0;
-    }
-  if (parent->sum_free_index == 8)
-    parent = make_sibling_summary (parent);
-  summary = xcalloc (1, sizeof(struct summary));
-  summary->sum_level = parent->sum_level - 1;
-  parent->sum_kids[parent->sum_free_index++] = summary;
-  summary->sum_parent = parent;
-  size = INIT_TOKENS_SIZE (summary->sum_level);
-  summary->sum_tokens_size = size;
-  summary->sum_tokens = xmalloc (sizeof(struct token *) * size);
-  return summary;
+static struct token_lines *
+get_token_lines (struct token const *token)
+{
+  struct token_lines key;
+  struct token_lines **slot;
+  struct token_lines *tl;
+
+  key.tl_token = token;
+  slot = (struct token_lines **) hash_find_slot (&token_lines_table, &key);
+  if (!HASH_VACANT (*slot))
+    return *slot;
+  tl = make_token_lines (token);
+  hash_insert_at (&token_lines_table, tl, slot);
+  return tl;
 }
 
-static int _GL_ATTRIBUTE_PURE
-count_vec_size (struct summary *summary, unsigned char const *tail_hits)
+/* Return new, empty positions of TOKEN.  */
+
+static struct token_lines *
+make_token_lines (struct token const *token)
 {
-  struct summary **kids;
-  unsigned int hits = (summary->sum_hits ? *summary->sum_hits : *tail_hits);
+  struct token_lines *tl = obstack_alloc (&token_lines_obstack, sizeof *tl);
+
+  tl->tl_token = token;
+  tl->tl_file = -1;
+  tl->tl_line = 0;
+  tl->tl_offset = 0;
+  tl->tl_line_count = 0;
+  tl->tl_size = 0;
+  tl->tl_alloc = 0;
+  tl->tl_postings = 0;
+  return tl;
+}
 
-  kids = summary->sum_kids;
-  if (*kids == NULL)
+/* Add an occurrence of a token on the line numbered LINE, which begins
+   at OFFSET, of the file numbered FILE to its positions TL.  Files
+   must be added in ascending order, and the lines of each file too.  */
+
+static void
+add_token_line (struct token_lines *tl, unsigned long file,
+		unsigned long line, uint64_t offset)
+{
+  if (tl->tl_line_count && file == tl->tl_file && line == tl->tl_line)
     {
-      static char bits_per_nybble[] = { 0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4 };
-      return bits_per_nybble[hits & 0xf] + bits_per_nybble[hits >> 4];
+      tl->tl_line_count++;
+      return;
     }
-  else
+  if (tl->tl_alloc - tl->tl_size < 5 * POSITION_NUMBER_MAX)
     {
-      int bit;
-      int count = 0;
-      --tail_hits;
-      for (bit = 1; bit & 0xff; bit <<= 1, ++kids)
-	if (bit & hits)
-	  count += count_vec_size (*kids, tail_hits);
-      return count;
+      token_lines_size += tl->tl_alloc + 5 * POSITION_NUMBER_MAX;
+      tl->tl_alloc = 2 * tl->tl_alloc + 5 * POSITION_NUMBER_MAX;
+      tl->tl_postings = xrealloc (tl->tl_postings, tl->tl_alloc);
     }
-}
-
-static int _GL_ATTRIBUTE_PURE
-count_buf_size (struct summary *summary, unsigned char const *tail_hits)
-{
-  struct summary **kids;
-  unsigned int hits = (summary->sum_hits ? *summary->sum_hits : *tail_hits);
-
-  kids = summary->sum_kids;
-  if (*kids == NULL)
-    return 1;
-  else
+  if (file != tl->tl_file)
     {
-      int bit;
-      int count = 1;
-      --tail_hits;
-      for (bit = 1; bit & 0xff; bit <<= 1, ++kids)
-	if (bit & hits)
-	  count += count_buf_size (*kids, tail_hits);
-      return count;
+      finish_token_lines (tl);
+      put_position_number (tl, file - tl->tl_file);
+      tl->tl_file = file;
+      tl->tl_line = 0;
+      tl->tl_offset = 0;
     }
+  else
+    put_position_number (tl, tl->tl_line_count);
+  put_position_number (tl, line - tl->tl_line);
+  put_position_number (tl, offset - tl->tl_offset);
+  tl->tl_line = line;
+  tl->tl_offset = offset;
+  tl->tl_line_count = 1;
 }
 
-/* Sanity-check hit counts.  Return nonzero if there's a problem.
-   Otherwise, return 0.  */
-static int
-check_hits (struct summary* summary)
-{
-  struct summary **kids = summary->sum_kids;
-  struct summary **end = &kids[8];
-
-  if ( ! (summary->sum_hits == NULL || *summary->sum_hits == 0))
-    return 1;
-
-  if (end[-1] == 0)
-    while (*--end == 0)
-      ;
-  while (kids < end)
-    if (check_hits (*kids++))
-      return 1;
+/* Write the count of occurrences on the last line of TL, and end the
+   lines of its last file.  */
 
-  return 0;
+static void
+finish_token_lines (struct token_lines *tl)
+{
+  if (tl->tl_line_count == 0)
+    return;
+  put_position_number (tl, tl->tl_line_count);
+  put_position_number (tl, 0);
+  tl->tl_line_count = 0;
 }
 
+/* Add to TL the lines of the file of PP whose lines are next, as the
+   lines of the file numbered FILE.  */
+
 static void
-write_hits (FILE *fp, struct summary *summary, unsigned char const *tail_hits)
+copy_position_lines (struct token_lines *tl, unsigned long file,
+		     struct position_postings *pp)
 {
-  struct summary **kids;
-  unsigned int hits = (summary->sum_hits ? *summary->sum_hits++ : *tail_hits);
+  unsigned long line;
+  uint64_t offset;
+  unsigned long occurrences;
 
-  assert (hits);
-  putc (hits, fp);
-
-  kids = summary->sum_kids;
-  if (*kids)
+  while (next_position_line (pp, &line, &offset, &occurrences))
     {
-      int bit;
-      --tail_hits;
-      for (bit = 1; (bit & 0xff) && *kids; bit <<= 1, ++kids)
-	if (bit & hits)
-	  write_hits (fp, *kids, tail_hits);
+      add_token_line (tl, file, line, offset);
+      tl->tl_line_count = occurrences;
     }
 }
 
 static void
-sign_token (struct token *token)
+put_position_number (struct token_lines *tl, uint64_t value)
 {
-  unsigned char *tok_hits = TOKEN_HITS (token);
-  unsigned char *hits_sig = current_hits_signature;
-  unsigned char *end = current_hits_signature + log_8_member_files;
-  struct summary *summary = summary_leaf;
-
-  while (summary)
-    {
-      if (*tok_hits == 0)
-	add_token_to_summary (summary, token);
-      if (*tok_hits & *hits_sig)
-	break;
-      *tok_hits |= *hits_sig;
-      summary = summary->sum_parent;
-      tok_hits++;
-      hits_sig++;
-    }
-  while (hits_sig < end)
+  while (value >= 0x80)
     {
-      if (*tok_hits & *hits_sig)
-	break;
-      *tok_hits |= *hits_sig;
-      tok_hits++;
-      hits_sig++;
+      tl->tl_postings[tl->tl_size++] = (value & 0x7f) | 0x80;
+      value >>= 7;
     }
+  tl->tl_postings[tl->tl_size++] = value;
 }
 
-static void
-add_token_to_summary (struct summary *summary, struct token *token)
+static unsigned long _GL_ATTRIBUTE_PURE
+token_lines_hash (void const *key)
 {
-  size_t size = summary->sum_tokens_size;
+  return_ADDRESS_HASH (((struct token_lines const *) key)->tl_token);
+}
 
-  if (summary->sum_hits_count >= size)
+static int _GL_ATTRIBUTE_PURE
+token_lines_hash_cmp (void const *x, void const *y)
+{
+  return_ADDRESS_COMPARE (((struct token_lines const *) x)->tl_token,
+			  ((struct token_lines const *) y)->tl_token);
+}
+
+/* Write the positions section at the current position of the ID file,
+   taking the positions of the tokens from ordered_token_lines, and
+   free them.  */
+
+static void
+write_token_positions (struct idhead *idhp)
+{
+  struct id_section *section = find_id_section (idhp, IDS_POSITIONS);
+  struct id_output *ido = &idhp->idh_output;
+  uint64_t count = idhp->idh_tokens;
+  uint64_t offset = 8 + count * 8;
+  unsigned long i;
+
+  section->ids_offset = id_output_tell (ido);
+  io_write (ido, &count, 8, IO_TYPE_INT);
+  for (i = 0; i < count; i++)
     {
-      summary->sum_tokens = x2nrealloc (summary->sum_tokens, &size,
-					sizeof *summary->sum_tokens);
-      summary->sum_tokens_size = size;
+      io_write (ido, &offset, 8, IO_TYPE_INT);
+      if (ordered_token_lines[i])
+	offset += ordered_token_lines[i]->tl_size;
     }
-  summary->sum_tokens[summary->sum_hits_count++] = token;
+  for (i = 0; i < count; i++)
+    {
+      struct token_lines *tl = ordered_token_lines[i];
+      if (tl == 0)
+	continue;
+      id_output_write (ido, tl->tl_postings, tl->tl_size);
+      free (tl->tl_postings);
+    }
+  section->ids_length = id_output_tell (ido) - section->ids_offset;
+
+  free (ordered_token_lines);
+  hash_free (&token_lines_table, 0);
+  obstack_free (&token_lines_obstack, 0);
 }
@@ -0,0 +1,7 @@
+enum mkid_mode
+  {
+    MKID_MODE_MKID,
+    MKID_MODE_MERGE
+  };
+
+extern enum mkid_mode mkid_mode;
@@ -319,22 +319,23 @@ scan_member_file (struct member_file const *member)
   struct language const *lang = lang_args->la_language;
   get_token_func_t get_token = lang->lg_get_token;
   struct file_link *flink = member->mf_link;
-  FILE *source_FILE;
+  struct source_file source;
 
   chdir_to_link (flink->fl_parent);
-  source_FILE = fopen (flink->fl_name, "r");
-  if (source_FILE)
+  if (open_source_file (flink->fl_name, &source) == 0)
     {
       void const *args = lang_args->la_args_digested;
+      char const *in = source.sf_begin;
       int flags;
       struct token *token;
 
-      while ((token = (*get_token) (source_FILE, args, &flags)) != NULL)
+      while ((token = (*get_token) (&in, source.sf_end, args, &flags))
+	     != NULL)
 	{
 	  puts (TOKEN_NAME (token));
 	  obstack_free (&tokens_obstack, token);
 	}
-      fclose (source_FILE);
+      close_source_file (&source);
     }
   else
     error (0, errno, _("can't open `%s'"), flink->fl_name);